@@ -16,6 +16,13 @@
 
 #define LED_COUNT	(30*5)
 
+//A program stuck in an endless loop errors out after this many instructions in one call,
+//instead of locking up this task.
+#define INSN_LIMIT	(50*1000*1000)
+//frame_start runs in slices of this many instructions, so a heavy one doesn't keep us
+//from picking up a new program.
+#define FRAME_START_BUDGET	20000
+
 static const char *TAG = "leds";
 
 //#define RGBW 1
@@ -119,8 +126,12 @@ static void led_task(void *args) {
 
 	led_syscalls_init();
 	vm_error_t err={};
+	double t=0;
 	while(1) {
-		if (xQueueReceive(progq, progname, pdMS_TO_TICKS(10))) {
+		//If frame_start is halfway, only give the web server a tick to send us a new
+		//program before continuing it.
+		int wait=(pgm && err.type==LSSL_VM_YIELDED)?1:pdMS_TO_TICKS(10);
+		if (xQueueReceive(progq, progname, wait)) {
 			assert(progname[16]==0);
 			if (progname[0]==PGMNAME_SPECIAL_LED) {
 				free(pgm);
@@ -149,6 +160,7 @@ static void led_task(void *args) {
 					led_syscalls_clear();
 					vm=lssl_vm_init(pgm, pgmlen, 8192);
 					if (vm) {
+						lssl_vm_set_insn_limit(vm, INSN_LIMIT);
 						lssl_vm_run_main(vm, &err);
 					} else {
 						printf("Couldn't init vm!\n");
@@ -160,26 +172,17 @@ static void led_task(void *args) {
 				}
 			}
 		}
-		if (pgm && err.type==LSSL_VM_ERR_NONE) {
-			led_syscalls_frame_start(vm, &err);
+		if (pgm && (err.type==LSSL_VM_ERR_NONE || err.type==LSSL_VM_YIELDED)) {
+			//A frame_start that yielded is still working on the frame it started for
+			if (err.type!=LSSL_VM_YIELDED) t=esp_timer_get_time()/1000000.0;
+			led_syscalls_frame_start(vm, t, FRAME_START_BUDGET, &err);
 			if (err.type==LSSL_VM_ERR_NONE) {
-				double t=esp_timer_get_time()/1000000.0;
-				for (int i=0; i<LED_COUNT; i++) {
-					led_syscalls_calculate_led(vm, i, t, &err);
-					if (err.type!=LSSL_VM_ERR_NONE) break;
-					//Note the LED-strip is BGR so we swap R and G here.
+				//Note the LED-strip is GRB so we swap R and G here.
 #ifdef RGBW
-					led_syscalls_get_rgbw(&led_strip_pixels[i*4+1],
-										&led_strip_pixels[i*4],
-										&led_strip_pixels[i*4+2],
-										&led_strip_pixels[i*4+3]);
+				led_syscalls_render_frame(vm, 0, LED_COUNT, t, led_strip_pixels, LED_FORMAT_GRBW, &err);
 #else
-					led_syscalls_get_rgb(&led_strip_pixels[i*3+1],
-										&led_strip_pixels[i*3],
-										&led_strip_pixels[i*3+2]);
+				led_syscalls_render_frame(vm, 0, LED_COUNT, t, led_strip_pixels, LED_FORMAT_GRB, &err);
 #endif
-					if (err.type!=LSSL_VM_ERR_NONE) break;
-				}
 				const rmt_transmit_config_t tx_config = {
 					.loop_count = 0, // no transfer loop
 				};
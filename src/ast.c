@@ -18,7 +18,8 @@ static void dump_insn(ast_node_t *node) {
 	} else if (lssl_vm_ops[i].argtype==ARG_REAL) {
 		printf("%s %f", lssl_vm_ops[i].op, (node->insn_arg/65536.0));
 	} else if (lssl_vm_ops[i].argtype==ARG_VAR) {
-		printf("%s [%d] ; %s", lssl_vm_ops[i].op, node->insn_arg, node->value->name);
+		//STA to a temporary has no var
+		printf("%s [%d] ; %s", lssl_vm_ops[i].op, node->insn_arg, node->value?node->value->name:"tmp");
 	} else if (lssl_vm_ops[i].argtype==ARG_STRUCT || lssl_vm_ops[i].argtype==ARG_ARRAY) {
 		printf("%s [%d]", lssl_vm_ops[i].op, node->insn_arg);
 	} else if (lssl_vm_ops[i].argtype==ARG_LABEL) {
@@ -27,6 +28,14 @@ static void dump_insn(ast_node_t *node) {
 		printf("%s 0x%X", lssl_vm_ops[i].op, node->insn_arg);
 	} else if (lssl_vm_ops[i].argtype==ARG_FUNCTION) {
 		printf("%s [%d] ; %s", lssl_vm_ops[i].op, node->insn_arg, node->value->name);
+	} else if (lssl_vm_ops[i].argtype==ARG_RRR) {
+		printf("%s [%d], [%d], [%d]", lssl_vm_ops[i].op, node->insn_d, node->insn_s, node->insn_arg);
+	} else if (lssl_vm_ops[i].argtype==ARG_RRN) {
+		printf("%s [%d], [%d], %f", lssl_vm_ops[i].op, node->insn_d, node->insn_s, (node->insn_arg/65536.0));
+	} else if (lssl_vm_ops[i].argtype==ARG_RN) {
+		printf("%s [%d], %f", lssl_vm_ops[i].op, node->insn_d, (node->insn_arg/65536.0));
+	} else if (lssl_vm_ops[i].argtype==ARG_RT) {
+		printf("%s [%d], 0x%X", lssl_vm_ops[i].op, node->insn_s, node->insn_arg);
 	}
 }
 
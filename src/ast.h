@@ -78,6 +78,7 @@ struct ast_node_t {
 	ast_node_t *alloc_next;
 	lssl_insn_enum insn_type;
 	int insn_arg;
+	int insn_d, insn_s; //slots d and s of register insns; the last operand is in insn_arg
 };
 
 static inline void ast_add_child(ast_node_t *parent, ast_node_t *n) {
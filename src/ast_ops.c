@@ -7,6 +7,9 @@
 #include "error.h"
 #include "vm_syscall.h"
 #include "codegen.h"
+#include "peephole.h"
+#include "vm.h"
+#include "loc_table.h"
 
 //Note: definition of 'fixup' is finding a position (e.g. in ram) for a symbol and changing
 //the instructions to match that.
@@ -31,43 +34,227 @@ void ast_ops_check_empty_array_deref(ast_node_t *node) {
 	}
 }
 
+//Does what the VM does for the insn an operator node compiles to. Returns 0 if this
+//can't be done at compile time: not an operator, or a division by zero, which should
+//happen at runtime so it gives the same error.
+static int fold_op(ast_type_en type, const int32_t *a, int argct, int32_t *r) {
+	if (argct==1) {
+		if (type==AST_TYPE_LNOT) {
+			*r=a[0]?0:(1<<16);
+		} else if (type==AST_TYPE_BNOT) {
+			*r=~a[0];
+		} else {
+			return 0;
+		}
+		return 1;
+	}
+	if (argct!=2) return 0;
+	if ((type==AST_TYPE_DIVIDE || type==AST_TYPE_MODULUS) && a[1]==0) return 0;
+	switch (type) {
+		case AST_TYPE_PLUS: *r=saturate((int64_t)a[0]+a[1]); break;
+		case AST_TYPE_MINUS: *r=saturate((int64_t)a[0]-a[1]); break;
+		case AST_TYPE_TIMES: *r=saturate(((int64_t)a[0]*a[1])>>16); break;
+		case AST_TYPE_DIVIDE: *r=saturate((((int64_t)a[0])<<16)/a[1]); break;
+		case AST_TYPE_MODULUS: *r=saturate((((int64_t)a[0])<<16)%a[1]); break;
+		case AST_TYPE_TEQ: *r=(a[0]==a[1])?(1<<16):0; break;
+		case AST_TYPE_TNEQ: *r=(a[0]!=a[1])?(1<<16):0; break;
+		case AST_TYPE_TL: *r=(a[0]<a[1])?(1<<16):0; break;
+		case AST_TYPE_TLEQ: *r=(a[0]<=a[1])?(1<<16):0; break;
+		case AST_TYPE_LAND: *r=(a[0]&&a[1])?(1<<16):0; break;
+		case AST_TYPE_LOR: *r=(a[0]||a[1])?(1<<16):0; break;
+		case AST_TYPE_BAND: *r=a[0]&a[1]; break;
+		case AST_TYPE_BOR: *r=a[0]|a[1]; break;
+		case AST_TYPE_BXOR: *r=a[0]^a[1]; break;
+		default: return 0;
+	}
+	return 1;
+}
+
+//Calls a syscall that has no side effects on constant args at compile time.
+static int fold_syscall(ast_node_t *node, const int32_t *a, int argct, int32_t *r) {
+	vm_syscall_fn_t *fn=vm_syscall_pure_fn(node->valpos);
+	if (!fn) return 0;
+	//Leave a wrong arg count to ast_ops_fix_function_args() to complain about
+	int defargs=0;
+	for (ast_node_t *n=node->value->children; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEFARG) defargs++;
+	}
+	if (argct!=defargs) return 0;
+	int32_t args[16];
+	memcpy(args, a, argct*sizeof(int32_t)); //syscalls may change their args
+	*r=fn(NULL, args);
+	return 1;
+}
 
 //This collates const values, e.g. '(2+4)/3)' gets collated into a single const number '2'.
-static void ast_ops_collate_consts_node(ast_node_t *node) {
+//Returns 1 if it collated anything.
+static int ast_ops_collate_consts_node(ast_node_t *node) {
 	//We can only collate things that only have child members that are also CONST.
+	int changed=0;
 	int all_const=1;
 	int32_t arg[16];
 	int argct=0;
 	for (ast_node_t *n=node->children; n!=NULL; n=n->sibling) {
-		ast_ops_collate_consts_node(n);
-		if (n->returns!=AST_RETURNS_CONST) all_const=0;
+		changed|=ast_ops_collate_consts_node(n);
+		if (n->type!=AST_TYPE_NUMBER || argct==16) all_const=0;
 		if (argct<16) arg[argct++]=n->number;
 	}
-	if (all_const) {
-		int collate_ok=1;
-		if (node->type==AST_TYPE_PLUS && argct==2) {
-			node->number=arg[0]+arg[1];
-		} else if (node->type==AST_TYPE_MINUS && argct==2) {
-			node->number=arg[0]-arg[1];
-		} else if (node->type==AST_TYPE_TIMES && argct==2) {
-			int64_t v=(int64_t)arg[0]*(int64_t)arg[1];
-			node->number=v>>16;
-		} else if (node->type==AST_TYPE_DIVIDE && argct==2) {
-			node->number=(arg[0]*65536.0)/arg[1];
+	if (all_const && node->children) {
+		int32_t v;
+		int collate_ok;
+		if (node->type==AST_TYPE_SYSCALL) {
+			collate_ok=fold_syscall(node, arg, argct, &v);
 		} else {
-			collate_ok=0;
+			collate_ok=fold_op(node->type, arg, argct, &v);
 		}
 		if (collate_ok) {
 			node->type=AST_TYPE_NUMBER;
+			node->number=v;
+			node->returns=AST_RETURNS_CONST;
+			node->value=NULL;
 			node->children=NULL; //ToDo: free nodes?
+			changed=1;
 		}
 	}
+	return changed;
 }
 
-void ast_ops_collate_consts(ast_node_t *node) {
+int ast_ops_collate_consts(ast_node_t *node) {
+	int changed=0;
 	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
-		ast_ops_collate_consts_node(n);
+		changed|=ast_ops_collate_consts_node(n);
 	}
+	return changed;
+}
+
+//Turns if/while/for statements with a constant condition into the code that actually
+//runs. The node becomes a MULTI with the remaining statements as children.
+static int fold_branches(ast_node_t *node) {
+	int changed=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->children) changed|=fold_branches(n->children);
+		ast_node_t *keep=NULL;
+		if (n->type==AST_TYPE_IF && n->children->type==AST_TYPE_NUMBER) {
+			keep=n->children->number?n->children->sibling:n->children->sibling->sibling;
+		} else if (n->type==AST_TYPE_WHILE && n->children->type==AST_TYPE_NUMBER && !n->children->number) {
+			keep=NULL;
+		} else if (n->type==AST_TYPE_FOR && n->children->sibling->type==AST_TYPE_NUMBER &&
+					!n->children->sibling->number) {
+			keep=n->children; //the initializer still runs
+		} else {
+			continue;
+		}
+		if (keep) keep->sibling=NULL;
+		n->type=AST_TYPE_MULTI;
+		n->children=keep;
+		changed=1;
+	}
+	return changed;
+}
+
+typedef struct {
+	ast_node_t *decl;
+	int refs;
+} const_var_t;
+
+typedef struct {
+	const_var_t *v;
+	int count;
+	int size;
+} const_var_list_t;
+
+//Finds POD vars declared with a constant as their initial value
+static void find_const_vars(ast_node_t *node, const_var_list_t *l, int globals) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_DECLARE && (globals || ast_is_local(n)) &&
+				!ast_find_type(n->children, AST_TYPE_ARRAYREF) &&
+				!ast_find_type(n->children, AST_TYPE_STRUCTREF)) {
+			ast_node_t *a=ast_find_type(n->children, AST_TYPE_ASSIGN);
+			if (a && a->children->sibling && a->children->sibling->type==AST_TYPE_NUMBER) {
+				if (l->count==l->size) {
+					l->size=l->size?l->size*2:64;
+					l->v=realloc(l->v, l->size*sizeof(const_var_t));
+				}
+				l->v[l->count++]=(const_var_t){n, 0};
+			}
+		}
+		if (n->children) find_const_vars(n->children, l, globals);
+	}
+}
+
+static const_var_t *find_const_var(const_var_list_t *l, ast_node_t *decl) {
+	for (int i=0; i<l->count; i++) {
+		if (l->v[i].decl==decl) return &l->v[i];
+	}
+	return NULL;
+}
+
+//Every write to a var goes through a REF; the initializer is one as well. A DEREF
+//with children indexes the var, which is an error for a POD var: leave that alone.
+static void count_const_var_refs(ast_node_t *node, const_var_list_t *l) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if ((n->type==AST_TYPE_REF || (n->type==AST_TYPE_DEREF && n->children)) && n->value) {
+			const_var_t *v=find_const_var(l, n->value);
+			if (v) v->refs+=(n->type==AST_TYPE_REF)?1:2;
+		}
+		if (n->children) count_const_var_refs(n->children, l);
+	}
+}
+
+static int replace_const_var_reads(ast_node_t *node, const_var_list_t *l) {
+	int changed=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_DEREF && !n->children && n->value) {
+			const_var_t *v=find_const_var(l, n->value);
+			if (v && v->refs==1) {
+				n->type=AST_TYPE_NUMBER;
+				n->number=ast_find_type(v->decl->children, AST_TYPE_ASSIGN)->children->sibling->number;
+				n->returns=AST_RETURNS_CONST;
+				n->value=NULL;
+				changed=1;
+			}
+		}
+		if (n->children) changed|=replace_const_var_reads(n->children, l);
+	}
+	return changed;
+}
+
+//Counts the function calls in a node and its children
+static int count_calls(ast_node_t *node) {
+	int ret=(node->type==AST_TYPE_FUNCCALL);
+	for (ast_node_t *n=node->children; n!=NULL; n=n->sibling) ret+=count_calls(n);
+	return ret;
+}
+
+//Replaces reads of vars that are assigned a constant when they're declared and never
+//written to after that by the constant.
+static int propagate_const_vars(ast_node_t *node) {
+	//Global initializers run before main(). If one calls a function, that could read a
+	//global before it's initialized, so then globals are left alone.
+	int init_calls=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type!=AST_TYPE_FUNCDEF) init_calls+=count_calls(n);
+	}
+	const_var_list_t l={};
+	find_const_vars(node, &l, init_calls<=1); //the one call is the one to main()
+	int changed=0;
+	if (l.count) {
+		count_const_var_refs(node, &l);
+		changed=replace_const_var_reads(node, &l);
+	}
+	free(l.v);
+	return changed;
+}
+
+//Constant folding and propagation. Needs symbols and the types of refs and derefs to
+//be resolved.
+void ast_ops_fold_consts(ast_node_t *node) {
+	int changed;
+	do {
+		changed=ast_ops_collate_consts(node);
+		changed|=fold_branches(node);
+		changed|=propagate_const_vars(node);
+	} while (changed);
 }
 
 typedef struct {
@@ -292,11 +479,15 @@ void ast_ops_var_place(ast_node_t *node) {
 	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
 		if (n->type==AST_TYPE_FUNCDEF) {
 			int stack_space_locals=block_place_locals(n->children, 0);
-			//Make and insert node so we can resolve this to an ENTER instruction
-			ast_node_t *d=ast_new_node(AST_TYPE_LOCALSIZE, &node->loc);
+			//Make and insert node so we can resolve this to an ENTER instruction. If
+			//this is run again after vars were removed, it's already there.
+			ast_node_t *d=ast_find_type(n->children, AST_TYPE_LOCALSIZE);
+			if (!d) {
+				d=ast_new_node(AST_TYPE_LOCALSIZE, &node->loc);
+				d->sibling=n->children;
+				n->children=d;
+			}
 			d->number=stack_space_locals;
-			d->sibling=n->children;
-			n->children=d;
 		}
 	}
 }
@@ -610,6 +801,234 @@ void ast_ops_fix_parents(ast_node_t *node) {
 	fix_parents(node, NULL);
 }
 
+//Returns 1 for the operators that can't fail and whose value only depends on their operands
+static int is_pure_operator(ast_type_en type) {
+	switch (type) {
+		case AST_TYPE_PLUS: case AST_TYPE_MINUS: case AST_TYPE_TIMES:
+		case AST_TYPE_TEQ: case AST_TYPE_TNEQ: case AST_TYPE_TL: case AST_TYPE_TLEQ:
+		case AST_TYPE_LAND: case AST_TYPE_LOR: case AST_TYPE_LNOT:
+		case AST_TYPE_BAND: case AST_TYPE_BOR: case AST_TYPE_BXOR: case AST_TYPE_BNOT:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+//Returns 1 if evaluating the expression can do more than give a value: write to something,
+//call a function or stop the program with an error.
+static int has_side_effects(ast_node_t *n) {
+	switch (n->type) {
+		case AST_TYPE_NUMBER:
+		case AST_TYPE_FUNCPTR:
+			return 0;
+		case AST_TYPE_DEREF:
+			return n->children!=NULL; //an index can be out of bounds
+		case AST_TYPE_SYSCALL:
+			if (!vm_syscall_pure_fn(n->valpos)) return 1;
+			break;
+		case AST_TYPE_DIVIDE:
+		case AST_TYPE_MODULUS: {
+			ast_node_t *d=n->children->sibling;
+			if (d->type!=AST_TYPE_NUMBER || d->number==0) return 1;
+			break;
+		}
+		default:
+			if (!is_pure_operator(n->type)) return 1;
+	}
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		if (has_side_effects(c)) return 1;
+	}
+	return 0;
+}
+
+//Returns 1 if something in the subtree uses an array, struct or function where a number
+//is expected. Codegen reports that as an error, so code like that can't just disappear.
+static int may_be_type_error(ast_node_t *n) {
+	int args_ok=(n->type==AST_TYPE_FUNCCALL || n->type==AST_TYPE_FUNCCALLARG ||
+				n->type==AST_TYPE_SYSCALL || n->type==AST_TYPE_DECLARE);
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		int val=(c->type==AST_TYPE_DEREF || c->type==AST_TYPE_REF || c->type==AST_TYPE_FUNCPTR);
+		if (!args_ok && val && (c->returns==AST_RETURNS_ARRAY || c->returns==AST_RETURNS_STRUCT ||
+				c->returns==AST_RETURNS_FUNCTION)) return 1;
+		if (may_be_type_error(c)) return 1;
+	}
+	return 0;
+}
+
+//Returns 1 if a statement always ends in a return
+static int always_returns(ast_node_t *n) {
+	if (n->type==AST_TYPE_RETURN) return 1;
+	if (n->type==AST_TYPE_BLOCK || n->type==AST_TYPE_MULTI) {
+		for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+			if (always_returns(c)) return 1;
+		}
+	}
+	if (n->type==AST_TYPE_IF) {
+		ast_node_t *body=n->children->sibling;
+		return body->sibling && always_returns(body) && always_returns(body->sibling);
+	}
+	return 0;
+}
+
+//Cuts off the statements after one that always returns
+static void remove_unreachable(ast_node_t *node) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->children) remove_unreachable(n->children);
+		if (n->type==AST_TYPE_FUNCDEF || n->type==AST_TYPE_BLOCK || n->type==AST_TYPE_MULTI) {
+			for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+				if (!always_returns(c)) continue;
+				int ok=1;
+				for (ast_node_t *d=c->sibling; d!=NULL; d=d->sibling) ok&=!may_be_type_error(d);
+				if (ok) c->sibling=NULL;
+				break;
+			}
+		}
+	}
+}
+
+typedef struct {
+	ast_node_t **n;
+	int count;
+	int size;
+} node_list_t;
+
+static void node_list_add(node_list_t *l, ast_node_t *n) {
+	if (l->count==l->size) {
+		l->size=l->size?l->size*2:64;
+		l->n=realloc(l->n, l->size*sizeof(ast_node_t*));
+	}
+	l->n[l->count++]=n;
+}
+
+static int node_list_has(node_list_t *l, ast_node_t *n) {
+	for (int i=0; i<l->count; i++) {
+		if (l->n[i]==n) return 1;
+	}
+	return 0;
+}
+
+//A ref to a POD var is a write if it's what's assigned to, or what's incremented in a
+//statement. Anything else may read it.
+static int ref_is_write(ast_node_t *n) {
+	ast_node_t *p=n->parent;
+	if (p->type==AST_TYPE_ASSIGN && p->children==n) return 1;
+	if ((p->type==AST_TYPE_PRE_ADD || p->type==AST_TYPE_POST_ADD) && p->parent->type==AST_TYPE_DROP) return 1;
+	return 0;
+}
+
+static void find_pod_locals(ast_node_t *node, node_list_t *l) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_DECLARE && ast_is_local(n) &&
+				!ast_find_type(n->children, AST_TYPE_ARRAYREF) &&
+				!ast_find_type(n->children, AST_TYPE_STRUCTREF)) {
+			node_list_add(l, n);
+		}
+		if (n->children) find_pod_locals(n->children, l);
+	}
+}
+
+//Vars that are read, plus vars that are written with something that may not compile
+static void find_read_vars(ast_node_t *node, node_list_t *l) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_ASSIGN && n->children->value && may_be_type_error(n)) {
+			if (!node_list_has(l, n->children->value)) node_list_add(l, n->children->value);
+		}
+		if ((n->type==AST_TYPE_DEREF || (n->type==AST_TYPE_REF && !ref_is_write(n))) && n->value) {
+			if (!node_list_has(l, n->value)) node_list_add(l, n->value);
+		}
+		if (n->children) find_read_vars(n->children, l);
+	}
+}
+
+//Replaces a statement by nothing, or by evaluating the expression e if that's needed for
+//its side effects.
+static void replace_statement(ast_node_t *n, ast_node_t *e) {
+	if (e && has_side_effects(e)) {
+		n->type=AST_TYPE_DROP;
+		e->sibling=NULL;
+		n->children=e;
+	} else {
+		n->type=AST_TYPE_MULTI;
+		n->children=NULL;
+	}
+}
+
+static void remove_writes(ast_node_t *node, node_list_t *dead) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->children) remove_writes(n->children, dead);
+		if (n->type==AST_TYPE_ASSIGN && n->children->type==AST_TYPE_REF &&
+				node_list_has(dead, n->children->value)) {
+			replace_statement(n, n->children->sibling);
+		} else if (n->type==AST_TYPE_DROP && (n->children->type==AST_TYPE_PRE_ADD ||
+				n->children->type==AST_TYPE_POST_ADD) &&
+				node_list_has(dead, n->children->children->value)) {
+			replace_statement(n, NULL);
+		} else if (n->type==AST_TYPE_DECLARE && node_list_has(dead, n)) {
+			//What's left of the initializer, if anything
+			ast_node_t *a=ast_find_type(n->children, AST_TYPE_DROP);
+			n->type=AST_TYPE_MULTI;
+			n->children=a;
+			if (a) a->sibling=NULL;
+		}
+	}
+}
+
+//Removes local POD vars that are never read, including all writes to them
+static void remove_dead_vars(ast_node_t *node) {
+	node_list_t locals={}, read={}, dead={};
+	find_pod_locals(node, &locals);
+	find_read_vars(node, &read);
+	for (int i=0; i<locals.count; i++) {
+		if (!node_list_has(&read, locals.n[i])) node_list_add(&dead, locals.n[i]);
+	}
+	if (dead.count) remove_writes(node, &dead);
+	free(locals.n);
+	free(read.n);
+	free(dead.n);
+}
+
+//Adds the functions called or referenced by node and its children to the list
+static void find_used_functions(ast_node_t *node, node_list_t *l) {
+	if ((node->type==AST_TYPE_FUNCCALL || node->type==AST_TYPE_FUNCPTR) &&
+			node->value && node->value->type==AST_TYPE_FUNCDEF && !node_list_has(l, node->value)) {
+		node_list_add(l, node->value);
+	}
+	for (ast_node_t *n=node->children; n!=NULL; n=n->sibling) find_used_functions(n, l);
+}
+
+//Removes functions that can't be reached from main() or a function passed as a callback.
+//Functions with type errors stay, so those still get reported.
+static void remove_unused_functions(ast_node_t *node) {
+	node_list_t used={};
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type!=AST_TYPE_FUNCDEF) {
+			find_used_functions(n, &used);
+		} else if (may_be_type_error(n) && !node_list_has(&used, n)) {
+			node_list_add(&used, n);
+		}
+	}
+	//The list grows while we go through it
+	for (int i=0; i<used.count; i++) find_used_functions(used.n[i], &used);
+	ast_node_t *prev=node;
+	for (ast_node_t *n=node->sibling; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF && !node_list_has(&used, n)) {
+			prev->sibling=n->sibling;
+		} else {
+			prev=n;
+		}
+	}
+	free(used.n);
+}
+
+//Dead code elimination: drops statements after a return, local vars that are never
+//read and functions that are never called. Run ast_ops_var_place() again afterwards.
+void ast_ops_remove_dead_code(ast_node_t *node) {
+	remove_unreachable(node);
+	ast_ops_fix_parents(node);
+	remove_dead_vars(node);
+	remove_unused_functions(node);
+}
+
 #define PROG_INC 1024
 
 typedef struct {
@@ -655,8 +1074,13 @@ static int globals_size(ast_node_t *node) {
 void ast_ops_add_program_start(ast_node_t *node, const char *main_fn_name) {
 	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
 		if (n->type==AST_TYPE_FUNCDEF && strcmp(n->name, main_fn_name)==0) {
-			ast_node_t *d=ast_new_node(AST_TYPE_GOTO, &node->loc);
-			d->name=strdup(main_fn_name);
+			//'return main();'. This needs to be a real call: main() needs its own stack
+			//frame, as the global arrays and structs are allocated in this one.
+			ast_node_t *c=ast_new_node(AST_TYPE_FUNCCALL, &node->loc);
+			c->name=strdup(main_fn_name);
+			c->returns=AST_RETURNS_NUMBER;
+			ast_node_t *d=ast_new_node(AST_TYPE_RETURN, &node->loc);
+			ast_add_child(d, c);
 			//need to put this at end of program
 			ast_node_t *last=node;
 			while (last->sibling) last=last->sibling;
@@ -832,13 +1256,590 @@ void ast_ops_add_obj_initializers(ast_node_t *node) {
 	}
 }
 
+//Max size, in AST nodes, of a function that gets inlined. 0 disables inlining.
+int ast_ops_inline_limit=80;
+
+static int count_nodes(ast_node_t *n) {
+	int r=1;
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) r+=count_nodes(c);
+	return r;
+}
+
+//Returns 1 if n or any of its children is of the given type
+static int has_type(ast_node_t *n, ast_type_en type) {
+	if (n->type==type) return 1;
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		if (has_type(c, type)) return 1;
+	}
+	return 0;
+}
+
+//Copies a node and its children (but not its siblings). Var declarations in there are
+//copied as well; map gets the old and the new node of each, as pairs.
+static ast_node_t *copy_tree(ast_node_t *n, node_list_t *map) {
+	ast_node_t *r=ast_new_node(n->type, &n->loc);
+	r->returns=n->returns;
+	if (n->name) r->name=strdup(n->name);
+	r->number=n->number;
+	r->size=n->size;
+	r->value=n->value;
+	r->valpos=n->valpos;
+	if (n->type==AST_TYPE_DECLARE) {
+		node_list_add(map, n);
+		node_list_add(map, r);
+	}
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) ast_add_child(r, copy_tree(c, map));
+	return r;
+}
+
+//Makes everything that refers to the first node of a pair in the map refer to the second
+static void remap_vars(ast_node_t *node, node_list_t *map) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		for (int i=0; i<map->count; i+=2) {
+			if (n->value==map->n[i]) {
+				n->value=map->n[i+1];
+				break;
+			}
+		}
+		if (n->children) remap_vars(n->children, map);
+	}
+}
+
+//Returns 1 if nothing the code of another function does can change the value of n: it
+//only reads local POD vars. Addresses count as well, as long as their indices are stable.
+static int is_stable(ast_node_t *n) {
+	switch (n->type) {
+		case AST_TYPE_NUMBER:
+		case AST_TYPE_FUNCPTR:
+			return 1;
+		case AST_TYPE_DEREF:
+			return !n->children && n->returns==AST_RETURNS_NUMBER && ast_is_local(n->value);
+		case AST_TYPE_SYSCALL:
+			if (!vm_syscall_pure_fn(n->valpos)) return 0;
+			break;
+		case AST_TYPE_REF: case AST_TYPE_ARRAYREF: case AST_TYPE_STRUCTMEMBER:
+			break;
+		default:
+			if (!is_pure_operator(n->type)) return 0;
+	}
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		if (!is_stable(c)) return 0;
+	}
+	return 1;
+}
+
+//Returns 1 if child c of n is a statement, rather than part of an expression
+static int is_statement_pos(ast_node_t *n, ast_node_t *c) {
+	if (n->type==AST_TYPE_FUNCDEF || n->type==AST_TYPE_BLOCK || n->type==AST_TYPE_MULTI) return 1;
+	int i=0;
+	for (ast_node_t *k=n->children; k!=c; k=k->sibling) i++;
+	if (n->type==AST_TYPE_IF) return i!=0;
+	if (n->type==AST_TYPE_WHILE) return i!=0;
+	if (n->type==AST_TYPE_FOR) return i!=1;
+	return 0;
+}
+
+//Finds the statement the inlined code of call c needs to go in front of. Returns NULL if
+//there's none (the call is in a loop condition) or if something evaluated before the
+//call may turn out different when it's evaluated after the inlined code instead.
+static ast_node_t *inline_stmt_for(ast_node_t *c) {
+	ast_node_t *prev=c;
+	for (ast_node_t *p=c->parent; p!=NULL; p=p->parent) {
+		if (is_statement_pos(p, prev)) return prev;
+		if (p->type==AST_TYPE_WHILE || p->type==AST_TYPE_FOR) return NULL;
+		for (ast_node_t *k=p->children; k!=prev; k=k->sibling) {
+			if (!is_stable(k)) return NULL;
+		}
+		if (p->type==AST_TYPE_IF) return p;
+		prev=p;
+	}
+	return NULL;
+}
+
+static ast_node_t *new_pod_ref(ast_node_t *decl, ast_type_en type) {
+	ast_node_t *r=ast_new_node(type, &decl->loc);
+	r->name=strdup(decl->name);
+	r->value=decl;
+	r->returns=AST_RETURNS_NUMBER;
+	return r;
+}
+
+static void append_stmts(ast_node_t *n, ast_node_t *stmts) {
+	if (!stmts) return;
+	if (n->children) {
+		ast_add_sibling(n->children, stmts);
+	} else {
+		n->children=stmts;
+	}
+}
+
+//Rewrites the returns in the statements of an inlined function into assignments to ret
+//(or into nothing, if ret is NULL). The statements after an if with a branch that returns
+//go into the other branch. Returns 0 if a return can't be rewritten, e.g. in a loop.
+static int lower_returns(ast_node_t *blk, ast_node_t *ret) {
+	for (ast_node_t *s=blk->children; s!=NULL; s=s->sibling) {
+		if (s->type==AST_TYPE_RETURN) {
+			ast_node_t *e=s->children;
+			if (ret) {
+				s->type=AST_TYPE_ASSIGN;
+				s->children=new_pod_ref(ret, AST_TYPE_REF);
+				s->children->sibling=e;
+			} else {
+				replace_statement(s, e);
+			}
+			s->sibling=NULL;
+			return 1;
+		}
+		if (!has_type(s, AST_TYPE_RETURN)) continue;
+		ast_node_t *rest=s->sibling;
+		s->sibling=NULL;
+		if (s->type==AST_TYPE_BLOCK || s->type==AST_TYPE_MULTI) {
+			append_stmts(s, rest);
+			return lower_returns(s, ret);
+		}
+		if (s->type!=AST_TYPE_IF) return 0;
+		//Put both branches in a MULTI, so we can add statements to them
+		ast_node_t *cond=s->children;
+		ast_node_t *t=ast_new_node(AST_TYPE_MULTI, &s->loc);
+		ast_node_t *e=ast_new_node(AST_TYPE_MULTI, &s->loc);
+		t->children=cond->sibling;
+		e->children=cond->sibling->sibling;
+		t->children->sibling=NULL;
+		cond->sibling=t;
+		t->sibling=e;
+		if (always_returns(t)) {
+			append_stmts(e, rest);
+		} else if (always_returns(e)) {
+			append_stmts(t, rest);
+		} else {
+			return 0;
+		}
+		return lower_returns(t, ret) && lower_returns(e, ret);
+	}
+	return 1;
+}
+
+//Returns 1 if f is small enough to inline and doesn't call any functions itself. The
+//latter means we never inline something recursive: callers become candidates only once
+//everything they call is inlined.
+static int can_inline(ast_node_t *f) {
+	int size=0;
+	for (ast_node_t *n=f->children; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEFARG || n->type==AST_TYPE_LOCALSIZE) continue;
+		if (has_type(n, AST_TYPE_FUNCCALL)) return 0;
+		size+=count_nodes(n);
+	}
+	return size<=ast_ops_inline_limit && !may_be_type_error(f);
+}
+
+//Replaces function call c by a copy of the function. Returns 0 if that can't be done.
+static int inline_call(ast_node_t *c) {
+	ast_node_t *f=c->value;
+	ast_node_t *s=inline_stmt_for(c);
+	if (!s || !s->parent) return 0;
+	node_list_t params={}, args={};
+	ast_node_t *arg=c->children;
+	for (ast_node_t *p=f->children; p!=NULL; p=p->sibling) {
+		if (p->type!=AST_TYPE_FUNCDEFARG) continue;
+		node_list_add(&params, p);
+		node_list_add(&args, arg);
+		arg=arg->sibling;
+	}
+
+	//Copy the function body into a block. The value isn't needed if the call is a statement.
+	node_list_t map={};
+	ast_node_t *blk=ast_new_node(AST_TYPE_BLOCK, &c->loc);
+	for (ast_node_t *n=f->children; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEFARG || n->type==AST_TYPE_LOCALSIZE) continue;
+		ast_add_child(blk, copy_tree(n, &map));
+	}
+	ast_node_t *ret=NULL;
+	if (s->type!=AST_TYPE_DROP || s->children!=c) {
+		ret=ast_new_node(AST_TYPE_DECLARE, &c->loc);
+		ret->name=strdup(f->name);
+		ret->size=1;
+		ret->returns=AST_RETURNS_NUMBER;
+	}
+	if (!lower_returns(blk, ret)) {
+		free(params.n);
+		free(args.n);
+		free(map.n);
+		return 0;
+	}
+
+	//Args become local vars initialized to what's passed. For objects, that's a var of the
+	//same type that refers to the object passed rather than allocating a new one.
+	ast_node_t *decls=NULL;
+	for (int i=params.count-1; i>=0; i--) {
+		ast_node_t *p=params.n[i], *a=args.n[i];
+		ast_node_t *d=ast_new_node(AST_TYPE_DECLARE, &a->loc);
+		d->name=strdup(p->name);
+		d->size=1;
+		a->sibling=NULL;
+		if (ast_ops_decl_node_is_pod(p)) {
+			d->returns=AST_RETURNS_NUMBER;
+			ast_node_t *as=ast_new_node(AST_TYPE_ASSIGN, &a->loc);
+			ast_add_child(as, new_pod_ref(d, AST_TYPE_REF));
+			ast_add_child(as, a);
+			ast_add_child(d, as);
+		} else {
+			d->returns=p->returns;
+			for (ast_node_t *t=p->children; t!=NULL; t=t->sibling) ast_add_child(d, copy_tree(t, &map));
+			ast_add_child(d, a);
+		}
+		d->sibling=decls;
+		decls=d;
+		node_list_add(&map, p);
+		node_list_add(&map, d);
+	}
+	remap_vars(blk->children, &map);
+	if (decls) {
+		ast_add_sibling(decls, blk->children);
+		blk->children=decls;
+	}
+	free(map.n);
+
+	if (!ret) {
+		//The call was all there was to the statement
+		s->type=AST_TYPE_MULTI;
+		s->children=blk;
+	} else {
+		//Statement s becomes [ret var, inlined code, s]; the call reads the ret var.
+		ast_node_t *m=ast_new_node(AST_TYPE_MULTI, &s->loc);
+		ast_node_t **pp=&s->parent->children;
+		while (*pp!=s) pp=&(*pp)->sibling;
+		*pp=m;
+		m->sibling=s->sibling;
+		m->children=ret;
+		ret->sibling=blk;
+		blk->sibling=s;
+		s->sibling=NULL;
+		c->type=AST_TYPE_DEREF;
+		c->value=ret;
+		c->children=NULL;
+		c->returns=AST_RETURNS_NUMBER;
+	}
+	free(params.n);
+	free(args.n);
+	return 1;
+}
+
+//Inlines the first call in node (not its siblings) it can
+static int inline_first_call(ast_node_t *node) {
+	if (node->type==AST_TYPE_FUNCCALL && can_inline(node->value) && inline_call(node)) return 1;
+	for (ast_node_t *n=node->children; n!=NULL; n=n->sibling) {
+		if (inline_first_call(n)) return 1;
+	}
+	return 0;
+}
+
+//Replaces calls to small functions by the code of the function, saving the CALL, ENTER
+//and RETURN. Every inlined call removes a call and adds none, so this ends.
+void ast_ops_inline_functions(ast_node_t *node) {
+	if (ast_ops_inline_limit<=0) return;
+	int changed=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type!=AST_TYPE_FUNCDEF) continue;
+		while (inline_first_call(n)) {
+			ast_ops_fix_parents(node);
+			changed=1;
+		}
+	}
+	if (!changed) return;
+	ast_ops_annotate_obj_ref_size(node);
+	ast_ops_set_ref_deref_return_type(node);
+}
+
+//Counts the REFs to var decl in n and its children: the writes to it, and the places that
+//take its address.
+static int count_refs_to(ast_node_t *n, ast_node_t *decl) {
+	int r=(n->type==AST_TYPE_REF && n->value==decl);
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) r+=count_refs_to(c, decl);
+	return r;
+}
+
+typedef struct {
+	ast_node_t *fn;			//LED callback
+	ast_node_t *time;		//its time arg, or NULL if it writes to that
+	node_list_t locals;		//local vars of it that only get a frame invariant initial value
+	ast_node_t *frame_fn;	//function calculating the invariants
+	ast_node_t *frame_time;	//its time arg
+	ast_node_t **globals;	//where that puts them
+	int count;
+} frame_hoist_t;
+
+//Returns 1 if expression n has the same value for every LED in a frame: it only depends
+//on the time arg, on globals the LED callback doesn't write and on locals in h->locals. It
+//must not be able to fail either, as it may be in a branch that's never taken.
+static int is_frame_invariant(ast_node_t *n, frame_hoist_t *h) {
+	switch (n->type) {
+		case AST_TYPE_NUMBER:
+			return 1;
+		case AST_TYPE_DEREF:
+			if (n->children || n->returns!=AST_RETURNS_NUMBER) return 0;
+			if (n->value==h->time || node_list_has(&h->locals, n->value)) return 1;
+			return !ast_is_local(n->value) && !count_refs_to(h->fn, n->value);
+		case AST_TYPE_SYSCALL:
+			if (!vm_syscall_pure_fn(n->valpos)) return 0;
+			break;
+		case AST_TYPE_DIVIDE:
+		case AST_TYPE_MODULUS: {
+			ast_node_t *d=n->children->sibling;
+			if (d->type!=AST_TYPE_NUMBER || d->number==0) return 0;
+			break;
+		}
+		default:
+			if (!is_pure_operator(n->type)) return 0;
+	}
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		if (!is_frame_invariant(c, h)) return 0;
+	}
+	return 1;
+}
+
+//Finds the local vars in node that are frame invariant because the only thing written to
+//them is a frame invariant initial value
+static int find_invariant_locals(ast_node_t *node, frame_hoist_t *h) {
+	int found=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_DECLARE && n->returns==AST_RETURNS_NUMBER && !node_list_has(&h->locals, n)) {
+			ast_node_t *a=ast_find_type(n->children, AST_TYPE_ASSIGN);
+			if (a && count_refs_to(h->fn, n)==1 && is_frame_invariant(a->children->sibling, h)) {
+				node_list_add(&h->locals, n);
+				found=1;
+			}
+		}
+		if (n->children) found|=find_invariant_locals(n->children, h);
+	}
+	return found;
+}
+
+//Roughly the insns n takes. Loading a global takes one, and so does a register op on
+//locals, so only things that take more than that are worth moving.
+static int op_cost(ast_node_t *n) {
+	int r=(n->type!=AST_TYPE_NUMBER && n->type!=AST_TYPE_DEREF);
+	if (n->type==AST_TYPE_SYSCALL) r=2;
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) r+=op_cost(c);
+	return r;
+}
+
+static int same_expr(ast_node_t *a, ast_node_t *b) {
+	if (a->type!=b->type || a->number!=b->number || a->value!=b->value || a->valpos!=b->valpos) return 0;
+	ast_node_t *ca=a->children, *cb=b->children;
+	while (ca && cb) {
+		if (!same_expr(ca, cb)) return 0;
+		ca=ca->sibling;
+		cb=cb->sibling;
+	}
+	return ca==cb;
+}
+
+//Replaces reads of the locals in h->locals by what they're initialized with, so the code
+//works in the per-frame function as well
+static void inline_invariant_locals(ast_node_t *node, frame_hoist_t *h) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		while (n->type==AST_TYPE_DEREF && node_list_has(&h->locals, n->value)) {
+			node_list_t map={};
+			ast_node_t *v=copy_tree(ast_find_type(n->value->children, AST_TYPE_ASSIGN)->children->sibling, &map);
+			free(map.n);
+			free(n->name);
+			n->type=v->type;
+			n->returns=v->returns;
+			n->name=v->name?strdup(v->name):NULL;
+			n->number=v->number;
+			n->value=v->value;
+			n->valpos=v->valpos;
+			n->children=v->children;
+		}
+		if (n->children) inline_invariant_locals(n->children, h);
+	}
+}
+
+//Replaces the largest frame invariant expressions in node by a global that frame_fn sets
+static void hoist_invariants(ast_node_t *node, frame_hoist_t *h) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_NUMBER || n->type==AST_TYPE_DEREF || !is_frame_invariant(n, h)) {
+			if (n->children) hoist_invariants(n->children, h);
+			continue;
+		}
+		if (op_cost(n)<2) continue;
+		//Make what frame_fn needs to calculate, then see if it already does
+		node_list_t map={};
+		ast_node_t *e=copy_tree(n, &map);
+		free(map.n);
+		inline_invariant_locals(e, h);
+		map=(node_list_t){};
+		node_list_add(&map, h->time);
+		node_list_add(&map, h->frame_time);
+		remap_vars(e, &map);
+		free(map.n);
+		ast_node_t *g=NULL;
+		for (ast_node_t *a=h->frame_fn->children; a!=NULL; a=a->sibling) {
+			if (a->type==AST_TYPE_ASSIGN && same_expr(a->children->sibling, e)) g=a->children->value;
+		}
+		if (!g) {
+			g=ast_new_node(AST_TYPE_DECLARE, &n->loc);
+			char name[128];
+			snprintf(name, sizeof(name), "%s.%d", h->frame_fn->name, h->count++);
+			g->name=strdup(name);
+			g->size=1;
+			g->returns=AST_RETURNS_NUMBER;
+			h->globals=realloc(h->globals, h->count*sizeof(ast_node_t*));
+			h->globals[h->count-1]=g;
+			ast_node_t *a=ast_new_node(AST_TYPE_ASSIGN, &n->loc);
+			ast_add_child(a, new_pod_ref(g, AST_TYPE_REF));
+			ast_add_child(a, e);
+			ast_add_child(h->frame_fn, a);
+		}
+		free(n->name);
+		n->name=strdup(g->name);
+		n->type=AST_TYPE_DEREF;
+		n->value=g;
+		n->children=NULL;
+		n->returns=AST_RETURNS_NUMBER;
+	}
+}
+
+//Finds the uses of fn outside of itself. Returns 0 if it's called anywhere, or if it's
+//used as a function pointer for something else than a LED callback registered in a
+//statement of its own.
+static int find_led_cb_regs(ast_node_t *node, ast_node_t *fn, int led_cb, int mapped_cb, node_list_t *regs) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCCALL && n->value==fn) return 0;
+		if (n->type==AST_TYPE_FUNCPTR && n->value==fn) {
+			ast_node_t *s=n->parent;
+			if (s->type!=AST_TYPE_SYSCALL || (s->valpos!=led_cb && s->valpos!=mapped_cb)) return 0;
+			if (s->parent->type!=AST_TYPE_DROP) return 0;
+			if (!node_list_has(regs, s)) node_list_add(regs, s);
+		}
+		if (n->children && !find_led_cb_regs(n->children, fn, led_cb, mapped_cb, regs)) return 0;
+	}
+	return 1;
+}
+
+//Adds statement n right after statement s
+static void add_stmt_after(ast_node_t *s, ast_node_t *n) {
+	ast_node_t *p=s->parent;
+	if (p && p->type!=AST_TYPE_FUNCDEF && p->type!=AST_TYPE_BLOCK && p->type!=AST_TYPE_MULTI) {
+		//e.g. the body of an if; turn that into a MULTI first
+		ast_node_t *m=ast_new_node(AST_TYPE_MULTI, &s->loc);
+		ast_node_t **pp=&p->children;
+		while (*pp!=s) pp=&(*pp)->sibling;
+		*pp=m;
+		m->sibling=s->sibling;
+		m->children=s;
+		s->sibling=NULL;
+	}
+	n->sibling=s->sibling;
+	s->sibling=n;
+}
+
+//Moves what a LED callback calculates the same for every LED into a function that runs
+//once per frame: LED callbacks are registered with register_led_cb() or
+//register_led_mapped_cb(), and this adds a register_led_prologue_cb() call after those.
+//led_syscalls_frame_start() then runs the function with the time of the frame, which
+//writes the results into globals that the LED callback reads instead.
+void ast_ops_hoist_frame_invariants(ast_node_t *node) {
+	int led_cb=vm_syscall_handle_for_name("register_led_cb");
+	int mapped_cb=vm_syscall_handle_for_name("register_led_mapped_cb");
+	int prologue_cb=vm_syscall_handle_for_name("register_led_prologue_cb");
+	ast_node_t *prologue_def=NULL, *last=node;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_SYSCALLDEF && strcmp(n->name, "register_led_prologue_cb")==0) prologue_def=n;
+		last=n;
+	}
+	if (prologue_cb<0 || !prologue_def) return;
+	ast_ops_fix_parents(node);
+
+	//This also gets to the functions it adds, but those aren't LED callbacks
+	for (ast_node_t *fn=node; fn!=NULL; fn=fn->sibling) {
+		if (fn->type!=AST_TYPE_FUNCDEF) continue;
+		node_list_t regs={};
+		if (!find_led_cb_regs(node, fn, led_cb, mapped_cb, &regs) || regs.count==0 ||
+				arg_size_for_fn(fn)!=2 || has_type(fn, AST_TYPE_FUNCCALL)) {
+			free(regs.n);
+			continue;
+		}
+		frame_hoist_t h={};
+		h.fn=fn;
+		h.time=ast_find_type(ast_find_type(fn->children, AST_TYPE_FUNCDEFARG)->sibling, AST_TYPE_FUNCDEFARG);
+		if (count_refs_to(fn, h.time)) h.time=NULL;
+		while (find_invariant_locals(fn->children, &h)) {}
+		char name[128];
+		snprintf(name, sizeof(name), "%s.frame", fn->name);
+		h.frame_fn=ast_new_node(AST_TYPE_FUNCDEF, &fn->loc);
+		h.frame_fn->name=strdup(name);
+		h.frame_fn->returns=AST_RETURNS_NUMBER;
+		h.frame_time=ast_new_node(AST_TYPE_FUNCDEFARG, &fn->loc);
+		h.frame_time->name=strdup("time");
+		h.frame_time->size=1;
+		h.frame_time->returns=AST_RETURNS_NUMBER;
+		ast_add_child(h.frame_fn, h.frame_time);
+		for (ast_node_t *n=fn->children; n!=NULL; n=n->sibling) {
+			if (n->type!=AST_TYPE_FUNCDEFARG && n->type!=AST_TYPE_LOCALSIZE) hoist_invariants(n, &h);
+		}
+		if (h.count) {
+			//Globals go in front of the functions, the new function at the end
+			for (int i=0; i<h.count; i++) {
+				h.globals[i]->sibling=node->sibling;
+				node->sibling=h.globals[i];
+			}
+			ast_node_t *r=ast_new_node(AST_TYPE_RETURN, &fn->loc);
+			ast_node_t *z=ast_new_node(AST_TYPE_NUMBER, &fn->loc);
+			z->returns=AST_RETURNS_CONST;
+			ast_add_child(r, z);
+			ast_add_child(h.frame_fn, r);
+			last->sibling=h.frame_fn;
+			last=h.frame_fn;
+			for (int i=0; i<regs.count; i++) {
+				ast_node_t *s=ast_new_node(AST_TYPE_SYSCALL, &regs.n[i]->loc);
+				s->name=strdup(prologue_def->name);
+				s->value=prologue_def;
+				s->valpos=prologue_cb;
+				s->returns=AST_RETURNS_NUMBER;
+				ast_node_t *f=ast_new_node(AST_TYPE_FUNCPTR, &regs.n[i]->loc);
+				f->name=strdup(name);
+				f->value=h.frame_fn;
+				f->returns=AST_RETURNS_FUNCTION;
+				ast_add_child(s, f);
+				ast_node_t *m=ast_new_node(AST_TYPE_NUMBER, &regs.n[i]->loc);
+				m->number=(regs.n[i]->valpos==mapped_cb)?(1<<16):0;
+				m->returns=AST_RETURNS_CONST;
+				ast_add_child(s, m);
+				ast_node_t *d=ast_new_node(AST_TYPE_DROP, &regs.n[i]->loc);
+				ast_add_child(d, s);
+				add_stmt_after(regs.n[i]->parent, d);
+			}
+			ast_ops_fix_parents(node);
+		}
+		free(h.globals);
+		free(h.locals.n);
+		free(regs.n);
+	}
+}
+
 static void gen_binary(ast_node_t *node, prog_t *p) {
 	for (ast_node_t *i=node; i!=NULL; i=i->sibling) {
 		if (i->type==AST_TYPE_INSN) {
-			int size=lssl_vm_argtypes[lssl_vm_ops[i->insn_type].argtype].byte_size;
+			int argtype=lssl_vm_ops[i->insn_type].argtype;
+			int size=lssl_vm_argtypes[argtype].byte_size;
 			if (size!=0) {
 				add_byte_prog(p, i->insn_type);
-				if (size==1) {
+				if (argtype==ARG_RRR) {
+					add_word_prog(p, i->insn_d);
+					add_word_prog(p, i->insn_s);
+					add_word_prog(p, i->insn_arg);
+				} else if (argtype==ARG_RRN) {
+					add_word_prog(p, i->insn_d);
+					add_word_prog(p, i->insn_s);
+					add_long_prog(p, i->insn_arg);
+				} else if (argtype==ARG_RN) {
+					add_word_prog(p, i->insn_d);
+					add_long_prog(p, i->insn_arg);
+				} else if (argtype==ARG_RT) {
+					add_word_prog(p, i->insn_s);
+					add_word_prog(p, i->insn_arg);
+				} else if (size==1) {
 					//no args
 				} else if (size==2) {
 					add_byte_prog(p, i->insn_arg);
@@ -866,6 +1867,64 @@ uint8_t *ast_ops_gen_binary(ast_node_t *node, int *len) {
 	return p.data;
 }
 
+typedef struct {
+	loc_table_entry_t *e;
+	int count;
+	int size;
+	uint32_t end_pc;
+} loc_list_t;
+
+//Collects the location of every insn, like ast_lookup_loc_for_pc() finds them. Insns
+//follow each other in the same order here as in ast_ops_position_insns().
+static int collect_locs(ast_node_t *node, loc_list_t *l) {
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_INSN && n->insn_type!=INSN_NOP) {
+			int size=lssl_vm_argtypes[lssl_vm_ops[n->insn_type].argtype].byte_size;
+			const file_loc_t *loc=&n->parent->loc;
+			loc_table_entry_t *last=l->count?&l->e[l->count-1]:NULL;
+			//An entry is for all pcs up to the next one, so skip repeats.
+			if (size && (!last || memcmp(&last->loc, loc, sizeof(file_loc_t))!=0)) {
+				if (l->count==l->size) {
+					l->size=l->size?l->size*2:64;
+					loc_table_entry_t *e=realloc(l->e, l->size*sizeof(loc_table_entry_t));
+					if (!e) return 0;
+					l->e=e;
+				}
+				l->e[l->count].pc=n->valpos;
+				l->e[l->count].loc=*loc;
+				l->count++;
+			}
+			if (size) l->end_pc=n->valpos+size;
+		}
+		if (n->children && !collect_locs(n->children, l)) return 0;
+	}
+	return 1;
+}
+
+uint8_t *ast_ops_gen_loc_table(ast_node_t *node, int *len) {
+	loc_list_t l={};
+	uint8_t *ret=NULL;
+	if (collect_locs(node, &l)) ret=loc_table_encode(l.e, l.count, l.end_pc, len);
+	free(l.e);
+	return ret;
+}
+
+//Second backend: the program as a WebAssembly module, for the browser. This translates
+//the bytecode, so the results are exactly those of the VM.
+uint8_t *ast_ops_gen_wasm(ast_node_t *node, int *len) {
+	int bin_len;
+	uint8_t *bin=ast_ops_gen_binary(node, &bin_len);
+	//Functions only used as callbacks need to be in the module as well
+	int pcs[1024];
+	int ct=0;
+	for (ast_node_t *n=node; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF && ct<1024) pcs[ct++]=n->valpos;
+	}
+	uint8_t *ret=lssl_vm_wasm_write(bin, bin_len, pcs, ct, len);
+	free(bin);
+	return ret;
+}
+
 //Calls all ops (except binary generation) in the proper order
 void ast_ops_do_compile(ast_node_t *prognode) {
 //	ast_dump(prognode); exit(0);
@@ -885,9 +1944,15 @@ void ast_ops_do_compile(ast_node_t *prognode) {
 	ast_ops_annotate_obj_ref_size(prognode);
 	ast_ops_fix_function_args(prognode);
 	ast_ops_set_ref_deref_return_type(prognode);
+	ast_ops_inline_functions(prognode);
+	ast_ops_fold_consts(prognode);
+	ast_ops_hoist_frame_invariants(prognode);
+	ast_ops_remove_dead_code(prognode);
+	ast_ops_var_place(prognode); //again, as vars may have been removed
 	codegen(prognode);
 	ast_ops_fixup_enter_return(prognode);
 	ast_ops_remove_useless_ops(prognode);
+	peephole(prognode);
 	ast_ops_position_insns(prognode);
 	ast_ops_assign_addr_to_fndef_node(prognode);
 	ast_ops_fixup_addrs(prognode);
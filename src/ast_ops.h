@@ -1,7 +1,11 @@
 #pragma once
 
 //ToDo: do these all need to be public? Are they still in sync with the c file?
-void ast_ops_collate_consts(ast_node_t *node);
+int ast_ops_collate_consts(ast_node_t *node);
+void ast_ops_fold_consts(ast_node_t *node);
+void ast_ops_remove_dead_code(ast_node_t *node);
+void ast_ops_inline_functions(ast_node_t *node);
+void ast_ops_hoist_frame_invariants(ast_node_t *node);
 void ast_ops_attach_symbol_defs(ast_node_t *node);
 void ast_ops_add_trailing_return(ast_node_t *node);
 void ast_ops_var_place(ast_node_t *node);
@@ -16,5 +20,9 @@ void ast_ops_fix_parents(ast_node_t *node);
 void ast_ops_do_compile(ast_node_t *prognode);
 
 uint8_t *ast_ops_gen_binary(ast_node_t *node, int *len);
+//Table to find the source location of a pc in the binary without the AST; see loc_table.h
+uint8_t *ast_ops_gen_loc_table(ast_node_t *node, int *len);
+uint8_t *ast_ops_gen_wasm(ast_node_t *node, int *len);
 
-
+//Max size, in AST nodes, of a function that gets inlined. 0 disables inlining.
+extern int ast_ops_inline_limit;
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "ast.h"
+#include "ast_ops.h"
+#include "compile.h"
+#include "led_syscalls.h"
+#include "led_threads.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "bench.h"
+
+#define DEF_LEDS 300
+#define DEF_FRAMES 100
+#define DEF_SEED 1
+#define DEF_RUNS 3
+#define DEF_THRESHOLD 10.0	//percent ns/LED can get worse before it counts as a regression
+#define TIME_STEP 0.05		//same as the simulator in lssl.c
+#define MAX_RESULTS 256
+
+typedef struct {
+	int leds;
+	int frames;
+	int lanes;
+	int threads;
+	int jit;
+	int runs;
+	unsigned int seed;
+} bench_opts_t;
+
+typedef struct {
+	char name[128];
+	double ns_per_led;
+	double fps;
+	double insns_per_led;
+	int64_t insns;		//all frames together; exact, so compare() uses this
+	int peak_stack;		//in words
+} bench_result_t;
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static char *read_file(const char *file) {
+	FILE *f=fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long len=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *buf=calloc(len+1, 1);
+	if (buf && fread(buf, 1, len, f)!=len) {
+		free(buf);
+		buf=NULL;
+	}
+	fclose(f);
+	return buf;
+}
+
+//Makes a VM for the program and runs its main().
+static lssl_vm_t *start_vm(const char *name, uint8_t *bin, int bin_len, int jit) {
+	led_syscalls_clear();
+	lssl_vm_t *vm=lssl_vm_init(bin, bin_len, 65536);
+	if (!vm) {
+		printf("%s: program doesn't load\n", name);
+		return NULL;
+	}
+	if (jit) lssl_vm_jit(vm); //interprets if there's no JIT
+	vm_error_t err={};
+	lssl_vm_run_main(vm, &err);
+	if (err.type) {
+		printf("%s: main() failed: %s at pc 0x%X\n", name, vm_err_to_str(err.type), err.pc);
+		lssl_vm_free(vm);
+		return NULL;
+	}
+	return vm;
+}
+
+//Renders all frames, on the threads if there are any. Every run starts with the same seed
+//and time, so it does exactly the same work.
+static int run_frames(const char *name, lssl_vm_t *vm, led_threads_t *threads, const bench_opts_t *o, uint8_t *leds) {
+	vm_error_t err={};
+	srand(o->seed);
+	for (int frame=0; frame<o->frames; frame++) {
+		double time=frame*TIME_STEP;
+		led_syscalls_frame_start(vm, time, 0, &err);
+		if (!err.type && threads) {
+			led_threads_render_frame(threads, 0, o->leds, time, leds, LED_FORMAT_RGB, &err);
+		} else if (!err.type) {
+			led_syscalls_render_frame(vm, 0, o->leds, time, leds, LED_FORMAT_RGB, &err);
+		}
+		if (err.type) {
+			printf("%s: frame %d: %s at pc 0x%X\n", name, frame, vm_err_to_str(err.type), err.pc);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//Returns 1 if it went well, 0 on errors, -1 if the program has no effect to run.
+static int bench_file(const char *file, const bench_opts_t *o, bench_result_t *r) {
+	const char *name=strrchr(file, '/');
+	name=name?name+1:file;
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	char *src=read_file(file);
+	if (!src) return 0;
+	ast_node_t *prognode=lssl_compile(src);
+	free(src);
+	if (!prognode) {
+		printf("%s: doesn't compile\n", name);
+		return 0;
+	}
+	int bin_len;
+	uint8_t *bin=ast_ops_gen_binary(prognode, &bin_len);
+	ast_free_all(prognode);
+	uint8_t *leds=malloc(o->leds*3);
+	int ok=0;
+
+	//Count insns and stack use with everything in the interpreter, one LED at a time.
+	lssl_vm_t *vm=start_vm(name, bin, bin_len, 0);
+	if (!vm) goto out;
+	if (!led_syscalls_have_cb()) {
+		printf("%s: skipped, main() doesn't register a LED callback\n", name);
+		lssl_vm_free(vm);
+		ok=-1;
+		goto out;
+	}
+	lssl_vm_paint_stack(vm);
+	int64_t insns=lssl_vm_insn_count(vm);
+	led_syscalls_set_lanes(1);
+	ok=run_frames(name, vm, NULL, o, leds);
+	insns=lssl_vm_insn_count(vm)-insns;
+	r->insns=insns;
+	r->insns_per_led=(double)insns/((double)o->frames*o->leds);
+	r->peak_stack=lssl_vm_stack_peak(vm);
+	lssl_vm_free(vm);
+	if (!ok) goto out;
+
+	//Time it on a new VM, the way it was asked to run. The fastest run has the least noise
+	//from whatever else the machine is doing.
+	double best=0;
+	for (int run=0; run<o->runs && ok; run++) {
+		ok=0;
+		vm=start_vm(name, bin, bin_len, o->jit);
+		if (!vm) goto out;
+		led_syscalls_set_lanes(o->lanes);
+		led_threads_t *threads=NULL;
+		if (o->threads>1) {
+			threads=led_threads_create(vm, o->threads);
+			if (!threads) {
+				printf("Could not create render threads.\n");
+				lssl_vm_free(vm);
+				goto out;
+			}
+		}
+		double start=now_ns();
+		ok=run_frames(name, vm, threads, o, leds);
+		double ns=now_ns()-start;
+		if (threads) led_threads_free(threads);
+		lssl_vm_free(vm);
+		if (run==0 || ns<best) best=ns;
+	}
+	if (best<1) best=1;
+	r->ns_per_led=best/((double)o->frames*o->leds);
+	r->fps=o->frames*1e9/best;
+out:
+	led_syscalls_set_lanes(1);
+	free(leds);
+	free(bin);
+	return ok;
+}
+
+static int write_json(const char *file, const bench_opts_t *o, const bench_result_t *r, int ct) {
+	FILE *f=fopen(file, "w");
+	if (!f) {
+		perror(file);
+		return 0;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "  \"leds\": %d, \"frames\": %d, \"seed\": %u, \"lanes\": %d, \"threads\": %d, \"jit\": %d, \"runs\": %d,\n",
+			o->leds, o->frames, o->seed, o->lanes, o->threads, o->jit, o->runs);
+	fprintf(f, "  \"results\": [\n");
+	//One effect per line; read_json() depends on that.
+	for (int i=0; i<ct; i++) {
+		fprintf(f, "    {\"name\": \"%s\", \"ns_per_led\": %.2f, \"fps\": %.2f, \"insns_per_led\": %.2f, \"peak_stack\": %d, \"insns\": %"PRId64"}%s\n",
+				r[i].name, r[i].ns_per_led, r[i].fps, r[i].insns_per_led, r[i].peak_stack, r[i].insns, (i==ct-1)?"":",");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+	return 1;
+}
+
+//Reads the settings and results in a file written by write_json(). Returns the amount of
+//results, or -1 on error.
+static int read_json(const char *file, bench_opts_t *o, bench_result_t *r, int max) {
+	FILE *f=fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	char line[512];
+	int ct=0;
+	while (ct<max && fgets(line, sizeof(line), f)) {
+		bench_result_t *e=&r[ct];
+		sscanf(line, " \"leds\": %d, \"frames\": %d, \"seed\": %u, \"lanes\": %d, \"threads\": %d, \"jit\": %d, \"runs\": %d",
+				&o->leds, &o->frames, &o->seed, &o->lanes, &o->threads, &o->jit, &o->runs);
+		if (sscanf(line, " {\"name\": \"%127[^\"]\", \"ns_per_led\": %lf, \"fps\": %lf, \"insns_per_led\": %lf, \"peak_stack\": %d, \"insns\": %"SCNd64,
+				e->name, &e->ns_per_led, &e->fps, &e->insns_per_led, &e->peak_stack, &e->insns)==6) ct++;
+	}
+	fclose(f);
+	return ct;
+}
+
+static double pct_change(double old, double new) {
+	return old?(new-old)*100.0/old:0;
+}
+
+//Prints the results next to the ones in base. Insns and stack use are deterministic, so
+//any increase there is a regression; timing only is if it's more than threshold percent.
+//Returns the amount of regressions.
+static int compare(const bench_result_t *base, int base_ct, const bench_result_t *r, int ct, double threshold) {
+	int regressions=0;
+	printf("\n%-24s %16s %16s %14s\n", "Compared to baseline", "ns/LED", "insns/LED", "peak stack");
+	for (int i=0; i<ct; i++) {
+		const bench_result_t *b=NULL;
+		for (int j=0; j<base_ct && !b; j++) {
+			if (strcmp(base[j].name, r[i].name)==0) b=&base[j];
+		}
+		if (!b) {
+			printf("%-24s not in baseline\n", r[i].name);
+			continue;
+		}
+		double t=pct_change(b->ns_per_led, r[i].ns_per_led);
+		double n=pct_change(b->insns, r[i].insns);
+		int s=r[i].peak_stack-b->peak_stack;
+		int bad=(t>threshold) || (r[i].insns>b->insns) || (s>0);
+		printf("%-24s %+15.1f%% %+15.2f%% %+14d%s\n", r[i].name, t, n, s, bad?"  REGRESSION":"");
+		regressions+=bad;
+	}
+	return regressions;
+}
+
+static void usage() {
+	printf("Usage: lssl bench [-h] [-s n] [-f n] [-l n] [-t n] [-n n] [-j] [-r seed] [-o out.json] [-c baseline.json] [-x percent] file.lssl...\n");
+	printf("  Runs frame_start and the LED callback of every program for a fixed amount of frames, and\n");
+	printf("  reports the time per LED, frames per second, instructions per LED and peak stack use.\n");
+	printf("  Instructions and stack use come from a separate run in the interpreter, one LED at a time.\n");
+	printf("  -s n: Render n leds (default %d)\n", DEF_LEDS);
+	printf("  -f n: Render n frames (default %d)\n", DEF_FRAMES);
+	printf("  -l n: Calculate n leds at the same time (default 8, or 1 with -j)\n");
+	printf("  -t n: Use n threads (default 1)\n");
+	printf("  -n n: Time every program n times, and report the fastest (default %d)\n", DEF_RUNS);
+	printf("  -j: run the programs as native code (x86-64 Linux only)\n");
+	printf("  -r seed: Seed for rand() (default %d)\n", DEF_SEED);
+	printf("  -o out.json: Write the results as JSON\n");
+	printf("  -c baseline.json: Compare the results against a file written by -o; exits with 2 on a regression\n");
+	printf("  -x percent: How much slower per LED counts as a regression (default %.0f)\n", DEF_THRESHOLD);
+}
+
+int bench_main(int argc, char **argv) {
+	bench_opts_t o={.leds=DEF_LEDS, .frames=DEF_FRAMES, .lanes=-1, .threads=1, .runs=DEF_RUNS, .seed=DEF_SEED};
+	const char *json_out="";
+	const char *baseline="";
+	double threshold=DEF_THRESHOLD;
+	const char *files[MAX_RESULTS];
+	int file_ct=0;
+	int error=0;
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-h")==0) {
+			error=1;
+		} else if (strcmp(argv[i], "-j")==0) {
+			o.jit=1;
+		} else if (strcmp(argv[i], "-s")==0 && argc>i+1) {
+			o.leds=atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-f")==0 && argc>i+1) {
+			o.frames=atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-l")==0 && argc>i+1) {
+			o.lanes=atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t")==0 && argc>i+1) {
+			o.threads=atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-n")==0 && argc>i+1) {
+			o.runs=atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r")==0 && argc>i+1) {
+			o.seed=strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-o")==0 && argc>i+1) {
+			json_out=argv[++i];
+		} else if (strcmp(argv[i], "-c")==0 && argc>i+1) {
+			baseline=argv[++i];
+		} else if (strcmp(argv[i], "-x")==0 && argc>i+1) {
+			threshold=atof(argv[++i]);
+		} else if (argv[i][0]!='-' && file_ct<MAX_RESULTS) {
+			files[file_ct++]=argv[i];
+		} else {
+			printf("Unknown arg: %s\n", argv[i]);
+			error=1;
+		}
+	}
+	if (error || file_ct==0 || o.leds<1 || o.frames<1 || o.runs<1) {
+		usage();
+		return 1;
+	}
+	//The native code is faster than running the interpreter for multiple LEDs at once
+	if (o.lanes<0) o.lanes=o.jit?1:8;
+
+	bench_result_t *base=NULL;
+	int base_ct=0;
+	if (strlen(baseline)!=0) {
+		bench_opts_t base_o={};
+		base=calloc(MAX_RESULTS, sizeof(bench_result_t));
+		base_ct=read_json(baseline, &base_o, base, MAX_RESULTS);
+		if (base_ct<0) return 1;
+		if (memcmp(&base_o, &o, sizeof(o))!=0) {
+			printf("Warning: %s was made with different settings; the numbers may not compare.\n", baseline);
+		}
+	}
+
+	led_syscalls_init();
+	bench_result_t *r=calloc(file_ct, sizeof(bench_result_t));
+	int ct=0, failed=0;
+	printf("%d LEDs, %d frames, %d lane(s), %d thread(s)%s\n", o.leds, o.frames, o.lanes, o.threads, o.jit?", native code":"");
+	printf("%-24s %12s %12s %12s %12s\n", "Effect", "ns/LED", "frames/s", "insns/LED", "peak stack");
+	for (int i=0; i<file_ct; i++) {
+		int ok=bench_file(files[i], &o, &r[ct]);
+		if (ok==0) failed++;
+		if (ok!=1) continue;
+		printf("%-24s %12.1f %12.1f %12.1f %12d\n", r[ct].name, r[ct].ns_per_led, r[ct].fps, r[ct].insns_per_led, r[ct].peak_stack);
+		ct++;
+	}
+	vm_syscall_free();
+
+	int ret=failed?1:0;
+	if (strlen(json_out)!=0 && !write_json(json_out, &o, r, ct)) ret=1;
+	if (base && compare(base, base_ct, r, ct, threshold)) {
+		printf("Regressions found.\n");
+		ret=2;
+	}
+	free(base);
+	free(r);
+	return ret;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+//'lssl bench': renders a set of effects for a fixed amount of frames with a fixed time
+//base and random seed, reports ns/LED, frames/s, instructions/LED and peak stack use per
+//effect, and optionally writes those as JSON or compares them against an earlier run.
+//argv[0] is "bench". Returns the exit code.
+int bench_main(int argc, char **argv);
@@ -108,10 +108,172 @@ void handle_rhs_lhs_op(ast_node_t *node, lssl_insn_enum type) {
 	insert_insn_after_arg_eval(node, type, 2);
 }
 
+/*
+Register insns. Inside functions, arithmetic and compares work directly on the stack
+frame: local vars are slots, constants are immediates, and intermediate results go into
+temporary slots after the local vars (ENTER makes room for those). Anything else is
+calculated on the stack as before and stored into a temporary with STA.
+*/
+
+static int reg_temp_base=-1;	//first temporary slot; -1 outside of functions
+static int reg_temps;			//temporaries in use
+static int reg_temps_max;		//most temporaries in use at once in this function
+
+static int alloc_temp() {
+	int t=reg_temp_base+reg_temps++;
+	if (reg_temps>reg_temps_max) reg_temps_max=reg_temps;
+	return t;
+}
+
+//Returns true if n is a ref/deref of a local POD var, which lives in a slot.
+static int is_local_pod(ast_node_t *n) {
+	if (n->type!=AST_TYPE_REF && n->type!=AST_TYPE_DEREF) return 0;
+	if (n->returns!=AST_RETURNS_NUMBER || n->value->returns!=AST_RETURNS_NUMBER) return 0;
+	return nth_param(n, 1)==NULL && ast_is_local(n->value);
+}
+
+static int has_incdec(ast_node_t *n) {
+	for (ast_node_t *c=n->children; c!=NULL; c=c->sibling) {
+		if (c->type==AST_TYPE_POST_ADD || c->type==AST_TYPE_PRE_ADD) return 1;
+		if (has_incdec(c)) return 1;
+	}
+	return 0;
+}
+
+//Returns the register insn for n, or -1 if it can't be done with one. Register insns read
+//local vars when they run rather than when the operand is evaluated, so this can't be used
+//if a ++ or -- in the expression may change a var in between.
+static int reg_op(ast_node_t *n) {
+	if (reg_temp_base<0) return -1;
+	int op=-1;
+	if (n->type==AST_TYPE_PLUS) op=INSN_RADD;
+	if (n->type==AST_TYPE_MINUS) op=INSN_RSUB;
+	if (n->type==AST_TYPE_TIMES) op=INSN_RMUL;
+	if (n->type==AST_TYPE_DIVIDE) op=INSN_RDIV;
+	if (n->type==AST_TYPE_MODULUS) op=INSN_RMOD;
+	if (n->type==AST_TYPE_TEQ) op=INSN_RTEQ;
+	if (n->type==AST_TYPE_TNEQ) op=INSN_RTNEQ;
+	if (n->type==AST_TYPE_TL) op=INSN_RTL;
+	if (n->type==AST_TYPE_TLEQ) op=INSN_RTLEQ;
+	if (op<0 || has_incdec(n)) return -1;
+	return op;
+}
+
+//Immediate version of a register insn
+#define REG_IMM(op) ((op)+(INSN_RADDI-INSN_RADD))
+
+//Register insn that gives the same result with s and t swapped, or -1 if there's none.
+static int reg_op_swapped(int op) {
+	if (op==INSN_RADD || op==INSN_RMUL || op==INSN_RTEQ || op==INSN_RTNEQ) return op;
+	if (op==INSN_RTL) return INSN_RTG;
+	if (op==INSN_RTLEQ) return INSN_RTGEQ;
+	return -1;
+}
+
+typedef struct {
+	int is_imm;
+	int32_t v; //immediate value or slot
+} reg_opnd_t;
+
+static void codegen_reg(ast_node_t *n, int d);
+
+//Generates the code for param argnum of n and returns where its value ends up.
+static reg_opnd_t reg_operand(ast_node_t *n, int argnum) {
+	ast_node_t *c=nth_param(n, argnum);
+	if (c->type==AST_TYPE_NUMBER) return (reg_opnd_t){1, c->number};
+	if (is_local_pod(c)) return (reg_opnd_t){0, c->value->valpos};
+	int t=alloc_temp();
+	if (reg_op(c)>=0) {
+		codegen_reg(c, t);
+	} else {
+		codegen_node_pod(c);
+		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_STA, argnum);
+		i->insn_arg=t;
+	}
+	return (reg_opnd_t){0, t};
+}
+
+//Generates register insns calculating n (which reg_op() must accept) into slot d.
+static void codegen_reg(ast_node_t *n, int d) {
+	int op=reg_op(n);
+	int saved_temps=reg_temps;
+	reg_opnd_t a=reg_operand(n, 1);
+	reg_opnd_t b=reg_operand(n, 2);
+	if (a.is_imm && !b.is_imm && reg_op_swapped(op)>=0) {
+		reg_opnd_t t=a;
+		a=b;
+		b=t;
+		op=reg_op_swapped(op);
+	} else if (a.is_imm) {
+		//The first operand needs to be in a slot
+		int t=alloc_temp();
+		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_RSET, 1);
+		i->insn_d=t;
+		i->insn_arg=a.v;
+		a=(reg_opnd_t){0, t};
+	}
+	ast_node_t *i=insert_insn_after_arg_eval(n, b.is_imm?REG_IMM(op):op, 2);
+	i->insn_d=d;
+	i->insn_s=a.v;
+	i->insn_arg=b.v;
+	reg_temps=saved_temps;
+}
+
+//Generates the code to write the value of n into slot d.
+static void codegen_to_slot(ast_node_t *parent, int argnum, int d, ast_node_t *var) {
+	ast_node_t *n=nth_param(parent, argnum);
+	if (n->type==AST_TYPE_NUMBER) {
+		ast_node_t *i=insert_insn_after_arg_eval(parent, INSN_RSET, argnum);
+		i->insn_d=d;
+		i->insn_arg=n->number;
+	} else if (is_local_pod(n)) {
+		ast_node_t *i=insert_insn_after_arg_eval(parent, INSN_RADDI, argnum);
+		i->insn_d=d;
+		i->insn_s=n->value->valpos;
+		i->insn_arg=0;
+	} else if (reg_op(n)>=0) {
+		codegen_reg(n, d);
+	} else {
+		codegen_node_pod(n);
+		ast_node_t *i=insert_insn_after_arg_eval(parent, INSN_STA, argnum);
+		i->insn_arg=d;
+		i->value=var;
+	}
+}
+
+//Generates the condition (param argnum of n) of an if, for or while, and a jump that is
+//taken if it's false. The caller sets the target of the returned jump.
+static ast_node_t *codegen_cond(ast_node_t *n, int argnum) {
+	ast_node_t *c=nth_param(n, argnum);
+	if (reg_temp_base>=0 && is_local_pod(c)) {
+		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_RJZ, argnum);
+		i->insn_s=c->value->valpos;
+		return i;
+	} else if (reg_op(c)>=0) {
+		int saved_temps=reg_temps;
+		int t=alloc_temp();
+		codegen_reg(c, t);
+		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_RJZ, argnum);
+		i->insn_s=t;
+		reg_temps=saved_temps;
+		return i;
+	}
+	codegen_node_pod(c);
+	return insert_insn_after_arg_eval(n, INSN_JZ, argnum);
+}
+
 
 static void codegen_node(ast_node_t *n) {
 	if (!n) return;
-	if (n->type==AST_TYPE_NUMBER) {
+	if (reg_op(n)>=0) {
+		//Value is needed on the stack: calculate it in a temporary and push that.
+		int saved_temps=reg_temps;
+		int t=alloc_temp();
+		codegen_reg(n, t);
+		ast_node_t *i=insert_insn_after_all_arg_eval(n, INSN_LDA);
+		i->insn_arg=t;
+		reg_temps=saved_temps;
+	} else if (n->type==AST_TYPE_NUMBER) {
 		if ((n->number&0xffff)==0) {
 			ast_node_t *i=insert_insn_before_arg_eval(n, INSN_PUSH_I);
 			i->insn_arg=n->number>>16;
@@ -149,13 +311,12 @@ static void codegen_node(ast_node_t *n) {
 		//Note: the body and increment are swapped in the AST wrt the order
 		//they appear in the code.
 		codegen_node(nth_param(n, 1)); //initial
-		codegen_node_pod(nth_param(n, 2)); //condition
+		//condition, plus conditional jump to end
+		ast_node_t *j=codegen_cond(n, 2);
 		codegen_node(nth_param(n, 3)); //body
 		codegen_node(nth_param(n, 4)); //increment
 		//dummy after initial so we can jump back there
 		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_NOP, 1);
-		//conditional jump to end after condition
-		ast_node_t *j=insert_insn_after_arg_eval(n, INSN_JZ, 2); 
 		//jump to condition at end of body/increment
 		ast_node_t *k=insert_insn_after_arg_eval(n, INSN_JMP, 4);
 		//nop for address placeholder for conditional jump
@@ -164,8 +325,7 @@ static void codegen_node(ast_node_t *n) {
 		k->value=i;
 	} else if (n->type==AST_TYPE_IF) {
 		ast_node_t *else_node=nth_param(n, 3);
-		codegen_node_pod(nth_param(n, 1)); //condition
-		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_JZ, 1); //conditional jmp
+		ast_node_t *i=codegen_cond(n, 1); //condition and conditional jmp
 		codegen_node(nth_param(n, 2)); //body
 		if (else_node) {
 			codegen_node(else_node); //else body
@@ -180,8 +340,7 @@ static void codegen_node(ast_node_t *n) {
 		}
 	} else if (n->type==AST_TYPE_WHILE) {
 		ast_node_t *h=insert_insn_before_arg_eval(n, INSN_NOP);
-		codegen_node_pod(nth_param(n, 1)); //condition
-		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_JZ, 1);
+		ast_node_t *i=codegen_cond(n, 1); //condition and conditional jmp
 		codegen_node(nth_param(n, 2)); //body
 		ast_node_t *j=insert_insn_after_arg_eval(n, INSN_JMP, 2);
 		j->value=h;
@@ -197,7 +356,14 @@ static void codegen_node(ast_node_t *n) {
 		handle_rhs_lhs_op_pod(n, INSN_TLEQ);
 	} else if (n->type==AST_TYPE_FUNCDEF) {
 		insert_insn_before_arg_eval(n, INSN_ENTER);
+		//Temporaries go after the local vars
+		ast_node_t *ls=ast_find_type(n->children, AST_TYPE_LOCALSIZE);
+		reg_temp_base=ls->number;
+		reg_temps=0;
+		reg_temps_max=0;
 		codegen(n->children);
+		ls->number+=reg_temps_max;
+		reg_temp_base=-1;
 	} else if (n->type==AST_TYPE_FUNCDEFARG) {
 		//na
 	} else if (n->type==AST_TYPE_SYSCALLDEF) {
@@ -213,18 +379,36 @@ static void codegen_node(ast_node_t *n) {
 	} else if (n->type==AST_TYPE_BLOCK) {
 		insert_insn_before_arg_eval(n, INSN_SCOPE_ENTER);
 		codegen(n->children);
-		insert_insn_after_arg_eval(n, INSN_SCOPE_LEAVE, 1);
+		//After all statements, not the first: the locals are in use until the end
+		insert_insn_after_all_arg_eval(n, INSN_SCOPE_LEAVE);
 	} else if (n->type==AST_TYPE_MULTI) {
-		codegen(n->children);
+		//can be empty after ast_ops_fold_consts() removed a branch
+		if (n->children) codegen(n->children);
 	} else if (n->type==AST_TYPE_DROP) {
-		codegen_node(nth_param(n, 1));
-		insert_insn_after_arg_eval(n, INSN_POP, 1);
+		ast_node_t *p=nth_param(n, 1);
+		if (reg_temp_base>=0 && (p->type==AST_TYPE_POST_ADD || p->type==AST_TYPE_PRE_ADD) &&
+				is_local_pod(nth_param(p, 1))) {
+			//Increment of a local var whose value isn't used
+			ast_node_t *i=insert_insn_after_arg_eval(n, INSN_RADDI, 1);
+			i->insn_d=nth_param(p, 1)->value->valpos;
+			i->insn_s=i->insn_d;
+			i->insn_arg=p->number;
+		} else {
+			codegen_node(p);
+			insert_insn_after_arg_eval(n, INSN_POP, 1);
+		}
 	} else if (n->type==AST_TYPE_ASSIGN) {
 		//Arg 1: address of thing to assign to
 		//Arg 2: value to assign
-		codegen_node_pod(nth_param(n, 1));
-		codegen_node_pod(nth_param(n, 2));
-		insert_insn_after_arg_eval(n, INSN_WR_VAR, 2);
+		ast_node_t *lhs=nth_param(n, 1);
+		if (reg_temp_base>=0 && is_local_pod(lhs)) {
+			//Write straight into the slot of the var
+			codegen_to_slot(n, 2, lhs->value->valpos, lhs->value);
+		} else {
+			codegen_node_pod(lhs);
+			codegen_node_pod(nth_param(n, 2));
+			insert_insn_after_arg_eval(n, INSN_WR_VAR, 2);
+		}
 	} else if (n->type==AST_TYPE_POST_ADD) {
 		codegen_node_pod(nth_param(n, 1));
 		ast_node_t *i=insert_insn_after_arg_eval(n, INSN_POST_ADD, 1);
@@ -237,7 +421,14 @@ static void codegen_node(ast_node_t *n) {
 		codegen_node_pod(nth_param(n, 1));
 		insert_insn_after_arg_eval(n, INSN_RETURN, 1);
 	} else if (n->type==AST_TYPE_DECLARE) {
-		if (n->returns==AST_RETURNS_ARRAY) {
+		ast_node_t *r=ast_find_type(n->children, AST_TYPE_REF);
+		if (r) {
+			//Refers to an existing object (an inlined object arg): only store its address
+			codegen_node(r);
+			ast_node_t *i=insert_insn_after_all_arg_eval(n, INSN_STA);
+			i->insn_arg=n->valpos;
+			i->value=n;
+		} else if (n->returns==AST_RETURNS_ARRAY) {
 			ast_node_t *a=ast_find_type(n->children, AST_TYPE_ARRAYREF);
 			assert(a && "No arrayref in returns->array declare?");
 			ast_node_t *j=insert_insn_before_arg_eval(n, ast_is_local(n)?INSN_LEA:INSN_LEA_G);
@@ -285,6 +476,11 @@ static void codegen_node(ast_node_t *n) {
 		//nothing
 	} else if (n->type==AST_TYPE_STRUCTREF) {
 		//n/a
+	} else if (n->type==AST_TYPE_DEREF && n->returns==AST_RETURNS_NUMBER &&
+			n->value->returns==AST_RETURNS_NUMBER && !nth_param(n, 1)) {
+		//Reading a POD var: load it directly
+		ast_node_t *i=insert_insn_before_arg_eval(n, ast_is_local(n->value)?INSN_LDA:INSN_LDA_G);
+		i->value=n->value;
 	} else if (n->type==AST_TYPE_REF || n->type==AST_TYPE_DEREF) {
 		codegen_node(nth_param(n, 1));
 		ast_node_t *i;
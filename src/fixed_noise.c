@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include "fixed_noise.h"
+
+#define FIXED_ONE (1<<16)
+
+//Hash of a lattice point. Unsigned, so overflow is well-defined.
+static uint32_t hash(int32_t ix, int32_t iy, int32_t iz, uint32_t seed) {
+	uint32_t h=(uint32_t)ix*0x8da6b343u;
+	h^=(uint32_t)iy*0xd8163841u;
+	h^=(uint32_t)iz*0xcb1ab31fu;
+	h^=seed*0x27d4eb2du;
+	h^=h>>13;
+	h*=0x85ebca6bu;
+	h^=h>>16;
+	return h;
+}
+
+//Dot product of the offset to a lattice point with one of the 12 gradients of Perlin's
+//improved noise, picked by the hash. 2D and 1D noise pass 0 for the unused offsets.
+static int32_t grad(uint32_t h, int32_t x, int32_t y, int32_t z) {
+	h&=15;
+	int32_t u=(h<8)?x:y;
+	int32_t v=(h<4)?y:((h==12 || h==14)?x:z);
+	return ((h&1)?-u:u)+((h&2)?-v:v);
+}
+
+//6t^5-15t^4+10t^3, for t in 0..1
+static int32_t fade(int32_t t) {
+	int64_t a=((((int64_t)6*t-15*FIXED_ONE)*t)>>16)+10*FIXED_ONE;
+	int64_t t3=((((int64_t)t*t)>>16)*t)>>16;
+	return (a*t3)>>16;
+}
+
+static int32_t lerp(int32_t a, int32_t b, int32_t t) {
+	return a+(((int64_t)b-a)*t>>16);
+}
+
+static int32_t noise1(int32_t x, uint32_t seed) {
+	int32_t ix=x>>16;
+	int32_t fx=x&0xffff;
+	int32_t u=fade(fx);
+	//In 1D the gradient is +1 or -1, which gives -0.5..0.5; scale that up.
+	int32_t a=(hash(ix, 0, 0, seed)&1)?-fx:fx;
+	int32_t b=(hash(ix+1, 0, 0, seed)&1)?FIXED_ONE-fx:fx-FIXED_ONE;
+	return lerp(a, b, u)*2;
+}
+
+static int32_t noise2(int32_t x, int32_t y, uint32_t seed) {
+	int32_t ix=x>>16, iy=y>>16;
+	int32_t fx=x&0xffff, fy=y&0xffff;
+	int32_t u=fade(fx), v=fade(fy);
+	int32_t n00=grad(hash(ix, iy, 0, seed), fx, fy, 0);
+	int32_t n10=grad(hash(ix+1, iy, 0, seed), fx-FIXED_ONE, fy, 0);
+	int32_t n01=grad(hash(ix, iy+1, 0, seed), fx, fy-FIXED_ONE, 0);
+	int32_t n11=grad(hash(ix+1, iy+1, 0, seed), fx-FIXED_ONE, fy-FIXED_ONE, 0);
+	return lerp(lerp(n00, n10, u), lerp(n01, n11, u), v);
+}
+
+static int32_t noise3(int32_t x, int32_t y, int32_t z, uint32_t seed) {
+	int32_t ix=x>>16, iy=y>>16, iz=z>>16;
+	int32_t fx=x&0xffff, fy=y&0xffff, fz=z&0xffff;
+	int32_t u=fade(fx), v=fade(fy), w=fade(fz);
+	int32_t n[2];
+	for (int k=0; k<2; k++) {
+		int32_t gz=fz-k*FIXED_ONE;
+		int32_t n00=grad(hash(ix, iy, iz+k, seed), fx, fy, gz);
+		int32_t n10=grad(hash(ix+1, iy, iz+k, seed), fx-FIXED_ONE, fy, gz);
+		int32_t n01=grad(hash(ix, iy+1, iz+k, seed), fx, fy-FIXED_ONE, gz);
+		int32_t n11=grad(hash(ix+1, iy+1, iz+k, seed), fx-FIXED_ONE, fy-FIXED_ONE, gz);
+		n[k]=lerp(lerp(n00, n10, u), lerp(n01, n11, u), v);
+	}
+	return lerp(n[0], n[1], w);
+}
+
+int32_t fixed_noise1(int32_t x) {
+	return noise1(x, 0);
+}
+
+int32_t fixed_noise2(int32_t x, int32_t y) {
+	return noise2(x, y, 0);
+}
+
+int32_t fixed_noise3(int32_t x, int32_t y, int32_t z) {
+	return noise3(x, y, z, 0);
+}
+
+//Every octave uses its own hash seed, so the layers don't line up at the origin.
+//Coordinates wrap around when doubling them overflows; that's fine for noise.
+#define FRACTAL(octaves, noise_octave) do { \
+		if (octaves<1) octaves=1; \
+		if (octaves>8) octaves=8; \
+		int64_t sum=0; \
+		for (int o=0; o<octaves; o++) sum+=(noise_octave)>>o; \
+		/* The amplitudes add up to 2-2^(1-octaves) */ \
+		return sum*(1<<(octaves-1))/((1<<octaves)-1); \
+	} while (0)
+
+#define OCT(c) ((int32_t)((uint32_t)(c)<<o))
+
+int32_t fixed_fractal_noise1(int32_t x, int octaves) {
+	FRACTAL(octaves, noise1(OCT(x), o));
+}
+
+int32_t fixed_fractal_noise2(int32_t x, int32_t y, int octaves) {
+	FRACTAL(octaves, noise2(OCT(x), OCT(y), o));
+}
+
+int32_t fixed_fractal_noise3(int32_t x, int32_t y, int32_t z, int octaves) {
+	FRACTAL(octaves, noise3(OCT(x), OCT(y), OCT(z), o));
+}
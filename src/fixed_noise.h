@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+//Gradient (Perlin) noise on 16.16 fixed point numbers. Like fixed_trig.c, this only
+//uses integer math, and the lattice is hashed rather than using rand(), so the same
+//coordinates give the same noise on every platform and every run.
+//
+//Results are about -1..1, and 0 at whole coordinates. The fractal versions add up
+//'octaves' layers (clamped to 1..8) of noise, every one at twice the frequency and half
+//the amplitude of the one before, and scale the sum back to about -1..1.
+
+int32_t fixed_noise1(int32_t x);
+int32_t fixed_noise2(int32_t x, int32_t y);
+int32_t fixed_noise3(int32_t x, int32_t y, int32_t z);
+
+int32_t fixed_fractal_noise1(int32_t x, int octaves);
+int32_t fixed_fractal_noise2(int32_t x, int32_t y, int octaves);
+int32_t fixed_fractal_noise3(int32_t x, int32_t y, int32_t z, int octaves);
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+//Trigonometry on 16.16 fixed point numbers, using integer math only. This way the
+//builtin syscalls don't need an FPU, and give the same results on every platform,
+//so the WebAssembly preview in the editor matches what the device shows.
+//
+//Angles are in radians. Max error versus (double precision) libm, in units of 1/65536,
+//as measured by trig_bench and a sweep over all inputs:
+// fixed_sin, fixed_cos: 1.3 for angles up to 4096, 2.3 over the whole range. The angle
+//                       gets converted to a fraction of a turn first, which rounds.
+// fixed_atan2: 1.8
+// fixed_tan: 2.7 for |result|<1, growing with the result near the poles, as the error
+//            of sin and cos gets divided by a small number there.
+//The float versions the syscalls used before were within 1.0 for small angles.
+
+int32_t fixed_sin(int32_t a);
+int32_t fixed_cos(int32_t a);
+//Saturates to INT32_MAX or INT32_MIN near the poles.
+int32_t fixed_tan(int32_t a);
+//Returns a value in -pi..pi, and 0 for atan2(0, 0).
+int32_t fixed_atan2(int32_t y, int32_t x);
@@ -11,29 +11,39 @@
 #include "vm.h"
 #include "error.h"
 #include "compile.h"
+#include "loc_table.h"
 
 static lssl_vm_t *vm=NULL;
 
 void init() {
 	led_syscalls_init();
+	led_syscalls_set_lanes(8);
 }
 
-ast_node_t *last_ast=NULL;
-
 typedef struct {
 	uint32_t len;
 	uint8_t *program;
+	uint32_t wasm_len;
+	uint8_t *wasm; //the program as a wasm module, for the page to instantiate
 } program_t;
 
 program_t program;
 
+//Source locations for runtime errors, so the AST can go once the program is compiled
+static uint8_t *locs=NULL;
+static int locs_len=0;
+
 program_t *recompile(char *code) {
 	if (vm) {
 		lssl_vm_free(vm);
 		vm=NULL;
 	}
 
-	ast_free_all(last_ast);
+	free(locs);
+	locs=NULL;
+	free(program.wasm);
+	program.wasm=NULL;
+	program.wasm_len=0;
 
 	ast_node_t *prognode=lssl_compile(code);
 	if (!prognode) return NULL;
@@ -42,40 +52,63 @@ program_t *recompile(char *code) {
 	int bin_len;
 	program.program=ast_ops_gen_binary(prognode, &bin_len);
 	program.len=bin_len;
+	int wasm_len;
+	program.wasm=ast_ops_gen_wasm(prognode, &wasm_len);
+	if (program.wasm) program.wasm_len=wasm_len;
+	locs=ast_ops_gen_loc_table(prognode, &locs_len);
+	ast_free_all(prognode);
 
 	led_syscalls_clear();
-	last_ast=prognode;
+	led_syscalls_set_lanes(8);
 	vm=lssl_vm_init(program.program, bin_len, 1024);
 	vm_error_t vm_err={};
 	lssl_vm_run_main(vm, &vm_err);
 	return &program;
 }
 
+//Called by the page once it has instantiated program.wasm, to run the program with that
+//instead of the interpreter.
+void use_wasm() {
+	if (!vm || !lssl_vm_wasm(vm)) return;
+	//Running natively beats interpreting multiple LEDs at once
+	led_syscalls_set_lanes(1);
+}
+
 int check_and_report_vm_error(vm_error_t *err, const char *what) {
 	if (err->type==LSSL_VM_ERR_NONE) return 0;
-	const file_loc_t *loc=ast_lookup_loc_for_pc(last_ast, err->pc);
-	yyerror(loc, &last_ast, NULL, "Runtime error calling %s: '%s' (%d)", what, vm_err_to_str(err->type), err->type);
+	file_loc_t loc={};
+	loc_table_lookup(locs, locs_len, err->pc, &loc);
+	yyerror(&loc, NULL, NULL, "Runtime error calling %s: '%s' (%d)", what, vm_err_to_str(err->type), err->type);
 	return 1;
 }
 
-uint8_t rgb[3];
+static uint8_t *leds_rgb=NULL;
+static int leds_rgb_count=0;
 
-uint8_t *get_led(int pos, float t) {
+//Returns count LEDs worth of RGB data for time t, or NULL on error.
+uint8_t *render_leds(int count, float t) {
+	if (count>leds_rgb_count) {
+		uint8_t *n=realloc(leds_rgb, count*3);
+		if (!n) return NULL;
+		leds_rgb=n;
+		leds_rgb_count=count;
+	}
 	if (!vm) {
-		rgb[0]=0; rgb[1]=0; rgb[2]=128;
-		return rgb;
+		for (int i=0; i<count; i++) {
+			leds_rgb[i*3]=0; leds_rgb[i*3+1]=0; leds_rgb[i*3+2]=128;
+		}
+		return leds_rgb;
 	}
 	vm_error_t err={};
-	led_syscalls_calculate_led(vm, pos, t, &err);
-	if (check_and_report_vm_error(&err, "get_led")) return NULL;
-	led_syscalls_get_rgb(&rgb[0], &rgb[1], &rgb[2]);
-	return rgb;
+	led_syscalls_render_frame(vm, 0, count, t, leds_rgb, LED_FORMAT_RGB, &err);
+	if (check_and_report_vm_error(&err, "render_leds")) return NULL;
+	return leds_rgb;
 }
 
-void frame_start() {
+void frame_start(float t) {
 	if (!vm) return;
 	vm_error_t err={};
-	led_syscalls_frame_start(vm, &err);
+	led_syscalls_frame_start(vm, t, 0, &err);
 	check_and_report_vm_error(&err, "frame_start");
 }
 
@@ -1,25 +1,72 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "vm_syscall.h"
 #include "led_syscalls.h"
 #include "error.h"
 #include "vm.h"
 #include "led_map.h"
+#include "fixed_noise.h"
 
 static int32_t led_cb_handle=-1;
 static int32_t led_mapped_cb_handle=-1;
 static int32_t frame_start_cb_handle=-1;
-static int32_t cur_led_col[4];
+//Per-frame part of the led callbacks, split off by the compiler
+static int32_t led_prologue_handle=-1;
+static int32_t led_mapped_prologue_handle=-1;
+//Set if the prologue yielded, so the next frame_start continues that
+static int in_prologue=0;
+
+//Offset of each colour within a LED in the output buffer, and bytes per LED
+typedef struct {
+	uint8_t r, g, b, w;
+	uint8_t bytes;
+} led_layout_t;
+
+static const led_layout_t led_layouts[]={
+	[LED_FORMAT_RGB]={0, 1, 2, 3, 3},
+	[LED_FORMAT_GRB]={1, 0, 2, 3, 3},
+	[LED_FORMAT_RGBW]={0, 1, 2, 3, 4},
+	[LED_FORMAT_GRBW]={1, 0, 2, 3, 4},
+};
+
+//Where led_set_rgb[w] writes to. Points at the LED currently being rendered, or at the
+//first of the LEDs if these are being rendered in lanes; NULL outside of rendering a
+//frame. Frames can be rendered on multiple threads at the same time (see led_threads.c),
+//so these are per thread.
+static _Thread_local uint8_t led_scratch[4*LSSL_VM_MAX_LANES];
+static _Thread_local uint8_t *cur_led_out=NULL;
+static _Thread_local const led_layout_t *cur_led_layout=&led_layouts[LED_FORMAT_RGBW];
+
+static uint8_t *led_out(lssl_vm_t *vm) {
+	uint8_t *o=cur_led_out?cur_led_out:led_scratch;
+	return o+lssl_vm_lane(vm)*cur_led_layout->bytes;
+}
+
+//Amount of LEDs to calculate at the same time
+static int render_lanes=1;
 
 LSSL_SYSCALL_FUNCTION(syscall_register_led_cb) {
 	led_cb_handle=arg[0];
+	led_prologue_handle=-1;
 	return 0;
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_register_led_mapped_cb) {
 	led_mapped_cb_handle=arg[0];
+	led_mapped_prologue_handle=-1;
+	return 0;
+}
+
+//Registered after the led callback it belongs to; arg[1] is nonzero for the mapped one
+LSSL_SYSCALL_FUNCTION(syscall_register_led_prologue_cb) {
+	if (arg[1]) {
+		led_mapped_prologue_handle=arg[0];
+	} else {
+		led_prologue_handle=arg[0];
+	}
 	return 0;
 }
 
@@ -30,21 +77,103 @@ LSSL_SYSCALL_FUNCTION(syscall_register_frame_start_cb) {
 
 
 LSSL_SYSCALL_FUNCTION(syscall_led_set_rgb) {
-	cur_led_col[0]=arg[0];
-	cur_led_col[1]=arg[1];
-	cur_led_col[2]=arg[2];
-	cur_led_col[3]=0;
+	uint8_t *o=led_out(vm);
+	o[cur_led_layout->r]=arg[0]>>16;
+	o[cur_led_layout->g]=arg[1]>>16;
+	o[cur_led_layout->b]=arg[2]>>16;
+	if (cur_led_layout->bytes==4) o[cur_led_layout->w]=0;
 	return 0;
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_led_set_rgbw) {
-	cur_led_col[0]=arg[0];
-	cur_led_col[1]=arg[1];
-	cur_led_col[2]=arg[2];
-	cur_led_col[3]=arg[3];
+	uint8_t *o=led_out(vm);
+	o[cur_led_layout->r]=arg[0]>>16;
+	o[cur_led_layout->g]=arg[1]>>16;
+	o[cur_led_layout->b]=arg[2]>>16;
+	if (cur_led_layout->bytes==4) o[cur_led_layout->w]=arg[3]>>16;
+	return 0;
+}
+
+//Colours in LSSL are r, g, b in 0..255 as taken by led_set_rgb, or h, s, v in 0..1 with
+//h wrapping around. All 16.16.
+static int32_t clamp_fixed(int32_t v, int32_t min, int32_t max) {
+	if (v<min) return min;
+	if (v>max) return max;
+	return v;
+}
+
+static int32_t mul_fixed(int32_t a, int32_t b) {
+	return ((int64_t)a*b)>>16;
+}
+
+static void hsv_to_rgb(int32_t h, int32_t s, int32_t v, int32_t *rgb) {
+	s=clamp_fixed(s, 0, 1<<16);
+	v=clamp_fixed(v, 0, 1<<16)*255;
+	int32_t h6=(h&0xffff)*6;
+	int32_t f=h6&0xffff;
+	int32_t p=mul_fixed(v, (1<<16)-s);
+	int32_t q=mul_fixed(v, (1<<16)-mul_fixed(f, s));
+	int32_t t=mul_fixed(v, (1<<16)-mul_fixed((1<<16)-f, s));
+	switch (h6>>16) {
+		case 0: rgb[0]=v; rgb[1]=t; rgb[2]=p; break;
+		case 1: rgb[0]=q; rgb[1]=v; rgb[2]=p; break;
+		case 2: rgb[0]=p; rgb[1]=v; rgb[2]=t; break;
+		case 3: rgb[0]=p; rgb[1]=q; rgb[2]=v; break;
+		case 4: rgb[0]=t; rgb[1]=p; rgb[2]=v; break;
+		default: rgb[0]=v; rgb[1]=p; rgb[2]=q; break;
+	}
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_led_set_hsv) {
+	int32_t rgb[3];
+	hsv_to_rgb(arg[0], arg[1], arg[2], rgb);
+	uint8_t *o=led_out(vm);
+	o[cur_led_layout->r]=rgb[0]>>16;
+	o[cur_led_layout->g]=rgb[1]>>16;
+	o[cur_led_layout->b]=rgb[2]>>16;
+	if (cur_led_layout->bytes==4) o[cur_led_layout->w]=0;
+	return 0;
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_hsv_to_rgb) {
+	int32_t *hsv=lssl_vm_data_ptr(vm, arg[0], 3, 0);
+	int32_t *rgb=lssl_vm_data_ptr(vm, arg[1], 3, 1);
+	if (!hsv || !rgb) return 0;
+	hsv_to_rgb(hsv[0], hsv[1], hsv[2], rgb);
+	return 0;
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_blend_rgb) {
+	int32_t *a=lssl_vm_data_ptr(vm, arg[0], 3, 0);
+	int32_t *b=lssl_vm_data_ptr(vm, arg[1], 3, 0);
+	int32_t *out=lssl_vm_data_ptr(vm, arg[3], 3, 1);
+	if (!a || !b || !out) return 0;
+	int32_t t=clamp_fixed(arg[2], 0, 1<<16);
+	for (int i=0; i<3; i++) out[i]=a[i]+((((int64_t)b[i]-a[i])*t)>>16);
 	return 0;
 }
 
+LSSL_SYSCALL_FUNCTION(syscall_scale_rgb) {
+	int32_t *rgb=lssl_vm_data_ptr(vm, arg[0], 3, 1);
+	if (!rgb) return 0;
+	for (int i=0; i<3; i++) rgb[i]=clamp_fixed(mul_fixed(rgb[i], arg[1]), 0, 255<<16);
+	return 0;
+}
+
+//3D noise at the position a mapped LED callback gets. Not lane-safe, as it takes an
+//address; noise3(pos.x, pos.y, pos.z) is.
+LSSL_SYSCALL_FUNCTION(syscall_noise3_pos) {
+	int32_t *pos=lssl_vm_data_ptr(vm, arg[0], 3, 0);
+	if (!pos) return 0;
+	return fixed_noise3(pos[0], pos[1], pos[2]);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_fractal_noise3_pos) {
+	int32_t *pos=lssl_vm_data_ptr(vm, arg[0], 3, 0);
+	if (!pos) return 0;
+	return fixed_fractal_noise3(pos[0], pos[1], pos[2], arg[1]>>16);
+}
+
 LSSL_SYSCALL_FUNCTION(syscall_led_get_closest) {
 	//ToDo: return array of leds closest to the indicated one
 	return 0;
@@ -55,9 +184,16 @@ static const vm_syscall_list_entry_t led_syscalls[]={
 	{"register_led_cb", syscall_register_led_cb},
 	{"register_led_mapped_cb", syscall_register_led_mapped_cb},
 	{"register_frame_start_cb", syscall_register_frame_start_cb},
-	{"led_set_rgb", syscall_led_set_rgb},
-	{"led_set_rgbw", syscall_led_set_rgbw},
-	{"led_get_closest", syscall_led_get_closest}
+	{"led_set_rgb", syscall_led_set_rgb, VM_SYSCALL_LANE_SAFE},
+	{"led_set_rgbw", syscall_led_set_rgbw, VM_SYSCALL_LANE_SAFE},
+	{"led_get_closest", syscall_led_get_closest},
+	{"led_set_hsv", syscall_led_set_hsv, VM_SYSCALL_LANE_SAFE},
+	{"hsv_to_rgb", syscall_hsv_to_rgb},
+	{"blend_rgb", syscall_blend_rgb},
+	{"scale_rgb", syscall_scale_rgb},
+	{"noise3_pos", syscall_noise3_pos},
+	{"fractal_noise3_pos", syscall_fractal_noise3_pos},
+	{"register_led_prologue_cb", syscall_register_led_prologue_cb}
 };
 
 static const char *led_hdr=
@@ -86,7 +222,15 @@ static const char *led_hdr=
 "syscalldef register_frame_start_cb(cb());\n"
 "syscalldef led_set_rgb(r, g, b);\n"
 "syscalldef led_set_rgbw(r, g, b, w);\n"
-"syscalldef led_get_closest(to_which, closest_leds_t closest[]);\n";
+"syscalldef led_get_closest(to_which, closest_leds_t closest[]);\n"
+"syscalldef led_set_hsv(h, s, v);\n"
+"syscalldef hsv_to_rgb(hsv_t hsv, rgb_t rgb);\n"
+"syscalldef blend_rgb(rgb_t a, rgb_t b, t, rgb_t out);\n"
+"syscalldef scale_rgb(rgb_t rgb, scale);\n"
+"syscalldef noise3_pos(mapped_pos_t pos);\n"
+"syscalldef fractal_noise3_pos(mapped_pos_t pos, octaves);\n"
+"//Used by the compiler for what the led callback calculates once per frame\n"
+"syscalldef register_led_prologue_cb(cb(time), mapped);\n";
 
 void led_syscalls_init() {
 	vm_syscall_add_local_syscalls("led", led_syscalls, sizeof(led_syscalls)/sizeof(vm_syscall_list_entry_t), led_hdr);
@@ -94,49 +238,125 @@ void led_syscalls_init() {
 
 void led_syscalls_clear() {
 	led_cb_handle=-1;
+	led_mapped_cb_handle=-1;
 	frame_start_cb_handle=-1;
+	led_prologue_handle=-1;
+	led_mapped_prologue_handle=-1;
+	in_prologue=0;
 }
 
 int led_syscalls_have_cb() {
 	return (led_cb_handle>=0) || (led_mapped_cb_handle>=0);
 }
 
-void led_syscalls_frame_start(lssl_vm_t *vm, vm_error_t *error) {
-	if (frame_start_cb_handle==-1) return;
-	lssl_vm_run_function(vm, frame_start_cb_handle, 0, NULL, error);
-}
-
-void led_syscalls_calculate_led(lssl_vm_t *vm, int32_t led, double time, vm_error_t *error) {
+//The time as the led callbacks get it
+static int32_t fixed_time(double time) {
 	//int32_t overflow is undefined, so use an uint first
 	uint32_t time_uint=(time*65536UL);
-	time_uint=(time_uint&0x7FFFFFFF);
-	if (led_cb_handle>=0) {
-		int32_t arg[2]={led<<16, time_uint};
-		lssl_vm_run_function(vm, led_cb_handle, 2, arg, error);
-		if (error->type) printf("VM error in led_syscalls_calculate_led for unmapped led function for led %d.\n", (int)led);
-	} else if (led_mapped_cb_handle>=0) {
-		int32_t *pos=lssl_vm_alloc_data(vm, 3);
-		pos[0]=led*65536;
-		pos[1]=0;
-		pos[2]=0;
-		led_map_get_led_pos_fixed(led, pos);
-		int32_t arg[2]={lssl_vm_data_addr(vm, pos), time_uint};
-		lssl_vm_run_function(vm, led_mapped_cb_handle, 2, arg, error);
-		lssl_vm_free_data(vm, pos);
-		if (error->type) printf("VM error in led_syscalls_calculate_led for mapped led function for led %d.\n", (int)led);
+	return (time_uint&0x7FFFFFFF);
+}
+
+void led_syscalls_frame_start(lssl_vm_t *vm, double time, int budget, vm_error_t *error) {
+	error->type=LSSL_VM_ERR_NONE;
+	if (!in_prologue && frame_start_cb_handle!=-1) {
+		lssl_vm_run(vm, frame_start_cb_handle, 0, NULL, budget, error);
+		if (error->type) return;
 	}
+	//The frame start callback may have registered another led callback, so look this up after
+	int32_t prologue=(led_cb_handle>=0)?led_prologue_handle:led_mapped_prologue_handle;
+	in_prologue=0;
+	if (prologue==-1) return;
+	int32_t arg=fixed_time(time);
+	lssl_vm_run(vm, prologue, 1, &arg, budget, error);
+	in_prologue=(error->type==LSSL_VM_YIELDED);
 }
 
-void led_syscalls_get_rgb(uint8_t *r, uint8_t *g, uint8_t *b) {
-	*r=cur_led_col[0]>>16;
-	*g=cur_led_col[1]>>16;
-	*b=cur_led_col[2]>>16;
+void led_syscalls_set_lanes(int lanes) {
+	if (lanes<1) lanes=1;
+	if (lanes>LSSL_VM_MAX_LANES) lanes=LSSL_VM_MAX_LANES;
+	render_lanes=lanes;
 }
 
-void led_syscalls_get_rgbw(uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *w) {
-	*r=cur_led_col[0]>>16;
-	*g=cur_led_col[1]>>16;
-	*b=cur_led_col[2]>>16;
-	*w=cur_led_col[3]>>16;
+int led_syscalls_format_bytes(led_format_en format) {
+	return led_layouts[format].bytes;
 }
 
+//Calculates the LEDs starting at led in lock-step. Returns 0 if the VM can't do that
+//for the program.
+static int render_leds_lanes(lssl_vm_t *vm, const lssl_vm_call_t *call, int led, int lanes, int mapped, const int32_t *arg) {
+	int32_t argv[LSSL_VM_MAX_LANES*2];
+	int32_t pos[LSSL_VM_MAX_LANES*3];
+	for (int l=0; l<lanes; l++) {
+		argv[l*2]=mapped?arg[0]:(led+l)<<16;
+		argv[l*2+1]=arg[1];
+		if (mapped) {
+			pos[l*3]=(led+l)*65536;
+			pos[l*3+1]=0;
+			pos[l*3+2]=0;
+			led_map_get_led_pos_fixed(led+l, &pos[l*3]);
+		}
+	}
+	return lssl_vm_call_lanes(vm, call, lanes, argv, pos, mapped?3:0);
+}
+
+//The callback is looked up and checked once, after which it is called for every LED
+//with the LED colour syscalls writing straight into the output buffer. If lanes are
+//enabled, we try to calculate that many LEDs at the same time, and fall back to doing
+//them one by one if the VM can't do that.
+void led_syscalls_render_frame(lssl_vm_t *vm, int first, int count, double time, uint8_t *out, led_format_en format, vm_error_t *error) {
+	const led_layout_t *layout=&led_layouts[format];
+	error->type=LSSL_VM_ERR_NONE;
+	memset(out, 0, count*layout->bytes);
+	if (!led_syscalls_have_cb()) return;
+	int mapped=(led_cb_handle<0);
+	int32_t *pos=NULL;
+	int32_t arg[2]={0, fixed_time(time)};
+	if (mapped) {
+		pos=lssl_vm_alloc_data(vm, 3);
+		if (!pos) {
+			error->type=LSSL_VM_ERR_STACK_OVF;
+			return;
+		}
+		arg[0]=lssl_vm_data_addr(vm, pos, 3);
+	}
+	lssl_vm_call_t call;
+	if (lssl_vm_call_prepare(vm, mapped?led_mapped_cb_handle:led_cb_handle, 2, &call, error)) {
+		cur_led_layout=layout;
+		int use_lanes=(render_lanes>1);
+		int i=0;
+		while (i<count && !error->type) {
+			int lanes=count-i;
+			if (lanes>render_lanes) lanes=render_lanes;
+			cur_led_out=&out[i*layout->bytes];
+			if (use_lanes && lanes>1) {
+				if (render_leds_lanes(vm, &call, first+i, lanes, mapped, arg)) {
+					i+=lanes;
+					continue;
+				}
+				//Chances are the next batch can't be done in lanes either.
+				use_lanes=0;
+				memset(cur_led_out, 0, lanes*layout->bytes);
+			}
+			for (int l=0; l<lanes; l++, i++) {
+				int led=first+i;
+				cur_led_out=&out[i*layout->bytes];
+				if (mapped) {
+					pos[0]=led*65536;
+					pos[1]=0;
+					pos[2]=0;
+					led_map_get_led_pos_fixed(led, pos);
+				} else {
+					arg[0]=led<<16;
+				}
+				lssl_vm_call(vm, &call, arg, error);
+				if (error->type) {
+					printf("VM error in led_syscalls_render_frame for %s led function for led %d.\n", mapped?"mapped":"unmapped", led);
+					break;
+				}
+			}
+		}
+		cur_led_out=NULL;
+		cur_led_layout=&led_layouts[LED_FORMAT_RGBW];
+	}
+	if (pos) lssl_vm_free_data(vm, pos);
+}
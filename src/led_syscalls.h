@@ -1,11 +1,34 @@
+#pragma once
 #include "vm.h"
 
 
 void led_syscalls_init();
-void led_syscalls_frame_start(lssl_vm_t *vm, vm_error_t *error);
-void led_syscalls_calculate_led(lssl_vm_t *vm, int32_t led, double time, vm_error_t *error);
-void led_syscalls_get_rgb(uint8_t *r, uint8_t *g, uint8_t *b);
-void led_syscalls_get_rgbw(uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *w);
+
+//Run the frame_start callback, if any, for at most budget instructions (0: no budget). If
+//it doesn't finish, error->type is LSSL_VM_YIELDED; call this again to continue it. After
+//that, this runs what the compiler moved out of the led callback because it's the same for
+//every LED; time must be the time of the frame rendered next.
+void led_syscalls_frame_start(lssl_vm_t *vm, double time, int budget, vm_error_t *error);
+
+//Byte layout of a LED in the output buffer of led_syscalls_render_frame
+typedef enum {
+	LED_FORMAT_RGB=0,
+	LED_FORMAT_GRB,
+	LED_FORMAT_RGBW,
+	LED_FORMAT_GRBW,
+} led_format_en;
+
+//Bytes per LED for a format
+int led_syscalls_format_bytes(led_format_en format);
+
+//Calculate the colours of count LEDs starting at first for the given time, and write
+//them to out in the given format. LEDs the program does not set a colour for are black.
+void led_syscalls_render_frame(lssl_vm_t *vm, int first, int count, double time, uint8_t *out, led_format_en format, vm_error_t *error);
+
+//Calculate this many LEDs at the same time in led_syscalls_render_frame, if the program
+//allows. 1 (the default) calculates them one by one.
+void led_syscalls_set_lanes(int lanes);
+
 void led_syscalls_clear();
 int led_syscalls_have_cb();
 
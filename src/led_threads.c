@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "led_threads.h"
+#include "led_syscalls.h"
+#include "vm.h"
+
+/*
+Renders frames on multiple threads. The LEDs of a frame get split up in as many ranges
+as there are threads, and every thread calculates its range using its own clone of
+the VM. The calling thread does the first range itself.
+
+Clones get a copy of the stack of the VM at the start of every frame, and can't write
+to it. If the LED callback of a program does write to a global, the clone stops with
+a LSSL_VM_ERR_RO_WRITE error and we redo the frame on the calling thread. As the
+program will do the same thing next frame, we keep doing that from then on. Calling
+rand() goes the same way, so the LEDs get the same random numbers as on one thread.
+*/
+
+typedef struct {
+	led_threads_t *pool;
+	pthread_t thread;
+	lssl_vm_t *vm;		//clone of pool->vm
+	int first;			//LEDs to render
+	int count;
+	uint8_t *out;
+	vm_error_t error;
+} worker_t;
+
+struct led_threads_t {
+	lssl_vm_t *vm;
+	worker_t *workers;
+	int worker_ct;		//includes worker 0, which runs on the calling thread
+	int serial;			//program writes globals, render on the calling thread only
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	int frame;			//increased for every frame the threads need to render
+	int busy;			//threads still rendering the current frame
+	int quit;
+	double time;
+	led_format_en format;
+};
+
+static void render_part(led_threads_t *t, worker_t *w) {
+	if (!lssl_vm_sync(w->vm, t->vm)) {
+		w->error.type=LSSL_VM_ERR_INTERNAL;
+		return;
+	}
+	led_syscalls_render_frame(w->vm, w->first, w->count, t->time, w->out, t->format, &w->error);
+}
+
+static void *worker_thread(void *arg) {
+	worker_t *w=(worker_t*)arg;
+	led_threads_t *t=w->pool;
+	int frame=0;
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while (t->frame==frame && !t->quit) pthread_cond_wait(&t->start_cond, &t->lock);
+		if (t->quit) break;
+		frame=t->frame;
+		pthread_mutex_unlock(&t->lock);
+		render_part(t, w);
+		pthread_mutex_lock(&t->lock);
+		t->busy--;
+		if (t->busy==0) pthread_cond_signal(&t->done_cond);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+led_threads_t *led_threads_create(lssl_vm_t *vm, int threads) {
+	if (threads<1) threads=1;
+	led_threads_t *t=calloc(1, sizeof(led_threads_t));
+	if (!t) return NULL;
+	t->vm=vm;
+	t->workers=calloc(threads, sizeof(worker_t));
+	if (!t->workers) {
+		free(t);
+		return NULL;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->start_cond, NULL);
+	pthread_cond_init(&t->done_cond, NULL);
+	for (int i=0; i<threads; i++) {
+		worker_t *w=&t->workers[i];
+		w->pool=t;
+		w->vm=lssl_vm_clone(vm);
+		if (!w->vm) break;
+		if (i!=0 && pthread_create(&w->thread, NULL, worker_thread, w)!=0) {
+			lssl_vm_free(w->vm);
+			break;
+		}
+		t->worker_ct++;
+	}
+	if (t->worker_ct==0) {
+		led_threads_free(t);
+		return NULL;
+	}
+	if (t->worker_ct!=threads) {
+		printf("led_threads_create: could only start %d of %d threads\n", t->worker_ct, threads);
+	}
+	return t;
+}
+
+void led_threads_render_frame(led_threads_t *t, int first, int count, double time, uint8_t *out, led_format_en format, vm_error_t *error) {
+	if (t->serial || t->worker_ct<2 || count<t->worker_ct) {
+		led_syscalls_render_frame(t->vm, first, count, time, out, format, error);
+		return;
+	}
+	int bytes=led_syscalls_format_bytes(format);
+	for (int i=0; i<t->worker_ct; i++) {
+		worker_t *w=&t->workers[i];
+		int start=(int64_t)count*i/t->worker_ct;
+		int end=(int64_t)count*(i+1)/t->worker_ct;
+		w->first=first+start;
+		w->count=end-start;
+		w->out=&out[start*bytes];
+	}
+	t->time=time;
+	t->format=format;
+
+	pthread_mutex_lock(&t->lock);
+	t->busy=t->worker_ct-1;
+	t->frame++;
+	pthread_cond_broadcast(&t->start_cond);
+	pthread_mutex_unlock(&t->lock);
+
+	render_part(t, &t->workers[0]);
+
+	pthread_mutex_lock(&t->lock);
+	while (t->busy) pthread_cond_wait(&t->done_cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+
+	error->type=LSSL_VM_ERR_NONE;
+	for (int i=0; i<t->worker_ct; i++) {
+		if (t->workers[i].error.type==LSSL_VM_ERR_RO_WRITE) {
+			printf("LED callback writes to globals or calls rand(); rendering frames on one thread.\n");
+			t->serial=1;
+			led_syscalls_render_frame(t->vm, first, count, time, out, format, error);
+			return;
+		}
+	}
+	for (int i=0; i<t->worker_ct; i++) {
+		if (t->workers[i].error.type) {
+			*error=t->workers[i].error;
+			return;
+		}
+	}
+}
+
+void led_threads_free(led_threads_t *t) {
+	if (!t) return;
+	pthread_mutex_lock(&t->lock);
+	t->quit=1;
+	pthread_cond_broadcast(&t->start_cond);
+	pthread_mutex_unlock(&t->lock);
+	for (int i=0; i<t->worker_ct; i++) {
+		if (i!=0) pthread_join(t->workers[i].thread, NULL);
+		lssl_vm_free(t->workers[i].vm);
+	}
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->start_cond);
+	pthread_cond_destroy(&t->done_cond);
+	free(t->workers);
+	free(t);
+}
@@ -0,0 +1,16 @@
+#include "vm.h"
+#include "led_syscalls.h"
+
+typedef struct led_threads_t led_threads_t;
+
+//Create a pool of threads to render the frames of the program in vm with. Every thread
+//gets its own clone of vm; the pool needs to be freed before vm is.
+led_threads_t *led_threads_create(lssl_vm_t *vm, int threads);
+
+//Same as led_syscalls_render_frame(), but with the LEDs split up between the threads.
+//Each thread works on a copy of the globals as they are after frame_start, so programs
+//that write to globals or call rand() when calculating a LED are rendered on this
+//thread instead.
+void led_threads_render_frame(led_threads_t *t, int first, int count, double time, uint8_t *out, led_format_en format, vm_error_t *error);
+
+void led_threads_free(led_threads_t *t);
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include "loc_table.h"
+
+/*
+Layout of the table; words are 32-bit little endian:
+- header: entry count, end pc, block count
+- per block: pc, line and pos_start of its first entry, offset of that entry in the data
+- data: per entry, varints of the pc delta, first_line delta (zigzag), first_column,
+  last_line-first_line (zigzag), last_column, pos_start delta (zigzag) and
+  pos_end-pos_start. Deltas are from the entry before, or for the first entry of a
+  block, from the block, so they're 0 there.
+*/
+#define HDR_SIZE 12
+#define BLOCK_SIZE 16
+
+typedef struct {
+	uint8_t *data;
+	int len;
+	int size;
+	int oom;
+} buf_t;
+
+static void put_byte(buf_t *b, uint8_t v) {
+	if (b->len==b->size) {
+		int size=b->size?b->size*2:256;
+		uint8_t *n=realloc(b->data, size);
+		if (!n) {
+			b->oom=1;
+			return;
+		}
+		b->data=n;
+		b->size=size;
+	}
+	b->data[b->len++]=v;
+}
+
+static void put_u32(buf_t *b, uint32_t v) {
+	for (int i=0; i<4; i++) put_byte(b, v>>(i*8));
+}
+
+static void put_varint(buf_t *b, uint32_t v) {
+	while (v>=0x80) {
+		put_byte(b, (v&0x7f)|0x80);
+		v>>=7;
+	}
+	put_byte(b, v);
+}
+
+static void put_svarint(buf_t *b, int32_t v) {
+	put_varint(b, ((uint32_t)v<<1)^(uint32_t)(v>>31));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+//Returns 0 if the varint runs past the end of the table.
+static int get_varint(const uint8_t *t, int len, int *pos, uint32_t *v) {
+	*v=0;
+	for (int shift=0; shift<32; shift+=7) {
+		if (*pos>=len) return 0;
+		uint8_t b=t[(*pos)++];
+		*v|=(uint32_t)(b&0x7f)<<shift;
+		if (!(b&0x80)) return 1;
+	}
+	return 0;
+}
+
+static int32_t unzigzag(uint32_t v) {
+	return (v>>1)^-(int32_t)(v&1);
+}
+
+uint8_t *loc_table_encode(const loc_table_entry_t *entries, int count, uint32_t end_pc, int *len) {
+	int blocks=(count+LOC_TABLE_BLOCK-1)/LOC_TABLE_BLOCK;
+	buf_t hdr={}, data={};
+	put_u32(&hdr, count);
+	put_u32(&hdr, end_pc);
+	put_u32(&hdr, blocks);
+	const loc_table_entry_t *prev=NULL;
+	for (int i=0; i<count; i++) {
+		const loc_table_entry_t *e=&entries[i];
+		if (i%LOC_TABLE_BLOCK==0) {
+			put_u32(&hdr, e->pc);
+			put_u32(&hdr, e->loc.first_line);
+			put_u32(&hdr, e->loc.pos_start);
+			put_u32(&hdr, data.len);
+			prev=e;
+		}
+		put_varint(&data, e->pc-prev->pc);
+		put_svarint(&data, e->loc.first_line-prev->loc.first_line);
+		put_varint(&data, e->loc.first_column);
+		put_svarint(&data, e->loc.last_line-e->loc.first_line);
+		put_varint(&data, e->loc.last_column);
+		put_svarint(&data, e->loc.pos_start-prev->loc.pos_start);
+		put_varint(&data, e->loc.pos_end-e->loc.pos_start);
+		prev=e;
+	}
+	uint8_t *ret=NULL;
+	if (!hdr.oom && !data.oom) ret=malloc(hdr.len+data.len);
+	if (ret) {
+		memcpy(ret, hdr.data, hdr.len);
+		if (data.len) memcpy(ret+hdr.len, data.data, data.len);
+		*len=hdr.len+data.len;
+	}
+	free(hdr.data);
+	free(data.data);
+	return ret;
+}
+
+int loc_table_lookup(const uint8_t *table, int len, uint32_t pc, file_loc_t *loc) {
+	if (!table || len<HDR_SIZE) return 0;
+	uint32_t count=get_u32(table);
+	uint32_t end_pc=get_u32(table+4);
+	uint32_t blocks=get_u32(table+8);
+	if (count==0 || pc>=end_pc || blocks>(len-HDR_SIZE)/BLOCK_SIZE) return 0;
+	if (blocks!=(count+LOC_TABLE_BLOCK-1)/LOC_TABLE_BLOCK) return 0;
+	const uint8_t *bt=table+HDR_SIZE;
+	if (pc<get_u32(bt)) return 0;
+	//Last block starting at or before pc
+	int lo=0, hi=blocks-1;
+	while (lo<hi) {
+		int mid=(lo+hi+1)/2;
+		if (get_u32(bt+mid*BLOCK_SIZE)<=pc) {
+			lo=mid;
+		} else {
+			hi=mid-1;
+		}
+	}
+	const uint8_t *b=bt+lo*BLOCK_SIZE;
+	uint32_t e_pc=get_u32(b);
+	int32_t line=get_u32(b+4);
+	int32_t pos=get_u32(b+8);
+	int off=HDR_SIZE+blocks*BLOCK_SIZE+get_u32(b+12);
+	int n=count-lo*LOC_TABLE_BLOCK;
+	if (n>LOC_TABLE_BLOCK) n=LOC_TABLE_BLOCK;
+	int found=0;
+	for (int i=0; i<n; i++) {
+		uint32_t v[7]; //see the layout above
+		for (int j=0; j<7; j++) {
+			if (!get_varint(table, len, &off, &v[j])) return 0;
+		}
+		e_pc+=v[0];
+		line+=unzigzag(v[1]);
+		pos+=unzigzag(v[5]);
+		if (e_pc>pc) break;
+		loc->first_line=line;
+		loc->first_column=v[2];
+		loc->last_line=line+unzigzag(v[3]);
+		loc->last_column=v[4];
+		loc->pos_start=pos;
+		loc->pos_end=pos+v[6];
+		found=1;
+	}
+	return found;
+}
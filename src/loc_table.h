@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include "file_loc.h"
+
+//Compact table mapping bytecode addresses back to source locations, so runtime errors
+//and profiles can be reported without keeping the AST around. Made by
+//ast_ops_gen_loc_table() next to the bytecode.
+//
+//Entries are delta-encoded varints, with an absolute checkpoint every LOC_TABLE_BLOCK
+//entries; a lookup binary-searches the checkpoints and decodes at most one block.
+
+#define LOC_TABLE_BLOCK 16
+
+typedef struct {
+	uint32_t pc;
+	file_loc_t loc;
+} loc_table_entry_t;
+
+//Encodes count entries, sorted by pc. Every entry is for the pcs up to the next one, the
+//last one for those up to end_pc. Returns a malloc'ed table, or NULL if out of memory.
+uint8_t *loc_table_encode(const loc_table_entry_t *entries, int count, uint32_t end_pc, int *len);
+
+//Finds the location of the insn at pc. Returns 0 if the table doesn't cover pc.
+int loc_table_lookup(const uint8_t *table, int len, uint32_t pc, file_loc_t *loc);
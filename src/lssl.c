@@ -1,38 +1,225 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <inttypes.h>
 #include "lexer.h"
 #include "lexer_gen.h"
 #include "parser.h"
 #include "ast_ops.h"
 #include "codegen.h"
+#include "peephole.h"
 #include "led_syscalls.h"
+#include "led_threads.h"
 #include "vm_syscall.h"
 #include "vm.h"
+#include "vm_defs.h"
+#include "vm_sample.h"
 #include "error.h"
 #include "ast.h"
 #include "compile.h"
+#include "loc_table.h"
+#include "bench.h"
+
+//Source locations of the program, see loc_table.h
+static uint8_t *locs=NULL;
+static int locs_len=0;
 
 void bail_if_vm_err(lssl_vm_t *vm, ast_node_t *prognode, vm_error_t *vm_err) {
 	if (vm_err->type==0) return;
-	const file_loc_t *loc=ast_lookup_loc_for_pc(prognode, vm_err->pc);
-	if (!loc) {
+	file_loc_t loc;
+	if (!loc_table_lookup(locs, locs_len, vm_err->pc, &loc)) {
 		printf("Running main() resulted in error %s (%d) at pc 0x%X, but file loc didn't resolve!\n", 
 				vm_err_to_str(vm_err->type), vm_err->type, vm_err->pc);
 		exit(1);
 	} else {
-		yyerror(loc, &prognode, NULL, "Runtime error %s (%d)", vm_err_to_str(vm_err->type), vm_err->type);
+		yyerror(&loc, &prognode, NULL, "Runtime error %s (%d)", vm_err_to_str(vm_err->type), vm_err->type);
+		exit(1);
+	}
+}
+
+//Writes the program as C code. The lssl_vm_native_t it defines gets its name from the
+//name of the file.
+static void write_c_file(const char *outfile, ast_node_t *prognode, uint8_t *bin, int bin_len) {
+	int pcs[1024];
+	const char *names[1024];
+	int ct=0;
+	for (ast_node_t *n=prognode; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF && ct<1024) {
+			pcs[ct]=n->valpos;
+			//Functions the compiler adds have a '.' in their name; that isn't valid C
+			names[ct]=strchr(n->name, '.')?NULL:n->name;
+			ct++;
+		}
+	}
+	char name[256]="lssl_";
+	const char *base=strrchr(outfile, '/');
+	base=base?base+1:outfile;
+	for (int i=5; i<sizeof(name)-1 && *base && *base!='.'; i++, base++) {
+		name[i]=isalnum((unsigned char)*base)?*base:'_';
+		name[i+1]=0;
+	}
+	FILE *f=fopen(outfile, "w");
+	if (!f) {
+		perror(outfile);
+		exit(1);
+	}
+	if (!lssl_vm_aot_write(f, name, bin, bin_len, pcs, names, ct)) {
+		printf("Could not write program as C code.\n");
 		exit(1);
 	}
+	fclose(f);
+}
+
+typedef struct {
+	const char *name;
+	int idx;
+	uint32_t pc;
+	int64_t calls;
+	int64_t count;
+} stat_line_t;
+
+static int cmp_stat_count(const void *a, const void *b) {
+	const stat_line_t *sa=a, *sb=b;
+	if (sa->count!=sb->count) return (sa->count<sb->count)?1:-1;
+	return sa->idx-sb->idx;
+}
+
+static int cmp_stat_pc(const void *a, const void *b) {
+	const stat_line_t *sa=a, *sb=b;
+	return (int)sa->pc-(int)sb->pc;
+}
+
+#define STAT_HOT_LINES 20
+
+//Prints where a VM built with LSSL_VM_STATS spent its instructions: per opcode, per
+//function, and the source lines that ran the most.
+static void print_stats(lssl_vm_t *vm, ast_node_t *prognode, const char *src) {
+	const lssl_vm_insn_stat_t *st;
+	int ct=lssl_vm_stats(vm, &st);
+	if (ct==0) {
+		printf("No execution counts: build lssl with LSSL_VM_STATS defined ('make lssl_stats').\n");
+		return;
+	}
+	int64_t total=0;
+	for (int i=0; i<ct; i++) total+=st[i].count;
+	double pct=total?100.0/total:0;
+	printf("\n%"PRId64" instructions run.\n", total);
+
+	stat_line_t ops[LSSL_INSN_COUNT]={};
+	for (int i=0; i<LSSL_INSN_COUNT; i++) {
+		ops[i].name=lssl_vm_ops[i].op;
+		ops[i].idx=i;
+	}
+	for (int i=0; i<ct; i++) {
+		if (st[i].op<LSSL_INSN_COUNT) ops[st[i].op].count+=st[i].count;
+	}
+	qsort(ops, LSSL_INSN_COUNT, sizeof(stat_line_t), cmp_stat_count);
+	printf("\nPer opcode:\n");
+	for (int i=0; i<LSSL_INSN_COUNT && ops[i].count; i++) {
+		printf("  %-12s %14"PRId64" %5.1f%%\n", ops[i].name, ops[i].count, ops[i].count*pct);
+	}
+
+	//The top-level code starts at pc 0, every function at its valpos.
+	int fct=1;
+	for (ast_node_t *n=prognode; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF) fct++;
+	}
+	stat_line_t *funcs=calloc(fct, sizeof(stat_line_t));
+	funcs[0].name="(top level)";
+	fct=1;
+	for (ast_node_t *n=prognode; n!=NULL; n=n->sibling) {
+		if (n->type!=AST_TYPE_FUNCDEF) continue;
+		funcs[fct].name=n->name;
+		funcs[fct].pc=n->valpos;
+		funcs[fct].idx=fct;
+		fct++;
+	}
+	qsort(funcs, fct, sizeof(stat_line_t), cmp_stat_pc);
+	int f=0;
+	for (int i=0; i<ct; i++) {
+		while (f<fct-1 && funcs[f+1].pc<=st[i].pc) f++;
+		if (st[i].pc==funcs[f].pc) funcs[f].calls+=st[i].calls;
+		funcs[f].count+=st[i].count;
+	}
+	qsort(funcs, fct, sizeof(stat_line_t), cmp_stat_count);
+	printf("\nPer function:               calls   instructions\n");
+	for (int i=0; i<fct && funcs[i].count; i++) {
+		printf("  %-20s %10"PRId64" %14"PRId64" %5.1f%%\n", funcs[i].name, funcs[i].calls, funcs[i].count, funcs[i].count*pct);
+	}
+	free(funcs);
+
+	//Per source line. Insns that don't map back to a line (e.g. the code that calls
+	//main()) go under line 0.
+	int line_ct=1;
+	for (const char *p=src; *p; p++) {
+		if (*p=='\n') line_ct++;
+	}
+	stat_line_t *lines=calloc(line_ct+1, sizeof(stat_line_t));
+	for (int i=0; i<=line_ct; i++) lines[i].idx=i;
+	for (int i=0; i<ct; i++) {
+		if (!st[i].count) continue;
+		file_loc_t loc;
+		int found=loc_table_lookup(locs, locs_len, st[i].pc, &loc);
+		int l=(found && loc.first_line<line_ct)?loc.first_line+1:0;
+		lines[l].count+=st[i].count;
+	}
+	qsort(lines, line_ct+1, sizeof(stat_line_t), cmp_stat_count);
+	printf("\nHot lines:\n");
+	for (int i=0; i<STAT_HOT_LINES && i<=line_ct && lines[i].count; i++) {
+		const char *p=src;
+		for (int l=1; l<lines[i].idx; l++) p=strchr(p, '\n')+1;
+		while (*p==' ' || *p=='\t') p++;
+		int len=strcspn(p, "\n");
+		if (lines[i].idx==0) {
+			p="(no source line)";
+			len=strlen(p);
+		}
+		printf("  %5d %14"PRId64" %5.1f%%  %.*s\n", lines[i].idx, lines[i].count, lines[i].count*pct, len, p);
+	}
+	free(lines);
 }
 
+//Labels a pc in the profiler output with the function and line it's in.
+static void label_pc(uint32_t pc, char *buf, int len, void *arg) {
+	ast_node_t *prognode=arg;
+	const char *name="(top level)";
+	int entry=0;
+	for (ast_node_t *n=prognode; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF && n->valpos<=pc && n->valpos>=entry) {
+			name=n->name;
+			entry=n->valpos;
+		}
+	}
+	file_loc_t loc;
+	if (loc_table_lookup(locs, locs_len, pc, &loc)) {
+		snprintf(buf, len, "%s:%d", name, loc.first_line+1);
+	} else {
+		snprintf(buf, len, "%s", name);
+	}
+}
+
+#define SAMPLE_HZ 997
+
 int main(int argc, char **argv) {
 	char buf[1024*1024]={};
 	char *infile="";
 	char *outfile="";
+	char *c_outfile="";
+	char *wasm_outfile="";
+	char *prof_outfile="";
 	int sim_leds=0;
+	int sim_frames=-1;
+	int sim_lanes=-1;
+	int use_jit=0;
+	int insn_limit=0;
+	int sim_threads=sysconf(_SC_NPROCESSORS_ONLN);
 	int do_run=0;
 	int error=0;
 	int print_ast=0;
+	int print_counts=0;
+	if (argc>1 && strcmp(argv[1], "bench")==0) return bench_main(argc-1, argv+1);
 	for (int i=1; i<argc; i++) {
 		if (strcmp(argv[i], "-r")==0) {
 			do_run=1;
@@ -40,15 +227,47 @@ int main(int argc, char **argv) {
 			error=1; //to show help
 		} else if (strcmp(argv[i], "-d")==0) {
 			yydebug=1;
+		} else if (strcmp(argv[i], "-j")==0) {
+			use_jit=1;
 		} else if (strcmp(argv[i], "-a")==0) {
 			print_ast=1;
+		} else if (strcmp(argv[i], "-O")==0) {
+			peephole_report=1;
+		} else if (strcmp(argv[i], "-p")==0) {
+			do_run=1;
+			print_counts=1;
+		} else if (strcmp(argv[i], "-P")==0 && argc>i+1) {
+			i++;
+			do_run=1;
+			prof_outfile=argv[i];
 		} else if (strcmp(argv[i], "-o")==0 && argc>i+1) {
 			i++;
 			outfile=argv[i];
+		} else if (strcmp(argv[i], "-c")==0 && argc>i+1) {
+			i++;
+			c_outfile=argv[i];
+		} else if (strcmp(argv[i], "-w")==0 && argc>i+1) {
+			i++;
+			wasm_outfile=argv[i];
+		} else if (strcmp(argv[i], "-f")==0 && argc>i+1) {
+			i++;
+			sim_frames=atoi(argv[i]);
 		} else if (strcmp(argv[i], "-s")==0 && argc>i+1) {
 			i++;
 			do_run=1;
 			sim_leds=atoi(argv[i]);
+		} else if (strcmp(argv[i], "-l")==0 && argc>i+1) {
+			i++;
+			sim_lanes=atoi(argv[i]);
+		} else if (strcmp(argv[i], "-t")==0 && argc>i+1) {
+			i++;
+			sim_threads=atoi(argv[i]);
+		} else if (strcmp(argv[i], "-I")==0 && argc>i+1) {
+			i++;
+			ast_ops_inline_limit=atoi(argv[i]);
+		} else if (strcmp(argv[i], "-i")==0 && argc>i+1) {
+			i++;
+			insn_limit=atoi(argv[i]);
 		} else if (strlen(infile)==0) {
 			infile=argv[i];
 		} else {
@@ -58,13 +277,28 @@ int main(int argc, char **argv) {
 	}
 
 	if (error) {
-		printf("Usage: %s [-r] [-h] [-d] [-a] [-o outfile.bin] [file.lsh]\n", argv[0]);
+		printf("Usage: %s [-r] [-h] [-d] [-a] [-O] [-j] [-p] [-P outfile.folded] [-o outfile.bin] [-c outfile.c] [-w outfile.wasm] [-s n] [-f n] [-l n] [-t n] [-i n] [-I n] [file.lsh]\n", argv[0]);
+		printf("       %s bench [options] file.lssl... (see %s bench -h)\n", argv[0], argv[0]);
 		printf("  -h: show this help text\n");
 		printf("  -o outfile.bin: Write generated bytecode to file\n");
+		printf("  -c outfile.c: Write program as C code to file, defining lssl_outfile for lssl_vm_init_native()\n");
+		printf("  -w outfile.wasm: Write program as a WebAssembly module to file\n");
 		printf("  -r: run program afterward\n");
 		printf("  -d: print parser debug info\n");
 		printf("  -a: dump AST tree\n");
+		printf("  -O: print how many instructions the peephole optimizer removed from every function\n");
+		printf("  -j: run the program as native code (x86-64 Linux only)\n");
 		printf("  -s n: Simulate n leds afterwards (implies -r)\n");
+		printf("  -f n: Stop simulating after n frames, printing the colours of every frame\n");
+		printf("  -l n: Calculate n leds at the same time when simulating (default 8, or 1 with -j)\n");
+		printf("  -t n: Use n threads when simulating (default: one per CPU core)\n");
+		printf("  -i n: Stop with an error if a call into the program runs more than n instructions\n");
+		printf("  -I n: Inline functions of up to n AST nodes into their callers (default 80, 0 to disable)\n");
+		printf("  -p: After running, print how often every opcode, function and line ran (implies -r)\n");
+		printf("      Needs lssl built with LSSL_VM_STATS defined, see 'make lssl_stats'.\n");
+		printf("  -P outfile.folded: Sample what the program does while running, and write the call stacks\n");
+		printf("      to file in the folded format flame graph tools use (implies -r, and -l 1).\n");
+		printf("      Needs lssl built with LSSL_VM_PROFILE defined, see 'make lssl_prof'.\n");
 		exit(1);
 	}
 
@@ -94,8 +328,9 @@ int main(int argc, char **argv) {
 
 	uint8_t *bin=NULL;
 	int bin_len;
-	if (strlen(outfile)!=0 || do_run) {
+	if (strlen(outfile)!=0 || strlen(c_outfile)!=0 || do_run) {
 		bin=ast_ops_gen_binary(prognode, &bin_len);
+		locs=ast_ops_gen_loc_table(prognode, &locs_len);
 	}
 
 	if (strlen(outfile)!=0) {
@@ -108,31 +343,100 @@ int main(int argc, char **argv) {
 		fclose(f);
 	}
 
+	if (strlen(c_outfile)!=0) {
+		write_c_file(c_outfile, prognode, bin, bin_len);
+	}
+
+	if (strlen(wasm_outfile)!=0) {
+		int wasm_len;
+		uint8_t *wasm=ast_ops_gen_wasm(prognode, &wasm_len);
+		if (!wasm) {
+			printf("Could not write program as wasm module.\n");
+			exit(1);
+		}
+		FILE *f=fopen(wasm_outfile, "wb");
+		if (!f) {
+			perror(wasm_outfile);
+			exit(1);
+		}
+		fwrite(wasm, wasm_len, 1, f);
+		fclose(f);
+		free(wasm);
+	}
+
 	if (do_run) {
 		printf("Compile done. Running VM code.\n");
 		lssl_vm_t *vm=lssl_vm_init(bin, bin_len, 65536);
+		if (!vm) {
+			//lssl_vm_init already said why
+			printf("Could not load the program into the VM.\n");
+			exit(1);
+		}
+		if (use_jit && !lssl_vm_jit(vm)) {
+			printf("JIT not available, interpreting instead.\n");
+			use_jit=0;
+		}
+		lssl_vm_set_insn_limit(vm, insn_limit);
+		if (strlen(prof_outfile)!=0 && !lssl_vm_sample_start(SAMPLE_HZ)) {
+			printf("Can't sample: build lssl with LSSL_VM_PROFILE defined ('make lssl_prof').\n");
+			exit(1);
+		}
 		vm_error_t vm_err={};
 		int32_t ret=lssl_vm_run_main(vm, &vm_err);
 		if (vm_err.type) {
-			printf("Running main() returned error %d\n", vm_err.type);
+			printf("Running main() returned error %d at pc 0x%X\n", vm_err.type, vm_err.pc);
 			bail_if_vm_err(vm, prognode, &vm_err);
 		} else {
 			printf("Ran main() succesfully, returned %f\n", ret/65536.0);
 		}
 		if (sim_leds!=0) {
-			printf("Simulating. Ctrl-C exits.\n");
+			if (sim_frames<0) printf("Simulating. Ctrl-C exits.\n");
 			float time=0;
-			while(1) {
-				led_syscalls_frame_start(vm, &vm_err);
-				if (vm_err.type) printf("At t=%f, frame_start_init:\n", time);
+			uint8_t *leds=malloc(sim_leds*3);
+			//The native code is faster than running the interpreter for multiple LEDs at once
+			if (sim_lanes<0) sim_lanes=use_jit?1:8;
+			if (strlen(prof_outfile)!=0) sim_lanes=1; //lanes aren't sampled
+			led_syscalls_set_lanes(sim_lanes);
+			if (print_counts) sim_threads=1; //the counters aren't thread-safe
+			led_threads_t *threads=led_threads_create(vm, sim_threads);
+			if (!threads) {
+				printf("Could not create render threads.\n");
+				exit(1);
+			}
+			for (int frame=0; frame!=sim_frames; frame++) {
+				led_syscalls_frame_start(vm, time, 0, &vm_err);
+				if (vm_err.type) {
+					printf("At t=%f, frame_start_init:\n", time);
+					if (sim_frames>=0) printf("Frame %d: error %d at pc 0x%X\n", frame, vm_err.type, vm_err.pc);
+				}
 				bail_if_vm_err(vm, prognode, &vm_err);
-				for (int i=0; i<sim_leds; i++) {
-					led_syscalls_calculate_led(vm, i, time, &vm_err);
-					if (vm_err.type) printf("At t=%f, led %d, calculate_led:\n", time, i);
-					bail_if_vm_err(vm, prognode, &vm_err);
+				led_threads_render_frame(threads, 0, sim_leds, time, leds, LED_FORMAT_RGB, &vm_err);
+				if (vm_err.type) {
+					printf("At t=%f, render_frame:\n", time);
+					if (sim_frames>=0) printf("Frame %d: error %d at pc 0x%X\n", frame, vm_err.type, vm_err.pc);
+				}
+				bail_if_vm_err(vm, prognode, &vm_err);
+				if (sim_frames>=0) {
+					printf("Frame %d:", frame);
+					for (int i=0; i<sim_leds*3; i+=3) printf(" %02x%02x%02x", leds[i], leds[i+1], leds[i+2]);
+					printf("\n");
 				}
 				time+=0.05;
 			}
+			led_threads_free(threads);
+			free(leds);
+		}
+		if (print_counts) print_stats(vm, prognode, buf);
+		if (strlen(prof_outfile)!=0) {
+			lssl_vm_sample_stop();
+			FILE *f=fopen(prof_outfile, "w");
+			if (!f) {
+				perror(prof_outfile);
+				exit(1);
+			}
+			int samples=lssl_vm_sample_write(f, label_pc, prognode);
+			fclose(f);
+			printf("Wrote %d samples to %s\n", samples, prof_outfile);
 		}
 		lssl_vm_free(vm);
 		vm_syscall_free();
@@ -140,4 +444,5 @@ int main(int argc, char **argv) {
 
 	ast_free_all(prognode);
 	free(bin);
+	free(locs);
 }
\ No newline at end of file
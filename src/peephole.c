@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "peephole.h"
+#include "vm_defs.h"
+
+/*
+Peephole optimizer. This works on the insns of one function at a time, in the order
+they'll end up in the binary. Every entry in the pattern table below is a sequence of
+opcodes plus a function that checks the rest and does the rewrite. Matches never span a
+label (a NOP some jump goes to), as the insns before and after it can be reached in a
+different way. Removed insns become NOPs; those don't end up in the binary.
+*/
+
+int peephole_report=0;
+
+#define PAT_MAX 4
+#define ANY_JUMP -1 //matches JMP, JZ, JNZ, RJZ and RJNZ
+#define COND_JUMP -2 //matches JZ, JNZ, RJZ and RJNZ
+
+typedef struct {
+	ast_node_t **n;
+	char *label;
+	int count;
+	int size;
+	int removed;
+} insn_list_t;
+
+static void add_insn(insn_list_t *l, ast_node_t *n) {
+	if (l->count==l->size) {
+		l->size=l->size?l->size*2:256;
+		l->n=realloc(l->n, l->size*sizeof(ast_node_t*));
+	}
+	l->n[l->count++]=n;
+}
+
+//Adds the insns of a node and its children, in the order ast_ops_position_insns() puts them
+static void collect_insns(ast_node_t *node, insn_list_t *l) {
+	if (node->type==AST_TYPE_INSN) add_insn(l, node);
+	for (ast_node_t *n=node->children; n!=NULL; n=n->sibling) collect_insns(n, l);
+}
+
+static int is_jump(ast_node_t *n) {
+	int t=n->insn_type;
+	return (t==INSN_JMP || t==INSN_JZ || t==INSN_JNZ || t==INSN_RJZ || t==INSN_RJNZ);
+}
+
+static int index_of(insn_list_t *l, ast_node_t *n) {
+	for (int i=0; i<l->count; i++) {
+		if (l->n[i]==n) return i;
+	}
+	return -1;
+}
+
+//Index of the next insn after i that isn't a NOP, or -1 if there is none. If stop_at_label
+//is set, also returns -1 if there's a label before it.
+static int next_insn(insn_list_t *l, int i, int stop_at_label) {
+	for (i++; i<l->count; i++) {
+		if (l->n[i]->insn_type!=INSN_NOP) return i;
+		if (stop_at_label && l->label[i]) return -1;
+	}
+	return -1;
+}
+
+//Returns true if the NOPs right after insn i contain the label tgt
+static int label_follows(insn_list_t *l, int i, ast_node_t *tgt) {
+	for (i++; i<l->count && l->n[i]->insn_type==INSN_NOP; i++) {
+		if (l->n[i]==tgt) return 1;
+	}
+	return 0;
+}
+
+static void del(insn_list_t *l, int i) {
+	l->n[i]->insn_type=INSN_NOP;
+	l->n[i]->value=NULL;
+	l->removed++;
+}
+
+//LEA x, DEREF -> LDA x
+static int pat_lea_deref(insn_list_t *l, int *at) {
+	ast_node_t *n=l->n[at[0]];
+	n->insn_type=(n->insn_type==INSN_LEA)?INSN_LDA:INSN_LDA_G;
+	del(l, at[1]);
+	return 1;
+}
+
+//PUSH_I a, STRUCT_IDX, PUSH_I b, STRUCT_IDX s -> PUSH_I a+b, STRUCT_IDX s. The size of
+//the first one doesn't matter, STRUCT_IDX doesn't check the offset.
+static int pat_struct_offsets(insn_list_t *l, int *at) {
+	l->n[at[2]]->insn_arg+=l->n[at[0]]->insn_arg;
+	del(l, at[0]);
+	del(l, at[1]);
+	return 1;
+}
+
+//Something that only pushes a value, then POP
+static int pat_push_pop(insn_list_t *l, int *at) {
+	del(l, at[0]);
+	del(l, at[1]);
+	return 1;
+}
+
+//Jump to a label that only has another JMP behind it -> jump to where that goes
+static int pat_thread_jump(insn_list_t *l, int *at) {
+	ast_node_t *n=l->n[at[0]];
+	if (!n->value || n->value->type!=AST_TYPE_INSN) return 0;
+	int t=next_insn(l, index_of(l, n->value), 0);
+	if (t<0 || l->n[t]->insn_type!=INSN_JMP) return 0;
+	ast_node_t *tgt=l->n[t]->value;
+	if (tgt==n->value || !tgt || tgt->type!=AST_TYPE_INSN) return 0;
+	n->value=tgt;
+	return 1;
+}
+
+//JMP or register jump to the insn right after it. (JZ/JNZ still need to pop the condition.)
+static int pat_jump_next(insn_list_t *l, int *at) {
+	ast_node_t *n=l->n[at[0]];
+	if (n->insn_type==INSN_JZ || n->insn_type==INSN_JNZ) return 0;
+	if (!label_follows(l, at[0], n->value)) return 0;
+	del(l, at[0]);
+	return 1;
+}
+
+//JZ a, JMP b, a: -> JNZ b, a:
+static int pat_cond_over_jmp(insn_list_t *l, int *at) {
+	ast_node_t *n=l->n[at[0]];
+	if (!label_follows(l, at[1], n->value)) return 0;
+	const int inv[][2]={{INSN_JZ, INSN_JNZ}, {INSN_JNZ, INSN_JZ}, {INSN_RJZ, INSN_RJNZ}, {INSN_RJNZ, INSN_RJZ}};
+	for (int i=0; i<4; i++) {
+		if (n->insn_type==inv[i][0]) {
+			n->insn_type=inv[i][1];
+			break;
+		}
+	}
+	n->value=l->n[at[1]]->value;
+	del(l, at[1]);
+	return 1;
+}
+
+//A scope only needs to be kept if something is allocated in it; otherwise SCOPE_LEAVE
+//leaves the stack the way it was anyway.
+static int pat_scope(insn_list_t *l, int *at) {
+	int depth=0;
+	for (int i=at[0]; i<l->count; i++) {
+		int t=l->n[i]->insn_type;
+		if (t==INSN_SCOPE_ENTER) {
+			depth++;
+		} else if (t==INSN_SCOPE_LEAVE) {
+			depth--;
+			if (depth==0) {
+				del(l, at[0]);
+				del(l, i);
+				return 1;
+			}
+		} else if (depth==1 && (t==INSN_ARRAYINIT || t==INSN_STRUCTINIT)) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	int len;
+	int ops[PAT_MAX];
+	int (*apply)(insn_list_t *l, int *at); //returns 1 if it changed something
+} pattern_t;
+
+static const pattern_t patterns[]={
+	{2, {INSN_LEA, INSN_DEREF}, pat_lea_deref},
+	{2, {INSN_LEA_G, INSN_DEREF}, pat_lea_deref},
+	{4, {INSN_PUSH_I, INSN_STRUCT_IDX, INSN_PUSH_I, INSN_STRUCT_IDX}, pat_struct_offsets},
+	{2, {INSN_PUSH_I, INSN_POP}, pat_push_pop},
+	{2, {INSN_PUSH_R, INSN_POP}, pat_push_pop},
+	{2, {INSN_LEA, INSN_POP}, pat_push_pop},
+	{2, {INSN_LEA_G, INSN_POP}, pat_push_pop},
+	{2, {INSN_LDA, INSN_POP}, pat_push_pop},
+	{2, {INSN_LDA_G, INSN_POP}, pat_push_pop},
+	{2, {INSN_DUP, INSN_POP}, pat_push_pop},
+	{1, {ANY_JUMP}, pat_thread_jump},
+	{1, {ANY_JUMP}, pat_jump_next},
+	{2, {COND_JUMP, INSN_JMP}, pat_cond_over_jmp},
+	{1, {INSN_SCOPE_ENTER}, pat_scope},
+};
+
+static int op_matches(int op, ast_node_t *n) {
+	if (op==ANY_JUMP) return is_jump(n);
+	if (op==COND_JUMP) return is_jump(n) && n->insn_type!=INSN_JMP;
+	return n->insn_type==op;
+}
+
+//Tries all patterns at insn i. Returns 1 if one changed something.
+static int match_at(insn_list_t *l, int i) {
+	for (int p=0; p<sizeof(patterns)/sizeof(patterns[0]); p++) {
+		const pattern_t *pat=&patterns[p];
+		int at[PAT_MAX];
+		at[0]=i;
+		if (!op_matches(pat->ops[0], l->n[i])) continue;
+		int k;
+		for (k=1; k<pat->len; k++) {
+			at[k]=next_insn(l, at[k-1], 1);
+			if (at[k]<0 || !op_matches(pat->ops[k], l->n[at[k]])) break;
+		}
+		if (k==pat->len && pat->apply(l, at)) return 1;
+	}
+	return 0;
+}
+
+static void optimize(insn_list_t *l, const char *name) {
+	if (l->count==0) return;
+	l->label=calloc(l->count, 1);
+	for (int i=0; i<l->count; i++) {
+		ast_node_t *v=l->n[i]->value;
+		if (is_jump(l->n[i]) && v && v->type==AST_TYPE_INSN) {
+			int t=index_of(l, v);
+			if (t>=0) l->label[t]=1;
+		}
+	}
+	int insns=0;
+	for (int i=0; i<l->count; i++) {
+		if (l->n[i]->insn_type!=INSN_NOP) insns++;
+	}
+	//Rewrites can make new matches possible; the cap is for jumps threading in a circle.
+	for (int pass=0; pass<16; pass++) {
+		int changed=0;
+		for (int i=0; i<l->count; i++) {
+			if (l->n[i]->insn_type!=INSN_NOP) changed|=match_at(l, i);
+		}
+		if (!changed) break;
+	}
+	if (peephole_report) printf("peephole: %s: removed %d of %d insns\n", name, l->removed, insns);
+	free(l->label);
+	l->label=NULL;
+}
+
+void peephole(ast_node_t *prognode) {
+	//The code outside functions is one piece, as move_functions_down put it before those.
+	insn_list_t start={};
+	for (ast_node_t *n=prognode; n!=NULL; n=n->sibling) {
+		if (n->type==AST_TYPE_FUNCDEF) {
+			insn_list_t l={};
+			collect_insns(n, &l);
+			optimize(&l, n->name);
+			free(l.n);
+		} else {
+			collect_insns(n, &start);
+		}
+	}
+	optimize(&start, "(program start)");
+	free(start.n);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "ast.h"
+
+//Set this to have peephole() print how many insns it removed from every function
+extern int peephole_report;
+
+//Rewrites short sequences of the insns codegen() generated into cheaper ones. Runs
+//before the insns are positioned; removed insns are turned into NOPs, which take no space.
+void peephole(ast_node_t *prognode);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <stdarg.h>
@@ -9,9 +10,12 @@
 #include "ast_ops.h"
 #include "codegen.h"
 #include "led_syscalls.h"
+#include "led_threads.h"
 #include "vm_syscall.h"
 #include "vm.h"
+#include "vm_defs.h"
 #include "compile.h"
+#include "loc_table.h"
 
 #define TEST_DIR "../tests"
 
@@ -26,6 +30,7 @@ int expected_error_line;
 int expected_error_col;
 int expected_error_got;
 int unexpected_error_got;
+int use_jit;
 
 int check_expected(const YYLTYPE *loc) {
 	//hacky way to compare
@@ -63,6 +68,220 @@ void yyerror(const YYLTYPE *loc, ast_node_t **program, yyscan_t yyscanner, const
 }
 
 
+//The location table should give the same results as looking in the AST.
+static int check_loc_table(ast_node_t *prognode, int bin_len) {
+	int len;
+	uint8_t *locs=ast_ops_gen_loc_table(prognode, &len);
+	int ok=(locs!=NULL);
+	for (int pc=0; ok && pc<bin_len; pc++) {
+		const file_loc_t *loc=ast_lookup_loc_for_pc(prognode, pc);
+		file_loc_t tloc;
+		int found=loc_table_lookup(locs, len, pc, &tloc);
+		if (loc && (!found || memcmp(loc, &tloc, sizeof(file_loc_t))!=0)) {
+			printf("Location table is wrong for pc 0x%X\n", pc);
+			ok=0;
+		}
+	}
+	free(locs);
+	return ok;
+}
+
+#define RENDER_LEDS 40
+#define RENDER_FRAMES 4
+#define RENDER_BYTES (RENDER_FRAMES*RENDER_LEDS*3)
+
+//Runs main() in a fresh VM and renders a few frames using the LED callback it registers
+static int render_frames(uint8_t *bin, int bin_len, int lanes, int threads, uint8_t *out) {
+	led_syscalls_clear();
+	srand(1);
+	lssl_vm_t *vm=lssl_vm_init(bin, bin_len, 65536);
+	if (!vm) return 0;
+	if (use_jit) lssl_vm_jit(vm);
+	vm_error_t err={};
+	lssl_vm_run_main(vm, &err);
+	led_syscalls_set_lanes(lanes);
+	led_threads_t *t=(threads>1)?led_threads_create(vm, threads):NULL;
+	for (int f=0; f<RENDER_FRAMES && !err.type; f++) {
+		led_syscalls_frame_start(vm, f*0.37, 0, &err);
+		if (err.type) break;
+		uint8_t *fout=&out[f*RENDER_LEDS*3];
+		if (t) {
+			led_threads_render_frame(t, 0, RENDER_LEDS, f*0.37, fout, LED_FORMAT_RGB, &err);
+		} else {
+			led_syscalls_render_frame(vm, 0, RENDER_LEDS, f*0.37, fout, LED_FORMAT_RGB, &err);
+		}
+	}
+	led_threads_free(t);
+	led_syscalls_set_lanes(1);
+	lssl_vm_free(vm);
+	if (err.type) {
+		printf("Rendering with %d lanes, %d threads returned error %d @ PC=0x%X\n", lanes, threads, err.type, err.pc);
+	}
+	return !err.type;
+}
+
+//Calculating LEDs in lock-step or on multiple threads should give the same colours as
+//doing them one by one
+static int check_render(uint8_t *bin, int bin_len) {
+	const int lanes[]={8, 1};
+	const int threads[]={1, 4};
+	uint8_t one[RENDER_BYTES], out[RENDER_BYTES];
+	if (!render_frames(bin, bin_len, 1, 1, one)) return ERR_RUNTIME;
+	for (int i=0; i<2; i++) {
+		if (!render_frames(bin, bin_len, lanes[i], threads[i], out)) return ERR_RUNTIME;
+		if (memcmp(one, out, RENDER_BYTES)!=0) {
+			printf("LEDs rendered with %d lanes, %d threads differ from the ones rendered one by one\n",
+					lanes[i], threads[i]);
+			return ERR_RESULT;
+		}
+	}
+	return ERR_OK;
+}
+
+//Hand-assembled programs for the bytecode verifier. Everything but the last one should be
+//rejected by lssl_vm_init(). Syscall 4 is sin(x), 0xfff doesn't exist.
+#define A16(v) ((v)&0xff), (((v)>>8)&0xff)
+typedef struct {
+	const char *desc;
+	int glob_size;
+	int len;
+	uint8_t code[32];
+	int valid;
+} verify_test_t;
+
+static const verify_test_t verify_tests[]={
+	{"bad opcode", 0, 7, {0xfe, INSN_PUSH_I, A16(0), INSN_RETURN, A16(0)}},
+	{"jump into an insn", 0, 9, {INSN_PUSH_I, A16(0), INSN_JMP, A16(1), INSN_RETURN, A16(0)}},
+	{"jump past the end", 0, 9, {INSN_PUSH_I, A16(0), INSN_JMP, A16(100), INSN_RETURN, A16(0)}},
+	{"running off the end", 0, 3, {INSN_PUSH_I, A16(0)}},
+	{"stack heights differ", 0, 15, {INSN_PUSH_I, A16(0), INSN_JZ, A16(9), INSN_PUSH_I, A16(1), 
+				INSN_PUSH_I, A16(2), INSN_RETURN, A16(0)}},
+	{"stack underflow", 0, 4, {INSN_ADD, INSN_RETURN, A16(0)}},
+	{"unknown syscall", 0, 6, {INSN_SYSCALL, A16(0xfff), INSN_RETURN, A16(0)}},
+	{"too few syscall args", 0, 6, {INSN_SYSCALL, A16(4), INSN_RETURN, A16(0)}},
+	{"too many syscall args", 0, 12, {INSN_PUSH_I, A16(0), INSN_PUSH_I, A16(0), 
+				INSN_SYSCALL, A16(4|(2<<12)), INSN_RETURN, A16(0)}},
+	{"LDA above the stack frame", 0, 6, {INSN_LDA, A16(5), INSN_RETURN, A16(0)}},
+	{"LDA below the stack frame", 0, 6, {INSN_LDA, A16(-10), INSN_RETURN, A16(0)}},
+	{"LDA_G outside of globals", 2, 6, {INSN_LDA_G, A16(2), INSN_RETURN, A16(0)}},
+	{"valid program", 2, 13, {INSN_PUSH_I, A16(1), INSN_SYSCALL, A16(4|(1<<12)), 
+				INSN_LDA_G, A16(1), INSN_ADD, INSN_RETURN, A16(0)}, 1},
+};
+
+//Returns ERR_OK if the VM loads the test program if and only if it's valid
+static int run_verify_test(const verify_test_t *t) {
+	uint8_t bin[8+sizeof(t->code)]={LSSL_VM_VER, 0, 0, 0, t->glob_size, 0, 0, 0};
+	memcpy(&bin[8], t->code, t->len);
+	lssl_vm_t *vm=lssl_vm_init(bin, 8+t->len, 1024);
+	int loaded=(vm!=NULL);
+	lssl_vm_free(vm);
+	if (loaded==t->valid) return ERR_OK;
+	printf("Verifier test '%s': program %s\n", t->desc, loaded?"loaded":"was rejected");
+	return t->valid?ERR_RUNTIME:ERR_NO_EXPECTED_ERR;
+}
+
+//Compiles code and loads it into a VM, without running anything
+static lssl_vm_t *load_program(char *code) {
+	unexpected_error_got=0;
+	ast_node_t *prognode=lssl_compile(code);
+	if (!prognode || unexpected_error_got) return NULL;
+	int bin_len;
+	uint8_t *bin=ast_ops_gen_binary(prognode, &bin_len);
+	led_syscalls_clear();
+	lssl_vm_t *vm=lssl_vm_init(bin, bin_len, 65536);
+	if (vm && use_jit) lssl_vm_jit(vm);
+	ast_free_all(prognode);
+	free(bin);
+	return vm;
+}
+
+static char budget_prog[]=
+	"function main() {\n"
+	"	var s=0;\n"
+	"	for (var i=0; i<300; i++) {\n"
+	"		s=s+(i%7)*0.25;\n"
+	"	}\n"
+	"	return s;\n"
+	"}\n";
+
+static char endless_prog[]=
+	"function main() {\n"
+	"	var x=0;\n"
+	"	while (x>=0) x=x+1;\n"
+	"	return 42;\n"
+	"}\n";
+
+static char endless_led_prog[]=
+	"function spin(pos, time) {\n"
+	"	var v=pos;\n"
+	"	while (v>=0) v=v+1;\n"
+	"	led_set_rgb(v, 0, 0);\n"
+	"}\n"
+	"function main() {\n"
+	"	register_led_cb(spin);\n"
+	"	return 42;\n"
+	"}\n";
+
+//Running main() a few insns at a time should give the same result as running it at once
+static int test_budget() {
+	lssl_vm_t *vm=load_program(budget_prog);
+	if (!vm) return ERR_UNEXPECTED_ERR;
+	vm_error_t err={};
+	int32_t expected=lssl_vm_run_main(vm, &err);
+	lssl_vm_free(vm);
+	if (err.type) return ERR_RUNTIME;
+	vm=load_program(budget_prog);
+	int yields=0;
+	int32_t r;
+	do {
+		r=lssl_vm_run(vm, 0, 0, NULL, 13, &err);
+		if (err.type==LSSL_VM_YIELDED) yields++;
+	} while (err.type==LSSL_VM_YIELDED);
+	lssl_vm_free(vm);
+	printf("Budget test: %d yields, returned %f, expected %f\n", yields, r/65536.0, expected/65536.0);
+	if (err.type) return ERR_RUNTIME;
+	return (r==expected && yields>10)?ERR_OK:ERR_RESULT;
+}
+
+//An endless loop should run into the insn limit
+static int test_insn_limit() {
+	lssl_vm_t *vm=load_program(endless_prog);
+	if (!vm) return ERR_UNEXPECTED_ERR;
+	lssl_vm_set_insn_limit(vm, 100000);
+	vm_error_t err={};
+	lssl_vm_run_main(vm, &err);
+	lssl_vm_free(vm);
+	return (err.type==LSSL_VM_ERR_INSN_LIMIT)?ERR_OK:ERR_RESULT;
+}
+
+//Same, but in a LED callback rendered in lanes
+static int test_insn_limit_lanes() {
+	lssl_vm_t *vm=load_program(endless_led_prog);
+	if (!vm) return ERR_UNEXPECTED_ERR;
+	lssl_vm_set_insn_limit(vm, 100000);
+	vm_error_t err={};
+	lssl_vm_run_main(vm, &err);
+	if (!err.type) {
+		uint8_t out[16*3];
+		led_syscalls_set_lanes(8);
+		led_syscalls_render_frame(vm, 0, 16, 0, out, LED_FORMAT_RGB, &err);
+		led_syscalls_set_lanes(1);
+	}
+	lssl_vm_free(vm);
+	return (err.type==LSSL_VM_ERR_INSN_LIMIT)?ERR_OK:ERR_RESULT;
+}
+
+typedef struct {
+	const char *desc;
+	int (*fn)();
+} vm_test_t;
+
+static const vm_test_t vm_tests[]={
+	{"run with a budget", test_budget},
+	{"insn limit", test_insn_limit},
+	{"insn limit in lanes", test_insn_limit_lanes},
+};
+
 int run_test(char *code) {
 	uint8_t *bin=NULL;
 	int bin_len;
@@ -120,9 +339,23 @@ int run_test(char *code) {
 	}
 
 	bin=ast_ops_gen_binary(prognode, &bin_len);
+	if (!check_loc_table(prognode, bin_len)) {
+		ret=ERR_TEST_ERR;
+		goto cleanup;
+	}
 
 	led_syscalls_clear();
 	vm=lssl_vm_init(bin, bin_len, 65536);
+	if (!vm) {
+		//lssl_vm_init already said why
+		ret=ERR_RUNTIME;
+		goto cleanup;
+	}
+	if (use_jit && !lssl_vm_jit(vm)) {
+		printf("JIT not available\n");
+		ret=ERR_RUNTIME;
+		goto cleanup;
+	}
 	vm_error_t vm_err;
 	int32_t vmret=lssl_vm_run_main(vm, &vm_err);
 	if (vm_err.type) {
@@ -150,6 +383,7 @@ int run_test(char *code) {
 		ret=ERR_RESULT;
 		goto cleanup;
 	}
+	if (led_syscalls_have_cb()) ret=check_render(bin, bin_len);
 
 cleanup:
 	lssl_vm_free(vm);
@@ -170,14 +404,17 @@ int main(int argc, char **argv) {
 		if (strcmp(argv[i],"-t")==0 && argc>i+1) {
 			i++;
 			testdir=argv[i];
+		} else if (strcmp(argv[i],"-j")==0) {
+			use_jit=1;
 		} else {
 			error=1;
 		}
 	}
 	if (error) {
-		printf("Usage: %s [-t testdir]\n", argv[0]);
+		printf("Usage: %s [-t testdir] [-j]\n", argv[0]);
 		printf("Compiles and runs all the tests in the given testdir.\n");
 		printf("  -t testdir: Specify custom testdir (default %s)\n", TEST_DIR);
+		printf("  -j: Run the tests as native code\n");
 		exit(1);
 	}
 	result_t errors[1024];
@@ -189,6 +426,17 @@ int main(int argc, char **argv) {
 	led_syscalls_init();
 	char code[1024*1024]={};
 	int res=0;
+	for (int i=0; i<sizeof(verify_tests)/sizeof(verify_tests[0]); i++) {
+		errors[res].file=strdup(verify_tests[i].desc);
+		errors[res].result=run_verify_test(&verify_tests[i]);
+		res++;
+	}
+	for (int i=0; i<sizeof(vm_tests)/sizeof(vm_tests[0]); i++) {
+		printf("Testing %s ...\n", vm_tests[i].desc);
+		errors[res].file=strdup(vm_tests[i].desc);
+		errors[res].result=vm_tests[i].fn();
+		res++;
+	}
 	struct dirent *de;
 	while ((de=readdir(dir))) {
 		if (strlen(de->d_name)>5 && strcmp(&de->d_name[strlen(de->d_name)-5], ".lssl")==0) {
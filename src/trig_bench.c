@@ -0,0 +1,87 @@
+//Checks the fixed point trig functions against libm, and compares their speed to the
+//float versions the syscalls used before. Build with 'make trig_bench'.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "fixed_trig.h"
+
+//What the syscalls used to do
+static int32_t float_sin(int32_t a) {
+	float f=a/65536.0;
+	return sinf(f)*65536;
+}
+
+static int32_t float_cos(int32_t a) {
+	float f=a/65536.0;
+	return cosf(f)*65536;
+}
+
+static int32_t float_atan2(int32_t y, int32_t x) {
+	return atan2f(y/65536.0, x/65536.0)*65536;
+}
+
+static double err(int32_t v, double ref) {
+	return fabs(v-ref*65536.0);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//Angles the LED effects are likely to use: a few turns either way
+#define ANGLE_RANGE (64<<16)
+#define BENCH_COUNT 20000000
+
+static volatile int32_t sink;
+
+static void bench(const char *name, int32_t (*fn)(int32_t), int32_t (*ref)(int32_t)) {
+	double t[2];
+	int32_t (*fns[2])(int32_t)={fn, ref};
+	for (int f=0; f<2; f++) {
+		double start=now();
+		int32_t acc=0;
+		for (int i=0; i<BENCH_COUNT; i++) acc+=fns[f]((i*97)%ANGLE_RANGE-ANGLE_RANGE/2);
+		sink=acc;
+		t[f]=now()-start;
+	}
+	printf("%-6s fixed %6.2f Mcalls/s, float %6.2f Mcalls/s\n", name, BENCH_COUNT/t[0]/1e6, BENCH_COUNT/t[1]/1e6);
+}
+
+static int32_t atan2_fixed_1(int32_t a) {
+	return fixed_atan2(a, (a*7)&0x3ffff);
+}
+
+static int32_t atan2_float_1(int32_t a) {
+	return float_atan2(a, (a*7)&0x3ffff);
+}
+
+int main(int argc, char **argv) {
+	double e_sin=0, e_cos=0, e_tan=0, e_atan2=0;
+	double ef_sin=0, ef_atan2=0;
+	for (int32_t a=-ANGLE_RANGE; a<ANGLE_RANGE; a+=7) {
+		double r=a/65536.0;
+		e_sin=fmax(e_sin, err(fixed_sin(a), sin(r)));
+		e_cos=fmax(e_cos, err(fixed_cos(a), cos(r)));
+		if (fabs(tan(r))<1) e_tan=fmax(e_tan, err(fixed_tan(a), tan(r)));
+		ef_sin=fmax(ef_sin, err(float_sin(a), sin(r)));
+	}
+	for (int32_t y=-(4<<16); y<(4<<16); y+=251) {
+		for (int32_t x=-(4<<16); x<(4<<16); x+=509) {
+			e_atan2=fmax(e_atan2, err(fixed_atan2(y, x), atan2(y, x)));
+			ef_atan2=fmax(ef_atan2, err(float_atan2(y, x), atan2(y, x)));
+		}
+	}
+	printf("Max error vs libm, in 1/65536:\n");
+	printf("sin    fixed %.2f float %.2f\n", e_sin, ef_sin);
+	printf("cos    fixed %.2f\n", e_cos);
+	printf("tan    fixed %.2f (|tan|<1)\n", e_tan);
+	printf("atan2  fixed %.2f float %.2f\n", e_atan2, ef_atan2);
+	bench("sin", fixed_sin, float_sin);
+	bench("cos", fixed_cos, float_cos);
+	bench("atan2", atan2_fixed_1, atan2_float_1);
+	return 0;
+}
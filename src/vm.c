@@ -2,21 +2,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <string.h>
 #include "vm_defs.h"
 #include "vm_syscall.h"
 #include "vm.h"
-
-struct lssl_vm_t {
-	uint8_t *progmem;
-	int proglen;
-	int32_t *stack;
-	int stack_size;
-	int bp;
-	int sp;
-	int ap;
-	int pc;
-	int error;
-};
+#include "vm_int.h"
 
 static int8_t get_i8(uint8_t *p) {
 	return p[0];
@@ -30,7 +20,313 @@ static int32_t get_i32(uint8_t *p) {
 	return p[0]|(p[1]<<8)|(p[2]<<16)|(p[3]<<24);
 }
 
+static int32_t vm_exec(lssl_vm_t *vm, vm_error_t *error);
+
+//Handler for each opcode. Filled by vm_exec when passed a NULL vm.
+static lssl_vm_handler_t vm_handlers[LSSL_INSN_COUNT+1];
+static int vm_handlers_filled=0;
+#define HANDLER_BAD_INSN LSSL_INSN_COUNT
+
+//Returns the index of the insn at bytecode address pc, or insn_count (which
+//is a 'bad instruction' sentinel) if no insn starts there.
+static int insn_for_pc(lssl_vm_t *vm, int pc) {
+	int lo=0, hi=vm->insn_count;
+	while (lo<hi) {
+		int mid=(lo+hi)/2;
+		if (vm->insn_pc[mid]<pc) {
+			lo=mid+1;
+		} else {
+			hi=mid;
+		}
+	}
+	if (lo<vm->insn_count && vm->insn_pc[lo]==pc) return lo;
+	return vm->insn_count;
+}
+
+//Size of the insn at the start of p, or 1 if it's not a valid insn. Invalid
+//opcodes still get an entry so the verifier can complain about them.
+static int insn_size(uint8_t *p, int len) {
+	int size=0;
+	if (p[0]<LSSL_INSN_COUNT) size=lssl_vm_argtypes[lssl_vm_ops[p[0]].argtype].byte_size;
+	if (size==0 || size>len) return 1;
+	return size;
+}
+
+//Returns the index in the function table of the function starting at the given insn,
+//adding it if it's not there yet. Returns -1 if out of memory.
+static int func_for_insn(lssl_vm_t *vm, int entry) {
+	for (int i=0; i<vm->func_count; i++) {
+		if (vm->funcs[i].entry==entry) return i;
+	}
+	lssl_vm_func_t *funcs=realloc(vm->funcs, (vm->func_count+1)*sizeof(lssl_vm_func_t));
+	if (!funcs) return -1;
+	vm->funcs=funcs;
+	lssl_vm_func_t *f=&vm->funcs[vm->func_count];
+	f->entry=entry;
+	f->state=FUNC_UNVERIFIED;
+	f->nargs=-1;
+	f->max_depth=0;
+	f->max_scopes=0;
+	return vm->func_count++;
+}
+
+//Translates the bytecode into the fixed-width form the interpreter runs.
+static int decode_program(lssl_vm_t *vm, uint8_t *prog, int len) {
+	if (!vm_handlers_filled) vm_exec(NULL, NULL);
+	int count=0, syscalls=0;
+	for (int pc=0; pc<len; pc+=insn_size(&prog[pc], len-pc)) {
+		if (prog[pc]==INSN_SYSCALL) syscalls++;
+		count++;
+	}
+	//Note the extra entry at the end; this catches running off the end of the program.
+	vm->insns=calloc(count+1, sizeof(lssl_vm_insn_t));
+	vm->insn_pc=calloc(count+1, sizeof(uint16_t));
+	vm->insn_op=calloc(count+1, sizeof(uint8_t));
+	vm->syscall_fns=calloc(syscalls+1, sizeof(vm_syscall_fn_t*));
+	if (!vm->insns || !vm->insn_pc || !vm->insn_op || !vm->syscall_fns) return 0;
+	vm->insn_count=count;
+	int i=0;
+	for (int pc=0; pc<len; pc+=insn_size(&prog[pc], len-pc)) {
+		int size=insn_size(&prog[pc], len-pc);
+		int op=prog[pc];
+		vm->insn_pc[i]=pc;
+		int argtype=(op<LSSL_INSN_COUNT)?lssl_vm_ops[op].argtype:-1;
+		if (op>=LSSL_INSN_COUNT || size!=lssl_vm_argtypes[argtype].byte_size) {
+			op=HANDLER_BAD_INSN;
+		} else if (argtype==ARG_RRR) {
+			vm->insns[i].d=get_i16(&prog[pc+1]);
+			vm->insns[i].s=get_i16(&prog[pc+3]);
+			vm->insns[i].arg=get_i16(&prog[pc+5]);
+		} else if (argtype==ARG_RRN) {
+			vm->insns[i].d=get_i16(&prog[pc+1]);
+			vm->insns[i].s=get_i16(&prog[pc+3]);
+			vm->insns[i].arg=get_i32(&prog[pc+5]);
+		} else if (argtype==ARG_RN) {
+			vm->insns[i].d=get_i16(&prog[pc+1]);
+			vm->insns[i].arg=get_i32(&prog[pc+3]);
+		} else if (argtype==ARG_RT) {
+			vm->insns[i].s=get_i16(&prog[pc+1]);
+			vm->insns[i].arg=get_i16(&prog[pc+3]);
+		} else if (size==2) {
+			vm->insns[i].arg=get_i8(&prog[pc+1]);
+		} else if (size==3) {
+			vm->insns[i].arg=get_i16(&prog[pc+1]);
+		} else if (size==5) {
+			vm->insns[i].arg=get_i32(&prog[pc+1]);
+		}
+		vm->insn_op[i]=op;
+		vm->insns[i].handler=vm_handlers[op];
+		i++;
+	}
+	vm->insn_pc[count]=len;
+	vm->insn_op[count]=HANDLER_BAD_INSN;
+	vm->insns[count].handler=vm_handlers[HANDLER_BAD_INSN];
+	vm->insns[count].arg=len;
+#ifdef LSSL_VM_STATS
+	vm->stats=calloc(count+1, sizeof(lssl_vm_insn_stat_t));
+	if (!vm->stats) return 0;
+	for (int i=0; i<=count; i++) {
+		vm->stats[i].pc=vm->insn_pc[i];
+		vm->stats[i].op=vm->insn_op[i];
+	}
+#endif
+	//The program starts at pc 0.
+	if (func_for_insn(vm, 0)<0) return 0;
+	//Resolve jump targets into insn indexes, and calls into function indexes. Every
+	//SYSCALL gets its function looked up here and stored in syscall_fns, with d as
+	//the index; unknown syscalls get NULL, which the verifier rejects.
+	syscalls=0;
+	for (i=0; i<count; i++) {
+		int op=vm->insn_op[i];
+		if (op==INSN_CALL) {
+			vm->insns[i].arg=func_for_insn(vm, insn_for_pc(vm, vm->insns[i].arg));
+			if (vm->insns[i].arg<0) return 0;
+		} else if (op==INSN_SYSCALL) {
+			vm->insns[i].d=syscalls;
+			vm->syscall_fns[syscalls++]=vm_syscall_fn(vm->insns[i].arg&0xfff);
+		} else if (op<LSSL_INSN_COUNT && (lssl_vm_ops[op].argtype==ARG_TARGET || lssl_vm_ops[op].argtype==ARG_RT)) {
+			vm->insns[i].arg=insn_for_pc(vm, vm->insns[i].arg);
+		}
+	}
+	return 1;
+}
+
+//Finds out how many arguments a function takes by looking at what its RETURNs clean
+//up. Returns -1 if there is no reachable RETURN, -2 if the RETURNs don't agree.
+static int func_nargs(lssl_vm_t *vm, int entry, int *seen, int *work) {
+	int n=vm->insn_count;
+	for (int i=0; i<=n; i++) seen[i]=0;
+	int nargs=-1;
+	int wp=0;
+	work[wp++]=entry;
+	seen[entry]=1;
+	while (wp) {
+		int i=work[--wp];
+		int op=vm->insn_op[i];
+		int arg=vm->insns[i].arg;
+		int next[2]={i+1, -1};
+		if (op>=LSSL_INSN_COUNT) {
+			continue;
+		} else if (op==INSN_RETURN) {
+			if (arg<0 || (nargs!=-1 && nargs!=arg)) return -2;
+			nargs=arg;
+			continue;
+		} else if (op==INSN_JMP) {
+			next[0]=arg;
+		} else if (op==INSN_JZ || op==INSN_JNZ || op==INSN_RJZ || op==INSN_RJNZ) {
+			next[1]=arg;
+		}
+		for (int k=0; k<2; k++) {
+			if (next[k]<0 || next[k]>=n || seen[next[k]]) continue;
+			seen[next[k]]=1;
+			work[wp++]=next[k];
+		}
+	}
+	return nargs;
+}
+
+#define VERIFY_FAIL(msg) do { \
+		printf("Bytecode verification failed at pc 0x%X: %s\n", vm->insn_pc[i], msg); \
+		return 0; \
+	} while(0)
+
+//Follows all paths through a function, keeping track of the stack height relative to
+//BP (not counting ARRAYINIT/STRUCTINIT allocations; those get checked at runtime) and
+//the SCOPE_ENTER we're in. Every instruction must be reached with the same height and
+//scope from every path, and must not pop what isn't there. Returns 1 if the function
+//checks out.
+static int verify_func(lssl_vm_t *vm, lssl_vm_func_t *f, int *scratch) {
+	int n=vm->insn_count;
+	int nargs=(f->nargs<0)?0:f->nargs;
+	int *height=scratch;
+	int *scope=&scratch[n+1];	//insn idx of innermost SCOPE_ENTER, or -1
+	int *nest=&scratch[2*(n+1)];	//amount of nested scopes
+	int *work=&scratch[3*(n+1)];
+	for (int i=0; i<=n; i++) height[i]=-1;
+	int max_depth=0, max_scopes=0;
+	int wp=0;
+	work[wp++]=f->entry;
+	height[f->entry]=0;
+	scope[f->entry]=-1;
+	nest[f->entry]=0;
+	while (wp) {
+		int i=work[--wp];
+		int op=vm->insn_op[i];
+		int arg=vm->insns[i].arg;
+		if (op>=LSSL_INSN_COUNT || op==INSN_NOP) VERIFY_FAIL("invalid instruction");
+		int pops=lssl_vm_ops[op].pops;
+		int pushes=lssl_vm_ops[op].pushes;
+		int h=height[i], s=scope[i], d=nest[i];
+		int next[2]={i+1, -1};
+		//Slots used by a register insn, as in the arg of LDA
+		int slots[3], nslots=0;
+		int argtype=lssl_vm_ops[op].argtype;
+		if (argtype==ARG_RRR || argtype==ARG_RRN || argtype==ARG_RN) slots[nslots++]=vm->insns[i].d;
+		if (argtype==ARG_RRR || argtype==ARG_RRN || argtype==ARG_RT) slots[nslots++]=vm->insns[i].s;
+		if (argtype==ARG_RRR) slots[nslots++]=arg;
+		for (int k=0; k<nslots; k++) {
+			if (slots[k]<-3-nargs || slots[k]>=h) VERIFY_FAIL("slot outside of stack frame");
+		}
+		if (op==INSN_JMP) {
+			next[0]=arg;
+		} else if (op==INSN_JZ || op==INSN_JNZ || op==INSN_RJZ || op==INSN_RJNZ) {
+			next[1]=arg;
+		} else if (op==INSN_RETURN) {
+			next[0]=-1;
+		} else if (op==INSN_ENTER) {
+			if (arg<0) VERIFY_FAIL("negative ENTER");
+			pushes=arg;
+		} else if (op==INSN_CALL) {
+			lssl_vm_func_t *callee=&vm->funcs[arg];
+			if (callee->nargs==-2) VERIFY_FAIL("call to function with inconsistent RETURNs");
+			if (callee->nargs==-1) {
+				next[0]=-1; //never returns
+			} else {
+				pops=callee->nargs;
+			}
+		} else if (op==INSN_SYSCALL) {
+			if (!vm_syscall_exists(arg&0xfff)) VERIFY_FAIL("unknown syscall");
+			pops=(arg>>12)&0xf;
+			//The syscall reads its args in place, so it must not read more than are there
+			if (pops!=vm_syscall_nargs(arg&0xfff)) VERIFY_FAIL("wrong syscall argument count");
+		} else if (op==INSN_SCOPE_ENTER) {
+			s=i;
+			d++;
+		} else if (op==INSN_SCOPE_LEAVE) {
+			if (s<0) VERIFY_FAIL("SCOPE_LEAVE without SCOPE_ENTER");
+			//Back to the state before the SCOPE_ENTER
+			h=height[s];
+			d=nest[s];
+			s=scope[s];
+		} else if (op==INSN_LDA) {
+			if (arg<-3-nargs || arg>=h) VERIFY_FAIL("LDA outside of stack frame");
+		} else if (op==INSN_STA) {
+			//the slot needs to be there after the value is popped
+			if (arg<-3-nargs || arg>=h-1) VERIFY_FAIL("STA outside of stack frame");
+		} else if (op==INSN_LDA_G) {
+			if (arg<0 || arg>=vm->glob_size) VERIFY_FAIL("LDA_G outside of globals");
+		} else if (op==INSN_ARRAY_IDX) {
+			if (arg<=0) VERIFY_FAIL("invalid array item size");
+		} else if (op==INSN_ARRAYINIT || op==INSN_STRUCTINIT) {
+			if (arg<0) VERIFY_FAIL("negative object size");
+		}
+		if (h<pops) VERIFY_FAIL("stack underflow");
+		h=h-pops+pushes;
+		if (h>max_depth) max_depth=h;
+		if (d>max_scopes) max_scopes=d;
+		for (int k=0; k<2; k++) {
+			int t=next[k];
+			if (t<0) continue;
+			if (t>=n) VERIFY_FAIL("code runs outside of program");
+			if (height[t]<0) {
+				height[t]=h;
+				scope[t]=s;
+				nest[t]=d;
+				work[wp++]=t;
+			} else if (height[t]!=h || scope[t]!=s) {
+				VERIFY_FAIL("stack height differs between paths");
+			}
+		}
+	}
+	f->max_depth=max_depth;
+	f->max_scopes=max_scopes;
+	if (max_depth>vm->max_depth) vm->max_depth=max_depth;
+	return 1;
+}
+
+#undef VERIFY_FAIL
+
+//Verifies all functions in the function table that haven't been looked at yet.
+//Returns 0 if any of them is bad.
+static int verify_funcs(lssl_vm_t *vm) {
+	int n=vm->insn_count+1;
+	int *scratch=malloc(n*4*sizeof(int));
+	if (!scratch) return 0;
+	//Callers need to know the arg count of their callees, so find those first.
+	for (int i=0; i<vm->func_count; i++) {
+		lssl_vm_func_t *f=&vm->funcs[i];
+		if (f->state==FUNC_UNVERIFIED) f->nargs=func_nargs(vm, f->entry, scratch, &scratch[n]);
+	}
+	int ret=1;
+	for (int i=0; i<vm->func_count; i++) {
+		lssl_vm_func_t *f=&vm->funcs[i];
+		if (f->state!=FUNC_UNVERIFIED) continue;
+		if (verify_func(vm, f, scratch)) {
+			f->state=FUNC_OK;
+		} else {
+			f->state=FUNC_BAD;
+			ret=0;
+		}
+	}
+	free(scratch);
+	return ret;
+}
+
 lssl_vm_t *lssl_vm_init(uint8_t *program, int prog_len, int stack_size_words) {
+	if (prog_len<8) {
+		printf("Program too short!\n");
+		return NULL;
+	}
 	uint32_t ver=get_i32(&program[0]);
 	uint32_t glob_sz=get_i32(&program[4]);
 
@@ -39,20 +335,36 @@ lssl_vm_t *lssl_vm_init(uint8_t *program, int prog_len, int stack_size_words) {
 		printf("Version error! Expected %d got %d\n", LSSL_VM_VER, (int)ver);
 		return NULL;
 	}
-	
+	//insn_pc is 16-bit
+	if (prog_len-8>0xffff) {
+		printf("Program too large! (%d bytes)\n", prog_len);
+		return NULL;
+	}
+	if ((int64_t)glob_sz>stack_size_words) {
+		printf("Globals (%d words) do not fit on stack!\n", (int)glob_sz);
+		return NULL;
+	}
+
 	lssl_vm_t *ret=calloc(sizeof(lssl_vm_t), 1);
 	if (!ret) goto error;
 
-	ret->progmem=&program[8];
-	ret->proglen=prog_len;
+	ret->glob_size=glob_sz;
+	ret->last_func=-1;
+	if (!decode_program(ret, &program[8], prog_len-8)) goto error;
+	//Programs can't be trusted, so check everything we can up front; this way, we
+	//don't need to check e.g. every push for a stack overflow when running.
+	if (!verify_funcs(ret)) goto error;
 	ret->stack_size=stack_size_words;
 	ret->stack=calloc(stack_size_words, sizeof(uint32_t));
+	if (!ret->stack) goto error;
+	ret->rstack_size=stack_size_words/2;
+	ret->rstack=calloc(ret->rstack_size, sizeof(uint32_t));
+	if (!ret->rstack) goto error;
 	ret->sp=glob_sz;
 	ret->bp=0;
 	return ret;
 error:
-	if (ret) free(ret->stack);
-	free(ret);
+	lssl_vm_free(ret);
 	return NULL;
 }
 
@@ -66,6 +378,7 @@ N: global var N
 N+1..M: global array/struct X
 M+1..O: global array/struct Y
 
+fn1 AP
 fn1 BP
 fn1 return PC
 <--- BP
@@ -83,290 +396,746 @@ allocated array/struct D in restricted scope
 //}
 
 
-static void push(lssl_vm_t *vm, int32_t val) {
-	if (vm->sp>=vm->stack_size) {
-		printf("Stack overflow at PC=0x%X (sp 0x%X stack size 0x%X)\n", vm->pc, vm->sp, vm->stack_size);
-		vm->error=LSSL_VM_ERR_STACK_OVF;
-		return;
+//Execution counters, see lssl_vm_stats(). These compile to nothing in normal builds.
+#ifdef LSSL_VM_STATS
+#define COUNT_INSN() vm->stats[ip-vm->insns].count++
+#define COUNT_CALL(insn) vm->stats[insn].calls++
+#else
+#define COUNT_INSN()
+#define COUNT_CALL(insn)
+#endif
+
+//For the sampling profiler (vm_sample.c), keep vm->pc up to date.
+#ifdef LSSL_VM_PROFILE
+__thread lssl_vm_t *lssl_vm_running;
+#define PROF_INSN() *(volatile int *)&vm->pc=ip-vm->insns
+#else
+#define PROF_INSN()
+#endif
+
+//Start of an opcode handler.
+#if LSSL_VM_COMPUTED_GOTO
+#define INSN(ins) op_##ins: COUNT_INSN(); PROF_INSN(); arg=ip->arg; new_ip=ip+1;
+#define DISPATCH() goto *ip->handler
+#else
+#define INSN(ins) case INSN_##ins: COUNT_INSN(); PROF_INSN(); arg=ip->arg; new_ip=ip+1;
+#define DISPATCH() goto dispatch
+#endif
+
+//End of an opcode handler: go to the next instruction. Handlers that can fail
+//jump to done themselves.
+#define NEXT() do { \
+			ip=new_ip; \
+			DISPATCH(); \
+		} while(0)
+
+//Bail out with an error if addr is not a valid address to read/write.
+#define CHECK_ADDR(addr) do { \
+			if (!addr_ok(vm, addr)) { \
+				bad_addr=addr; \
+				goto invalid_addr; \
+			} \
+		} while(0)
+
+//Same, for addresses that are written to.
+#define CHECK_WR_ADDR(addr) do { \
+			CHECK_ADDR(addr); \
+			if (pos_from_addr(addr)<vm->ro_top) { \
+				bad_addr=addr; \
+				goto ro_write; \
+			} \
+		} while(0)
+
+//Taken jumps, calls and returns end a run of consecutive insns: count those, and stop
+//if we're at insn_stop. Any endless loop has to come through here, and this way we
+//don't need to count every single insn.
+#define BRANCH() do { \
+			insn_left-=ip-seg+1; \
+			seg=new_ip; \
+			if (insn_left<=0) goto out_of_insns; \
+		} while(0)
+
+//Bytecode address of an insn, for error messages.
+#define BYTE_PC(ip) (vm->insn_pc[(ip)-vm->insns])
+
+//Stack frame word k, as used by the register insns
+#define SLOT(k) vm->stack[vm->bp+(k)]
+
+//Register insn ins and its immediate form insI, which calculate v from int32_t a and b.
+#define REG_INSN(ins, v) \
+	INSN(ins) { \
+		int32_t a=SLOT(ip->s); \
+		int32_t b=SLOT(arg); \
+		SLOT(ip->d)=(v); \
+		NEXT(); \
+	} \
+	INSN(ins##I) { \
+		int32_t a=SLOT(ip->s); \
+		int32_t b=arg; \
+		SLOT(ip->d)=(v); \
+		NEXT(); \
+	}
+
+//Same for division; b is checked for zero first.
+#define REG_DIV_INSN(ins, v) \
+	INSN(ins) { \
+		int32_t a=SLOT(ip->s); \
+		int32_t b=SLOT(arg); \
+		if (b==0) goto divzero; \
+		SLOT(ip->d)=(v); \
+		NEXT(); \
+	} \
+	INSN(ins##I) { \
+		int32_t a=SLOT(ip->s); \
+		int32_t b=arg; \
+		if (b==0) goto divzero; \
+		SLOT(ip->d)=(v); \
+		NEXT(); \
+	}
+
+//Runs until error, or until we return to address -1. If called with a NULL vm, this
+//instead fills vm_handlers.
+static int32_t vm_exec(lssl_vm_t *vm, vm_error_t *error) {
+	if (!vm) {
+#if LSSL_VM_COMPUTED_GOTO
+#define LSSL_INS_ENTRY(ins, argtype, pops, pushes, desc) vm_handlers[INSN_##ins]=&&op_##ins;
+#define LSSL_RINS_ENTRY(ins, argtype, stack_op, desc) vm_handlers[INSN_##ins]=&&op_##ins;
+		LSSL_INSTRUCTIONS
+		LSSL_REG_INSTRUCTIONS
+#undef LSSL_INS_ENTRY
+#undef LSSL_RINS_ENTRY
+		vm_handlers[HANDLER_BAD_INSN]=&&bad_insn;
+#else
+		for (int i=0; i<=LSSL_INSN_COUNT; i++) vm_handlers[i]=i;
+#endif
+		vm_handlers_filled=1;
+		return 0;
+	}
+	int32_t ret=0;
+	const lssl_vm_insn_t *ip=&vm->insns[vm->pc];
+	const lssl_vm_insn_t *new_ip;
+	const lssl_vm_insn_t *seg=ip; //start of the current run of consecutive insns
+	int64_t insn_left=vm->insn_stop-vm->insns_run;
+	int32_t arg;
+	uint32_t bad_addr;
+	vm->error=0;
+#ifdef LSSL_VM_PROFILE
+	lssl_vm_t *prof_prev=lssl_vm_running;
+	lssl_vm_running=vm;
+#endif
+#if LSSL_VM_COMPUTED_GOTO
+	DISPATCH();
+	{
+#else
+dispatch:
+	switch (ip->handler) {
+#endif
+	INSN(NOP)
+		//Never emitted into the bytecode.
+		goto bad_insn;
+	INSN(PUSH_I)
+		push(vm, arg<<16);
+		NEXT();
+	INSN(PUSH_R)
+		push(vm, arg);
+		NEXT();
+	INSN(MUL) {
+		int32_t a=pop(vm);
+		int32_t b=pop(vm);
+		int64_t v=(int64_t)a*(int64_t)b;
+		push(vm, saturate(v>>16));
+		NEXT();
+	}
+	INSN(DIV) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		if (b==0) {
+			printf("Divide by zero. PC=0x%X\n", BYTE_PC(ip));
+			vm->error=LSSL_VM_ERR_DIVZERO;
+			goto done;
+		}
+		int64_t v=(((int64_t)a)<<16)/b;
+		push(vm, saturate(v));
+		NEXT();
+	}
+	INSN(MOD) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		if (b==0) {
+			printf("Divide by zero. PC=0x%X\n", BYTE_PC(ip));
+			vm->error=LSSL_VM_ERR_DIVZERO;
+			goto done;
+		}
+		int64_t v=(((int64_t)a)<<16)%b;
+		push(vm, saturate(v));
+		NEXT();
+	}
+	INSN(ADD) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, saturate((int64_t)a+b));
+		NEXT();
+	}
+	INSN(SUB) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, saturate((int64_t)a-b));
+		NEXT();
+	}
+	INSN(LAND) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a&&b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(LOR) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a||b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(BAND) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, a&b);
+		NEXT();
+	}
+	INSN(BOR) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, a|b);
+		NEXT();
+	}
+	INSN(BXOR) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, a^b);
+		NEXT();
+	}
+	INSN(BNOT) {
+		int32_t a=pop(vm);
+		push(vm, ~a);
+		NEXT();
+	}
+	INSN(LNOT) {
+		int32_t a=pop(vm);
+		push(vm, (a)?0:(1<<16));
+		NEXT();
+	}
+	INSN(JMP)
+		new_ip=&vm->insns[arg];
+		BRANCH();
+		NEXT();
+	INSN(JNZ)
+		if (pop(vm)!=0) {
+			new_ip=&vm->insns[arg];
+			BRANCH();
+		}
+		NEXT();
+	INSN(JZ)
+		if (pop(vm)==0) {
+			new_ip=&vm->insns[arg];
+			BRANCH();
+		}
+		NEXT();
+	INSN(ENTER)
+		//Locals start out as 0
+		for (int i=0; i<arg; i++) push(vm, 0);
+		NEXT();
+	INSN(RETURN) {
+		int32_t v=pop(vm);
+		//clear local vars, local objs, saved registers and args
+		vm->sp=vm->bp-3-arg;
+		int32_t ret_insn=pop_frame(vm);
+		if (ret_insn==-1) { //fake return address we pushed before
+			//end of called routine
+			ret=v;
+			goto done;
+		}
+		new_ip=&vm->insns[ret_insn];
+		push(vm, v);
+		BRANCH();
+		NEXT();
+	}
+	INSN(CALL) {
+		lssl_vm_func_t *f=&vm->funcs[arg];
+		//The verifier knows how much stack a function needs, but not how deep
+		//we'll recurse, so this is where we check for a stack overflow.
+		if (!room_for_call(vm, f, 0)) {
+			printf("Stack overflow calling function at pc 0x%X from pc 0x%X (sp 0x%X stack size 0x%X)\n",
+					vm->insn_pc[f->entry], BYTE_PC(ip), vm->sp, vm->stack_size);
+			vm->error=LSSL_VM_ERR_STACK_OVF;
+			goto done;
+		}
+		push_frame(vm, new_ip-vm->insns);
+		new_ip=&vm->insns[f->entry];
+		COUNT_CALL(f->entry);
+		BRANCH();
+		NEXT();
+	}
+	INSN(POP)
+		pop(vm);
+		NEXT();
+	INSN(TEQ) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a==b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(TNEQ) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a!=b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(TL) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a<b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(TG) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a>b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(TLEQ) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a<=b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(TGEQ) {
+		int32_t b=pop(vm);
+		int32_t a=pop(vm);
+		push(vm, (a>=b)?(1<<16):0);
+		NEXT();
+	}
+	INSN(SYSCALL) {
+		int args=(arg>>12)&0xf;	//argument count
+		//The arguments are popped, but passed in place.
+		vm->sp-=args;
+		int32_t v=vm->syscall_fns[ip->d](vm, &vm->stack[vm->sp]);
+		push(vm, v);
+		if (vm->error) goto done;
+		NEXT();
+	}
+	INSN(DUP) {
+		int32_t v=pop(vm);
+		push(vm, v);
+		push(vm, v);
+		NEXT();
+	}
+	INSN(LEA)
+		push(vm, make_addr(vm->bp+arg, 1));
+		NEXT();
+	INSN(LEA_G)
+		push(vm, make_addr(arg, 1));
+		NEXT();
+	INSN(LDA)
+		push(vm, vm->stack[vm->bp+arg]);
+		NEXT();
+	INSN(LDA_G)
+		push(vm, vm->stack[arg]);
+		NEXT();
+	INSN(DEREF) {
+		uint32_t addr=pop(vm);
+		//printf("deref addr %x @ pc %x\n", addr, BYTE_PC(ip));
+		CHECK_ADDR(addr);
+		push(vm, vm->stack[pos_from_addr(addr)]);
+		NEXT();
+	}
+	INSN(PRE_ADD) {
+		int32_t addr=pop(vm);
+		CHECK_WR_ADDR(addr);
+		vm->stack[pos_from_addr(addr)]=saturate((int64_t)vm->stack[pos_from_addr(addr)]+arg);
+		push(vm, vm->stack[pos_from_addr(addr)]);
+		NEXT();
 	}
-	vm->stack[vm->sp++]=val;
+	INSN(POST_ADD) {
+		int32_t addr=pop(vm);
+		CHECK_WR_ADDR(addr);
+		push(vm, vm->stack[pos_from_addr(addr)]);
+		vm->stack[pos_from_addr(addr)]=saturate((int64_t)vm->stack[pos_from_addr(addr)]+arg);
+		NEXT();
+	}
+	INSN(ARRAY_IDX) {
+		int idx=(pop(vm)>>16);
+		uint32_t addr=pop(vm);
+		//printf("array_idx: addr 0x%X\n", addr);
+		if (idx*arg>=size_from_addr(addr) || idx<0) {
+			printf("Array out of bounds! Idx is %d, size is %d items of %d. PC=0x%X\n", idx, size_from_addr(addr)/arg, size_from_addr(addr), BYTE_PC(ip));
+			vm->error=LSSL_VM_ERR_ARRAY_OOB;
+			goto done;
+		}
+		addr=make_addr(pos_from_addr(addr)+idx*arg, arg);
+		//printf("array_idx: out addr 0x%X\n", addr);
+		push(vm, addr);
+		NEXT();
+	}
+	INSN(STRUCT_IDX) {
+		uint32_t addr=pop(vm);
+		int offset=(pop(vm)>>16);
+		addr=make_addr(pos_from_addr(addr)+offset, arg);
+		//printf("struct_idx: out addr 0x%X\n", addr);
+		push(vm, addr);
+		NEXT();
+	}
+	INSN(SCOPE_ENTER)
+		push(vm, vm->ap);
+		rpush(vm, vm->ap);
+		vm->ap=vm->sp;
+		NEXT();
+	INSN(SCOPE_LEAVE)
+		vm->sp=vm->ap-1;
+		vm->ap=rpop(vm);
+		NEXT();
+	INSN(ARRAYINIT) {
+		int count=(pop(vm)>>16);
+		uint32_t addr=pop(vm);
+		CHECK_WR_ADDR(addr);
+		if (count<0) {
+			printf("Array with negative size %d! PC=0x%X\n", count, BYTE_PC(ip));
+			vm->error=LSSL_VM_ERR_ARRAY_OOB;
+			goto done;
+		}
+		//Allocations are not accounted for by the verifier, so check if there's
+		//room for this plus anything a function may push afterwards.
+		if (vm->sp+(int64_t)count*arg+vm->max_depth>vm->stack_size) goto alloc_ovf;
+		//printf("array_init %d to 0x%x\n",pos_from_addr(addr),make_addr(vm->ap, arg*count));
+		vm->stack[pos_from_addr(addr)]=make_addr(vm->sp, arg*count);
+		if (pos_from_addr(addr)<vm->glob_size) vm->glob_top=vm->sp+count*arg;
+		for (int i=0; i<count*arg; i++) push(vm, 0);
+		NEXT();
+	}
+	INSN(STRUCTINIT) {
+		uint32_t addr=pop(vm);
+		CHECK_WR_ADDR(addr);
+		if (vm->sp+arg+vm->max_depth>vm->stack_size) goto alloc_ovf;
+		vm->stack[pos_from_addr(addr)]=make_addr(vm->sp, arg);
+		if (pos_from_addr(addr)<vm->glob_size) vm->glob_top=vm->sp+arg;
+		for (int i=0; i<arg; i++) push(vm, 0);
+		NEXT();
+	}
+	INSN(WR_VAR) {
+		uint32_t val=pop(vm);
+		uint32_t addr=pop(vm);
+		//printf("wr_var addr %x @ pc %x\n", addr, BYTE_PC(ip));
+		CHECK_WR_ADDR(addr);
+		vm->stack[pos_from_addr(addr)]=val;
+		NEXT();
+	}
+	INSN(STA)
+		SLOT(arg)=pop(vm);
+		NEXT();
+	REG_INSN(RADD, saturate((int64_t)a+b))
+	REG_INSN(RSUB, saturate((int64_t)a-b))
+	REG_INSN(RMUL, saturate(((int64_t)a*(int64_t)b)>>16))
+	REG_DIV_INSN(RDIV, saturate((((int64_t)a)<<16)/b))
+	REG_DIV_INSN(RMOD, saturate((((int64_t)a)<<16)%b))
+	REG_INSN(RTEQ, (a==b)?(1<<16):0)
+	REG_INSN(RTNEQ, (a!=b)?(1<<16):0)
+	REG_INSN(RTL, (a<b)?(1<<16):0)
+	REG_INSN(RTG, (a>b)?(1<<16):0)
+	REG_INSN(RTLEQ, (a<=b)?(1<<16):0)
+	REG_INSN(RTGEQ, (a>=b)?(1<<16):0)
+	INSN(RSET)
+		SLOT(ip->d)=arg;
+		NEXT();
+	INSN(RJZ)
+		if (SLOT(ip->s)==0) {
+			new_ip=&vm->insns[arg];
+			BRANCH();
+		}
+		NEXT();
+	INSN(RJNZ)
+		if (SLOT(ip->s)!=0) {
+			new_ip=&vm->insns[arg];
+			BRANCH();
+		}
+		NEXT();
+#if !LSSL_VM_COMPUTED_GOTO
+	default:
+		goto bad_insn;
+#endif
+	}
+
+bad_insn:
+	//Should not happen as the verifier does not allow these.
+	printf("Unknown op %d @ pc 0x%x\n", vm->insn_op[ip-vm->insns], BYTE_PC(ip));
+	vm->error=LSSL_VM_ERR_UNK_OP;
+	goto done;
+invalid_addr:
+	printf("Invalid address 0x%X at pc 0x%X\n", bad_addr, BYTE_PC(ip));
+	vm->error=LSSL_VM_ERR_ARRAY_OOB;
+	goto done;
+ro_write:
+	printf("Write to read-only address 0x%X at pc 0x%X\n", bad_addr, BYTE_PC(ip));
+	vm->error=LSSL_VM_ERR_RO_WRITE;
+	goto done;
+divzero:
+	printf("Divide by zero. PC=0x%X\n", BYTE_PC(ip));
+	vm->error=LSSL_VM_ERR_DIVZERO;
+	goto done;
+alloc_ovf:
+	printf("Stack overflow allocating object at pc 0x%X (sp 0x%X stack size 0x%X)\n", BYTE_PC(ip), vm->sp, vm->stack_size);
+	vm->error=LSSL_VM_ERR_STACK_OVF;
+	goto done;
+out_of_insns:
+	vm->insns_run=vm->insn_stop-insn_left;
+	if (vm->insn_limit && vm->insns_run>=vm->insn_limit) {
+		printf("Instruction limit of %"PRId64" reached at pc 0x%X\n", vm->insn_limit, BYTE_PC(ip));
+		vm->error=LSSL_VM_ERR_INSN_LIMIT;
+	} else {
+		//Out of budget; the branch has been taken, so lssl_vm_run() resumes at its target.
+		ip=new_ip;
+		vm->error=LSSL_VM_YIELDED;
+	}
+	goto stopped;
+done:
+	vm->insns_run=vm->insn_stop-(insn_left-(ip-seg+1));
+stopped:
+	vm->pc=ip-vm->insns;
+	error->type=vm->error;
+	error->pc=BYTE_PC(ip);
+#ifdef LSSL_VM_PROFILE
+	lssl_vm_running=prof_prev;
+#endif
+	return ret;
+}
+
+#undef INSN
+#undef NEXT
+#undef DISPATCH
+#undef CHECK_ADDR
+#undef CHECK_WR_ADDR
+#undef BYTE_PC
+#undef BRANCH
+#undef COUNT_INSN
+#undef PROF_INSN
+#undef COUNT_CALL
+#undef SLOT
+#undef REG_INSN
+#undef REG_DIV_INSN
+
+//ARRAYINIT and STRUCTINIT are rare and not speed critical, so native code (vm_jit.c,
+//vm_aot.c) calls these instead of having its own version.
+int lssl_vm_arrayinit(lssl_vm_t *vm, int arg) {
+	int count=(vm->stack[vm->sp-1]>>16);
+	uint32_t addr=vm->stack[vm->sp-2];
+	int sp=vm->sp-2;
+	if (!addr_ok(vm, addr) || pos_from_addr(addr)<vm->ro_top || count<0) return 0;
+	if (sp+(int64_t)count*arg+vm->max_depth>vm->stack_size) return 0;
+	vm->stack[pos_from_addr(addr)]=make_addr(sp, arg*count);
+	if (pos_from_addr(addr)<vm->glob_size) vm->glob_top=sp+count*arg;
+	for (int i=0; i<count*arg; i++) vm->stack[sp++]=0;
+	vm->sp=sp;
+	return 1;
+}
+
+int lssl_vm_structinit(lssl_vm_t *vm, int arg) {
+	uint32_t addr=vm->stack[vm->sp-1];
+	int sp=vm->sp-1;
+	if (!addr_ok(vm, addr) || pos_from_addr(addr)<vm->ro_top) return 0;
+	if (sp+arg+vm->max_depth>vm->stack_size) return 0;
+	vm->stack[pos_from_addr(addr)]=make_addr(sp, arg);
+	if (pos_from_addr(addr)<vm->glob_size) vm->glob_top=sp+arg;
+	for (int i=0; i<arg; i++) vm->stack[sp++]=0;
+	vm->sp=sp;
+	return 1;
+}
+
+//Finds the function a function handle (= its bytecode address) refers to. Functions that
+//are only used as callbacks are not known before they're called, so they get verified here.
+static lssl_vm_func_t *func_for_handle(lssl_vm_t *vm, uint32_t fn_handle) {
+	if (vm->last_func>=0 && vm->insn_pc[vm->funcs[vm->last_func].entry]==fn_handle) {
+		return &vm->funcs[vm->last_func];
+	}
+	int entry=insn_for_pc(vm, fn_handle);
+	if (entry==vm->insn_count) {
+		printf("Aiee! No function at pc 0x%X!\n", (int)fn_handle);
+		return NULL;
+	}
+	int i=func_for_insn(vm, entry);
+	if (i<0) return NULL;
+	if (vm->funcs[i].state==FUNC_UNVERIFIED) verify_funcs(vm);
+	if (vm->funcs[i].state!=FUNC_OK) return NULL;
+	vm->last_func=i;
+	return &vm->funcs[i];
 }
 
-static int32_t pop(lssl_vm_t *vm) {
-	if (vm->sp<0) {
-		printf("Stack underflow at PC=0x%X\n", vm->pc);
-		vm->error=LSSL_VM_ERR_STACK_UDF;
+int lssl_vm_call_prepare(lssl_vm_t *vm, uint32_t fn_handle, int argc, lssl_vm_call_t *call, vm_error_t *error) {
+	error->type=LSSL_VM_ERR_NONE;
+	error->pc=fn_handle;
+	if (vm->yielded) {
+		printf("Can't call function at pc 0x%X: lssl_vm_run() has a call halfway\n", (int)fn_handle);
+		error->type=LSSL_VM_ERR_INTERNAL;
 		return 0;
 	}
-	return vm->stack[--vm->sp];
+	lssl_vm_func_t *f=func_for_handle(vm, fn_handle);
+	if (!f) {
+		error->type=LSSL_VM_ERR_INTERNAL;
+		return 0;
+	}
+	if (f->nargs>=0 && f->nargs!=argc) {
+		printf("Function at pc 0x%X takes %d arguments, not %d\n", (int)fn_handle, f->nargs, argc);
+		error->type=LSSL_VM_ERR_INTERNAL;
+		return 0;
+	}
+	if (!room_for_call(vm, f, argc)) {
+		printf("Stack overflow calling function at pc 0x%X\n", (int)fn_handle);
+		error->type=LSSL_VM_ERR_STACK_OVF;
+		return 0;
+	}
+	call->func=f-vm->funcs;
+	call->argc=argc;
+	call->sp=vm->sp;
+	return 1;
+}
+
+//Runs the function the VM is about to start natively, if we can. Returns 0 if the
+//interpreter needs to run (the rest of) it.
+static int native_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+#if defined(LSSL_VM_STATS) || defined(LSSL_VM_PROFILE)
+	return 0; //native code isn't instrumented
+#endif
+	if (vm->jit) return lssl_vm_jit_exec(vm, ret, error);
+	if (vm->native) return lssl_vm_aot_exec(vm, ret, error);
+	if (vm->wasm) return lssl_vm_wasm_exec(vm, ret, error);
+	return 0;
 }
 
-inline static uint32_t make_addr(int pos, int size) {
-	return (pos<<16)|size;
+//Only AOT code counts insns; the others leave calls with a limit or budget to the interpreter.
+static int native_counts(const lssl_vm_t *vm) {
+	return vm->native && !vm->jit;
 }
 
-inline static int pos_from_addr(uint32_t addr) {
-	return (addr>>16);
+//Sets up the stack frame for a prepared call, saving the registers call_unwind() needs.
+static void call_enter(lssl_vm_t *vm, const lssl_vm_call_t *call, const int32_t *argv, lssl_vm_regs_t *saved) {
+	saved->bp=vm->bp;
+	saved->ap=vm->ap;
+	saved->rsp=vm->rsp;
+	saved->rbp=vm->rbp;
+	vm->sp=call->sp;
+	//push the arguments
+	for (int i=0; i<call->argc; i++) push(vm, argv[i]);
+	//fake call
+	push_frame(vm, -1); //fake return address
+	vm->pc=vm->funcs[call->func].entry;
+	vm->insns_run=0;
+#ifdef LSSL_VM_STATS
+	vm->stats[vm->pc].calls++;
+#endif
 }
 
-inline static int size_from_addr(uint32_t addr) {
-	return (addr&0xffff);
+//Bailed out halfway; clean up whatever the function left behind.
+static void call_unwind(lssl_vm_t *vm, const lssl_vm_call_t *call, const lssl_vm_regs_t *saved) {
+	vm->sp=call->sp;
+	vm->bp=saved->bp;
+	vm->ap=saved->ap;
+	vm->rsp=saved->rsp;
+	vm->rbp=saved->rbp;
 }
 
-inline static int32_t saturate(int64_t v) {
-	if (v<INT32_MIN) return INT32_MIN;
-	if (v>INT32_MAX) return INT32_MAX;
+int32_t lssl_vm_call(lssl_vm_t *vm, const lssl_vm_call_t *call, const int32_t *argv, vm_error_t *error) {
+	lssl_vm_regs_t saved;
+	call_enter(vm, call, argv, &saved);
+	int32_t v;
+	vm->insn_stop=vm->insn_limit?vm->insn_limit:INT64_MAX;
+	if ((vm->insn_limit && !native_counts(vm)) || !native_exec(vm, &v, error)) v=vm_exec(vm, error);
+	vm->insn_total+=vm->insns_run;
+	if (error->type!=LSSL_VM_ERR_NONE) call_unwind(vm, call, &saved);
 	return v;
 }
 
-//Runs until error, or until we return to address -1.
-int32_t lssl_vm_run(lssl_vm_t *vm, vm_error_t *error) {
-	int32_t ret=0;
-	vm->error=0;
-	while(vm->error==LSSL_VM_ERR_NONE) {
-		int new_pc=vm->pc;
-		int op=vm->progmem[new_pc++];
-		//todo: bounds check
-		int bytes=lssl_vm_argtypes[lssl_vm_ops[op].argtype].byte_size;
-		int arg=0;
-		if (bytes==2) {
-			arg=get_i8(&vm->progmem[new_pc]);
-			new_pc+=1;
-		} else if (bytes==3) {
-			arg=get_i16(&vm->progmem[new_pc]);
-			new_pc+=2;
-		} else if (bytes==5) {
-			arg=get_i32(&vm->progmem[new_pc]);
-			new_pc+=4;
-		}
-		if (op==INSN_PUSH_I) {
-			push(vm, arg<<16);
-		} else if (op==INSN_PUSH_R) {
-			push(vm, arg);
-		} else if (op==INSN_MUL) {
-			int32_t a=pop(vm);
-			int32_t b=pop(vm);
-			int64_t v=(int64_t)a*(int64_t)b;
-			push(vm, saturate(v>>16));
-		} else if (op==INSN_DIV) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			if (b==0) {
-				printf("Divide by zero. PC=0x%X\n", vm->pc);
-				vm->error=LSSL_VM_ERR_DIVZERO;
-			} else {
-				int64_t v=(((int64_t)a)<<16)/b;
-				push(vm, saturate(v));
-			}
-		} else if (op==INSN_MOD) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			if (b==0) {
-				printf("Divide by zero. PC=0x%X\n", vm->pc);
-				vm->error=LSSL_VM_ERR_DIVZERO;
-			} else {
-				int64_t v=(((int64_t)a)<<16)%b;
-				push(vm, saturate(v));
-			}
-		} else if (op==INSN_ADD) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, saturate(a+b));
-		} else if (op==INSN_SUB) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, saturate(a-b));
-		} else if (op==INSN_LAND) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a&&b)?(1<<16):0);
-		} else if (op==INSN_LOR) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a||b)?(1<<16):0);
-		} else if (op==INSN_BAND) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, a&b);
-		} else if (op==INSN_BOR) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, a|b);
-		} else if (op==INSN_BXOR) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, a^b);
-		} else if (op==INSN_BNOT) {
-			int32_t a=pop(vm);
-			push(vm, ~a);
-		} else if (op==INSN_LNOT) {
-			int32_t a=pop(vm);
-			push(vm, (a)?0:(1<<16));
-		} else if (op==INSN_JMP) {
-			new_pc=arg;
-		} else if (op==INSN_JNZ) {
-			if (pop(vm)!=0) new_pc=arg;
-		} else if (op==INSN_JZ) {
-			if (pop(vm)==0) new_pc=arg;
-		} else if (op==INSN_ENTER) {
-			vm->sp+=arg;
-		} else if (op==INSN_RETURN) {
-			int32_t v=pop(vm);
-			vm->sp=vm->bp; //clear local vars, local objs
-			new_pc=pop(vm);
-			vm->bp=pop(vm);
-			vm->ap=pop(vm);
-			vm->sp=vm->sp-arg;
-			if (new_pc==-1) { //fake return address we pushed before
-				//end of called routine
-				ret=v;
-				break;
-			} else {
-				push(vm, v);
-			}
-		} else if (op==INSN_CALL) {
-			push(vm, vm->ap);
-			push(vm, vm->bp);
-			push(vm, new_pc);
-			vm->bp=vm->sp;
-			vm->ap=vm->sp;
-			new_pc=arg;
-		} else if (op==INSN_POP) {
-			pop(vm);
-		} else if (op==INSN_TEQ) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a==b)?(1<<16):0);
-		} else if (op==INSN_TNEQ) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a!=b)?(1<<16):0);
-		} else if (op==INSN_TL) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a<b)?(1<<16):0);
-		} else if (op==INSN_TG) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a>b)?(1<<16):0);
-		} else if (op==INSN_TLEQ) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a<=b)?(1<<16):0);
-		} else if (op==INSN_TGEQ) {
-			int32_t b=pop(vm);
-			int32_t a=pop(vm);
-			push(vm, (a>=b)?(1<<16):0);
-		} else if (op==INSN_POST_ADD) {
-			int32_t addr=pop(vm);
-			assert(size_from_addr(addr)==1 && "Huh? POST_ADD to addr with size != 1");
-			push(vm, vm->stack[pos_from_addr(addr)]);
-			vm->stack[pos_from_addr(addr)]+=arg;
-		} else if (op==INSN_PRE_ADD) {
-			int32_t addr=pop(vm);
-			assert(size_from_addr(addr)==1 && "Huh? POST_ADD to addr with size != 1");
-			vm->stack[pos_from_addr(addr)]+=arg;
-			push(vm, vm->stack[pos_from_addr(addr)]);
-		} else if (op==INSN_SYSCALL) {
-			int args=(arg>>12);	//argument count
-			int no=(arg&0xfff);	//syscall number
-			int32_t argv[16];
-			for (int i=0; i<args; i++) argv[args-i-1]=pop(vm);
-			push(vm, vm_syscall(vm, no, argv));
-		} else if (op==INSN_DUP) {
-			int32_t v=pop(vm);
-			push(vm, v);
-			push(vm, v);
-		} else if (op==INSN_SCOPE_ENTER) {
-			push(vm, vm->ap);
-			vm->ap=vm->sp;
-		} else if (op==INSN_SCOPE_LEAVE) {
-			vm->sp=vm->ap;
-			vm->ap=pop(vm);
-		} else if (op==INSN_LEA) {
-			int addr=vm->bp+arg;
-			push(vm, make_addr(addr, 1));
-		} else if (op==INSN_LEA_G) {
-			int addr=arg;
-			push(vm, make_addr(addr, 1));
-		} else if (op==INSN_LDA) {
-			int addr=vm->bp+arg;
-			push(vm, vm->stack[addr]);
-		} else if (op==INSN_LDA_G) {
-			int addr=arg;
-			push(vm, vm->stack[addr]);
-		} else if (op==INSN_ARRAYINIT) {
-			int count=(pop(vm)>>16);
-			uint32_t addr=pop(vm);
-			//printf("array_init %d to 0x%x\n",pos_from_addr(addr),make_addr(vm->ap, arg*count));
-			vm->stack[pos_from_addr(addr)]=make_addr(vm->sp, arg*count);
-			vm->sp+=count*arg;
-		} else if (op==INSN_STRUCTINIT) {
-			uint32_t addr=pop(vm);
-			vm->stack[pos_from_addr(addr)]=make_addr(vm->sp, arg);
-			vm->sp+=arg;
-		} else if (op==INSN_ARRAY_IDX) {
-			int idx=(pop(vm)>>16);
-			uint32_t addr=pop(vm);
-			//printf("array_idx: addr 0x%X\n", addr);
-			if (idx*arg>=size_from_addr(addr) || idx<0) {
-				printf("Array out of bounds! Idx is %d, size is %d items of %d. PC=0x%X\n", idx, size_from_addr(addr)/arg, size_from_addr(addr), vm->pc);
-				vm->error=LSSL_VM_ERR_ARRAY_OOB;
-			}
-			addr=make_addr(pos_from_addr(addr)+idx*arg, arg);
-			//printf("array_idx: out addr 0x%X\n", addr);
-			push(vm, addr);
-		} else if (op==INSN_STRUCT_IDX) {
-			uint32_t addr=pop(vm);
-			int offset=(pop(vm)>>16);
-			addr=make_addr(pos_from_addr(addr)+offset, arg);
-			//printf("struct_idx: out addr 0x%X\n", addr);
-			push(vm, addr);
-		} else if (op==INSN_WR_VAR) {
-			uint32_t val=pop(vm);
-			uint32_t addr=pop(vm);
-			//printf("wr_var addr %x @ pc %x\n", addr, vm->pc);
-			assert(size_from_addr(addr)==1 && "Huh? WR_VAR to addr with size != 1");
-			vm->stack[pos_from_addr(addr)]=val;
-		} else if (op==INSN_DEREF) {
-			uint32_t addr=pop(vm);
-			//printf("deref addr %x @ pc %x\n", addr, vm->pc);
-			assert(size_from_addr(addr)==1 && "Huh? DEREF to addr with size != 1");
-			push(vm, vm->stack[pos_from_addr(addr)]);
-		} else {
-			printf("Unknown op %s (%d) @ pc 0x%x\n", lssl_vm_ops[op].op, op, vm->pc);
-			vm->error=LSSL_VM_ERR_UNK_OP;
-		}
-		if (new_pc<0 || new_pc>=vm->proglen) {
-			printf("Aiee! Op at pc=0x%X wants to go to 0x%X!\n", vm->pc, new_pc);
-			vm->error=LSSL_VM_ERR_INTERNAL;
-		}
-		if (!vm->error) vm->pc=new_pc;
+static int check_sp(const lssl_vm_t *vm, const lssl_vm_call_t *call, vm_error_t *error) {
+	if (error->type==LSSL_VM_ERR_NONE && call->sp!=vm->sp) {
+		printf("Aiee! SP before and after calling fn doesn't match. Before 0x%x after 0x%x\n", call->sp, vm->sp);
+		error->type=LSSL_VM_ERR_INTERNAL;
+		return 0;
 	}
-	error->type=vm->error;
-	error->pc=vm->pc;
-	return ret;
+	return 1;
 }
 
 int32_t lssl_vm_run_function(lssl_vm_t *vm, uint32_t fn_handle, int argc, int32_t *argv, vm_error_t *error) {
-	int old_sp=vm->sp;
-	//push the arguments
-	for (int i=0; i<argc; i++) push(vm, argv[i]);
-	//fake call
-	push(vm, vm->ap);
-	push(vm, vm->bp);
-	push(vm, -1); //fake return address
-	vm->pc=fn_handle;
-	vm->bp=vm->sp;
-	vm->ap=vm->sp;
-	int32_t v=lssl_vm_run(vm, error);
-	if (error->type==LSSL_VM_ERR_NONE && old_sp!=vm->sp) {
-		printf("Aiee! SP before and after calling fn doesn't match. Before 0x%x after 0x%x\n", old_sp, vm->sp);
-		error->type=LSSL_VM_ERR_INTERNAL;
+	lssl_vm_call_t call;
+	if (!lssl_vm_call_prepare(vm, fn_handle, argc, &call, error)) return 0;
+	int32_t v=lssl_vm_call(vm, &call, argv, error);
+	check_sp(vm, &call, error);
+	return v;
+}
+
+int32_t lssl_vm_run(lssl_vm_t *vm, uint32_t fn_handle, int argc, int32_t *argv, int budget, vm_error_t *error) {
+	int resume=vm->yielded;
+	if (!resume) {
+		if (!lssl_vm_call_prepare(vm, fn_handle, argc, &vm->yield_call, error)) return 0;
+		call_enter(vm, &vm->yield_call, argv, &vm->yield_regs);
+	}
+	vm->yielded=0;
+	int64_t start=vm->insns_run;
+	int64_t stop=vm->insn_limit?vm->insn_limit:INT64_MAX;
+	if (budget>0 && vm->insns_run+budget<stop) stop=vm->insns_run+budget;
+	vm->insn_stop=stop;
+	int32_t v;
+	//Native code can't pick up halfway a function, so resuming is left to the interpreter.
+	if (resume || (stop!=INT64_MAX && !native_counts(vm)) || !native_exec(vm, &v, error)) v=vm_exec(vm, error);
+	vm->insn_total+=vm->insns_run-start;
+	if (error->type==LSSL_VM_YIELDED) {
+		vm->yielded=1;
+		return 0;
 	}
+	if (error->type!=LSSL_VM_ERR_NONE) call_unwind(vm, &vm->yield_call, &vm->yield_regs);
+	check_sp(vm, &vm->yield_call, error);
 	return v;
 }
 
+void lssl_vm_abort(lssl_vm_t *vm) {
+	if (!vm->yielded) return;
+	call_unwind(vm, &vm->yield_call, &vm->yield_regs);
+	vm->yielded=0;
+}
+
+void lssl_vm_set_insn_limit(lssl_vm_t *vm, int64_t limit) {
+	vm->insn_limit=(limit>0)?limit:0;
+}
+
+int64_t lssl_vm_insn_count(lssl_vm_t *vm) {
+	return vm->insn_total;
+}
+
+//Unlikely to be a value a program leaves behind
+#define STACK_PAINT 0x5A5AA5A5
+
+void lssl_vm_paint_stack(lssl_vm_t *vm) {
+	for (int i=vm->sp; i<vm->stack_size; i++) vm->stack[i]=STACK_PAINT;
+}
+
+int lssl_vm_stack_peak(lssl_vm_t *vm) {
+	int top=vm->stack_size;
+	while (top>vm->sp && vm->stack[top-1]==STACK_PAINT) top--;
+	return top;
+}
+
+int lssl_vm_stats(lssl_vm_t *vm, const lssl_vm_insn_stat_t **stats) {
+#ifdef LSSL_VM_STATS
+	*stats=vm->stats;
+	return vm->insn_count;
+#else
+	*stats=NULL;
+	return 0;
+#endif
+}
+
+void lssl_vm_stats_reset(lssl_vm_t *vm) {
+#ifdef LSSL_VM_STATS
+	for (int i=0; i<vm->insn_count; i++) {
+		vm->stats[i].count=0;
+		vm->stats[i].calls=0;
+	}
+#endif
+}
+
 void lssl_vm_dump_stack(lssl_vm_t *vm) {
 	printf("SP %x BP %x AP %x\n", vm->sp, vm->bp, vm->ap);
 	printf("Addr\tValue\n");
@@ -380,7 +1149,12 @@ void lssl_vm_dump_stack(lssl_vm_t *vm) {
 
 
 int32_t lssl_vm_run_main(lssl_vm_t *vm, vm_error_t *error) {
-	return lssl_vm_run_function(vm, 0, 0, NULL, error);
+	vm->glob_top=vm->sp;
+	int32_t ret=lssl_vm_run_function(vm, 0, 0, NULL, error);
+	//Global arrays and structs are allocated by the top-level code, in the stack frame
+	//that main() returns from. Keep them around for the callbacks.
+	if (error->type==LSSL_VM_ERR_NONE && vm->glob_top>vm->sp) vm->sp=vm->glob_top;
+	return ret;
 }
 
 int32_t *lssl_vm_alloc_data(lssl_vm_t *vm, int item_ct) {
@@ -394,10 +1168,10 @@ int32_t *lssl_vm_alloc_data(lssl_vm_t *vm, int item_ct) {
 	return ret;
 }
 
-int32_t lssl_vm_data_addr(lssl_vm_t *vm, int32_t *ptr) {
+int32_t lssl_vm_data_addr(lssl_vm_t *vm, int32_t *ptr, int item_ct) {
 	int pos=ptr-vm->stack;
 	assert(pos>=0);
-	return pos;
+	return make_addr(pos, item_ct);
 }
 
 
@@ -407,7 +1181,88 @@ void lssl_vm_free_data(lssl_vm_t *vm, int32_t *data) {
 	if (vm->sp > pos) vm->sp=pos;
 }
 
+int32_t *lssl_vm_data_ptr(lssl_vm_t *vm, int32_t addr, int item_ct, int write) {
+	int pos=pos_from_addr(addr);
+	if (size_from_addr(addr)<item_ct || pos+item_ct>vm->stack_size) {
+		printf("Invalid address 0x%X passed to syscall\n", (unsigned)addr);
+		vm->error=LSSL_VM_ERR_ARRAY_OOB;
+		return NULL;
+	}
+	if (write && pos<vm->ro_top) {
+		printf("Write to read-only address 0x%X by syscall\n", (unsigned)addr);
+		vm->error=LSSL_VM_ERR_RO_WRITE;
+		return NULL;
+	}
+	return &vm->stack[pos];
+}
+
+int lssl_vm_shared_write(lssl_vm_t *vm) {
+	if (!vm->parent) return 1;
+	printf("Syscall changing shared state called from a clone\n");
+	vm->error=LSSL_VM_ERR_RO_WRITE;
+	return 0;
+}
+
+lssl_vm_t *lssl_vm_clone(lssl_vm_t *vm) {
+	lssl_vm_t *ret=calloc(sizeof(lssl_vm_t), 1);
+	if (!ret) return NULL;
+	*ret=*vm;
+	ret->parent=vm;
+	ret->lanes=NULL;
+	ret->yielded=0;
+	//Callbacks get verified when first called, so every VM needs its own function table.
+	ret->funcs=NULL;
+	ret->func_count=0;
+	ret->stack=calloc(vm->stack_size, sizeof(uint32_t));
+	ret->rstack=calloc(vm->rstack_size, sizeof(uint32_t));
+	if (!ret->stack || !ret->rstack || !lssl_vm_sync(ret, vm)) {
+		lssl_vm_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+int lssl_vm_sync(lssl_vm_t *clone, const lssl_vm_t *vm) {
+	//Functions get added to the table when they're first used as a callback
+	if (clone->func_count!=vm->func_count) {
+		lssl_vm_func_t *funcs=realloc(clone->funcs, vm->func_count*sizeof(lssl_vm_func_t));
+		if (!funcs) return 0;
+		clone->funcs=funcs;
+		clone->func_count=vm->func_count;
+	}
+	memcpy(clone->funcs, vm->funcs, vm->func_count*sizeof(lssl_vm_func_t));
+	memcpy(clone->stack, vm->stack, vm->sp*sizeof(int32_t));
+	memcpy(clone->rstack, vm->rstack, vm->rsp*sizeof(int32_t));
+	clone->last_func=vm->last_func;
+	clone->glob_top=vm->glob_top;
+	clone->max_depth=vm->max_depth;
+	clone->rsp=vm->rsp;
+	clone->rbp=vm->rbp;
+	clone->bp=vm->bp;
+	clone->sp=vm->sp;
+	clone->ap=vm->ap;
+	clone->error=LSSL_VM_ERR_NONE;
+	clone->ro_top=vm->sp;
+	return 1;
+}
+
 void lssl_vm_free(lssl_vm_t *vm) {
-	if (vm) free(vm->stack);
+	if (vm) {
+		free(vm->stack);
+		free(vm->rstack);
+		if (!vm->parent) {
+			free(vm->insns);
+			free(vm->insn_pc);
+			free(vm->insn_op);
+			free(vm->syscall_fns);
+#ifdef LSSL_VM_STATS
+			free(vm->stats);
+#endif
+			lssl_vm_jit_free(vm->jit);
+			free(vm->native);
+		}
+		free(vm->funcs);
+		lssl_vm_lanes_free(vm);
+	}
 	free(vm);
 }
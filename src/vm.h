@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <stdio.h>
 
 typedef enum {
 	LSSL_VM_ERR_NONE=0,
@@ -8,7 +9,11 @@ typedef enum {
 	LSSL_VM_ERR_UNK_OP,
 	LSSL_VM_ERR_ARRAY_OOB,
 	LSSL_VM_ERR_DIVZERO,
-	LSSL_VM_ERR_INTERNAL
+	LSSL_VM_ERR_INTERNAL,
+	LSSL_VM_ERR_RO_WRITE,
+	LSSL_VM_ERR_INSN_LIMIT,
+	//Not an error: lssl_vm_run() ran out of budget and will continue on the next call.
+	LSSL_VM_YIELDED
 } vm_error_en;
 
 typedef struct {
@@ -19,7 +24,8 @@ typedef struct {
 static inline const char *vm_err_to_str(vm_error_en error) {
 	const char *erstr[]={"none", "stack overflow", "stack underflow", 
 			"unknown opcode", "array out of bounds", "divide by zero", 
-			"internal error"};
+			"internal error", "write to read-only memory", "instruction limit reached",
+			"yielded"};
 	if (error<0 || error>=(sizeof(erstr)/sizeof(erstr[0]))) return "unknown error?";
 	return erstr[error];
 }
@@ -32,6 +38,121 @@ lssl_vm_t *lssl_vm_init(uint8_t *program, int prog_len, int stack_size_words);
 //Run a function using a function handle.
 int32_t lssl_vm_run_function(lssl_vm_t *vm, uint32_t fn_handle, int argc, int32_t *argv, vm_error_t *error);
 
+//Same, but stop after running (about) budget instructions; 0 means no budget. If the
+//function isn't done by then, error->type is LSSL_VM_YIELDED and the next lssl_vm_run()
+//continues where it stopped, ignoring fn_handle, argc and argv. Nothing else can be run
+//on the VM until then, or until lssl_vm_abort() drops the call.
+int32_t lssl_vm_run(lssl_vm_t *vm, uint32_t fn_handle, int argc, int32_t *argv, int budget, vm_error_t *error);
+void lssl_vm_abort(lssl_vm_t *vm);
+
+//Fail calls running more than limit instructions with LSSL_VM_ERR_INSN_LIMIT; 0 (the
+//default) means no limit. Over multiple lssl_vm_run()s, the limit is for the call as a
+//whole. Clones made afterwards get the same limit. Of the native code, only AOT code
+//(lssl_vm_init_native()) counts instructions: with a limit or budget, the JIT and WASM
+//code don't get used, and calls run in the interpreter at its speed instead.
+void lssl_vm_set_insn_limit(lssl_vm_t *vm, int64_t limit);
+
+//Instructions run on this VM so far. The JIT, WASM code and lanes don't count
+//instructions, so this is only complete if none of those was used.
+int64_t lssl_vm_insn_count(lssl_vm_t *vm);
+
+//Fill the unused part of the stack with a marker, so lssl_vm_stack_peak() can tell how
+//far up it got used afterwards.
+void lssl_vm_paint_stack(lssl_vm_t *vm);
+//Highest amount of stack words (globals included) in use since lssl_vm_paint_stack()
+int lssl_vm_stack_peak(lssl_vm_t *vm);
+
+//How often an insn ran, see lssl_vm_stats()
+typedef struct {
+	uint32_t pc;	//bytecode address
+	int op;			//opcode (see vm_defs.h); LSSL_INSN_COUNT or more if it's not valid
+	int64_t count;	//times it ran
+	int64_t calls;	//times the function starting here got called, or used as a callback
+} lssl_vm_insn_stat_t;
+
+//A VM built with LSSL_VM_STATS defined counts how often every insn runs ('make lssl_stats'
+//builds lssl like that). It then runs everything in the interpreter, one lane at a time.
+//Clones add to the counts of the VM they're cloned from, without locking, so only use one
+//thread for exact numbers. Points stats at the counts for every insn, in program order,
+//and returns how many insns there are; returns 0 in normal builds.
+int lssl_vm_stats(lssl_vm_t *vm, const lssl_vm_insn_stat_t **stats);
+void lssl_vm_stats_reset(lssl_vm_t *vm);
+
+//A function call that has been looked up and checked, so it can be run many times
+//in a row (e.g. once for every LED) with as little overhead as possible.
+typedef struct {
+	int func;
+	int argc;
+	int sp;
+} lssl_vm_call_t;
+
+//Prepare calling a function using a function handle. Returns 0 (and sets error) if
+//the function cannot be called with argc arguments.
+int lssl_vm_call_prepare(lssl_vm_t *vm, uint32_t fn_handle, int argc, lssl_vm_call_t *call, vm_error_t *error);
+
+//Run a call prepared by lssl_vm_call_prepare. Nothing must be allocated on or freed
+//from the stack in between.
+int32_t lssl_vm_call(lssl_vm_t *vm, const lssl_vm_call_t *call, const int32_t *argv, vm_error_t *error);
+
+//Max amount of lanes lssl_vm_call_lanes() can run at once
+#define LSSL_VM_MAX_LANES 16
+
+//Run a prepared call for multiple sets of arguments ('lanes') at once, in lock-step.
+//argv holds call->argc arguments for every lane. If data_ct is not 0, the data_ct words
+//right below the arguments (e.g. allocated with lssl_vm_alloc_data before preparing the
+//call) are private to each lane, with data holding data_ct words for every lane.
+//Returns 0 if the lanes can't be run like this, e.g. because the function writes to a
+//global or calls a syscall that isn't lane-safe, or because it runs into an error. In
+//that case, nothing has changed except for calls to lane-safe syscalls, and the caller
+//should run the lanes one by one using lssl_vm_call().
+int lssl_vm_call_lanes(lssl_vm_t *vm, const lssl_vm_call_t *call, int lanes, const int32_t *argv,
+						const int32_t *data, int data_ct);
+
+//The lane a lane-safe syscall is being called for. 0 when not running lanes.
+int lssl_vm_lane(lssl_vm_t *vm);
+
+//Make a VM for the same program as vm with a stack of its own, e.g. to run callbacks
+//on another thread. The program is shared, so vm must be freed after its clones.
+lssl_vm_t *lssl_vm_clone(lssl_vm_t *vm);
+
+//Copy the stack (globals, allocated data) of vm to its clone. Writes to anything that
+//is on the stack at this point fail with LSSL_VM_ERR_RO_WRITE when running the clone,
+//as they would not end up in vm. Returns 0 if out of memory.
+int lssl_vm_sync(lssl_vm_t *clone, const lssl_vm_t *vm);
+
+//Translate the program into native code, which is used from then on to run it. Results
+//are the same as with the interpreter. Only available on x86-64 Linux; returns 0 if
+//the program is interpreted as usual.
+int lssl_vm_jit(lssl_vm_t *vm);
+
+//Write the program as C code to f, so it can be built into firmware instead of being
+//loaded as bytecode. Every function becomes a C function; func_pcs holds the bytecode
+//addresses of all functions in the program, so the ones that are only used as callbacks
+//get translated as well, and func_names their names (or NULL). The code defines a const
+//lssl_vm_native_t called name. Returns 0 if the program can't be translated.
+int lssl_vm_aot_write(FILE *f, const char *name, uint8_t *program, int prog_len,
+						const int *func_pcs, const char **func_names, int func_ct);
+
+//A program translated to C by lssl_vm_aot_write()
+typedef struct lssl_vm_native_t lssl_vm_native_t;
+
+//Initialize a VM with a program that was translated to C. This works like a VM made by
+//lssl_vm_init() for the bytecode (callbacks, led_syscalls etc. are all the same), only
+//faster; the bytecode is still needed to report errors.
+lssl_vm_t *lssl_vm_init_native(const lssl_vm_native_t *native, int stack_size_words);
+
+//Translate the program into a standalone WebAssembly module, so a browser can run it
+//natively. The module imports the memory of the VM (as 'env.memory') and the syscalls it
+//uses (as 'lssl.<name>'), and exports run(). func_pcs is as for lssl_vm_aot_write().
+//Returns the module, to be freed by the caller, and its length in *len; NULL if the
+//program can't be translated.
+uint8_t *lssl_vm_wasm_write(uint8_t *program, int prog_len, const int *func_pcs, int func_ct, int *len);
+
+//Have the VM run the program using the module lssl_vm_wasm_write() made for it, which
+//the page has instantiated as Module.lssl_wasm. Results are the same as with the
+//interpreter. Only available in the emscripten build; returns 0 otherwise.
+int lssl_vm_wasm(lssl_vm_t *vm);
+
 //Run the main function of a program
 int32_t lssl_vm_run_main(lssl_vm_t *vm, vm_error_t *error);
 
@@ -44,10 +165,20 @@ void lssl_vm_dump_stack(lssl_vm_t *vm);
 //Allocate space for item_ct int32_t items on the stack
 int32_t *lssl_vm_alloc_data(lssl_vm_t *vm, int item_ct);
 
-//Get VM address for 'real' address
-int32_t lssl_vm_data_addr(lssl_vm_t *vm, int32_t *ptr);
+//Get VM address for 'real' address of item_ct items
+int32_t lssl_vm_data_addr(lssl_vm_t *vm, int32_t *ptr, int item_ct);
 
 //Free earlier allocated space
 void lssl_vm_free_data(lssl_vm_t *vm, int32_t *data);
 
+//For syscalls taking an array or struct: get the 'real' address of the item_ct items at
+//VM address addr. Returns NULL and sets the VM error if addr doesn't cover that many
+//items, or if write is set and the items are read-only.
+int32_t *lssl_vm_data_ptr(lssl_vm_t *vm, int32_t addr, int item_ct, int write);
+
+//For syscalls that change state outside of the VM, like the seed of rand(). Clones
+//can't do that, as the order they run in isn't fixed: for those, this returns 0 and
+//sets the VM error to LSSL_VM_ERR_RO_WRITE, same as for a write to a global.
+int lssl_vm_shared_write(lssl_vm_t *vm);
+
 
@@ -0,0 +1,621 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "vm_aot.h"
+
+/*
+Ahead-of-time compiler: writes out a program as C code, to be built into firmware that
+always runs the same effects. Like the JIT, the generated code works on the stack, frames
+and return stack of the VM itself, so anything rare or hard (errors, deep recursion) can
+be left to the interpreter: the generated code writes back its state and returns, and the
+interpreter continues from the same insn. This is also why the bytecode is included in
+the generated code.
+
+Every function in the program becomes a C function, and CALLs become C calls. Within a
+function, values that are pushed stay in local variables (t0, t1, ...) as long as they
+are only used by the insns that follow; they are written to the stack at the end of a
+basic block, or when anything else may look at the stack. This assumes the program does
+not use addresses or the slots of register insns to read the values an expression is
+working on, which the compiler never does.
+
+Insns are counted the way the interpreter does, at every taken jump, call and return,
+so calls with an insn limit or budget can run here too. When one of those would stop
+the call, we fall back at the branch insn and let the interpreter stop at the same place.
+*/
+
+typedef struct {
+	FILE *f;		//NULL in the first pass, which only finds out how many temps we need
+	lssl_vm_t *vm;
+	const char **cname; //per insn: name of the C function for the function starting there
+	int n;			//values pushed but not written to the stack yet, in t0..t(n-1)
+	int m;			//values the current insn popped from the stack; sp isn't updated yet
+	int n_insn;		//n at the start of the current insn
+	int seg;		//first insn of the current run that isn't in vm->insns_run yet
+	int max_n;
+	char opnd[4][32];
+	int opnd_idx;
+} aot_t;
+
+static void out(aot_t *a, const char *fmt, ...) {
+	if (!a->f) return;
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(a->f, fmt, ap);
+	va_end(ap);
+}
+
+//Returns a C expression for the value popped.
+static const char *pop_opnd(aot_t *a) {
+	char *r=a->opnd[a->opnd_idx++&3];
+	if (a->n) {
+		sprintf(r, "t%d", --a->n);
+	} else {
+		sprintf(r, "s[sp-%d]", ++a->m);
+	}
+	return r;
+}
+
+//Returns the temp the value pushed goes in.
+static int push_opnd(aot_t *a) {
+	if (a->n+1>a->max_n) a->max_n=a->n+1;
+	return a->n++;
+}
+
+//Pops a value into a temp, so it survives sp changing.
+static int pop_temp(aot_t *a) {
+	if (a->n) return --a->n;
+	const char *v=pop_opnd(a);
+	if (a->max_n<1) a->max_n=1;
+	out(a, "\tt0=%s;\n", v);
+	return 0;
+}
+
+static void apply_pops(aot_t *a) {
+	if (a->m) out(a, "\tsp-=%d;\n", a->m);
+	a->m=0;
+}
+
+//Writes all pending values to the stack.
+static void flush(aot_t *a) {
+	apply_pops(a);
+	for (int k=0; k<a->n; k++) out(a, "\ts[sp+%d]=t%d;\n", k, k);
+	if (a->n) out(a, "\tsp+=%d;\n", a->n);
+	a->n=0;
+}
+
+//Bails out to the interpreter at insn i if cond is true. Can only be used before the
+//current insn changes sp or pushes anything.
+static void fallback_if(aot_t *a, int i, const char *cond) {
+	out(a, "\tif (%s) {", cond);
+	for (int k=0; k<a->n_insn; k++) out(a, " s[sp+%d]=t%d;", k, k);
+	out(a, " AOT_FALLBACK_AT(%d, %d, %d); }\n", i, a->n_insn, i-a->seg);
+}
+
+//For taken branches: falls back if the interpreter would stop at insn i, see BRANCH() in
+//vm.c. Same restrictions as fallback_if(); pass the condition for the branch being taken.
+static void branch_check(aot_t *a, int i, const char *taken) {
+	char cond[160];
+	sprintf(cond, "%s%svm->insns_run+%d>=vm->insn_stop", taken?taken:"", taken?" && ":"", i-a->seg+1);
+	fallback_if(a, i, cond);
+}
+
+//Counts the run up to and including insn i, on the path that takes the branch.
+static void count_run(aot_t *a, int i, const char *indent) {
+	out(a, "%svm->insns_run+=%d;\n", indent, i-a->seg+1);
+}
+
+static void binop(aot_t *a, const char *fmt) {
+	const char *y=pop_opnd(a);
+	const char *x=pop_opnd(a);
+	int t=push_opnd(a);
+	out(a, "\tt%d=", t);
+	out(a, fmt, x, y);
+	out(a, ";\n");
+}
+
+//C expression calculating what the stack insn op does with %s and %s, for the register insns.
+static const char *reg_fmt(int op) {
+	switch (op) {
+		case INSN_ADD: return "aot_add(%s, %s)";
+		case INSN_SUB: return "aot_sub(%s, %s)";
+		case INSN_MUL: return "aot_mul(%s, %s)";
+		case INSN_DIV: return "aot_div(%s, %s)";
+		case INSN_MOD: return "aot_mod(%s, %s)";
+		case INSN_TEQ: return "(%s==%s)?65536:0";
+		case INSN_TNEQ: return "(%s!=%s)?65536:0";
+		case INSN_TL: return "(%s<%s)?65536:0";
+		case INSN_TG: return "(%s>%s)?65536:0";
+		case INSN_TLEQ: return "(%s<=%s)?65536:0";
+		case INSN_TGEQ: return "(%s>=%s)?65536:0";
+	}
+	return NULL;
+}
+
+//Insns that can be reached when starting at entry, and which of those are jumped to.
+static void find_reach(lssl_vm_t *vm, int entry, uint8_t *reach, uint8_t *label, int *work) {
+	int n=vm->insn_count;
+	memset(reach, 0, n+1);
+	memset(label, 0, n+1);
+	int wp=0;
+	work[wp++]=entry;
+	reach[entry]=1;
+	while (wp) {
+		int i=work[--wp];
+		int op=vm->insn_op[i];
+		int arg=vm->insns[i].arg;
+		int next[2]={i+1, -1};
+		if (op>=LSSL_INSN_COUNT || op==INSN_NOP || op==INSN_RETURN) {
+			continue;
+		} else if (op==INSN_JMP) {
+			next[0]=arg;
+		} else if (op==INSN_JZ || op==INSN_JNZ || op==INSN_RJZ || op==INSN_RJNZ) {
+			next[1]=arg;
+		}
+		if (op==INSN_JMP || next[1]>=0) label[arg]=1;
+		for (int k=0; k<2; k++) {
+			if (next[k]<0 || next[k]>=n || reach[next[k]]) continue;
+			reach[next[k]]=1;
+			work[wp++]=next[k];
+		}
+	}
+}
+
+//Writes the code for insn i. Returns 0 if the code after it is never reached from here.
+static int emit_insn(aot_t *a, int i) {
+	lssl_vm_t *vm=a->vm;
+	int op=vm->insn_op[i];
+	int32_t arg=vm->insns[i].arg;
+	int rd=vm->insns[i].d, rs=vm->insns[i].s;
+	int argtype=(op<LSSL_INSN_COUNT)?lssl_vm_ops[op].argtype:ARG_NONE;
+	char cond[128];
+	a->n_insn=a->n;
+	a->m=0;
+	out(a, "\t//%s", (op<LSSL_INSN_COUNT)?lssl_vm_ops[op].op:"?");
+	if (argtype==ARG_RRR || argtype==ARG_RRN || argtype==ARG_RN) out(a, " [%d],", rd);
+	if (argtype==ARG_RRR || argtype==ARG_RRN || argtype==ARG_RT) out(a, " [%d],", rs);
+	if (argtype!=ARG_NONE) out(a, " %d", (int)arg);
+	out(a, "\n");
+	switch (op) {
+	case INSN_PUSH_I:
+		out(a, "\tt%d=%d;\n", push_opnd(a), (int32_t)((uint32_t)arg<<16));
+		break;
+	case INSN_PUSH_R:
+		out(a, "\tt%d=%d;\n", push_opnd(a), arg);
+		break;
+	case INSN_MUL:
+		binop(a, "aot_mul(%s, %s)");
+		break;
+	case INSN_DIV:
+	case INSN_MOD: {
+		//Check the divisor before popping anything
+		const char *y=(a->n)?"t%d":"s[sp-%d]";
+		char b[32];
+		sprintf(b, y, (a->n)?a->n-1:1);
+		sprintf(cond, "%s==0", b);
+		fallback_if(a, i, cond);
+		binop(a, (op==INSN_DIV)?"aot_div(%s, %s)":"aot_mod(%s, %s)");
+		break;
+	}
+	case INSN_ADD:
+		binop(a, "aot_add(%s, %s)");
+		break;
+	case INSN_SUB:
+		binop(a, "aot_sub(%s, %s)");
+		break;
+	case INSN_LAND:
+		binop(a, "(%s && %s)?65536:0");
+		break;
+	case INSN_LOR:
+		binop(a, "(%s || %s)?65536:0");
+		break;
+	case INSN_BAND:
+		binop(a, "%s & %s");
+		break;
+	case INSN_BOR:
+		binop(a, "%s | %s");
+		break;
+	case INSN_BXOR:
+		binop(a, "%s ^ %s");
+		break;
+	case INSN_TEQ:
+		binop(a, "(%s==%s)?65536:0");
+		break;
+	case INSN_TNEQ:
+		binop(a, "(%s!=%s)?65536:0");
+		break;
+	case INSN_TL:
+		binop(a, "(%s<%s)?65536:0");
+		break;
+	case INSN_TG:
+		binop(a, "(%s>%s)?65536:0");
+		break;
+	case INSN_TLEQ:
+		binop(a, "(%s<=%s)?65536:0");
+		break;
+	case INSN_TGEQ:
+		binop(a, "(%s>=%s)?65536:0");
+		break;
+	case INSN_BNOT: {
+		const char *x=pop_opnd(a);
+		out(a, "\tt%d=~%s;\n", push_opnd(a), x);
+		break;
+	}
+	case INSN_LNOT: {
+		const char *x=pop_opnd(a);
+		out(a, "\tt%d=(%s)?0:65536;\n", push_opnd(a), x);
+		break;
+	}
+	case INSN_JMP:
+		branch_check(a, i, NULL);
+		flush(a);
+		count_run(a, i, "\t");
+		out(a, "\tgoto L%d;\n", arg);
+		return 0;
+	case INSN_JZ:
+	case INSN_JNZ: {
+		const char *cmp=(op==INSN_JZ)?"==":"!=";
+		sprintf(cond, (a->n)?"t%d%s0":"s[sp-%d]%s0", (a->n)?a->n-1:1, cmp);
+		branch_check(a, i, cond);
+		int t=pop_temp(a);
+		flush(a);
+		out(a, "\tif (t%d%s0) {\n", t, cmp);
+		count_run(a, i, "\t\t");
+		out(a, "\t\tgoto L%d;\n", arg);
+		out(a, "\t}\n");
+		break;
+	}
+	case INSN_ENTER:
+		flush(a);
+		if (arg>0) out(a, "\tmemset(&s[sp], 0, %d*sizeof(int32_t));\n\tsp+=%d;\n", arg, arg);
+		break;
+	case INSN_RETURN: {
+		branch_check(a, i, NULL);
+		count_run(a, i, "\t");
+		const char *v=pop_opnd(a);
+		out(a, "\t{\n");
+		out(a, "\t\tint32_t v=%s;\n", v);
+		out(a, "\t\tvm->sp=bp-3-%d;\n", arg);
+		out(a, "\t\tif (pop_frame(vm)==-1) {\n");
+		out(a, "\t\t\t*ret=v;\n");
+		out(a, "\t\t} else {\n");
+		out(a, "\t\t\tpush(vm, v);\n");
+		out(a, "\t\t}\n");
+		out(a, "\t\treturn AOT_DONE;\n");
+		out(a, "\t}\n");
+		a->n=0;
+		a->m=0;
+		return 0;
+	}
+	case INSN_CALL: {
+		lssl_vm_func_t *f=&vm->funcs[arg];
+		branch_check(a, i, NULL);
+		flush(a);
+		out(a, "\tvm->sp=sp;\n");
+		out(a, "\tvm->ap=ap;\n");
+		out(a, "\tif (!room_for_call(vm, &vm->funcs[%d], 0)) AOT_FALLBACK_AT(%d, 0, %d);\n", arg, i, i-a->seg);
+		count_run(a, i, "\t");
+		a->seg=i+1; //the callee counts its return to here
+		out(a, "\tpush_frame(vm, %d);\n", i+1);
+		out(a, "\tif (depth>=LSSL_VM_AOT_MAX_DEPTH) {\n");
+		out(a, "\t\tvm->pc=%d;\n", f->entry);
+		out(a, "\t\treturn AOT_FALLBACK;\n");
+		out(a, "\t}\n");
+		out(a, "\t{\n");
+		out(a, "\t\tint r=%s(vm, ret, depth+1);\n", a->cname[f->entry]);
+		out(a, "\t\tif (r!=AOT_DONE) return r;\n");
+		out(a, "\t}\n");
+		out(a, "\tsp=vm->sp;\n");
+		break;
+	}
+	case INSN_POP: {
+		const char *x=pop_opnd(a);
+		if (x[0]=='t') out(a, "\t(void)%s;\n", x);
+		break;
+	}
+	case INSN_SYSCALL: {
+		int args=(arg>>12)&0xf;
+		out(a, "\t{\n");
+		out(a, "\t\tint32_t argv[16];\n");
+		for (int k=0; k<args; k++) out(a, "\t\targv[%d]=%s;\n", args-k-1, pop_opnd(a));
+		if (a->m) out(a, "\t\tsp-=%d;\n", a->m);
+		a->m=0;
+		out(a, "\t\tvm->sp=sp;\n");
+		out(a, "\t\tvm->ap=ap;\n");
+		int t=push_opnd(a);
+		out(a, "\t\tt%d=vm_syscall(vm, %d, argv);\n", t, arg&0xfff);
+		out(a, "\t\tsp=vm->sp;\n");
+		out(a, "\t\tif (vm->error) {\n");
+		out(a, "\t\t\tvm->insns_run+=%d;\n", i-a->seg+1);
+		out(a, "\t\t\tvm->pc=%d;\n", i);
+		out(a, "\t\t\treturn AOT_ERROR;\n");
+		out(a, "\t\t}\n");
+		out(a, "\t}\n");
+		break;
+	}
+	case INSN_DUP: {
+		const char *x=pop_opnd(a);
+		int t=push_opnd(a);
+		out(a, "\tt%d=%s;\n", push_opnd(a), x);
+		out(a, "\tt%d=t%d;\n", t, t+1);
+		break;
+	}
+	case INSN_LEA:
+		out(a, "\tt%d=make_addr(bp+%d, 1);\n", push_opnd(a), arg);
+		break;
+	case INSN_LEA_G:
+		out(a, "\tt%d=0x%X;\n", push_opnd(a), make_addr(arg, 1));
+		break;
+	case INSN_LDA:
+		out(a, "\tt%d=s[bp+%d];\n", push_opnd(a), arg);
+		break;
+	case INSN_LDA_G:
+		out(a, "\tt%d=s[%d];\n", push_opnd(a), arg);
+		break;
+	case INSN_DEREF:
+	case INSN_PRE_ADD:
+	case INSN_POST_ADD:
+	case INSN_WR_VAR: {
+		const char *v=(op==INSN_WR_VAR)?pop_opnd(a):NULL;
+		const char *addr=pop_opnd(a);
+		out(a, "\t{\n");
+		out(a, "\t\tuint32_t a=%s;\n", addr);
+		out(a, "\t");
+		fallback_if(a, i, (op==INSN_DEREF)?"!addr_ok(vm, a)":"!aot_wr_addr_ok(vm, a)");
+		if (op==INSN_WR_VAR) {
+			out(a, "\t\ts[pos_from_addr(a)]=%s;\n", v);
+		} else if (op==INSN_DEREF) {
+			out(a, "\t\tt%d=s[pos_from_addr(a)];\n", push_opnd(a));
+		} else {
+			int t=push_opnd(a);
+			if (op==INSN_POST_ADD) out(a, "\t\tt%d=s[pos_from_addr(a)];\n", t);
+			out(a, "\t\ts[pos_from_addr(a)]=aot_add(s[pos_from_addr(a)], %d);\n", arg);
+			if (op==INSN_PRE_ADD) out(a, "\t\tt%d=s[pos_from_addr(a)];\n", t);
+		}
+		out(a, "\t}\n");
+		break;
+	}
+	case INSN_ARRAY_IDX: {
+		const char *idx=pop_opnd(a);
+		const char *addr=pop_opnd(a);
+		out(a, "\t{\n");
+		out(a, "\t\tint idx=(%s>>16);\n", idx);
+		out(a, "\t\tuint32_t a=%s;\n", addr);
+		sprintf(cond, "idx*%d>=size_from_addr(a) || idx<0", arg);
+		out(a, "\t");
+		fallback_if(a, i, cond);
+		out(a, "\t\tt%d=make_addr(pos_from_addr(a)+idx*%d, %d);\n", push_opnd(a), arg, arg);
+		out(a, "\t}\n");
+		break;
+	}
+	case INSN_STRUCT_IDX: {
+		const char *addr=pop_opnd(a);
+		const char *offset=pop_opnd(a);
+		out(a, "\tt%d=make_addr(pos_from_addr(%s)+(%s>>16), %d);\n", push_opnd(a), addr, offset, arg);
+		break;
+	}
+	case INSN_SCOPE_ENTER:
+		flush(a);
+		out(a, "\ts[sp++]=ap;\n");
+		out(a, "\trpush(vm, ap);\n");
+		out(a, "\tap=sp;\n");
+		break;
+	case INSN_SCOPE_LEAVE:
+		a->n=0;
+		out(a, "\tsp=ap-1;\n");
+		out(a, "\tap=rpop(vm);\n");
+		break;
+	case INSN_ARRAYINIT:
+	case INSN_STRUCTINIT:
+		flush(a);
+		out(a, "\tvm->sp=sp;\n");
+		out(a, "\tif (!%s(vm, %d)) AOT_FALLBACK_AT(%d, 0, %d);\n",
+				(op==INSN_ARRAYINIT)?"lssl_vm_arrayinit":"lssl_vm_structinit", arg, i, i-a->seg);
+		out(a, "\tsp=vm->sp;\n");
+		break;
+	case INSN_STA:
+		out(a, "\ts[bp+%d]=%s;\n", arg, pop_opnd(a));
+		break;
+	case INSN_RADD:
+	case INSN_RSUB:
+	case INSN_RMUL:
+	case INSN_RDIV:
+	case INSN_RMOD:
+	case INSN_RTEQ:
+	case INSN_RTNEQ:
+	case INSN_RTL:
+	case INSN_RTG:
+	case INSN_RTLEQ:
+	case INSN_RTGEQ:
+	case INSN_RADDI:
+	case INSN_RSUBI:
+	case INSN_RMULI:
+	case INSN_RDIVI:
+	case INSN_RMODI:
+	case INSN_RTEQI:
+	case INSN_RTNEQI:
+	case INSN_RTLI:
+	case INSN_RTGI:
+	case INSN_RTLEQI:
+	case INSN_RTGEQI: {
+		int stack_op=lssl_vm_ops[op].stack_op;
+		char x[32], y[32];
+		sprintf(x, "s[bp+%d]", rs);
+		if (argtype==ARG_RRN) {
+			sprintf(y, "%d", arg);
+		} else {
+			sprintf(y, "s[bp+%d]", arg);
+		}
+		if (stack_op==INSN_DIV || stack_op==INSN_MOD) {
+			sprintf(cond, "%s==0", y);
+			fallback_if(a, i, cond);
+		}
+		out(a, "\ts[bp+%d]=", rd);
+		out(a, reg_fmt(stack_op), x, y);
+		out(a, ";\n");
+		break;
+	}
+	case INSN_RSET:
+		out(a, "\ts[bp+%d]=%d;\n", rd, arg);
+		break;
+	case INSN_RJZ:
+	case INSN_RJNZ: {
+		const char *cmp=(op==INSN_RJZ)?"==":"!=";
+		sprintf(cond, "s[bp+%d]%s0", rs, cmp);
+		branch_check(a, i, cond);
+		flush(a);
+		out(a, "\tif (%s) {\n", cond);
+		count_run(a, i, "\t\t");
+		out(a, "\t\tgoto L%d;\n", arg);
+		out(a, "\t}\n");
+		break;
+	}
+	default:
+		//Not allowed by the verifier, so a function with this never runs
+		flush(a);
+		out(a, "\tAOT_FALLBACK_AT(%d, 0, %d);\n", i, i-a->seg);
+		return 0;
+	}
+	apply_pops(a);
+	return 1;
+}
+
+static void emit_func(aot_t *a, int entry, const uint8_t *reach, const uint8_t *label) {
+	lssl_vm_t *vm=a->vm;
+	out(a, "static int %s(lssl_vm_t *vm, int32_t *ret, int depth) {\n", a->cname[entry]);
+	out(a, "\tAOT_ENTER();\n");
+	if (a->max_n) {
+		out(a, "\tint32_t t0");
+		for (int k=1; k<a->max_n; k++) out(a, ", t%d", k);
+		out(a, ";\n");
+	}
+	a->n=0;
+	int falls=0;
+	for (int i=0; i<vm->insn_count; i++) {
+		if (!reach[i]) continue;
+		if (label[i]) {
+			if (falls) {
+				flush(a);
+				//Jumps to here start counting again
+				if (i>a->seg) out(a, "\tvm->insns_run+=%d;\n", i-a->seg);
+			}
+			out(a, "L%d:\n", i);
+			a->seg=i;
+		} else if (!falls) {
+			a->seg=i;
+		}
+		falls=emit_insn(a, i);
+	}
+	if (falls) {
+		//Runs off the end of the program; the verifier does not allow this.
+		flush(a);
+		out(a, "\tAOT_FALLBACK_AT(%d, 0, %d);\n", vm->insn_count, vm->insn_count-a->seg);
+	}
+	out(a, "}\n\n");
+}
+
+int lssl_vm_aot_write(FILE *f, const char *name, uint8_t *program, int prog_len,
+						const int *func_pcs, const char **func_names, int func_ct) {
+	lssl_vm_t *vm=lssl_vm_init(program, prog_len, 65536);
+	if (!vm) return 0;
+	int n=vm->insn_count;
+	int ret=0;
+	const char **cname=calloc(n+1, sizeof(char*));
+	char *names=calloc(n+1, 64);
+	uint8_t *reach=malloc(n+1);
+	uint8_t *label=malloc(n+1);
+	int *work=malloc((n+1)*sizeof(int));
+	if (!cname || !names || !reach || !label || !work) goto out;
+
+	//Everything that is CALLed, plus the functions the caller knows of
+	for (int k=0; k<vm->func_count; k++) {
+		int e=vm->funcs[k].entry;
+		sprintf(&names[e*64], "fn_at_%X", vm->insn_pc[e]);
+		cname[e]=&names[e*64];
+	}
+	for (int k=0; k<func_ct; k++) {
+		int e=0;
+		while (e<n && vm->insn_pc[e]!=func_pcs[k]) e++;
+		if (e==n) {
+			printf("lssl_vm_aot_write: no function at pc 0x%X\n", func_pcs[k]);
+			goto out;
+		}
+		if (func_names && func_names[k]) {
+			snprintf(&names[e*64], 64, "fn_%s", func_names[k]);
+		} else {
+			sprintf(&names[e*64], "fn_at_%X", func_pcs[k]);
+		}
+		cname[e]=&names[e*64];
+	}
+	if (!cname[0] || strncmp(cname[0], "fn_at_", 6)==0) cname[0]="program_start";
+
+	fprintf(f, "//Generated by lssl from a LSSL program; do not edit. To use, build this with\n");
+	fprintf(f, "//the LSSL VM and pass &%s to lssl_vm_init_native().\n", name);
+	fprintf(f, "#include \"vm_aot.h\"\n\n");
+	fprintf(f, "static const uint8_t program[%d]={", prog_len);
+	for (int i=0; i<prog_len; i++) fprintf(f, "%s0x%02X,", (i%16)?" ":"\n\t", program[i]);
+	fprintf(f, "\n};\n\n");
+	for (int e=0; e<n; e++) {
+		if (cname[e]) fprintf(f, "static int %s(lssl_vm_t *vm, int32_t *ret, int depth);\n", cname[e]);
+	}
+	fprintf(f, "\n");
+
+	aot_t a={.vm=vm, .cname=cname};
+	for (int e=0; e<n; e++) {
+		if (!cname[e]) continue;
+		find_reach(vm, e, reach, label, work);
+		//First pass to count the temps, then the real thing
+		a.f=NULL;
+		a.max_n=0;
+		emit_func(&a, e, reach, label);
+		a.f=f;
+		emit_func(&a, e, reach, label);
+	}
+
+	int count=0;
+	fprintf(f, "static const lssl_vm_native_func_t funcs[]={\n");
+	for (int e=0; e<n; e++) {
+		if (!cname[e]) continue;
+		fprintf(f, "\t{0x%X, %s},\n", vm->insn_pc[e], cname[e]);
+		count++;
+	}
+	fprintf(f, "};\n\n");
+	fprintf(f, "const lssl_vm_native_t %s={program, %d, funcs, %d};\n", name, prog_len, count);
+	ret=!ferror(f);
+out:
+	free(cname);
+	free(names);
+	free(reach);
+	free(label);
+	free(work);
+	lssl_vm_free(vm);
+	return ret;
+}
+
+lssl_vm_t *lssl_vm_init_native(const lssl_vm_native_t *native, int stack_size_words) {
+	lssl_vm_t *vm=lssl_vm_init((uint8_t*)native->program, native->prog_len, stack_size_words);
+	if (!vm) return NULL;
+	vm->native=calloc(vm->insn_count+1, sizeof(lssl_vm_native_fn_t*));
+	if (!vm->native) {
+		lssl_vm_free(vm);
+		return NULL;
+	}
+	int i=0;
+	for (int k=0; k<native->func_count; k++) {
+		//Both are sorted by pc
+		while (i<vm->insn_count && vm->insn_pc[i]<native->funcs[k].pc) i++;
+		if (i<vm->insn_count && vm->insn_pc[i]==native->funcs[k].pc) vm->native[i]=native->funcs[k].fn;
+	}
+	return vm;
+}
+
+int lssl_vm_aot_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+	lssl_vm_native_fn_t *fn=vm->native[vm->pc];
+	if (!fn) return 0;
+	vm->error=LSSL_VM_ERR_NONE;
+	int r=fn(vm, ret, 0);
+	if (r==AOT_FALLBACK) return 0;
+	error->type=(r==AOT_ERROR)?vm->error:LSSL_VM_ERR_NONE;
+	error->pc=vm->insn_pc[vm->pc];
+	return 1;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "vm_int.h"
+
+//Included by the C code lssl_vm_aot_write() generates for a program. As this code runs
+//on the internals of the VM, it needs to be built with the same version of the VM and
+//the same syscalls as the compiler used.
+
+//Return values of the generated functions
+#define AOT_DONE 0		//the function returned
+#define AOT_FALLBACK 1	//the interpreter needs to continue at vm->pc
+#define AOT_ERROR 2		//a syscall set vm->error
+
+//The generated functions call each other directly, so recursion in the program uses the
+//C stack. Calls nested deeper than this are left to the interpreter.
+#ifndef LSSL_VM_AOT_MAX_DEPTH
+#define LSSL_VM_AOT_MAX_DEPTH 32
+#endif
+
+typedef struct {
+	int pc; //bytecode address of the function
+	lssl_vm_native_fn_t *fn;
+} lssl_vm_native_func_t;
+
+struct lssl_vm_native_t {
+	const uint8_t *program; //the bytecode, for the verifier and the interpreter
+	int prog_len;
+	const lssl_vm_native_func_t *funcs;
+	int func_count;
+};
+
+//Start of every generated function: keep the registers in local variables.
+#define AOT_ENTER() \
+	int32_t *s=vm->stack; \
+	int sp=vm->sp, bp=vm->bp, ap=vm->ap; \
+	(void)s; (void)sp; (void)bp; (void)ap
+
+//Write the registers back and have the interpreter continue at insn i. The values the
+//generated code had not written to the stack yet need to be stored before this, and the
+//insns run since the last taken branch still need counting.
+#define AOT_FALLBACK_AT(i, pending, uncounted) do { \
+		vm->insns_run+=(uncounted); \
+		vm->sp=sp+(pending); \
+		vm->ap=ap; \
+		vm->pc=(i); \
+		return AOT_FALLBACK; \
+	} while(0)
+
+//Same results as the interpreter gives
+static inline int32_t aot_add(int32_t a, int32_t b) {
+	return saturate((int64_t)a+b);
+}
+
+static inline int32_t aot_sub(int32_t a, int32_t b) {
+	return saturate((int64_t)a-b);
+}
+
+static inline int32_t aot_mul(int32_t a, int32_t b) {
+	return saturate(((int64_t)a*(int64_t)b)>>16);
+}
+
+static inline int32_t aot_div(int32_t a, int32_t b) {
+	return saturate((((int64_t)a)<<16)/b);
+}
+
+static inline int32_t aot_mod(int32_t a, int32_t b) {
+	return saturate((((int64_t)a)<<16)%b);
+}
+
+static inline int aot_wr_addr_ok(lssl_vm_t *vm, uint32_t addr) {
+	return addr_ok(vm, addr) && pos_from_addr(addr)>=vm->ro_top;
+}
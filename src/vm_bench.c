@@ -0,0 +1,502 @@
+//Measures what every VM instruction and syscall costs, by running synthesized bytecode
+//with each of them in a tight loop. Build with 'make vm_bench', or 'make vm_bench.js' for
+//the VM as the browser preview runs it (run that with node).
+//
+//Most insns can't run on their own: ADD needs two values pushed and one popped afterwards.
+//So every insn gets measured in a sequence with other insns, and the cost of those,
+//measured earlier, is subtracted. PUSH_R and POP are measured as a pair, and are taken
+//to cost the same. CALL and RETURN, and SCOPE_ENTER and SCOPE_LEAVE, are measured as
+//pairs as well; their cost is listed with the first one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "led_syscalls.h"
+#include "vm.h"
+
+#define REPS 32					//copies of the sequence in the loop
+#define MIN_NS 20000000.0		//keep doubling the iterations until a run takes this long
+#define RUNS 5					//runs per measurement; the fastest one counts
+#define NUM 0x34000				//3.25; a number most syscalls do some work for
+
+//Globals of the program
+#define G_ARRAY 0				//array of OBJ_SIZE words
+#define G_OBJ 1					//and MAX_OBJ_ARGS objects of OBJ_SIZE words
+#define MAX_OBJ_ARGS 4
+#define OBJ_SIZE 16
+#define GLOBALS (G_OBJ+MAX_OBJ_ARGS)
+
+//Slots of the loop function: loop counter, and values for the register insns
+#define S_COUNT 0
+#define S_ZERO 1
+#define S_A 2
+#define S_B 3
+#define S_DEST 4
+#define LOCALS 5
+
+typedef struct {
+	uint8_t *data;
+	int len;
+	int size;
+	//insns in the sequence being emitted, other than the ones being measured
+	int helpers[64];
+	int helper_ct;
+} prog_t;
+
+static void put(prog_t *p, int v) {
+	if (p->len==p->size) {
+		p->size=p->size?p->size*2:4096;
+		p->data=realloc(p->data, p->size);
+		if (!p->data) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	p->data[p->len++]=v;
+}
+
+static void put16(prog_t *p, int v) {
+	put(p, v);
+	put(p, v>>8);
+}
+
+static void put32(prog_t *p, int32_t v) {
+	put16(p, v);
+	put16(p, v>>16);
+}
+
+//Bytecode address of the next insn
+static int pc(prog_t *p) {
+	return p->len-8;
+}
+
+//Emits an insn. Its arg is taken from args as far as its argtype needs: the number, or
+//the slots, number and target of register insns.
+static void emit(prog_t *p, int op, int a, int b, int c) {
+	put(p, op);
+	int type=lssl_vm_ops[op].argtype;
+	if (type==ARG_RRR) {
+		put16(p, a);
+		put16(p, b);
+		put16(p, c);
+	} else if (type==ARG_RRN) {
+		put16(p, a);
+		put16(p, b);
+		put32(p, c);
+	} else if (type==ARG_RN || type==ARG_REAL) {
+		if (type==ARG_RN) put16(p, a);
+		put32(p, (type==ARG_RN)?b:a);
+	} else if (type==ARG_RT) {
+		put16(p, a);
+		put16(p, b);
+	} else if (lssl_vm_argtypes[type].byte_size==3) {
+		put16(p, a);
+	}
+}
+
+//Emits an insn that's only there to feed or clean up after the one being measured.
+static void helper(prog_t *p, int op, int a) {
+	emit(p, op, a, 0, 0);
+	p->helpers[p->helper_ct++]=op;
+}
+
+//Jump to the insn right after this one
+static void emit_jump_next(prog_t *p, int op, int s) {
+	int size=lssl_vm_argtypes[lssl_vm_ops[op].argtype].byte_size;
+	if (lssl_vm_ops[op].argtype==ARG_RT) {
+		emit(p, op, s, pc(p)+size, 0);
+	} else {
+		emit(p, op, pc(p)+size, 0, 0);
+	}
+}
+
+//What to measure: an insn, or a syscall with the kinds of arguments it takes.
+enum {ARG_KIND_NUM, ARG_KIND_OBJ, ARG_KIND_FN};
+
+typedef struct {
+	int op;			//insn, or INSN_SYSCALL
+	const char *name;
+	int syscall;
+	int argc;
+	int argkind[16];
+} bench_t;
+
+//Functions the sequences call
+typedef struct {
+	int ret0;		//returns 0
+	int enter;		//same, with ENTER
+} callees_t;
+
+//Emits the sequence for b once. Returns 0 if there's no way to run the insn.
+static int emit_seq(prog_t *p, const bench_t *b, const callees_t *c) {
+	int op=b->op;
+	int type=lssl_vm_ops[op].argtype;
+	if (type==ARG_RRR || type==ARG_RRN) {
+		emit(p, op, S_DEST, S_A, (type==ARG_RRR)?S_B:NUM);
+		return 1;
+	}
+	switch (op) {
+	case INSN_NOP:
+		return 0; //rejected by the verifier
+	case INSN_PUSH_I:
+	case INSN_LEA:
+	case INSN_LEA_G:
+	case INSN_LDA:
+	case INSN_LDA_G:
+		emit(p, op, (op==INSN_PUSH_I)?3:S_A, 0, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_PUSH_R:
+	case INSN_POP:
+		emit(p, INSN_PUSH_R, NUM, 0, 0);
+		emit(p, INSN_POP, 0, 0, 0);
+		return 1;
+	case INSN_WR_VAR:
+		helper(p, INSN_LEA, S_DEST);
+		helper(p, INSN_PUSH_R, NUM);
+		emit(p, op, 0, 0, 0);
+		return 1;
+	case INSN_BNOT:
+	case INSN_LNOT:
+		helper(p, INSN_PUSH_R, NUM);
+		emit(p, op, 0, 0, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_JMP:
+		emit_jump_next(p, op, 0);
+		return 1;
+	case INSN_JZ:
+	case INSN_JNZ:
+		//taken
+		helper(p, INSN_PUSH_R, (op==INSN_JZ)?0:NUM);
+		emit_jump_next(p, op, 0);
+		return 1;
+	case INSN_RJZ:
+	case INSN_RJNZ:
+		emit_jump_next(p, op, (op==INSN_RJZ)?S_ZERO:S_A);
+		return 1;
+	case INSN_RSET:
+		emit(p, op, S_DEST, NUM, 0);
+		return 1;
+	case INSN_ENTER:
+		emit(p, INSN_CALL, c->enter, 0, 0);
+		p->helpers[p->helper_ct++]=INSN_CALL; //with the RETURN
+		p->helpers[p->helper_ct++]=INSN_PUSH_I;
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_CALL:
+	case INSN_RETURN:
+		emit(p, INSN_CALL, c->ret0, 0, 0);
+		p->helpers[p->helper_ct++]=INSN_PUSH_I; //in the callee
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_SYSCALL:
+		for (int i=0, obj=0; i<b->argc; i++) {
+			if (b->argkind[i]==ARG_KIND_OBJ) {
+				helper(p, INSN_LDA_G, G_OBJ+obj++);
+			} else {
+				helper(p, INSN_PUSH_R, (b->argkind[i]==ARG_KIND_FN)?c->ret0:NUM);
+			}
+		}
+		emit(p, op, b->syscall|(b->argc<<12), 0, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_DUP:
+		helper(p, INSN_PUSH_R, NUM);
+		emit(p, op, 0, 0, 0);
+		helper(p, INSN_POP, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_DEREF:
+	case INSN_PRE_ADD:
+	case INSN_POST_ADD:
+		helper(p, INSN_LEA, S_DEST);
+		emit(p, op, 0, 0, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_ARRAY_IDX:
+	case INSN_STRUCT_IDX:
+		//They take the index and the address in a different order
+		if (op==INSN_ARRAY_IDX) helper(p, INSN_LDA_G, G_ARRAY);
+		helper(p, INSN_PUSH_I, 3);
+		if (op==INSN_STRUCT_IDX) helper(p, INSN_LDA_G, G_ARRAY);
+		emit(p, op, 1, 0, 0);
+		helper(p, INSN_POP, 0);
+		return 1;
+	case INSN_SCOPE_ENTER:
+	case INSN_SCOPE_LEAVE:
+		emit(p, INSN_SCOPE_ENTER, 0, 0, 0);
+		emit(p, INSN_SCOPE_LEAVE, 0, 0, 0);
+		return 1;
+	case INSN_ARRAYINIT:
+	case INSN_STRUCTINIT:
+		helper(p, INSN_SCOPE_ENTER, 0);
+		helper(p, INSN_LEA, S_DEST);
+		if (op==INSN_ARRAYINIT) helper(p, INSN_PUSH_I, 4);
+		emit(p, op, 4, 0, 0);
+		p->helpers[p->helper_ct++]=INSN_SCOPE_LEAVE;
+		emit(p, INSN_SCOPE_LEAVE, 0, 0, 0);
+		return 1;
+	case INSN_STA:
+		helper(p, INSN_PUSH_R, NUM);
+		emit(p, op, S_DEST, 0, 0);
+		return 1;
+	}
+	//Insns taking two values and leaving one
+	helper(p, INSN_PUSH_R, NUM);
+	helper(p, INSN_PUSH_R, NUM+0x8000);
+	emit(p, op, 0, 0, 0);
+	helper(p, INSN_POP, 0);
+	return 1;
+}
+
+//Makes a program with a function at *entry that runs reps copies of the sequence for b
+//as many times as its argument says. Returns NULL if b can't be measured.
+static uint8_t *gen_prog(const bench_t *b, int reps, int *len, int *entry, int *helpers, int *helper_ct) {
+	prog_t p={};
+	put32(&p, LSSL_VM_VER);
+	put32(&p, GLOBALS);
+	//Top-level code: allocate the global array and objects
+	emit(&p, INSN_LEA_G, G_ARRAY, 0, 0);
+	emit(&p, INSN_PUSH_I, OBJ_SIZE, 0, 0);
+	emit(&p, INSN_ARRAYINIT, 1, 0, 0);
+	for (int i=0; i<MAX_OBJ_ARGS; i++) {
+		emit(&p, INSN_LEA_G, G_OBJ+i, 0, 0);
+		emit(&p, INSN_STRUCTINIT, OBJ_SIZE, 0, 0);
+	}
+	emit(&p, INSN_PUSH_I, 0, 0, 0);
+	emit(&p, INSN_RETURN, 0, 0, 0);
+	callees_t c;
+	c.ret0=pc(&p);
+	emit(&p, INSN_PUSH_I, 0, 0, 0);
+	emit(&p, INSN_RETURN, 0, 0, 0);
+	c.enter=pc(&p);
+	emit(&p, INSN_ENTER, 4, 0, 0);
+	emit(&p, INSN_PUSH_I, 0, 0, 0);
+	emit(&p, INSN_RETURN, 0, 0, 0);
+
+	//The loop; its argument, the amount of iterations, is in slot -4.
+	*entry=pc(&p);
+	emit(&p, INSN_ENTER, LOCALS, 0, 0);
+	emit(&p, INSN_RADDI, S_COUNT, -4, 0);
+	emit(&p, INSN_RSET, S_A, NUM, 0);
+	emit(&p, INSN_RSET, S_B, NUM+0x8000, 0);
+	int top=pc(&p);
+	for (int i=0; i<reps; i++) {
+		p.helper_ct=0;
+		if (!emit_seq(&p, b, &c)) {
+			free(p.data);
+			return NULL;
+		}
+	}
+	emit(&p, INSN_RSUBI, S_COUNT, S_COUNT, 1);
+	emit(&p, INSN_RJNZ, S_COUNT, top, 0);
+	emit(&p, INSN_PUSH_I, 0, 0, 0);
+	emit(&p, INSN_RETURN, 1, 0, 0);
+	memcpy(helpers, p.helpers, p.helper_ct*sizeof(int));
+	*helper_ct=p.helper_ct;
+	*len=p.len;
+	return p.data;
+}
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+//Runs the loop for the given amount of iterations. Returns the ns it took, or -1 on error.
+static double time_loop(lssl_vm_t *vm, int entry, int iters) {
+	vm_error_t err={};
+	int32_t arg=iters; //not a number: the loop counts down in steps of 1/65536
+	double start=now_ns();
+	lssl_vm_run_function(vm, entry, 1, &arg, &err);
+	double ns=now_ns()-start;
+	if (err.type) {
+		printf("Error %s at pc 0x%X\n", vm_err_to_str(err.type), err.pc);
+		return -1;
+	}
+	return ns;
+}
+
+//Time in ns one pass of the loop takes with reps sequences for b, or -1 on error.
+static double time_per_iter(const bench_t *b, int reps, int iters, int jit, int *helpers, int *helper_ct) {
+	int len, entry;
+	uint8_t *prog=gen_prog(b, reps, &len, &entry, helpers, helper_ct);
+	if (!prog) return -1;
+	lssl_vm_t *vm=lssl_vm_init(prog, len, 65536);
+	double best=-1;
+	if (vm) {
+		if (jit) lssl_vm_jit(vm);
+		vm_error_t err={};
+		lssl_vm_run_main(vm, &err);
+		for (int i=0; i<RUNS && !err.type; i++) {
+			double ns=time_loop(vm, entry, iters);
+			if (ns<0) break;
+			if (best<0 || ns<best) best=ns;
+		}
+		lssl_vm_free(vm);
+	}
+	free(prog);
+	return (best<0)?-1:best/iters;
+}
+
+//Finds the syscalls and the kinds of arguments they take from their syscalldefs.
+static int find_syscalls(bench_t *b, int max) {
+	int ct=0;
+	const char *name, *header;
+	for (int l=0; vm_syscall_get_info(l, &name, &header); l++) {
+		for (const char *s=header?strstr(header, "syscalldef "):NULL; s; s=strstr(s, "syscalldef ")) {
+			s+=strlen("syscalldef ");
+			char fname[64];
+			int n=strcspn(s, "(");
+			if (n>=sizeof(fname) || s[n]!='(' || ct==max) continue;
+			memcpy(fname, s, n);
+			fname[n]=0;
+			bench_t *e=&b[ct];
+			memset(e, 0, sizeof(*e));
+			e->op=INSN_SYSCALL;
+			e->name=strdup(fname);
+			e->syscall=vm_syscall_handle_for_name(fname);
+			s+=n+1;
+			//Args: 'x' is a number, 'type x' or 'x[]' an object, 'x(...)' a function.
+			const char *arg=s;
+			for (int depth=0; *s && depth>=0; s++) {
+				if (*s=='(') depth++;
+				if (*s==')') depth--;
+				if ((*s==',' && depth==0) || depth<0) {
+					while (*arg==' ') arg++;
+					int len=s-arg;
+					while (len && arg[len-1]==' ') len--;
+					int kind=ARG_KIND_NUM;
+					if (memchr(arg, '(', len)) {
+						kind=ARG_KIND_FN;
+					} else if (memchr(arg, '[', len) || memchr(arg, ' ', len)) {
+						kind=ARG_KIND_OBJ;
+					}
+					if (len && e->argc<16) e->argkind[e->argc++]=kind;
+					arg=s+1;
+				}
+			}
+			//Things that print, and syscalls that take more objects than there are
+			int objs=0;
+			for (int i=0; i<e->argc; i++) objs+=(e->argkind[i]==ARG_KIND_OBJ);
+			if (e->syscall<0 || strcmp(fname, "dump_stack")==0 || objs>MAX_OBJ_ARGS) {
+				free((char*)e->name);
+				continue;
+			}
+			ct++;
+		}
+	}
+	return ct;
+}
+
+static void usage() {
+	printf("Usage: vm_bench [-h] [-j] [-m] [-g GHz] [-f filter]\n");
+	printf("  -j: run the loops as native code (x86-64 Linux only)\n");
+	printf("  -m: machine-readable output: kind, name, ns and (with -g) cycles, tab separated\n");
+	printf("  -g GHz: also show cycles per insn for a CPU running at this speed\n");
+	printf("  -f filter: only measure insns and syscalls with this in their name\n");
+}
+
+int main(int argc, char **argv) {
+	int jit=0, machine=0;
+	double ghz=0;
+	const char *filter="";
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-j")==0) {
+			jit=1;
+		} else if (strcmp(argv[i], "-m")==0) {
+			machine=1;
+		} else if (strcmp(argv[i], "-g")==0 && argc>i+1) {
+			ghz=atof(argv[++i]);
+		} else if (strcmp(argv[i], "-f")==0 && argc>i+1) {
+			filter=argv[++i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	led_syscalls_init();
+
+	//Measured in this order, so the insns the sequences need are measured before they're
+	//needed; the rest follow in opcode order, then the syscalls.
+	static const int first[]={INSN_PUSH_R, INSN_PUSH_I, INSN_LEA, INSN_LEA_G, INSN_LDA, INSN_LDA_G,
+			INSN_CALL, INSN_SCOPE_ENTER};
+	int nfirst=sizeof(first)/sizeof(first[0]);
+	bench_t benches[LSSL_INSN_COUNT+256];
+	int ct=0;
+	for (int i=0; i<nfirst; i++) benches[ct++]=(bench_t){.op=first[i]};
+	for (int op=0; op<LSSL_INSN_COUNT; op++) {
+		int dup=(op==INSN_SYSCALL || op==INSN_POP || op==INSN_RETURN || op==INSN_SCOPE_LEAVE);
+		for (int i=0; i<nfirst; i++) dup|=(op==first[i]);
+		if (!dup) benches[ct++]=(bench_t){.op=op};
+	}
+	ct+=find_syscalls(&benches[ct], 256);
+	for (int i=0; i<ct; i++) {
+		if (!benches[i].name) benches[i].name=lssl_vm_ops[benches[i].op].op;
+	}
+
+	//Iterations needed for a run to take long enough, using the empty loop
+	bench_t empty={.op=INSN_JMP};
+	int helpers[64], helper_ct;
+	int iters=1000;
+	while (iters<(1<<24) && time_per_iter(&empty, REPS, iters, jit, helpers, &helper_ct)*iters<MIN_NS) iters*=2;
+	double loop_ns=time_per_iter(&empty, 0, iters, jit, helpers, &helper_ct);
+
+	double cost[LSSL_INSN_COUNT];
+	int known[LSSL_INSN_COUNT]={};
+	if (!machine) {
+		printf("%d iterations of %d copies per measurement%s\n", iters, REPS, jit?", native code":"");
+		printf("%-24s %10s%s\n", "", "ns/op", ghz?"   cycles/op":"");
+	}
+	for (int i=0; i<ct; i++) {
+		bench_t *b=&benches[i];
+		//The first ones are needed for the rest
+		if (i>=nfirst && !strstr(b->name, filter)) continue;
+		double t=time_per_iter(b, REPS, iters, jit, helpers, &helper_ct);
+		if (t<0) {
+			if (!machine) printf("%-24s %10s\n", b->name, "n/a");
+			continue;
+		}
+		double ns=(t-loop_ns)/REPS;
+		for (int h=0; h<helper_ct; h++) {
+			if (!known[helpers[h]]) printf("Warning: %s is measured with %s, which isn't known yet\n", b->name, lssl_vm_ops[helpers[h]].op);
+			ns-=cost[helpers[h]];
+		}
+		const char *label=b->name;
+		if (b->op==INSN_PUSH_R) {
+			ns/=2;
+			cost[INSN_POP]=ns;
+			known[INSN_POP]=1;
+		} else if (b->op==INSN_CALL) {
+			cost[INSN_RETURN]=0;
+			known[INSN_RETURN]=1;
+			label="CALL+RETURN";
+		} else if (b->op==INSN_SCOPE_ENTER) {
+			cost[INSN_SCOPE_LEAVE]=0;
+			known[INSN_SCOPE_LEAVE]=1;
+			label="SCOPE_ENTER+LEAVE";
+		}
+		if (b->op!=INSN_SYSCALL) {
+			cost[b->op]=ns;
+			known[b->op]=1;
+		}
+		if (!strstr(b->name, filter)) continue;
+		for (int k=0; k<=(b->op==INSN_PUSH_R); k++) {
+			if (k) label="POP";
+			if (machine) {
+				printf("%s\t%s\t%.3f", (b->op==INSN_SYSCALL)?"syscall":"insn", label, ns);
+				if (ghz) printf("\t%.1f", ns*ghz);
+			} else {
+				printf("%-24s %10.2f", label, ns);
+				if (ghz) printf("%12.1f", ns*ghz);
+			}
+			printf("\n");
+		}
+	}
+	vm_syscall_free();
+	return 0;
+}
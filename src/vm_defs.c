@@ -5,11 +5,14 @@
 #define TOKENPASTE(x, y) x ## y
 #define TOKENPASTE2(x, y) TOKENPASTE(x, y)
 
-#define LSSL_INS_ENTRY(ins, argtype, desc) {STRINGIFY(ins), argtype},
+#define LSSL_INS_ENTRY(ins, argtype, pops, pushes, desc) {STRINGIFY(ins), argtype, pops, pushes, INSN_##ins},
+#define LSSL_RINS_ENTRY(ins, argtype, stack_op, desc) {STRINGIFY(ins), argtype, 0, 0, INSN_##stack_op},
 const lssl_vm_op_t lssl_vm_ops[]={
 	LSSL_INSTRUCTIONS
+	LSSL_REG_INSTRUCTIONS
 };
 #undef LSSL_INS_ENTRY
+#undef LSSL_RINS_ENTRY
 
 #define LSSL_ARGTYPE_ENTRY(arg, argbytes) {.byte_size=argbytes},
 const lssl_vm_argtype_t lssl_vm_argtypes[]={
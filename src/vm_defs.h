@@ -4,14 +4,15 @@
 //Increase this if you mess with instructions, argtypes  or syscalls
 //It makes previous binaries incompatible with the VM, forcing the user
 //to do a recompile.
-#define LSSL_VM_VER 1
+#define LSSL_VM_VER 3
 
 
 //We use some Deeper C Preprocessor Magic so we can keep the instruction defs and arg
 //types in one place, and generate enums/structs/... from that. This keeps them from 
 //going out of sync.
 
-//name of arg, bytes in opcode
+//name of arg, bytes in opcode. The RRR/RRN/RN/RT args of the register insns are made up
+//of slots (R, 16 bit), numbers (N, 32 bit) and jump targets (T, 16 bit), in that order.
 #define LSSL_ARGTYPES \
 	LSSL_ARGTYPE_ENTRY(NOP, 0) \
 	LSSL_ARGTYPE_ENTRY(NONE, 1) \
@@ -22,62 +23,101 @@
 	LSSL_ARGTYPE_ENTRY(STRUCT, 3) \
 	LSSL_ARGTYPE_ENTRY(LABEL, 3) \
 	LSSL_ARGTYPE_ENTRY(TARGET, 3) \
-	LSSL_ARGTYPE_ENTRY(FUNCTION, 3)
+	LSSL_ARGTYPE_ENTRY(FUNCTION, 3) \
+	LSSL_ARGTYPE_ENTRY(RRR, 7) \
+	LSSL_ARGTYPE_ENTRY(RRN, 9) \
+	LSSL_ARGTYPE_ENTRY(RN, 7) \
+	LSSL_ARGTYPE_ENTRY(RT, 5)
 
-//name of inst, type of arg
+//name of inst, type of arg, values popped, values pushed. Note that the verifier in
+//vm.c special-cases the stack effects of instructions where these depend on the
+//argument or on runtime values (ENTER, RETURN, CALL, SYSCALL, SCOPE_*, *INIT).
 #define LSSL_INSTRUCTIONS \
-	LSSL_INS_ENTRY(NOP, ARG_NOP, "No operation") \
-	LSSL_INS_ENTRY(PUSH_I, ARG_INT, "Push the integer I to the stack as a number") \
-	LSSL_INS_ENTRY(PUSH_R, ARG_REAL, "Push the number N to the stack") \
-	LSSL_INS_ENTRY(WR_VAR, ARG_NONE, "Pop address & value, write value to address") \
-	LSSL_INS_ENTRY(MUL, ARG_NONE, "Pop two values and push the multiplied result") \
-	LSSL_INS_ENTRY(DIV, ARG_NONE, "Pop two values and push the divided result") \
-	LSSL_INS_ENTRY(MOD, ARG_NONE, "Pop two values and push the modulus") \
-	LSSL_INS_ENTRY(ADD, ARG_NONE, "Pop two values and push the added result") \
-	LSSL_INS_ENTRY(SUB, ARG_NONE, "Pop two values and push the subtracted result") \
-	LSSL_INS_ENTRY(LAND, ARG_NONE, "Pop two values and push the logical and-ed result") \
-	LSSL_INS_ENTRY(LOR, ARG_NONE, "Pop two values and push the logical or-ed result") \
-	LSSL_INS_ENTRY(BAND, ARG_NONE, "Pop two values and push the binary and-ed result") \
-	LSSL_INS_ENTRY(BOR, ARG_NONE, "Pop two values and push the binary or-ed result") \
-	LSSL_INS_ENTRY(BXOR, ARG_NONE, "Pop two values and push the binary xor-ed result") \
-	LSSL_INS_ENTRY(BNOT, ARG_NONE, "Pop value and push the bit inverted result") \
-	LSSL_INS_ENTRY(LNOT, ARG_NONE, "Pop value and push the logical inverse result") \
-	LSSL_INS_ENTRY(JMP, ARG_TARGET, "Jump to the argument") \
-	LSSL_INS_ENTRY(JNZ, ARG_TARGET, "Pop value, jump to the argument if it's non-zero") \
-	LSSL_INS_ENTRY(JZ, ARG_TARGET, "Pop value, jump to the argument if it's zero") \
-	LSSL_INS_ENTRY(ENTER, ARG_INT, "Increase sp by argument to make space for local vars") \
-	LSSL_INS_ENTRY(RETURN, ARG_INT, "Pop value, restore sp to bp, pop return address, bp and ap, " \
+	LSSL_INS_ENTRY(NOP, ARG_NOP, 0, 0, "No operation") \
+	LSSL_INS_ENTRY(PUSH_I, ARG_INT, 0, 1, "Push the integer I to the stack as a number") \
+	LSSL_INS_ENTRY(PUSH_R, ARG_REAL, 0, 1, "Push the number N to the stack") \
+	LSSL_INS_ENTRY(WR_VAR, ARG_NONE, 2, 0, "Pop address & value, write value to address") \
+	LSSL_INS_ENTRY(MUL, ARG_NONE, 2, 1, "Pop two values and push the multiplied result") \
+	LSSL_INS_ENTRY(DIV, ARG_NONE, 2, 1, "Pop two values and push the divided result") \
+	LSSL_INS_ENTRY(MOD, ARG_NONE, 2, 1, "Pop two values and push the modulus") \
+	LSSL_INS_ENTRY(ADD, ARG_NONE, 2, 1, "Pop two values and push the added result") \
+	LSSL_INS_ENTRY(SUB, ARG_NONE, 2, 1, "Pop two values and push the subtracted result") \
+	LSSL_INS_ENTRY(LAND, ARG_NONE, 2, 1, "Pop two values and push the logical and-ed result") \
+	LSSL_INS_ENTRY(LOR, ARG_NONE, 2, 1, "Pop two values and push the logical or-ed result") \
+	LSSL_INS_ENTRY(BAND, ARG_NONE, 2, 1, "Pop two values and push the binary and-ed result") \
+	LSSL_INS_ENTRY(BOR, ARG_NONE, 2, 1, "Pop two values and push the binary or-ed result") \
+	LSSL_INS_ENTRY(BXOR, ARG_NONE, 2, 1, "Pop two values and push the binary xor-ed result") \
+	LSSL_INS_ENTRY(BNOT, ARG_NONE, 1, 1, "Pop value and push the bit inverted result") \
+	LSSL_INS_ENTRY(LNOT, ARG_NONE, 1, 1, "Pop value and push the logical inverse result") \
+	LSSL_INS_ENTRY(JMP, ARG_TARGET, 0, 0, "Jump to the argument") \
+	LSSL_INS_ENTRY(JNZ, ARG_TARGET, 1, 0, "Pop value, jump to the argument if it's non-zero") \
+	LSSL_INS_ENTRY(JZ, ARG_TARGET, 1, 0, "Pop value, jump to the argument if it's zero") \
+	LSSL_INS_ENTRY(ENTER, ARG_INT, 0, 0, "Increase sp by argument to make space for local vars") \
+	LSSL_INS_ENTRY(RETURN, ARG_INT, 1, 0, "Pop value, restore sp to bp, pop return address, bp and ap, " \
 			"subtract arg from sp (to account for function args), push value") \
-	LSSL_INS_ENTRY(CALL, ARG_FUNCTION, "Push ap, bp and pc, set bp=sp, jump to arg") \
-	LSSL_INS_ENTRY(POP, ARG_NONE, "Pop value and discard") \
-	LSSL_INS_ENTRY(TEQ, ARG_NONE, "Pop two values, push 1 if equal, 0 otherwise") \
-	LSSL_INS_ENTRY(TNEQ, ARG_NONE, "Pop two values, push 1 if not equal, 0 otherwise") \
-	LSSL_INS_ENTRY(TL, ARG_NONE, "Pop two values, push 1 if 1st is less, 0 otherwise") \
-	LSSL_INS_ENTRY(TG, ARG_NONE, "Pop two values, push 1 if 1st is greater, 0 otherwise") \
-	LSSL_INS_ENTRY(TLEQ, ARG_NONE, "Pop two values, push 1 if 1st is less or equal, 0 otherwise") \
-	LSSL_INS_ENTRY(TGEQ, ARG_NONE, "Pop two values, push 1 if 1st is greater or equal, 0 otherwise") \
-	LSSL_INS_ENTRY(SYSCALL, ARG_INT, "Perform a syscall. Syscall no is in lower 12 bit, " \
+	LSSL_INS_ENTRY(CALL, ARG_FUNCTION, 0, 1, "Push ap, bp and pc, set bp=sp, jump to arg") \
+	LSSL_INS_ENTRY(POP, ARG_NONE, 1, 0, "Pop value and discard") \
+	LSSL_INS_ENTRY(TEQ, ARG_NONE, 2, 1, "Pop two values, push 1 if equal, 0 otherwise") \
+	LSSL_INS_ENTRY(TNEQ, ARG_NONE, 2, 1, "Pop two values, push 1 if not equal, 0 otherwise") \
+	LSSL_INS_ENTRY(TL, ARG_NONE, 2, 1, "Pop two values, push 1 if 1st is less, 0 otherwise") \
+	LSSL_INS_ENTRY(TG, ARG_NONE, 2, 1, "Pop two values, push 1 if 1st is greater, 0 otherwise") \
+	LSSL_INS_ENTRY(TLEQ, ARG_NONE, 2, 1, "Pop two values, push 1 if 1st is less or equal, 0 otherwise") \
+	LSSL_INS_ENTRY(TGEQ, ARG_NONE, 2, 1, "Pop two values, push 1 if 1st is greater or equal, 0 otherwise") \
+	LSSL_INS_ENTRY(SYSCALL, ARG_INT, 0, 1, "Perform a syscall. Syscall no is in lower 12 bit, " \
 									"arg count is in upper 4 bit.") \
-	LSSL_INS_ENTRY(DUP, ARG_NONE, "Pop a value from the stack and push it twice") \
-	LSSL_INS_ENTRY(LEA, ARG_VAR, "Push the absolute address of the local var") \
-	LSSL_INS_ENTRY(LEA_G, ARG_VAR, "Push the absolute adddress of the global var") \
-	LSSL_INS_ENTRY(LDA, ARG_VAR, "Load the address from the local var and push it") \
-	LSSL_INS_ENTRY(LDA_G, ARG_VAR, "Load the address from the global var and push it") \
-	LSSL_INS_ENTRY(DEREF, ARG_NONE, "Load the address from the local var and push it") \
-	LSSL_INS_ENTRY(PRE_ADD, ARG_REAL, "Pop address, load val from addr, add arg, write to addr, push val") \
-	LSSL_INS_ENTRY(POST_ADD, ARG_REAL, "Pop address, load val from addr, push val, add arg, write to addr") \
-	LSSL_INS_ENTRY(ARRAY_IDX, ARG_INT, "Pop addr, pop idx, addr+=idx*arg, push addr. " \
+	LSSL_INS_ENTRY(DUP, ARG_NONE, 1, 2, "Pop a value from the stack and push it twice") \
+	LSSL_INS_ENTRY(LEA, ARG_VAR, 0, 1, "Push the absolute address of the local var") \
+	LSSL_INS_ENTRY(LEA_G, ARG_VAR, 0, 1, "Push the absolute adddress of the global var") \
+	LSSL_INS_ENTRY(LDA, ARG_VAR, 0, 1, "Load the address from the local var and push it") \
+	LSSL_INS_ENTRY(LDA_G, ARG_VAR, 0, 1, "Load the address from the global var and push it") \
+	LSSL_INS_ENTRY(DEREF, ARG_NONE, 1, 1, "Load the address from the local var and push it") \
+	LSSL_INS_ENTRY(PRE_ADD, ARG_REAL, 1, 1, "Pop address, load val from addr, add arg, write to addr, push val") \
+	LSSL_INS_ENTRY(POST_ADD, ARG_REAL, 1, 1, "Pop address, load val from addr, push val, add arg, write to addr") \
+	LSSL_INS_ENTRY(ARRAY_IDX, ARG_INT, 2, 1, "Pop addr, pop idx, addr+=idx*arg, push addr. " \
 									"Note that the size of the addr returned equal arg. "\
 									"Also throws an error if the addr is out of the range " \
 									"of the original addr.") \
-	LSSL_INS_ENTRY(STRUCT_IDX, ARG_INT, "Pop addr, pop offset, addr+=offset, push addr" \
+	LSSL_INS_ENTRY(STRUCT_IDX, ARG_INT, 2, 1, "Pop addr, pop offset, addr+=offset, push addr" \
 									"Note that the size of the addr returned is the arg " \
 									"to this function. Also throws an error if the offset " \
 									"is outside of the size of the original addr.") \
-	LSSL_INS_ENTRY(SCOPE_ENTER, ARG_NONE, "Push AP, set AP=SP") \
-	LSSL_INS_ENTRY(SCOPE_LEAVE, ARG_NONE, "Set SP=AP, pop AP") \
-	LSSL_INS_ENTRY(ARRAYINIT, ARG_INT, "Pop addr, pop count, [addr]=[SP, count*arg], SP+=count*arg") \
-	LSSL_INS_ENTRY(STRUCTINIT, ARG_INT, "Pop addr, [addr]=[SP, arg], SP+=arg")
+	LSSL_INS_ENTRY(SCOPE_ENTER, ARG_NONE, 0, 1, "Push AP, set AP=SP") \
+	LSSL_INS_ENTRY(SCOPE_LEAVE, ARG_NONE, 0, 0, "Set SP=AP, pop AP") \
+	LSSL_INS_ENTRY(ARRAYINIT, ARG_INT, 2, 0, "Pop addr, pop count, [addr]=[SP, count*arg], SP+=count*arg") \
+	LSSL_INS_ENTRY(STRUCTINIT, ARG_INT, 1, 0, "Pop addr, [addr]=[SP, arg], SP+=arg") \
+	LSSL_INS_ENTRY(STA, ARG_VAR, 1, 0, "Pop value and store it in the local var")
+
+//Register insns (VM version 2). Instead of going through the stack, these work on 'slots':
+//words in the stack frame, relative to BP like the arg of LEA and LDA, so an expression
+//like 'a=pos*0.2+time*2' takes three of them. The compiler keeps temporary values in
+//slots above the local vars. Slots are called d (destination), s and t.
+//name of inst, type of arg, stack insn that does the same operation, description
+#define LSSL_REG_INSTRUCTIONS \
+	LSSL_RINS_ENTRY(RADD, ARG_RRR, ADD, "Add slots s and t, write the result to slot d") \
+	LSSL_RINS_ENTRY(RSUB, ARG_RRR, SUB, "Subtract slot t from slot s, write the result to slot d") \
+	LSSL_RINS_ENTRY(RMUL, ARG_RRR, MUL, "Multiply slots s and t, write the result to slot d") \
+	LSSL_RINS_ENTRY(RDIV, ARG_RRR, DIV, "Divide slot s by slot t, write the result to slot d") \
+	LSSL_RINS_ENTRY(RMOD, ARG_RRR, MOD, "Write the modulus of slot s and slot t to slot d") \
+	LSSL_RINS_ENTRY(RTEQ, ARG_RRR, TEQ, "Write 1 to slot d if slots s and t are equal, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTNEQ, ARG_RRR, TNEQ, "Write 1 to slot d if slots s and t differ, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTL, ARG_RRR, TL, "Write 1 to slot d if slot s is less than slot t, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTG, ARG_RRR, TG, "Write 1 to slot d if slot s is greater than slot t, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTLEQ, ARG_RRR, TLEQ, "Write 1 to slot d if slot s is less or equal to slot t, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTGEQ, ARG_RRR, TGEQ, "Write 1 to slot d if slot s is greater or equal to slot t, 0 otherwise") \
+	LSSL_RINS_ENTRY(RADDI, ARG_RRN, ADD, "Add N to slot s, write the result to slot d") \
+	LSSL_RINS_ENTRY(RSUBI, ARG_RRN, SUB, "Subtract N from slot s, write the result to slot d") \
+	LSSL_RINS_ENTRY(RMULI, ARG_RRN, MUL, "Multiply slot s by N, write the result to slot d") \
+	LSSL_RINS_ENTRY(RDIVI, ARG_RRN, DIV, "Divide slot s by N, write the result to slot d") \
+	LSSL_RINS_ENTRY(RMODI, ARG_RRN, MOD, "Write the modulus of slot s and N to slot d") \
+	LSSL_RINS_ENTRY(RTEQI, ARG_RRN, TEQ, "Write 1 to slot d if slot s equals N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTNEQI, ARG_RRN, TNEQ, "Write 1 to slot d if slot s differs from N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTLI, ARG_RRN, TL, "Write 1 to slot d if slot s is less than N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTGI, ARG_RRN, TG, "Write 1 to slot d if slot s is greater than N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTLEQI, ARG_RRN, TLEQ, "Write 1 to slot d if slot s is less or equal to N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RTGEQI, ARG_RRN, TGEQ, "Write 1 to slot d if slot s is greater or equal to N, 0 otherwise") \
+	LSSL_RINS_ENTRY(RSET, ARG_RN, PUSH_R, "Write N to slot d") \
+	LSSL_RINS_ENTRY(RJZ, ARG_RT, JZ, "Jump to the target if slot s is zero") \
+	LSSL_RINS_ENTRY(RJNZ, ARG_RT, JNZ, "Jump to the target if slot s is non-zero")
 
 
 typedef enum lssl_argtype_enum lssl_argtype_enum;
@@ -88,21 +128,35 @@ enum lssl_argtype_enum {
 #undef LSSL_ARGTYPE_ENTRY
 
 typedef enum lssl_insn_enum lssl_insn_enum;
-#define LSSL_INS_ENTRY(ins, argtype, desc) INSN_##ins,
+#define LSSL_INS_ENTRY(ins, argtype, pops, pushes, desc) INSN_##ins,
+#define LSSL_RINS_ENTRY(ins, argtype, stack_op, desc) INSN_##ins,
 enum lssl_insn_enum {
 	LSSL_INSTRUCTIONS
+	LSSL_REG_INSTRUCTIONS
+	LSSL_INSN_COUNT
 };
 #undef LSSL_INS_ENTRY
+#undef LSSL_RINS_ENTRY
 
 typedef struct {
 	const char *op;
 	uint8_t argtype;
+	uint8_t pops;
+	uint8_t pushes;
+	uint8_t stack_op; //for register insns, the stack insn doing the same; the insn itself otherwise
 } lssl_vm_op_t;
 
 typedef struct {
 	uint8_t byte_size;
 } lssl_vm_argtype_t;
 
+//Clamps the result of adding or subtracting two numbers, like ADD and SUB do
+inline static int32_t saturate(int64_t v) {
+	if (v<INT32_MIN) return INT32_MIN;
+	if (v>INT32_MAX) return INT32_MAX;
+	return v;
+}
+
 //defined in vm_defs.c
 extern const lssl_vm_op_t lssl_vm_ops[];
 extern const lssl_vm_argtype_t lssl_vm_argtypes[];
@@ -0,0 +1,198 @@
+#pragma once
+#include <stdint.h>
+#include "vm.h"
+#include "vm_defs.h"
+#include "vm_syscall.h"
+
+//Internals of the VM, shared between the files implementing it. Nothing outside of
+//vm*.c should need these.
+
+//We dispatch using a jump table of label addresses ('computed goto') if the compiler
+//supports it, as this saves a bounds check and gives every handler its own indirect
+//jump, which branch predictors like a lot better. Otherwise, we fall back to a switch.
+#if defined(__GNUC__) && !defined(LSSL_VM_NO_COMPUTED_GOTO)
+#define LSSL_VM_COMPUTED_GOTO 1
+typedef const void *lssl_vm_handler_t;
+#else
+typedef int lssl_vm_handler_t;
+#endif
+
+//The bytecode gets translated into an array of these when the VM is initialized,
+//so the interpreter does not need to decode variable-length instructions. The
+//handler is the address of the opcode implementation (or the opcode itself if
+//we use a switch to dispatch) and jump targets are indexes into the array. For
+//CALL, the arg is an index into the function table instead. Register insns keep
+//their last operand (slot t, the number or the jump target) in arg, and the
+//slots before that in d and s.
+typedef struct {
+	lssl_vm_handler_t handler;
+	int32_t arg;
+	int16_t d, s;
+} lssl_vm_insn_t;
+
+#define FUNC_UNVERIFIED 0
+#define FUNC_OK 1
+#define FUNC_BAD 2
+
+//Everything that is CALLed or used as a callback gets an entry in the function table.
+//The verifier fills in the rest of the fields.
+typedef struct {
+	int entry;		//insn index of the first instruction
+	int state;		//FUNC_*
+	int nargs;		//arguments cleaned up by RETURN; -1 if it never returns
+	int max_depth;	//max amount of stack words used above BP
+	int max_scopes;	//max nesting depth of SCOPE_ENTER
+} lssl_vm_func_t;
+
+/*
+The program cannot be trusted to leave the return address, BP and AP it saves on the
+stack alone: any address can be written to using WR_VAR. Hence we also keep a copy
+of those in a return stack the program has no access to, and restore from there.
+*/
+//Registers to restore when a call bails out halfway
+typedef struct {
+	int bp, ap, rsp, rbp;
+} lssl_vm_regs_t;
+
+typedef struct lssl_vm_lanes_t lssl_vm_lanes_t;
+typedef struct lssl_vm_jit_t lssl_vm_jit_t;
+
+//C function made by lssl_vm_aot_write() for the function at an insn; see vm_aot.h
+typedef int (lssl_vm_native_fn_t)(lssl_vm_t *vm, int32_t *ret, int depth);
+
+struct lssl_vm_t {
+	lssl_vm_insn_t *insns;
+	int insn_count;
+	uint16_t *insn_pc; //bytecode address for each insn, for error reporting
+	uint8_t *insn_op;  //opcode for each insn
+	vm_syscall_fn_t **syscall_fns; //per SYSCALL insn, indexed by its d
+	lssl_vm_func_t *funcs;
+	int func_count;
+	int last_func;
+	int glob_size;
+	int glob_top; //end of the global arrays/structs allocated by the top-level code
+	int max_depth; //max of max_depth of all verified functions
+	int32_t *stack;
+	int stack_size;
+	int ro_top; //writes below this fail, see lssl_vm_sync()
+	lssl_vm_t *parent; //VM this is a clone of, which owns the program
+	int32_t *rstack;
+	int rstack_size;
+	int rsp;
+	int rbp; //rsp at function entry
+	int bp;
+	int sp;
+	int ap;
+	int pc; //index into insns
+	int error;
+	int lane; //lane syscalls are called for, see lssl_vm_lane()
+	int64_t insns_run; //insns run by the current call, see vm_exec()
+	int64_t insn_stop; //vm_exec() stops when insns_run gets here
+	int64_t insn_limit; //see lssl_vm_set_insn_limit(); 0 if none
+	int64_t insn_total; //see lssl_vm_insn_count()
+	int yielded; //lssl_vm_run() ran out of budget halfway yield_call
+	lssl_vm_call_t yield_call;
+	lssl_vm_regs_t yield_regs;
+	lssl_vm_lanes_t *lanes; //state for lssl_vm_call_lanes(), allocated on first use
+	lssl_vm_jit_t *jit; //native code, see lssl_vm_jit(); shared with clones
+	lssl_vm_native_fn_t **native; //per insn, see lssl_vm_init_native(); shared with clones
+	int wasm; //run by the module the page instantiated, see lssl_vm_wasm()
+#ifdef LSSL_VM_STATS
+	//Only vm.c gets built with this, so it needs to stay the last field.
+	lssl_vm_insn_stat_t *stats; //per insn; shared with clones
+#endif
+};
+
+#ifdef LSSL_VM_PROFILE
+//VM the interpreter is running on this thread, for vm_sample.c
+extern __thread lssl_vm_t *lssl_vm_running;
+#endif
+
+inline static uint32_t make_addr(int pos, int size) {
+	return (pos<<16)|size;
+}
+
+inline static int pos_from_addr(uint32_t addr) {
+	return (addr>>16);
+}
+
+inline static int size_from_addr(uint32_t addr) {
+	return (addr&0xffff);
+}
+
+//Returns 1 if the address is for a single word within the stack.
+inline static int addr_ok(lssl_vm_t *vm, uint32_t addr) {
+	return size_from_addr(addr)==1 && pos_from_addr(addr)<vm->stack_size;
+}
+
+//Note: no bounds checks here. The verifier makes sure a function never uses more
+//than max_depth words, and that is checked when the function is called.
+inline static void push(lssl_vm_t *vm, int32_t val) {
+	vm->stack[vm->sp++]=val;
+}
+
+inline static int32_t pop(lssl_vm_t *vm) {
+	return vm->stack[--vm->sp];
+}
+
+inline static void rpush(lssl_vm_t *vm, int32_t val) {
+	vm->rstack[vm->rsp++]=val;
+}
+
+inline static int32_t rpop(lssl_vm_t *vm) {
+	return vm->rstack[--vm->rsp];
+}
+
+//Saves the registers for a function call and sets up a new stack frame.
+inline static void push_frame(lssl_vm_t *vm, int32_t ret_insn) {
+	push(vm, vm->ap);
+	push(vm, vm->bp);
+	push(vm, ret_insn);
+	rpush(vm, vm->ap);
+	rpush(vm, vm->bp);
+	rpush(vm, vm->rbp);
+	rpush(vm, ret_insn);
+	vm->bp=vm->sp;
+	vm->ap=vm->sp;
+	vm->rbp=vm->rsp;
+}
+
+//Restores the registers saved by push_frame. Returns the return address.
+inline static int32_t pop_frame(lssl_vm_t *vm) {
+	//Also drops the APs saved by SCOPE_ENTERs we didn't leave
+	vm->rsp=vm->rbp;
+	int32_t ret_insn=rpop(vm);
+	vm->rbp=rpop(vm);
+	vm->bp=rpop(vm);
+	vm->ap=rpop(vm);
+	return ret_insn;
+}
+
+//Returns 1 if there's room to call f with the given amount of args still to be pushed.
+inline static int room_for_call(lssl_vm_t *vm, lssl_vm_func_t *f, int argc) {
+	return (vm->sp+argc+3+f->max_depth<=vm->stack_size) && (vm->rsp+4+f->max_scopes<=vm->rstack_size);
+}
+
+//in vm.c
+//Run ARRAYINIT/STRUCTINIT with arg as the argument and the operands on top of the stack.
+//Returns 0, without changing anything, if that would result in an error.
+int lssl_vm_arrayinit(lssl_vm_t *vm, int arg);
+int lssl_vm_structinit(lssl_vm_t *vm, int arg);
+
+//in vm_lanes.c
+void lssl_vm_lanes_free(lssl_vm_t *vm);
+
+//in vm_jit.c
+//Runs the native code from vm->pc until the called function returns. Returns 0 if the
+//interpreter needs to continue from vm->pc (with error untouched), 1 otherwise.
+int lssl_vm_jit_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error);
+void lssl_vm_jit_free(lssl_vm_jit_t *jit);
+
+//in vm_aot.c
+//Same as lssl_vm_jit_exec(), for programs that were translated to C.
+int lssl_vm_aot_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error);
+
+//in vm_wasm.c
+//Same as lssl_vm_jit_exec(), for programs that were translated to a wasm module. The
+//module handles errors itself, so it only returns 0 if it doesn't have the function.
+int lssl_vm_wasm_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error);
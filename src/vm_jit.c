@@ -0,0 +1,1041 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "vm_int.h"
+
+/*
+JIT compiler: translates the decoded instructions into x86-64 code. This is a pretty
+straightforward translation: the native code uses the same stack, frames and return
+stack as the interpreter, so the two can take over from each other at the start of
+any instruction, as long as the registers are written back to the VM struct.
+
+We use that to keep the native code simple: anything that would result in an error
+(divide by zero, bad address, stack overflow, ...) makes the native code write back
+its state and return, after which the interpreter runs the instruction again and
+reports the error exactly as it would have without the JIT.
+
+Register use in the generated code:
+ rbx: vm->stack
+ r12d: sp, minus the words pushed since it was last updated (jit_t.d)
+ r13d: bp
+ r14d: ap
+ r15: vm
+ rbp: table with the native address of every insn (NULL if it can't be jumped to)
+Everything else is scratch. vm->rsp and vm->rbp only live in the VM struct.
+
+The whole program gets translated in one go, as calls and returns jump straight to the
+native code of the insn they go to. Functions that are only used as callbacks aren't
+known at that point, but their code follows a RETURN or JMP, which gets a table entry.
+*/
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LSSL_VM_NO_JIT)
+
+#include <sys/mman.h>
+
+//Return values of the native code
+#define JIT_DONE 0		//the function returned to the caller of lssl_vm_call()
+#define JIT_FALLBACK 1	//the interpreter needs to continue at vm->pc
+#define JIT_ERROR 2		//a syscall set vm->error
+
+typedef int (jit_fn_t)(lssl_vm_t *vm, int32_t *ret, const void *target, const void **table);
+
+struct lssl_vm_jit_t {
+	uint8_t *code;
+	size_t code_size;
+	const void **table;
+};
+
+//Registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define NOREG -1
+
+//Condition codes for jcc/setcc
+#define CC_NO 0x1
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+#define CC_ALWAYS -1
+
+//Memory operand: [base+index*scale+disp]
+typedef struct {
+	int base;
+	int index;
+	int scale;
+	int32_t disp;
+} mem_t;
+
+//A rel32 that needs to point at the code of an insn, or at a stub that lets the
+//interpreter take over at an insn.
+typedef struct {
+	int pos;
+	int insn;
+	int d;
+} fixup_t;
+
+typedef struct {
+	fixup_t *f;
+	int ct;
+	int size;
+} fixup_list_t;
+
+typedef struct {
+	uint8_t *buf;
+	int len;
+	int size;
+	int oom;
+	int d;					//words pushed since r12 was last updated
+	int *insn_pos;			//code position of every insn, -1 if it can't be jumped to
+	fixup_list_t jumps;		//to insns
+	fixup_list_t stubs;		//to fallback stubs
+	fixup_list_t errors;	//to error stubs
+	fixup_list_t done;		//to the exit for returning from the called function
+} jit_t;
+
+static void emit8(jit_t *j, int v) {
+	if (j->len==j->size) {
+		int size=j->size?j->size*2:4096;
+		uint8_t *n=realloc(j->buf, size);
+		if (!n) {
+			j->oom=1;
+			j->len=0;
+			return;
+		}
+		j->buf=n;
+		j->size=size;
+	}
+	j->buf[j->len++]=v;
+}
+
+static void emit32(jit_t *j, int32_t v) {
+	for (int i=0; i<4; i++) emit8(j, (v>>(i*8))&0xff);
+}
+
+static void emit64(jit_t *j, uint64_t v) {
+	emit32(j, v&0xffffffff);
+	emit32(j, v>>32);
+}
+
+static int fits8(int32_t v) {
+	return v>=-128 && v<=127;
+}
+
+static void emit_rex(jit_t *j, int w, int reg, int index, int base) {
+	int rex=0x40;
+	if (w) rex|=8;
+	if (reg&8) rex|=4;
+	if (index!=NOREG && (index&8)) rex|=2;
+	if (base!=NOREG && (base&8)) rex|=1;
+	if (rex!=0x40) emit8(j, rex);
+}
+
+//Opcodes of two bytes are passed as e.g. 0x0FAF.
+static void emit_opcode(jit_t *j, int op) {
+	if (op>0xff) emit8(j, op>>8);
+	emit8(j, op&0xff);
+}
+
+//op reg, [mem]. For opcodes with a /n extension, reg is n.
+static void op_mem(jit_t *j, int w, int op, int reg, mem_t m) {
+	emit_rex(j, w, reg, m.index, m.base);
+	emit_opcode(j, op);
+	int mod=(m.disp==0 && (m.base&7)!=RBP)?0:(fits8(m.disp)?1:2);
+	if (m.index!=NOREG || (m.base&7)==RSP) {
+		int ss=(m.scale==8)?3:(m.scale==4)?2:(m.scale==2)?1:0;
+		int index=(m.index==NOREG)?RSP:m.index;
+		emit8(j, (mod<<6)|((reg&7)<<3)|4);
+		emit8(j, (ss<<6)|((index&7)<<3)|(m.base&7));
+	} else {
+		emit8(j, (mod<<6)|((reg&7)<<3)|(m.base&7));
+	}
+	if (mod==1) emit8(j, m.disp);
+	if (mod==2) emit32(j, m.disp);
+}
+
+//op reg, rm (register to register). For opcodes with a /n extension, reg is n.
+static void op_reg(jit_t *j, int w, int op, int reg, int rm) {
+	emit_rex(j, w, reg, NOREG, rm);
+	emit_opcode(j, op);
+	emit8(j, 0xC0|((reg&7)<<3)|(rm&7));
+}
+
+static mem_t mem(int base, int index, int scale, int32_t disp) {
+	return (mem_t){base, index, scale, disp};
+}
+
+//Stack slot k words below the top of the stack; slot 1 is the topmost value.
+static mem_t slot(jit_t *j, int k) {
+	return mem(RBX, R12, 4, (j->d-k)*4);
+}
+
+//Word k of the stack frame, as used by LDA and the register insns
+static mem_t frame_slot(int k) {
+	return mem(RBX, R13, 4, k*4);
+}
+
+//Field of the VM struct
+#define VMF(field) mem(R15, NOREG, 1, offsetof(lssl_vm_t, field))
+
+//Opcodes we use, in op r, r/m form
+#define OP_ADD 0x03
+#define OP_OR 0x0B
+#define OP_AND 0x23
+#define OP_SUB 0x2B
+#define OP_XOR 0x33
+#define OP_CMP 0x3B
+#define OP_MOVSXD 0x63
+#define OP_TEST 0x85
+#define OP_MOV_RM 0x89 //mov r/m, r
+#define OP_MOV 0x8B
+#define OP_LEA 0x8D
+#define OP_IMUL 0x0FAF
+#define OP_MOVZX16 0x0FB7
+
+//Extensions for the 0x81/0x83 immediate ALU ops
+#define ALU_ADD 0
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_XOR 6
+#define ALU_CMP 7
+
+//Extensions for the 0xC1 shifts
+#define SH_SHL 4
+#define SH_SHR 5
+#define SH_SAR 7
+
+static void mov_r_m(jit_t *j, int reg, mem_t m) {
+	op_mem(j, 0, OP_MOV, reg, m);
+}
+
+static void mov_m_r(jit_t *j, mem_t m, int reg) {
+	op_mem(j, 0, OP_MOV_RM, reg, m);
+}
+
+static void mov64_r_m(jit_t *j, int reg, mem_t m) {
+	op_mem(j, 1, OP_MOV, reg, m);
+}
+
+static void mov_m_i(jit_t *j, mem_t m, int32_t v) {
+	op_mem(j, 0, 0xC7, 0, m);
+	emit32(j, v);
+}
+
+static void mov_r_i(jit_t *j, int reg, int32_t v) {
+	emit_rex(j, 0, 0, NOREG, reg);
+	emit8(j, 0xB8+(reg&7));
+	emit32(j, v);
+}
+
+static void mov64_r_i(jit_t *j, int reg, uint64_t v) {
+	emit_rex(j, 1, 0, NOREG, reg);
+	emit8(j, 0xB8+(reg&7));
+	emit64(j, v);
+}
+
+static void alu_r_i(jit_t *j, int w, int ext, int reg, int32_t v) {
+	if (fits8(v)) {
+		op_reg(j, w, 0x83, ext, reg);
+		emit8(j, v);
+	} else {
+		op_reg(j, w, 0x81, ext, reg);
+		emit32(j, v);
+	}
+}
+
+static void alu_m_i(jit_t *j, int ext, mem_t m, int32_t v) {
+	if (fits8(v)) {
+		op_mem(j, 0, 0x83, ext, m);
+		emit8(j, v);
+	} else {
+		op_mem(j, 0, 0x81, ext, m);
+		emit32(j, v);
+	}
+}
+
+static void shift_r_i(jit_t *j, int w, int ext, int reg, int v) {
+	op_reg(j, w, 0xC1, ext, reg);
+	emit8(j, v);
+}
+
+static void push_r(jit_t *j, int reg) {
+	emit_rex(j, 0, 0, NOREG, reg);
+	emit8(j, 0x50+(reg&7));
+}
+
+static void pop_r(jit_t *j, int reg) {
+	emit_rex(j, 0, 0, NOREG, reg);
+	emit8(j, 0x58+(reg&7));
+}
+
+//Only for eax...ebx, as the low byte of the others needs a REX prefix.
+static void setcc_r(jit_t *j, int cc, int reg) {
+	op_reg(j, 0, 0x0F90|cc, 0, reg);
+}
+
+//Writes 0x10000 to m if condition cc is true, 0 otherwise.
+static void store_flag_m(jit_t *j, int cc, mem_t m) {
+	setcc_r(j, cc, RCX);
+	op_reg(j, 0, OP_MOVZX16-1, RCX, RCX); //movzx ecx, cl
+	shift_r_i(j, 0, SH_SHL, RCX, 16);
+	mov_m_r(j, m, RCX);
+}
+
+//Same, for slot k
+static void store_flag(jit_t *j, int cc, int k) {
+	store_flag_m(j, cc, slot(j, k));
+}
+
+//Short forward jump, fixed up by patch8() at the target
+static int jcc8(jit_t *j, int cc) {
+	emit8(j, 0x70|cc);
+	emit8(j, 0);
+	return j->len-1;
+}
+
+static void patch8(jit_t *j, int pos) {
+	if (!j->oom) j->buf[pos]=j->len-(pos+1);
+}
+
+static void patch32(jit_t *j, int pos, int target) {
+	int32_t rel=target-(pos+4);
+	if (!j->oom) memcpy(&j->buf[pos], &rel, 4);
+}
+
+//Jump with a rel32 that gets added to list, to be filled in later.
+static void jump_fixup(jit_t *j, int cc, fixup_list_t *l, int insn) {
+	if (cc==CC_ALWAYS) {
+		emit8(j, 0xE9);
+	} else {
+		emit8(j, 0x0F);
+		emit8(j, 0x80|cc);
+	}
+	emit32(j, 0);
+	if (l->ct==l->size) {
+		int size=l->size?l->size*2:256;
+		fixup_t *n=realloc(l->f, size*sizeof(fixup_t));
+		if (!n) {
+			j->oom=1;
+			return;
+		}
+		l->f=n;
+		l->size=size;
+	}
+	l->f[l->ct++]=(fixup_t){j->len-4, insn, j->d};
+}
+
+//Jump to the code of insn, which expects r12 to be up to date.
+static void jump_insn(jit_t *j, int cc, int insn) {
+	jump_fixup(j, cc, &j->jumps, insn);
+}
+
+//Let the interpreter take over at insn, which runs it again. Must be done before the
+//code for the insn changes anything.
+static void fallback(jit_t *j, int cc, int insn) {
+	jump_fixup(j, cc, &j->stubs, insn);
+}
+
+//Makes r12 the real sp.
+static void flush_sp(jit_t *j) {
+	if (j->d) alu_r_i(j, 0, ALU_ADD, R12, j->d);
+	j->d=0;
+}
+
+//Writes sp, bp and ap back to the VM, for C code that looks at them.
+static void store_regs(jit_t *j) {
+	op_mem(j, 0, OP_LEA, RAX, mem(R12, NOREG, 1, j->d));
+	mov_m_r(j, VMF(sp), RAX);
+	mov_m_r(j, VMF(bp), R13);
+	mov_m_r(j, VMF(ap), R14);
+}
+
+static void call_abs(jit_t *j, const void *fn) {
+	mov64_r_i(j, RAX, (uint64_t)(uintptr_t)fn);
+	op_reg(j, 0, 0xFF, 2, RAX);
+}
+
+//Loads the address in slot k and falls back to the interpreter at insn if it's not
+//valid for reading (or writing) a single word. Leaves the stack position in rax.
+static void check_addr(jit_t *j, int k, int insn, int write) {
+	mov_r_m(j, RAX, slot(j, k));
+	op_reg(j, 0, OP_MOVZX16, RCX, RAX);
+	alu_r_i(j, 0, ALU_CMP, RCX, 1);
+	fallback(j, CC_NE, insn);
+	shift_r_i(j, 0, SH_SHR, RAX, 16);
+	op_mem(j, 0, OP_CMP, RAX, VMF(stack_size));
+	fallback(j, CC_AE, insn);
+	if (write) {
+		op_mem(j, 0, OP_CMP, RAX, VMF(ro_top));
+		fallback(j, CC_B, insn);
+	}
+}
+
+//Saturates the int64 in rax to an int32 in eax.
+static void saturate_rax(jit_t *j) {
+	op_reg(j, 1, OP_MOVSXD, RCX, RAX);
+	op_reg(j, 1, OP_CMP, RCX, RAX);
+	int p=jcc8(j, CC_E);
+	shift_r_i(j, 1, SH_SAR, RAX, 63);
+	alu_r_i(j, 0, ALU_XOR, RAX, 0x7fffffff);
+	patch8(j, p);
+}
+
+//After a 32-bit add or sub into reg: saturates the result if that overflowed. The
+//wrapped result has the wrong sign then, so that tells which way.
+static void saturate_of(jit_t *j, int reg) {
+	int p=jcc8(j, CC_NO);
+	shift_r_i(j, 0, SH_SAR, reg, 31);
+	alu_r_i(j, 0, ALU_XOR, reg, INT32_MIN);
+	patch8(j, p);
+}
+
+//Condition code for the compare insns, -1 for other insns
+static int cmp_cc(int op) {
+	switch (op) {
+		case INSN_TEQ: return CC_E;
+		case INSN_TNEQ: return CC_NE;
+		case INSN_TL: return CC_L;
+		case INSN_TG: return CC_G;
+		case INSN_TLEQ: return CC_LE;
+		case INSN_TGEQ: return CC_GE;
+	}
+	return -1;
+}
+
+//Marks the insns that can be jumped to. The code for these starts with an up to
+//date r12, and gets a table entry.
+static void find_labels(lssl_vm_t *vm, uint8_t *label) {
+	int n=vm->insn_count;
+	memset(label, 0, n+1);
+	label[0]=1;
+	for (int i=0; i<vm->func_count; i++) label[vm->funcs[i].entry]=1;
+	for (int i=0; i<n; i++) {
+		int op=vm->insn_op[i];
+		if (op==INSN_JMP || op==INSN_JZ || op==INSN_JNZ || op==INSN_RJZ || op==INSN_RJNZ) {
+			label[vm->insns[i].arg]=1;
+		}
+		if (op==INSN_CALL || op==INSN_JMP || op==INSN_RETURN) label[i+1]=1;
+	}
+}
+
+//Emits the code for insn i. Returns how many insns that covered, as some get fused
+//with the next one.
+static int emit_insn(jit_t *j, lssl_vm_t *vm, int i, const uint8_t *label) {
+	int op=vm->insn_op[i];
+	int32_t arg=vm->insns[i].arg;
+	mem_t rd=frame_slot(vm->insns[i].d), rs=frame_slot(vm->insns[i].s);
+	int imm=(op<LSSL_INSN_COUNT && lssl_vm_ops[op].argtype==ARG_RRN);
+	//next insn, if it can be fused with this one
+	int next_op=(i+1<vm->insn_count && !label[i+1])?vm->insn_op[i+1]:-1;
+	int32_t next_arg=vm->insns[i+1].arg;
+
+	switch (op) {
+	case INSN_PUSH_I:
+		mov_m_i(j, slot(j, 0), arg<<16);
+		j->d++;
+		return 1;
+	case INSN_PUSH_R:
+		mov_m_i(j, slot(j, 0), arg);
+		j->d++;
+		return 1;
+	case INSN_MUL:
+		op_mem(j, 1, OP_MOVSXD, RAX, slot(j, 2));
+		op_mem(j, 1, OP_MOVSXD, RCX, slot(j, 1));
+		op_reg(j, 1, OP_IMUL, RAX, RCX);
+		shift_r_i(j, 1, SH_SAR, RAX, 16);
+		saturate_rax(j);
+		mov_m_r(j, slot(j, 2), RAX);
+		j->d--;
+		return 1;
+	case INSN_DIV:
+	case INSN_MOD:
+		mov_r_m(j, RCX, slot(j, 1));
+		op_reg(j, 0, OP_TEST, RCX, RCX);
+		fallback(j, CC_E, i);
+		op_mem(j, 1, OP_MOVSXD, RAX, slot(j, 2));
+		shift_r_i(j, 1, SH_SHL, RAX, 16);
+		op_reg(j, 1, OP_MOVSXD, RCX, RCX);
+		emit8(j, 0x48); emit8(j, 0x99);			//cqo
+		op_reg(j, 1, 0xF7, 7, RCX);				//idiv rcx
+		if (op==INSN_DIV) {
+			saturate_rax(j);
+			mov_m_r(j, slot(j, 2), RAX);
+		} else {
+			//the remainder always fits
+			mov_m_r(j, slot(j, 2), RDX);
+		}
+		j->d--;
+		return 1;
+	case INSN_ADD:
+	case INSN_SUB:
+	case INSN_BAND:
+	case INSN_BOR:
+	case INSN_BXOR: {
+		int alu=(op==INSN_ADD)?OP_ADD:(op==INSN_SUB)?OP_SUB:(op==INSN_BAND)?OP_AND:(op==INSN_BOR)?OP_OR:OP_XOR;
+		mov_r_m(j, RAX, slot(j, 2));
+		op_mem(j, 0, alu, RAX, slot(j, 1));
+		if (op==INSN_ADD || op==INSN_SUB) saturate_of(j, RAX);
+		mov_m_r(j, slot(j, 2), RAX);
+		j->d--;
+		return 1;
+	}
+	case INSN_LAND:
+		alu_m_i(j, ALU_CMP, slot(j, 2), 0);
+		setcc_r(j, CC_NE, RDX);
+		alu_m_i(j, ALU_CMP, slot(j, 1), 0);
+		setcc_r(j, CC_NE, RCX);
+		op_reg(j, 0, OP_AND-2, RDX, RCX);		//and ecx, edx
+		op_reg(j, 0, OP_MOVZX16-1, RCX, RCX);	//movzx ecx, cl
+		shift_r_i(j, 0, SH_SHL, RCX, 16);
+		mov_m_r(j, slot(j, 2), RCX);
+		j->d--;
+		return 1;
+	case INSN_LOR:
+		mov_r_m(j, RAX, slot(j, 2));
+		op_mem(j, 0, OP_OR, RAX, slot(j, 1));
+		store_flag(j, CC_NE, 2);
+		j->d--;
+		return 1;
+	case INSN_BNOT:
+		op_mem(j, 0, 0xF7, 2, slot(j, 1));		//not
+		return 1;
+	case INSN_LNOT:
+		alu_m_i(j, ALU_CMP, slot(j, 1), 0);
+		store_flag(j, CC_E, 1);
+		return 1;
+	case INSN_TEQ:
+	case INSN_TNEQ:
+	case INSN_TL:
+	case INSN_TG:
+	case INSN_TLEQ:
+	case INSN_TGEQ:
+		mov_r_m(j, RAX, slot(j, 2));
+		if (next_op==INSN_JZ || next_op==INSN_JNZ) {
+			//compare and branch in one go
+			mov_r_m(j, RDX, slot(j, 1));
+			j->d-=2;
+			flush_sp(j);
+			op_reg(j, 0, OP_CMP, RAX, RDX);
+			jump_insn(j, (next_op==INSN_JNZ)?cmp_cc(op):(cmp_cc(op)^1), next_arg);
+			return 2;
+		}
+		op_mem(j, 0, OP_CMP, RAX, slot(j, 1));
+		store_flag(j, cmp_cc(op), 2);
+		j->d--;
+		return 1;
+	case INSN_JMP:
+		flush_sp(j);
+		jump_insn(j, CC_ALWAYS, arg);
+		return 1;
+	case INSN_JZ:
+	case INSN_JNZ:
+		mov_r_m(j, RAX, slot(j, 1));
+		j->d--;
+		flush_sp(j);
+		op_reg(j, 0, OP_TEST, RAX, RAX);
+		jump_insn(j, (op==INSN_JZ)?CC_E:CC_NE, arg);
+		return 1;
+	case INSN_ENTER:
+		//Locals start out as 0
+		if (arg<=8) {
+			for (int k=0; k<arg; k++) mov_m_i(j, slot(j, -k), 0);
+		} else {
+			op_mem(j, 1, OP_LEA, RDI, slot(j, 0));
+			mov_r_i(j, RCX, arg);
+			op_reg(j, 0, OP_XOR, RAX, RAX);
+			emit8(j, 0xF3); emit8(j, 0xAB);		//rep stosd
+		}
+		if (arg>0) j->d+=arg;
+		return 1;
+	case INSN_RETURN: {
+		mov_r_m(j, RAX, slot(j, 1));			//return value
+		op_mem(j, 0, OP_LEA, R12, mem(R13, NOREG, 1, -3-arg));
+		j->d=0;
+		//pop_frame(): rstack holds ap, bp, rbp and the return insn, below rbp
+		mov_r_m(j, RSI, VMF(rbp));
+		mov64_r_m(j, RDX, VMF(rstack));
+		op_mem(j, 1, OP_LEA, RDI, mem(RDX, RSI, 4, 0));
+		mov_r_m(j, RCX, mem(RDI, NOREG, 1, -4));
+		mov_r_m(j, RDX, mem(RDI, NOREG, 1, -8));
+		mov_m_r(j, VMF(rbp), RDX);
+		mov_r_m(j, R13, mem(RDI, NOREG, 1, -12));
+		mov_r_m(j, R14, mem(RDI, NOREG, 1, -16));
+		alu_r_i(j, 0, ALU_SUB, RSI, 4);
+		mov_m_r(j, VMF(rsp), RSI);
+		alu_r_i(j, 0, ALU_CMP, RCX, -1);
+		int p=jcc8(j, CC_NE);
+		mov_r_i(j, RCX, i);
+		jump_fixup(j, CC_ALWAYS, &j->done, i);
+		patch8(j, p);
+		mov_m_r(j, mem(RBX, R12, 4, 0), RAX);
+		alu_r_i(j, 0, ALU_ADD, R12, 1);
+		//Go to the code for the insn we return to. If there's none, the interpreter
+		//continues there.
+		mov64_r_m(j, RDX, mem(RBP, RCX, 8, 0));
+		op_reg(j, 1, OP_TEST, RDX, RDX);
+		jump_fixup(j, CC_E, &j->stubs, -1);
+		op_reg(j, 0, 0xFF, 4, RDX);				//jmp rdx
+		return 1;
+	}
+	case INSN_CALL: {
+		lssl_vm_func_t *f=&vm->funcs[arg];
+		int fo=arg*sizeof(lssl_vm_func_t);
+		flush_sp(j);
+		//room_for_call(vm, f, 0)
+		mov64_r_m(j, RDX, VMF(funcs));
+		mov_r_m(j, RAX, mem(RDX, NOREG, 1, fo+offsetof(lssl_vm_func_t, max_depth)));
+		op_mem(j, 0, OP_LEA, RAX, mem(RAX, R12, 1, 3));
+		op_mem(j, 0, OP_CMP, RAX, VMF(stack_size));
+		fallback(j, CC_G, i);
+		mov_r_m(j, RAX, mem(RDX, NOREG, 1, fo+offsetof(lssl_vm_func_t, max_scopes)));
+		op_mem(j, 0, OP_ADD, RAX, VMF(rsp));
+		alu_r_i(j, 0, ALU_ADD, RAX, 4);
+		op_mem(j, 0, OP_CMP, RAX, VMF(rstack_size));
+		fallback(j, CC_G, i);
+		//push_frame(vm, i+1)
+		mov_m_r(j, slot(j, 0), R14);
+		mov_m_r(j, slot(j, -1), R13);
+		mov_m_i(j, slot(j, -2), i+1);
+		alu_r_i(j, 0, ALU_ADD, R12, 3);
+		mov_r_m(j, RSI, VMF(rsp));
+		mov64_r_m(j, RDX, VMF(rstack));
+		op_mem(j, 1, OP_LEA, RDI, mem(RDX, RSI, 4, 0));
+		mov_m_r(j, mem(RDI, NOREG, 1, 0), R14);
+		mov_m_r(j, mem(RDI, NOREG, 1, 4), R13);
+		mov_r_m(j, RAX, VMF(rbp));
+		mov_m_r(j, mem(RDI, NOREG, 1, 8), RAX);
+		mov_m_i(j, mem(RDI, NOREG, 1, 12), i+1);
+		alu_r_i(j, 0, ALU_ADD, RSI, 4);
+		mov_m_r(j, VMF(rsp), RSI);
+		mov_m_r(j, VMF(rbp), RSI);
+		op_reg(j, 0, OP_MOV, R13, R12);
+		op_reg(j, 0, OP_MOV, R14, R12);
+		jump_insn(j, CC_ALWAYS, f->entry);
+		return 1;
+	}
+	case INSN_POP:
+		j->d--;
+		return 1;
+	case INSN_SYSCALL: {
+		int args=(arg>>12)&0xf;
+		vm_syscall_fn_t *fn=vm_syscall_fn(arg&0xfff);
+		if (!fn) {
+			fallback(j, CC_ALWAYS, i);
+			return 1;
+		}
+		//The arguments are popped before the call, but we pass them in place.
+		j->d-=args;
+		store_regs(j);
+		op_reg(j, 1, OP_MOV_RM, R15, RDI);		//mov rdi, r15
+		op_mem(j, 1, OP_LEA, RSI, slot(j, 0));
+		call_abs(j, (const void*)fn);
+		mov_m_r(j, slot(j, 0), RAX);
+		j->d++;
+		alu_m_i(j, ALU_CMP, VMF(error), 0);
+		jump_fixup(j, CC_NE, &j->errors, i);
+		return 1;
+	}
+	case INSN_DUP:
+		mov_r_m(j, RAX, slot(j, 1));
+		mov_m_r(j, slot(j, 0), RAX);
+		j->d++;
+		return 1;
+	case INSN_LEA:
+		if (next_op==INSN_DEREF) {
+			//Reading a local; DEREF would check the address LEA made, which comes down
+			//to checking the position.
+			op_mem(j, 0, OP_LEA, RAX, mem(R13, NOREG, 1, arg));
+			op_reg(j, 0, OP_MOVZX16, RAX, RAX);
+			op_mem(j, 0, OP_CMP, RAX, VMF(stack_size));
+			fallback(j, CC_AE, i);
+			mov_r_m(j, RAX, mem(RBX, RAX, 4, 0));
+			mov_m_r(j, slot(j, 0), RAX);
+			j->d++;
+			return 2;
+		}
+		op_mem(j, 0, OP_LEA, RAX, mem(R13, NOREG, 1, arg));
+		shift_r_i(j, 0, SH_SHL, RAX, 16);
+		alu_r_i(j, 0, 1, RAX, 1);				//or eax, 1
+		mov_m_r(j, slot(j, 0), RAX);
+		j->d++;
+		return 1;
+	case INSN_LEA_G:
+		mov_m_i(j, slot(j, 0), make_addr(arg, 1));
+		j->d++;
+		return 1;
+	case INSN_LDA:
+		mov_r_m(j, RAX, mem(RBX, R13, 4, arg*4));
+		mov_m_r(j, slot(j, 0), RAX);
+		j->d++;
+		return 1;
+	case INSN_LDA_G:
+		mov_r_m(j, RAX, mem(RBX, NOREG, 1, arg*4));
+		mov_m_r(j, slot(j, 0), RAX);
+		j->d++;
+		return 1;
+	case INSN_DEREF:
+		check_addr(j, 1, i, 0);
+		mov_r_m(j, RAX, mem(RBX, RAX, 4, 0));
+		mov_m_r(j, slot(j, 1), RAX);
+		return 1;
+	case INSN_PRE_ADD:
+	case INSN_POST_ADD:
+		check_addr(j, 1, i, 1);
+		mov_r_m(j, RCX, mem(RBX, RAX, 4, 0));
+		op_reg(j, 0, OP_MOV, RDX, RCX);
+		alu_r_i(j, 0, ALU_ADD, RDX, arg);
+		saturate_of(j, RDX);
+		mov_m_r(j, mem(RBX, RAX, 4, 0), RDX);
+		mov_m_r(j, slot(j, 1), (op==INSN_PRE_ADD)?RDX:RCX);
+		return 1;
+	case INSN_ARRAY_IDX:
+		//idx
+		mov_r_m(j, RCX, slot(j, 1));
+		shift_r_i(j, 0, SH_SAR, RCX, 16);
+		op_reg(j, 0, OP_TEST, RCX, RCX);
+		fallback(j, CC_L, i);
+		op_reg(j, 0, 0x69, RDX, RCX);			//imul edx, ecx, arg
+		emit32(j, arg);
+		//addr
+		mov_r_m(j, RAX, slot(j, 2));
+		op_reg(j, 0, OP_MOVZX16, RCX, RAX);
+		op_reg(j, 0, OP_CMP, RDX, RCX);
+		fallback(j, CC_GE, i);
+		shift_r_i(j, 0, SH_SHR, RAX, 16);
+		op_reg(j, 0, OP_ADD, RAX, RDX);
+		shift_r_i(j, 0, SH_SHL, RAX, 16);
+		alu_r_i(j, 0, 1, RAX, arg);				//or eax, arg
+		mov_m_r(j, slot(j, 2), RAX);
+		j->d--;
+		return 1;
+	case INSN_STRUCT_IDX:
+		mov_r_m(j, RAX, slot(j, 1));			//addr
+		shift_r_i(j, 0, SH_SHR, RAX, 16);
+		mov_r_m(j, RCX, slot(j, 2));			//offset
+		shift_r_i(j, 0, SH_SAR, RCX, 16);
+		op_reg(j, 0, OP_ADD, RAX, RCX);
+		shift_r_i(j, 0, SH_SHL, RAX, 16);
+		alu_r_i(j, 0, 1, RAX, arg);
+		mov_m_r(j, slot(j, 2), RAX);
+		j->d--;
+		return 1;
+	case INSN_SCOPE_ENTER:
+		mov_m_r(j, slot(j, 0), R14);
+		j->d++;
+		mov_r_m(j, RSI, VMF(rsp));
+		mov64_r_m(j, RDX, VMF(rstack));
+		mov_m_r(j, mem(RDX, RSI, 4, 0), R14);
+		alu_r_i(j, 0, ALU_ADD, RSI, 1);
+		mov_m_r(j, VMF(rsp), RSI);
+		op_mem(j, 0, OP_LEA, R14, mem(R12, NOREG, 1, j->d));
+		return 1;
+	case INSN_SCOPE_LEAVE:
+		op_mem(j, 0, OP_LEA, R12, mem(R14, NOREG, 1, -1));
+		j->d=0;
+		mov_r_m(j, RSI, VMF(rsp));
+		alu_r_i(j, 0, ALU_SUB, RSI, 1);
+		mov_m_r(j, VMF(rsp), RSI);
+		mov64_r_m(j, RDX, VMF(rstack));
+		mov_r_m(j, R14, mem(RDX, RSI, 4, 0));
+		return 1;
+	case INSN_ARRAYINIT:
+	case INSN_STRUCTINIT:
+		store_regs(j);
+		op_reg(j, 1, OP_MOV_RM, R15, RDI);
+		mov_r_i(j, RSI, arg);
+		call_abs(j, (op==INSN_ARRAYINIT)?(const void*)lssl_vm_arrayinit:(const void*)lssl_vm_structinit);
+		op_reg(j, 0, OP_TEST, RAX, RAX);
+		fallback(j, CC_E, i);
+		mov_r_m(j, R12, VMF(sp));
+		j->d=0;
+		return 1;
+	case INSN_WR_VAR:
+		check_addr(j, 2, i, 1);
+		mov_r_m(j, RCX, slot(j, 1));
+		mov_m_r(j, mem(RBX, RAX, 4, 0), RCX);
+		j->d-=2;
+		return 1;
+	case INSN_STA:
+		mov_r_m(j, RAX, slot(j, 1));
+		mov_m_r(j, frame_slot(arg), RAX);
+		j->d--;
+		return 1;
+	case INSN_RADD:
+	case INSN_RSUB:
+	case INSN_RADDI:
+	case INSN_RSUBI: {
+		int add=(op==INSN_RADD || op==INSN_RADDI);
+		mov_r_m(j, RAX, rs);
+		if (imm) {
+			alu_r_i(j, 0, add?ALU_ADD:ALU_SUB, RAX, arg);
+		} else {
+			op_mem(j, 0, add?OP_ADD:OP_SUB, RAX, frame_slot(arg));
+		}
+		saturate_of(j, RAX);
+		mov_m_r(j, rd, RAX);
+		return 1;
+	}
+	case INSN_RMUL:
+	case INSN_RMULI:
+		op_mem(j, 1, OP_MOVSXD, RAX, rs);
+		if (imm) {
+			op_reg(j, 1, 0x69, RAX, RAX);		//imul rax, rax, arg
+			emit32(j, arg);
+		} else {
+			op_mem(j, 1, OP_MOVSXD, RCX, frame_slot(arg));
+			op_reg(j, 1, OP_IMUL, RAX, RCX);
+		}
+		shift_r_i(j, 1, SH_SAR, RAX, 16);
+		saturate_rax(j);
+		mov_m_r(j, rd, RAX);
+		return 1;
+	case INSN_RDIV:
+	case INSN_RMOD:
+	case INSN_RDIVI:
+	case INSN_RMODI:
+		if (imm) {
+			if (arg==0) {
+				fallback(j, CC_ALWAYS, i);
+				return 1;
+			}
+			mov_r_i(j, RCX, arg);
+		} else {
+			mov_r_m(j, RCX, frame_slot(arg));
+			op_reg(j, 0, OP_TEST, RCX, RCX);
+			fallback(j, CC_E, i);
+		}
+		op_mem(j, 1, OP_MOVSXD, RAX, rs);
+		shift_r_i(j, 1, SH_SHL, RAX, 16);
+		op_reg(j, 1, OP_MOVSXD, RCX, RCX);
+		emit8(j, 0x48); emit8(j, 0x99);			//cqo
+		op_reg(j, 1, 0xF7, 7, RCX);				//idiv rcx
+		if (op==INSN_RDIV || op==INSN_RDIVI) {
+			saturate_rax(j);
+			mov_m_r(j, rd, RAX);
+		} else {
+			mov_m_r(j, rd, RDX);
+		}
+		return 1;
+	case INSN_RTEQ:
+	case INSN_RTNEQ:
+	case INSN_RTL:
+	case INSN_RTG:
+	case INSN_RTLEQ:
+	case INSN_RTGEQ:
+	case INSN_RTEQI:
+	case INSN_RTNEQI:
+	case INSN_RTLI:
+	case INSN_RTGI:
+	case INSN_RTLEQI:
+	case INSN_RTGEQI:
+		mov_r_m(j, RAX, rs);
+		if (imm) {
+			alu_r_i(j, 0, ALU_CMP, RAX, arg);
+		} else {
+			op_mem(j, 0, OP_CMP, RAX, frame_slot(arg));
+		}
+		store_flag_m(j, cmp_cc(lssl_vm_ops[op].stack_op), rd);
+		return 1;
+	case INSN_RSET:
+		mov_m_i(j, rd, arg);
+		return 1;
+	case INSN_RJZ:
+	case INSN_RJNZ:
+		flush_sp(j);
+		alu_m_i(j, ALU_CMP, rs, 0);
+		jump_insn(j, (op==INSN_RJZ)?CC_E:CC_NE, arg);
+		return 1;
+	default:
+		//NOP and invalid insns; the verifier won't let us get here.
+		fallback(j, CC_ALWAYS, i);
+		return 1;
+	}
+}
+
+//Entry point: save registers, load the VM state and jump to the native code of the
+//first insn.
+static void emit_prologue(jit_t *j) {
+	push_r(j, RBX);
+	push_r(j, RBP);
+	push_r(j, R12);
+	push_r(j, R13);
+	push_r(j, R14);
+	push_r(j, R15);
+	alu_r_i(j, 1, ALU_SUB, RSP, 24);			//keeps the stack 16-byte aligned
+	op_mem(j, 1, OP_MOV_RM, RSI, mem(RSP, NOREG, 1, 0));
+	op_reg(j, 1, OP_MOV_RM, RDI, R15);			//mov r15, rdi
+	op_reg(j, 1, OP_MOV_RM, RCX, RBP);			//mov rbp, rcx
+	mov64_r_m(j, RBX, VMF(stack));
+	mov_r_m(j, R12, VMF(sp));
+	mov_r_m(j, R13, VMF(bp));
+	mov_r_m(j, R14, VMF(ap));
+	op_reg(j, 0, 0xFF, 4, RDX);					//jmp rdx
+}
+
+//Exit with return value ret: write back the registers, restore ours and return. Expects
+//the insn we're at in ecx. For JIT_DONE, eax holds the value the function returned.
+static void emit_exit(jit_t *j, int ret) {
+	if (ret==JIT_DONE) {
+		mov64_r_m(j, RDX, mem(RSP, NOREG, 1, 0));
+		mov_m_r(j, mem(RDX, NOREG, 1, 0), RAX);
+	}
+	mov_m_r(j, VMF(pc), RCX);
+	mov_m_r(j, VMF(sp), R12);
+	mov_m_r(j, VMF(bp), R13);
+	mov_m_r(j, VMF(ap), R14);
+	mov_r_i(j, RAX, ret);
+	alu_r_i(j, 1, ALU_ADD, RSP, 24);
+	pop_r(j, R15);
+	pop_r(j, R14);
+	pop_r(j, R13);
+	pop_r(j, R12);
+	pop_r(j, RBP);
+	pop_r(j, RBX);
+	emit8(j, 0xC3);								//ret
+}
+
+//Stubs for the fixups in l: bring r12 up to date, put the insn in ecx and go to the
+//exit at exit_pos.
+static void emit_stubs(jit_t *j, fixup_list_t *l, int exit_pos) {
+	for (int i=0; i<l->ct; i++) {
+		fixup_t *f=&l->f[i];
+		patch32(j, f->pos, j->len);
+		if (f->d) alu_r_i(j, 0, ALU_ADD, R12, f->d);
+		//insn -1 is used when ecx already holds the insn
+		if (f->insn>=0) mov_r_i(j, RCX, f->insn);
+		emit8(j, 0xE9);
+		emit32(j, 0);
+		patch32(j, j->len-4, exit_pos);
+	}
+}
+
+static void jit_free_state(jit_t *j) {
+	free(j->buf);
+	free(j->insn_pos);
+	free(j->jumps.f);
+	free(j->stubs.f);
+	free(j->errors.f);
+	free(j->done.f);
+}
+
+int lssl_vm_jit(lssl_vm_t *vm) {
+	if (vm->jit) return 1;
+	int n=vm->insn_count;
+	jit_t j={};
+	uint8_t *label=calloc(n+1, 1);
+	j.insn_pos=malloc((n+1)*sizeof(int));
+	lssl_vm_jit_t *jit=calloc(1, sizeof(lssl_vm_jit_t));
+	if (jit) jit->table=calloc(n+1, sizeof(void*));
+	if (!label || !j.insn_pos || !jit || !jit->table) goto error;
+	find_labels(vm, label);
+
+	emit_prologue(&j);
+	for (int i=0; i<=n;) {
+		j.insn_pos[i]=-1;
+		if (label[i]) {
+			flush_sp(&j);
+			j.insn_pos[i]=j.len;
+		}
+		if (i==n) {
+			//running off the end of the program
+			fallback(&j, CC_ALWAYS, i);
+			break;
+		}
+		int ct=emit_insn(&j, vm, i, label);
+		if (ct==2) j.insn_pos[i+1]=-1;
+		i+=ct;
+		//code after an unconditional jump is only reached through a label
+		int op=vm->insn_op[i-1];
+		if (op==INSN_JMP || op==INSN_RETURN || op==INSN_CALL) j.d=0;
+	}
+
+	int exit_done=j.len;
+	emit_exit(&j, JIT_DONE);
+	int exit_fallback=j.len;
+	emit_exit(&j, JIT_FALLBACK);
+	int exit_error=j.len;
+	emit_exit(&j, JIT_ERROR);
+	for (int i=0; i<j.jumps.ct; i++) {
+		patch32(&j, j.jumps.f[i].pos, j.insn_pos[j.jumps.f[i].insn]);
+	}
+	for (int i=0; i<j.done.ct; i++) patch32(&j, j.done.f[i].pos, exit_done);
+	emit_stubs(&j, &j.stubs, exit_fallback);
+	emit_stubs(&j, &j.errors, exit_error);
+	if (j.oom) goto error;
+
+	jit->code_size=j.len;
+	jit->code=mmap(NULL, j.len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (jit->code==MAP_FAILED) {
+		jit->code=NULL;
+		goto error;
+	}
+	memcpy(jit->code, j.buf, j.len);
+	if (mprotect(jit->code, j.len, PROT_READ|PROT_EXEC)!=0) goto error;
+	for (int i=0; i<=n; i++) {
+		if (j.insn_pos[i]>=0) jit->table[i]=jit->code+j.insn_pos[i];
+	}
+	vm->jit=jit;
+	jit_free_state(&j);
+	free(label);
+	return 1;
+error:
+	printf("lssl_vm_jit: out of memory\n");
+	jit_free_state(&j);
+	free(label);
+	lssl_vm_jit_free(jit);
+	return 0;
+}
+
+int lssl_vm_jit_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+	const void *target=vm->jit->table[vm->pc];
+	if (!target) return 0;
+	vm->error=LSSL_VM_ERR_NONE;
+	jit_fn_t *fn=(jit_fn_t*)vm->jit->code;
+	int r=fn(vm, ret, target, vm->jit->table);
+	if (r==JIT_FALLBACK) return 0;
+	error->type=(r==JIT_ERROR)?vm->error:LSSL_VM_ERR_NONE;
+	error->pc=vm->insn_pc[vm->pc];
+	return 1;
+}
+
+void lssl_vm_jit_free(lssl_vm_jit_t *jit) {
+	if (!jit) return;
+	if (jit->code) munmap(jit->code, jit->code_size);
+	free(jit->table);
+	free(jit);
+}
+
+#else
+
+int lssl_vm_jit(lssl_vm_t *vm) {
+	return 0;
+}
+
+int lssl_vm_jit_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+	return 0;
+}
+
+void lssl_vm_jit_free(lssl_vm_jit_t *jit) {
+}
+
+#endif
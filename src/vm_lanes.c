@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "vm_int.h"
+
+/*
+Lock-step interpreter. This runs one function for a bunch of argument sets ('lanes')
+at the same time: every stack slot is a row with a word for every lane, so each
+instruction gets decoded once and then does its thing for all lanes in a simple loop
+the compiler can vectorize.
+
+Lanes that take a different branch than the rest of the lanes get split off. Of all
+the lanes, the ones with the lowest pc get run first (with a mask making sure the
+others stay untouched) until they catch up with the pc of another set of lanes, at
+which point the lanes merge again. As code for loops and ifs jumps back to the start
+of the loop or forward to the end of the if, this gets the lanes back together
+pretty quickly. All lanes with the same pc are at the same stack depth, so sp, ap
+etc are kept per group of lanes, not per lane.
+
+Anything we can't do for some lanes only (calls while the lanes are split up), that
+would be visible outside of the lanes (writes to globals, most syscalls) or that
+would make scalar execution behave differently (errors) makes us give up. The caller
+then runs the lanes one by one using the normal interpreter.
+*/
+
+//Stack and return stack words per lane. Functions that need more fall back to the
+//normal interpreter.
+#define LANE_STACK_WORDS 1024
+#define LANE_RSTACK_WORDS 128
+
+//If on average less than a quarter of the lanes do useful work because they're split
+//up, we give up as the normal interpreter is faster then.
+#define UTILIZATION_MIN_INSNS 256
+
+struct lssl_vm_lanes_t {
+	int32_t stack[LANE_STACK_WORDS*LSSL_VM_MAX_LANES];
+	int32_t rstack[LANE_RSTACK_WORDS*LSSL_VM_MAX_LANES];
+};
+
+void lssl_vm_lanes_free(lssl_vm_t *vm) {
+	free(vm->lanes);
+	vm->lanes=NULL;
+}
+
+int lssl_vm_lane(lssl_vm_t *vm) {
+	return vm->lane;
+}
+
+//Writes v to the lanes in mask m of a row, and leaves the other lanes alone.
+inline static void row_store(int32_t *row, const int32_t *v, const int32_t *m, int n) {
+	for (int l=0; l<n; l++) row[l]=(v[l]&m[l])|(row[l]&~m[l]);
+}
+
+inline static void row_fill(int32_t *row, int32_t v, const int32_t *m, int n) {
+	for (int l=0; l<n; l++) row[l]=(v&m[l])|(row[l]&~m[l]);
+}
+
+//Returns the word addr refers to for lane l. Stack below base is shared between the
+//lanes and can only be read. Returns NULL for anything we can't handle here, including
+//invalid addresses; the normal interpreter will report those.
+inline static int32_t *lane_word(lssl_vm_t *vm, int32_t *st, int n, int base, int top,
+									uint32_t addr, int l, int write) {
+	if (!addr_ok(vm, addr)) return NULL;
+	int pos=pos_from_addr(addr);
+	if (pos<base) return write?NULL:&vm->stack[pos];
+	if (pos>=top) return NULL;
+	return &st[(pos-base)*n+l];
+}
+
+//Row of the lane stack for stack position p, and row of the lane return stack for
+//return stack position p.
+#define ROW(p) (&st[((p)-base)*n])
+#define RROW(p) (&rst[(p)*n])
+
+//Pops b, pops a, pushes expr for every lane.
+#define BINOP(expr) do { \
+			int32_t *a=ROW(sp-2), *b=ROW(sp-1); \
+			int32_t v[LSSL_VM_MAX_LANES]; \
+			for (int l=0; l<n; l++) v[l]=(expr); \
+			row_store(a, v, m, n); \
+			sp--; \
+		} while(0)
+
+#define LANE_WORD(addr, l, write) lane_word(vm, st, n, base, top, addr, l, write)
+
+//Addresses of locals come from LEA and are the same for all lanes, so they refer to
+//the same row of the lane stack. Returns that row, or NULL if the lanes in mask m
+//don't all use the same address of a lane-private word.
+inline static int32_t *uniform_row(lssl_vm_t *vm, int32_t *st, int n, int base, int top,
+									const int32_t *a, const int32_t *m, int lead) {
+	int32_t diff=0;
+	for (int l=0; l<n; l++) diff|=(a[l]^a[lead])&m[l];
+	if (diff || !addr_ok(vm, a[lead])) return NULL;
+	int pos=pos_from_addr(a[lead]);
+	if (pos<base || pos>=top) return NULL;
+	return &st[(pos-base)*n];
+}
+
+#define UNIFORM_ROW(a) uniform_row(vm, st, n, base, top, a, m, lead)
+
+//This gets inlined into lssl_vm_call_lanes for the usual amounts of lanes, so the
+//compiler knows the size of the loops over the lanes.
+#if defined(__GNUC__)
+#define LANES_INLINE __attribute__((always_inline)) inline static
+#else
+#define LANES_INLINE inline static
+#endif
+
+//Calculates v=a op b for every lane, for the stack insn a register insn does the same as.
+//Returns 0 if a lane in mask m divides by zero.
+LANES_INLINE int lane_binop(int op, int32_t *v, const int32_t *a, const int32_t *b, const int32_t *m, int n) {
+	switch (op) {
+	case INSN_ADD:
+		for (int l=0; l<n; l++) v[l]=saturate((int64_t)a[l]+b[l]);
+		break;
+	case INSN_SUB:
+		for (int l=0; l<n; l++) v[l]=saturate((int64_t)a[l]-b[l]);
+		break;
+	case INSN_MUL:
+		for (int l=0; l<n; l++) v[l]=saturate(((int64_t)a[l]*(int64_t)b[l])>>16);
+		break;
+	case INSN_DIV:
+	case INSN_MOD:
+		for (int l=0; l<n; l++) {
+			if (m[l] && b[l]==0) return 0;
+		}
+		if (op==INSN_DIV) {
+			for (int l=0; l<n; l++) v[l]=b[l]?saturate((((int64_t)a[l])<<16)/b[l]):0;
+		} else {
+			for (int l=0; l<n; l++) v[l]=b[l]?saturate((((int64_t)a[l])<<16)%b[l]):0;
+		}
+		break;
+	case INSN_TEQ:
+		for (int l=0; l<n; l++) v[l]=(a[l]==b[l])?(1<<16):0;
+		break;
+	case INSN_TNEQ:
+		for (int l=0; l<n; l++) v[l]=(a[l]!=b[l])?(1<<16):0;
+		break;
+	case INSN_TL:
+		for (int l=0; l<n; l++) v[l]=(a[l]<b[l])?(1<<16):0;
+		break;
+	case INSN_TG:
+		for (int l=0; l<n; l++) v[l]=(a[l]>b[l])?(1<<16):0;
+		break;
+	case INSN_TLEQ:
+		for (int l=0; l<n; l++) v[l]=(a[l]<=b[l])?(1<<16):0;
+		break;
+	case INSN_TGEQ:
+		for (int l=0; l<n; l++) v[l]=(a[l]>=b[l])?(1<<16):0;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+LANES_INLINE int exec_lanes(lssl_vm_t *vm, const lssl_vm_call_t *call, const int n, const int32_t *argv,
+						const int32_t *data, int data_ct) {
+	int32_t *st=vm->lanes->stack;
+	int32_t *rst=vm->lanes->rstack;
+	const int base=call->sp-data_ct;
+	int top=base+LANE_STACK_WORDS;
+	if (top>vm->stack_size) top=vm->stack_size;
+	const int parked=vm->insn_count; //pc of lanes waiting for the rest to return
+	lssl_vm_func_t *f=&vm->funcs[call->func];
+
+	//Registers of the group of lanes that is running
+	int sp=call->sp, bp=vm->bp, ap=vm->ap, rsp=0, rbp=0, pc;
+	int32_t m[LSSL_VM_MAX_LANES];	//-1 for lanes in the group, 0 otherwise
+	int lead=0;						//first lane in the group
+	int group_ct=n;
+	int other_min=INT_MAX;			//lowest pc of lanes not in the group
+	int converged=1;				//all lanes that haven't returned are in the group
+	int depth=0;					//call depth; lanes only split up within a function
+	//Saved registers for lanes not in the group
+	int lpc[LSSL_VM_MAX_LANES], lsp[LSSL_VM_MAX_LANES], lap[LSSL_VM_MAX_LANES], lrsp[LSSL_VM_MAX_LANES];
+	int alive[LSSL_VM_MAX_LANES];	//lane hasn't returned from the called function yet
+	int32_t ret_v[LSSL_VM_MAX_LANES]; //return value of parked lanes
+	int ret_nargs=0;
+	int64_t insns=0, lane_insns=0; //for checking utilization
+
+	if (sp+call->argc+3+f->max_depth>top || 4+f->max_scopes>LANE_RSTACK_WORDS) return 0;
+	for (int l=0; l<n; l++) {
+		m[l]=-1;
+		alive[l]=1;
+		lpc[l]=lsp[l]=lap[l]=lrsp[l]=0;
+		ret_v[l]=0;
+	}
+	for (int i=0; i<data_ct; i++) {
+		for (int l=0; l<n; l++) ROW(base+i)[l]=data[l*data_ct+i];
+	}
+	for (int i=0; i<call->argc; i++) {
+		for (int l=0; l<n; l++) ROW(sp)[l]=argv[l*call->argc+i];
+		sp++;
+	}
+	//Same frame as push_frame(vm, -1) would make
+	row_fill(ROW(sp++), ap, m, n);
+	row_fill(ROW(sp++), bp, m, n);
+	row_fill(ROW(sp++), -1, m, n);
+	row_fill(RROW(rsp++), ap, m, n);
+	row_fill(RROW(rsp++), bp, m, n);
+	row_fill(RROW(rsp++), rbp, m, n);
+	row_fill(RROW(rsp++), -1, m, n);
+	bp=sp;
+	ap=sp;
+	rbp=rsp;
+	pc=f->entry;
+
+	for (;;) {
+		if (pc>=other_min) goto reschedule;
+		int op=vm->insn_op[pc];
+		int32_t arg=vm->insns[pc].arg;
+		int rd=vm->insns[pc].d, rs=vm->insns[pc].s; //slots of register insns
+		pc++;
+		insns++;
+		lane_insns+=group_ct;
+		//Let the scalar code run into the limit and report it
+		if (vm->insn_limit && insns>=vm->insn_limit) goto bail;
+		switch (op) {
+		case INSN_PUSH_I:
+			row_fill(ROW(sp++), arg<<16, m, n);
+			break;
+		case INSN_PUSH_R:
+			row_fill(ROW(sp++), arg, m, n);
+			break;
+		case INSN_MUL:
+			BINOP(saturate(((int64_t)a[l]*(int64_t)b[l])>>16));
+			break;
+		case INSN_DIV:
+		case INSN_MOD: {
+			int32_t *b=ROW(sp-1);
+			for (int l=0; l<n; l++) {
+				if (m[l] && b[l]==0) goto bail;
+			}
+			if (op==INSN_DIV) {
+				BINOP(b[l]?saturate((((int64_t)a[l])<<16)/b[l]):0);
+			} else {
+				BINOP(b[l]?saturate((((int64_t)a[l])<<16)%b[l]):0);
+			}
+			break;
+		}
+		case INSN_ADD:
+			BINOP(saturate((int64_t)a[l]+b[l]));
+			break;
+		case INSN_SUB:
+			BINOP(saturate((int64_t)a[l]-b[l]));
+			break;
+		case INSN_LAND:
+			BINOP((a[l]&&b[l])?(1<<16):0);
+			break;
+		case INSN_LOR:
+			BINOP((a[l]||b[l])?(1<<16):0);
+			break;
+		case INSN_BAND:
+			BINOP(a[l]&b[l]);
+			break;
+		case INSN_BOR:
+			BINOP(a[l]|b[l]);
+			break;
+		case INSN_BXOR:
+			BINOP(a[l]^b[l]);
+			break;
+		case INSN_TEQ:
+			BINOP((a[l]==b[l])?(1<<16):0);
+			break;
+		case INSN_TNEQ:
+			BINOP((a[l]!=b[l])?(1<<16):0);
+			break;
+		case INSN_TL:
+			BINOP((a[l]<b[l])?(1<<16):0);
+			break;
+		case INSN_TG:
+			BINOP((a[l]>b[l])?(1<<16):0);
+			break;
+		case INSN_TLEQ:
+			BINOP((a[l]<=b[l])?(1<<16):0);
+			break;
+		case INSN_TGEQ:
+			BINOP((a[l]>=b[l])?(1<<16):0);
+			break;
+		case INSN_BNOT:
+		case INSN_LNOT: {
+			int32_t *a=ROW(sp-1);
+			int32_t v[LSSL_VM_MAX_LANES];
+			for (int l=0; l<n; l++) v[l]=(op==INSN_BNOT)?~a[l]:(a[l]?0:(1<<16));
+			row_store(a, v, m, n);
+			break;
+		}
+		case INSN_JMP:
+			pc=arg;
+			break;
+		case INSN_JZ:
+		case INSN_JNZ:
+		case INSN_RJZ:
+		case INSN_RJNZ: {
+			int32_t *c=(op==INSN_JZ || op==INSN_JNZ)?ROW(--sp):ROW(bp+rs);
+			int taken=0;
+			int jump_if_zero=(op==INSN_JZ || op==INSN_RJZ);
+			for (int l=0; l<n; l++) {
+				if (m[l] && ((c[l]==0)==jump_if_zero)) taken++;
+			}
+			if (taken==group_ct) {
+				pc=arg;
+			} else if (taken!=0) {
+				//Lanes disagree. Save them with their own pc and see who runs next.
+				for (int l=0; l<n; l++) {
+					if (!m[l]) continue;
+					lpc[l]=((c[l]==0)==jump_if_zero)?arg:pc;
+					lsp[l]=sp;
+					lap[l]=ap;
+					lrsp[l]=rsp;
+				}
+				goto pick;
+			}
+			break;
+		}
+		case INSN_ENTER:
+			//Locals start out as 0, same as in the normal interpreter.
+			for (int i=0; i<arg; i++) row_fill(ROW(sp++), 0, m, n);
+			break;
+		case INSN_RETURN: {
+			if (depth==0) {
+				//These lanes are done.
+				for (int l=0; l<n; l++) {
+					if (m[l]) alive[l]=0;
+				}
+				goto pick;
+			}
+			if (!converged) {
+				//Wait for the other lanes to return as well.
+				for (int l=0; l<n; l++) {
+					if (!m[l]) continue;
+					ret_v[l]=ROW(sp-1)[l];
+					lpc[l]=parked;
+				}
+				ret_nargs=arg;
+				goto pick;
+			}
+			int32_t v[LSSL_VM_MAX_LANES];
+			memcpy(v, ROW(sp-1), n*sizeof(int32_t));
+			sp=bp-3-arg;
+			rsp=rbp;
+			pc=RROW(--rsp)[lead];
+			rbp=RROW(--rsp)[lead];
+			bp=RROW(--rsp)[lead];
+			ap=RROW(--rsp)[lead];
+			row_store(ROW(sp++), v, m, n);
+			depth--;
+			break;
+		}
+		case INSN_CALL: {
+			//Lanes that went different ways can't call functions.
+			if (!converged) goto bail;
+			lssl_vm_func_t *cf=&vm->funcs[arg];
+			if (sp+3+cf->max_depth>top || rsp+4+cf->max_scopes>LANE_RSTACK_WORDS) goto bail;
+			row_fill(ROW(sp++), ap, m, n);
+			row_fill(ROW(sp++), bp, m, n);
+			row_fill(ROW(sp++), pc, m, n);
+			row_fill(RROW(rsp++), ap, m, n);
+			row_fill(RROW(rsp++), bp, m, n);
+			row_fill(RROW(rsp++), rbp, m, n);
+			row_fill(RROW(rsp++), pc, m, n);
+			bp=sp;
+			ap=sp;
+			rbp=rsp;
+			pc=cf->entry;
+			depth++;
+			break;
+		}
+		case INSN_POP:
+			sp--;
+			break;
+		case INSN_SYSCALL: {
+			int args=(arg>>12)&0xf;	//argument count
+			vm_syscall_fn_t *fn=vm_syscall_lane_fn(arg&0xfff);
+			if (!fn) goto bail;
+			sp-=args;
+			int32_t v[LSSL_VM_MAX_LANES];
+			for (int l=0; l<n; l++) {
+				v[l]=0;
+				if (!m[l]) continue;
+				int32_t argv[16];
+				for (int i=0; i<args; i++) argv[i]=ROW(sp+i)[l];
+				vm->lane=l;
+				v[l]=fn(vm, argv);
+				if (vm->error) goto bail;
+			}
+			row_store(ROW(sp++), v, m, n);
+			break;
+		}
+		case INSN_DUP:
+			row_store(ROW(sp), ROW(sp-1), m, n);
+			sp++;
+			break;
+		case INSN_LEA:
+			row_fill(ROW(sp++), make_addr(bp+arg, 1), m, n);
+			break;
+		case INSN_LEA_G:
+			row_fill(ROW(sp++), make_addr(arg, 1), m, n);
+			break;
+		case INSN_LDA:
+		case INSN_LDA_G: {
+			int p=(op==INSN_LDA)?bp+arg:arg;
+			if (p<base) {
+				row_fill(ROW(sp++), vm->stack[p], m, n);
+			} else {
+				row_store(ROW(sp), ROW(p), m, n);
+				sp++;
+			}
+			break;
+		}
+		case INSN_DEREF:
+		case INSN_PRE_ADD:
+		case INSN_POST_ADD: {
+			int32_t *a=ROW(sp-1);
+			int32_t v[LSSL_VM_MAX_LANES];
+			int32_t *r=UNIFORM_ROW(a);
+			if (r) {
+				int32_t inc=(op==INSN_DEREF)?0:arg;
+				int32_t old[LSSL_VM_MAX_LANES];
+				for (int l=0; l<n; l++) {
+					old[l]=r[l];
+					v[l]=saturate((int64_t)r[l]+(inc&m[l]));
+				}
+				row_store(r, v, m, n);
+				row_store(a, (op==INSN_POST_ADD)?old:v, m, n);
+				break;
+			}
+			for (int l=0; l<n; l++) {
+				v[l]=0;
+				if (!m[l]) continue;
+				int32_t *w=LANE_WORD(a[l], l, op!=INSN_DEREF);
+				if (!w) goto bail;
+				if (op==INSN_PRE_ADD) *w=saturate((int64_t)*w+arg);
+				v[l]=*w;
+				if (op==INSN_POST_ADD) *w=saturate((int64_t)*w+arg);
+			}
+			row_store(a, v, m, n);
+			break;
+		}
+		case INSN_ARRAY_IDX: {
+			int32_t *a=ROW(sp-2), *b=ROW(sp-1);
+			int32_t v[LSSL_VM_MAX_LANES];
+			for (int l=0; l<n; l++) {
+				int idx=(b[l]>>16);
+				v[l]=make_addr(pos_from_addr(a[l])+idx*arg, arg);
+				if (m[l] && (idx*arg>=size_from_addr(a[l]) || idx<0)) goto bail;
+			}
+			row_store(a, v, m, n);
+			sp--;
+			break;
+		}
+		case INSN_STRUCT_IDX:
+			BINOP(make_addr(pos_from_addr(b[l])+(a[l]>>16), arg));
+			break;
+		case INSN_SCOPE_ENTER:
+			row_fill(ROW(sp++), ap, m, n);
+			row_fill(RROW(rsp++), ap, m, n);
+			ap=sp;
+			break;
+		case INSN_SCOPE_LEAVE:
+			sp=ap-1;
+			ap=RROW(--rsp)[lead];
+			break;
+		case INSN_ARRAYINIT:
+		case INSN_STRUCTINIT: {
+			int size=arg;
+			if (op==INSN_ARRAYINIT) {
+				//Only if all lanes want the same size
+				int count=ROW(--sp)[lead]>>16;
+				for (int l=0; l<n; l++) {
+					if (m[l] && (ROW(sp)[l]>>16)!=count) goto bail;
+				}
+				if (count<0) goto bail;
+				size=count*arg;
+			}
+			int32_t *a=ROW(--sp);
+			if (sp+(int64_t)size+vm->max_depth>top) goto bail;
+			for (int l=0; l<n; l++) {
+				if (!m[l]) continue;
+				int32_t *w=LANE_WORD(a[l], l, 1);
+				if (!w) goto bail;
+				*w=make_addr(sp, size);
+			}
+			for (int i=0; i<size; i++) row_fill(ROW(sp++), 0, m, n);
+			break;
+		}
+		case INSN_WR_VAR: {
+			int32_t *a=ROW(sp-2), *v=ROW(sp-1);
+			int32_t *r=UNIFORM_ROW(a);
+			if (r) {
+				row_store(r, v, m, n);
+				sp-=2;
+				break;
+			}
+			for (int l=0; l<n; l++) {
+				if (!m[l]) continue;
+				int32_t *w=LANE_WORD(a[l], l, 1);
+				if (!w) goto bail;
+				*w=v[l];
+			}
+			sp-=2;
+			break;
+		}
+		case INSN_STA:
+			sp--;
+			row_store(ROW(bp+arg), ROW(sp), m, n);
+			break;
+		case INSN_RADD:
+		case INSN_RSUB:
+		case INSN_RMUL:
+		case INSN_RDIV:
+		case INSN_RMOD:
+		case INSN_RTEQ:
+		case INSN_RTNEQ:
+		case INSN_RTL:
+		case INSN_RTG:
+		case INSN_RTLEQ:
+		case INSN_RTGEQ:
+		case INSN_RADDI:
+		case INSN_RSUBI:
+		case INSN_RMULI:
+		case INSN_RDIVI:
+		case INSN_RMODI:
+		case INSN_RTEQI:
+		case INSN_RTNEQI:
+		case INSN_RTLI:
+		case INSN_RTGI:
+		case INSN_RTLEQI:
+		case INSN_RTGEQI: {
+			//Frame slots are always in the lane stack
+			int32_t v[LSSL_VM_MAX_LANES], imm[LSSL_VM_MAX_LANES];
+			const int32_t *b=imm;
+			if (lssl_vm_ops[op].argtype==ARG_RRR) {
+				b=ROW(bp+arg);
+			} else {
+				for (int l=0; l<n; l++) imm[l]=arg;
+			}
+			if (!lane_binop(lssl_vm_ops[op].stack_op, v, ROW(bp+rs), b, m, n)) goto bail;
+			row_store(ROW(bp+rd), v, m, n);
+			break;
+		}
+		case INSN_RSET:
+			row_fill(ROW(bp+rd), arg, m, n);
+			break;
+		default:
+			goto bail;
+		}
+		continue;
+
+reschedule:
+		//We caught up with (or jumped past) other lanes.
+		for (int l=0; l<n; l++) {
+			if (!m[l]) continue;
+			lpc[l]=pc;
+			lsp[l]=sp;
+			lap[l]=ap;
+			lrsp[l]=rsp;
+		}
+pick: {
+			if (insns>=UTILIZATION_MIN_INSNS && lane_insns*4<insns*n) goto bail;
+			int min=INT_MAX;
+			for (int l=0; l<n; l++) {
+				if (alive[l] && lpc[l]<min) min=lpc[l];
+			}
+			if (min==INT_MAX) goto done; //everything returned
+			if (min==parked) {
+				//All lanes returned from a function we called; finish the return.
+				group_ct=0;
+				for (int l=0; l<n; l++) {
+					m[l]=alive[l]?-1:0;
+					if (alive[l]) {
+						if (!group_ct) lead=l;
+						group_ct++;
+					}
+				}
+				sp=bp-3-ret_nargs;
+				rsp=rbp;
+				pc=RROW(--rsp)[lead];
+				rbp=RROW(--rsp)[lead];
+				bp=RROW(--rsp)[lead];
+				ap=RROW(--rsp)[lead];
+				row_store(ROW(sp++), ret_v, m, n);
+				depth--;
+				other_min=INT_MAX;
+				converged=1;
+				continue;
+			}
+			group_ct=0;
+			other_min=INT_MAX;
+			for (int l=0; l<n; l++) {
+				if (alive[l] && lpc[l]==min) {
+					if (!group_ct) {
+						lead=l;
+					} else if (lsp[l]!=lsp[lead] || lap[l]!=lap[lead] || lrsp[l]!=lrsp[lead]) {
+						//Can't happen unless objects were allocated by some lanes only
+						goto bail;
+					}
+					m[l]=-1;
+					group_ct++;
+				} else {
+					m[l]=0;
+					if (alive[l] && lpc[l]<other_min) other_min=lpc[l];
+				}
+			}
+			converged=(other_min==INT_MAX);
+			pc=min;
+			sp=lsp[lead];
+			ap=lap[lead];
+			rsp=lrsp[lead];
+		}
+	}
+
+done:
+	vm->lane=0;
+	return 1;
+bail:
+	vm->lane=0;
+	vm->error=0;
+	return 0;
+}
+
+int lssl_vm_call_lanes(lssl_vm_t *vm, const lssl_vm_call_t *call, int lanes, const int32_t *argv,
+						const int32_t *data, int data_ct) {
+	if (lanes<1 || lanes>LSSL_VM_MAX_LANES) return 0;
+	//Counting is done by the interpreter, see lssl_vm_stats()
+	const lssl_vm_insn_stat_t *stats;
+	if (lssl_vm_stats(vm, &stats)) return 0;
+	if (!vm->lanes) {
+		vm->lanes=malloc(sizeof(lssl_vm_lanes_t));
+		if (!vm->lanes) return 0;
+	}
+	if (lanes==4) return exec_lanes(vm, call, 4, argv, data, data_ct);
+	if (lanes==8) return exec_lanes(vm, call, 8, argv, data, data_ct);
+	if (lanes==16) return exec_lanes(vm, call, 16, argv, data, data_ct);
+	return exec_lanes(vm, call, lanes, argv, data, data_ct);
+}
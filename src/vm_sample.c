@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sample.h"
+
+#ifdef LSSL_VM_PROFILE
+#include <signal.h>
+#include <sys/time.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "vm_int.h"
+
+#define MAX_SAMPLES (256*1024)
+#define MAX_DEPTH 32
+#define MAX_LABEL 128
+
+typedef struct {
+	int depth;			//0 if the thread wasn't running the interpreter
+	int syscall;		//handle of the syscall running, or -1
+	uint16_t pc[MAX_DEPTH];	//bytecode addresses of the insn running and the CALLs to it
+} sample_t;
+
+static sample_t *samples;
+static int sample_ct;
+
+//Runs on whatever thread the signal lands on, possibly in the middle of a call or return,
+//so this only reads the VM and doesn't trust anything it finds on the return stack.
+static void on_sigprof(int sig) {
+	int i=__atomic_fetch_add(&sample_ct, 1, __ATOMIC_RELAXED);
+	if (i>=MAX_SAMPLES) return;
+	sample_t *s=&samples[i];
+	s->depth=0;
+	s->syscall=-1;
+	lssl_vm_t *vm=lssl_vm_running;
+	if (!vm) return;
+	int pc=*(volatile int *)&vm->pc;
+	if (pc<0 || pc>=vm->insn_count) return;
+	if (vm->insn_op[pc]==INSN_SYSCALL) s->syscall=vm->insns[pc].arg&0xfff;
+	s->pc[s->depth++]=vm->insn_pc[pc];
+	//Every frame has the return address and the rbp of the caller at its rbp.
+	int rbp=vm->rbp;
+	while (s->depth<MAX_DEPTH && rbp>=4 && rbp<=vm->rstack_size) {
+		int ret=vm->rstack[rbp-1];
+		if (ret<1 || ret>vm->insn_count) break; //-1: called from C
+		s->pc[s->depth++]=vm->insn_pc[ret-1];
+		int caller_rbp=vm->rstack[rbp-2];
+		if (caller_rbp>=rbp) break;
+		rbp=caller_rbp;
+	}
+}
+
+int lssl_vm_sample_start(int hz) {
+	if (hz<1) return 0;
+	free(samples);
+	samples=calloc(MAX_SAMPLES, sizeof(sample_t));
+	if (!samples) return 0;
+	sample_ct=0;
+	struct sigaction sa={};
+	sa.sa_handler=on_sigprof;
+	sa.sa_flags=SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL)!=0) return 0;
+	struct itimerval it={};
+	it.it_interval.tv_sec=0;
+	it.it_interval.tv_usec=(hz>1000000)?1:1000000/hz;
+	it.it_value=it.it_interval;
+	return setitimer(ITIMER_PROF, &it, NULL)==0;
+}
+
+void lssl_vm_sample_stop() {
+	struct itimerval it={};
+	setitimer(ITIMER_PROF, &it, NULL);
+	signal(SIGPROF, SIG_IGN);
+}
+
+static int cmp_sample(const void *a, const void *b) {
+	return memcmp(a, b, sizeof(sample_t));
+}
+
+typedef struct {
+	char *stack;
+	int count;
+} folded_t;
+
+static int cmp_folded(const void *a, const void *b) {
+	return strcmp(((const folded_t*)a)->stack, ((const folded_t*)b)->stack);
+}
+
+//Labels the frames of a sample, outer to inner.
+static char *fold_sample(const sample_t *s, lssl_vm_sample_label_fn *label, void *arg) {
+	char *ret=malloc((MAX_DEPTH+1)*MAX_LABEL);
+	if (!ret) return NULL;
+	char *p=ret;
+	if (s->depth==0) p+=sprintf(p, "[outside VM]");
+	for (int d=s->depth-1; d>=0; d--) {
+		char buf[MAX_LABEL];
+		label(s->pc[d], buf, sizeof(buf), arg);
+		p+=sprintf(p, "%s%s", buf, d?";":"");
+	}
+	if (s->syscall>=0) {
+		const char *name=vm_syscall_exists(s->syscall)?vm_syscall_name(s->syscall):"syscall";
+		snprintf(p, MAX_LABEL, ";%s()", name);
+	}
+	return ret;
+}
+
+int lssl_vm_sample_write(FILE *f, lssl_vm_sample_label_fn *label, void *arg) {
+	if (!samples) return 0;
+	int ct=(sample_ct<MAX_SAMPLES)?sample_ct:MAX_SAMPLES;
+	if (sample_ct>ct) printf("Profiler: buffer full, dropped %d samples.\n", sample_ct-ct);
+	//Unused entries in pc[] are zero, so equal call chains sort next to each other. Label
+	//every different one once; different pcs can still end up with the same labels.
+	qsort(samples, ct, sizeof(sample_t), cmp_sample);
+	folded_t *folded=calloc(ct+1, sizeof(folded_t));
+	if (!folded) return 0;
+	int fct=0;
+	for (int i=0; i<ct; i+=folded[fct++].count) {
+		folded[fct].count=1;
+		while (i+folded[fct].count<ct && cmp_sample(&samples[i], &samples[i+folded[fct].count])==0) {
+			folded[fct].count++;
+		}
+		folded[fct].stack=fold_sample(&samples[i], label, arg);
+		if (!folded[fct].stack) break;
+	}
+	qsort(folded, fct, sizeof(folded_t), cmp_folded);
+	for (int i=0; i<fct; ) {
+		int n=0, j=i;
+		for (; j<fct && strcmp(folded[i].stack, folded[j].stack)==0; j++) n+=folded[j].count;
+		fprintf(f, "%s %d\n", folded[i].stack, n);
+		for (; i<j; i++) free(folded[i].stack);
+	}
+	free(folded);
+	return ct;
+}
+
+#else
+
+int lssl_vm_sample_start(int hz) {
+	return 0;
+}
+
+void lssl_vm_sample_stop() {
+}
+
+int lssl_vm_sample_write(FILE *f, lssl_vm_sample_label_fn *label, void *arg) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+
+//Sampling profiler for lssl on Linux. While running, every 1/hz second of CPU time a
+//SIGPROF records what the interpreter is doing on the thread it lands on: the call chain
+//of the program (taken from the return stack) and the syscall it's in, if any. This
+//needs a VM built with LSSL_VM_PROFILE ('make lssl_prof'); without it, nothing can be
+//sampled and lssl_vm_sample_start() returns 0. Native code and lanes aren't sampled.
+
+int lssl_vm_sample_start(int hz);
+void lssl_vm_sample_stop();
+
+//Writes a label for the insn at bytecode address pc into buf, e.g. function and line.
+typedef void (lssl_vm_sample_label_fn)(uint32_t pc, char *buf, int len, void *arg);
+
+//Writes the samples as folded stacks, as used by flamegraph.pl and compatible tools: one
+//line for every call chain, with the frames from outer to inner separated by ';', then
+//the amount of samples. Returns the amount of samples.
+int lssl_vm_sample_write(FILE *f, lssl_vm_sample_label_fn *label, void *arg);
@@ -1,9 +1,10 @@
 #include <stdio.h>
-#include <math.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include "vm_syscall.h"
+#include "fixed_trig.h"
+#include "fixed_noise.h"
 #include "vm_defs.h"
 #include "vm.h"
 
@@ -30,28 +31,48 @@ LSSL_SYSCALL_FUNCTION(syscall_clamp) {
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_sin) {
-	float f=arg[0]/65536.0;
-	return sinf(f)*65536;
+	return fixed_sin(arg[0]);
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_cos) {
-	float f=arg[0]/65536.0;
-	return cosf(f)*65536;
+	return fixed_cos(arg[0]);
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_tan) {
-	float f=arg[0]/65536.0;
-	return tanf(f)*65536;
+	return fixed_tan(arg[0]);
 }
 
 LSSL_SYSCALL_FUNCTION(syscall_atan2) {
-	float y=arg[0]/65536.0;
-	float x=arg[1]/65536.0;
-	return atan2f(y, x)*65536;
+	return fixed_atan2(arg[0], arg[1]);
 }
 
+LSSL_SYSCALL_FUNCTION(syscall_noise1) {
+	return fixed_noise1(arg[0]);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_noise2) {
+	return fixed_noise2(arg[0], arg[1]);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_noise3) {
+	return fixed_noise3(arg[0], arg[1], arg[2]);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_fractal_noise1) {
+	return fixed_fractal_noise1(arg[0], arg[1]>>16);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_fractal_noise2) {
+	return fixed_fractal_noise2(arg[0], arg[1], arg[2]>>16);
+}
+
+LSSL_SYSCALL_FUNCTION(syscall_fractal_noise3) {
+	return fixed_fractal_noise3(arg[0], arg[1], arg[2], arg[3]>>16);
+}
 
 LSSL_SYSCALL_FUNCTION(syscall_rand) {
+	//The sequence rand() gives depends on the order it's called in
+	if (!lssl_vm_shared_write(vm)) return 0;
 	//note this returns a real number
 	if (arg[0]==arg[1]) {
 		return arg[0];
@@ -78,19 +99,33 @@ static const char header[]=
 	"syscalldef tan(x);\n"
 	"syscalldef atan2(y, x);\n"
 	"syscalldef rand(x, y);\n"
-	"syscalldef dump_stack();\n";
+	"syscalldef dump_stack();\n"
+	"syscalldef noise1(x);\n"
+	"syscalldef noise2(x, y);\n"
+	"syscalldef noise3(x, y, z);\n"
+	"syscalldef fractal_noise1(x, octaves);\n"
+	"syscalldef fractal_noise2(x, y, octaves);\n"
+	"syscalldef fractal_noise3(x, y, z, octaves);\n";
 
+//Compiled programs refer to syscalls by their index, so new ones go at the end. The led
+//syscalls are numbered after these, so adding any still needs LSSL_VM_VER increased.
 static const vm_syscall_list_entry_t builtin_syscalls[]={
-	{"abs", syscall_abs}, 
-	{"floor", syscall_floor}, 
-	{"ceil", syscall_ceil}, 
-	{"clamp", syscall_clamp},
-	{"sin", syscall_sin}, 
-	{"cos", syscall_cos}, 
-	{"tan", syscall_tan}, 
-	{"atan2", syscall_atan2}, 
+	{"abs", syscall_abs, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"floor", syscall_floor, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"ceil", syscall_ceil, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"clamp", syscall_clamp, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"sin", syscall_sin, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"cos", syscall_cos, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"tan", syscall_tan, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
+	{"atan2", syscall_atan2, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}, 
 	{"rand", syscall_rand},
-	{"dump_stack", syscall_dumpstack}
+	{"dump_stack", syscall_dumpstack},
+	{"noise1", syscall_noise1, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"noise2", syscall_noise2, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"noise3", syscall_noise3, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"fractal_noise1", syscall_fractal_noise1, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"fractal_noise2", syscall_fractal_noise2, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE},
+	{"fractal_noise3", syscall_fractal_noise3, VM_SYSCALL_LANE_SAFE|VM_SYSCALL_PURE}
 };
 
 typedef struct syscall_list_t syscall_list_t;
@@ -115,6 +150,51 @@ static syscall_list_t syscall_list_builtin={
 
 static syscall_list_t *syscall_list_last=&syscall_list_builtin;
 
+typedef struct {
+	vm_syscall_list_entry_t ent;
+	int nargs;
+} syscall_table_ent_t;
+
+//All syscalls of all lists, indexed by handle, so looking one up doesn't need to walk
+//the lists. Rebuilt when a list is added.
+static syscall_table_ent_t *syscall_table;
+static int syscall_table_len;
+
+//Gets the argument count of a syscall from its syscalldef in the header. Returns -1 if
+//it isn't in there.
+static int nargs_from_header(const char *header, const char *name) {
+	const char *p=header;
+	int len=strlen(name);
+	while ((p=strstr(p, "syscalldef "))!=NULL) {
+		p+=strlen("syscalldef ");
+		if (strncmp(p, name, len)!=0 || p[len]!='(') continue;
+		p+=len+1;
+		int depth=1, nargs=0, empty=1;
+		for (; *p && depth; p++) {
+			if (*p=='(') depth++;
+			if (*p==')') depth--;
+			if (*p==',' && depth==1) nargs++;
+			if (*p!=' ' && *p!=')') empty=0;
+		}
+		return empty?0:nargs+1;
+	}
+	return -1;
+}
+
+static void build_table() {
+	int len=syscall_list_last->start+syscall_list_last->count;
+	syscall_table_ent_t *t=realloc(syscall_table, len*sizeof(syscall_table_ent_t));
+	assert(t && "Out of memory building syscall table!");
+	for (syscall_list_t *l=syscall_list_last; l; l=l->next) {
+		for (int i=0; i<l->count; i++) {
+			t[l->start+i].ent=l->ent[i];
+			t[l->start+i].nargs=nargs_from_header(l->header, l->ent[i].name);
+		}
+	}
+	syscall_table=t;
+	syscall_table_len=len;
+}
+
 void vm_syscall_add_local_syscalls(const char *name, const vm_syscall_list_entry_t *syscalls, 
 									int count, const char *header) {
 	syscall_list_t *l=calloc(1, sizeof(syscall_list_t));
@@ -125,6 +205,7 @@ void vm_syscall_add_local_syscalls(const char *name, const vm_syscall_list_entry
 	l->ent=syscalls;
 	l->header=header;
 	syscall_list_last=l;
+	build_table();
 }
 
 int vm_syscall_handle_for_name(const char *name) {
@@ -152,14 +233,9 @@ int vm_syscall_get_info(int idx, const char **name, const char **header) {
 }
 
 static vm_syscall_list_entry_t const *ent_for_handle(int handle) {
-	syscall_list_t *l=syscall_list_last;
-	while (l) {
-		if (handle>=l->start && handle<(l->start+l->count)) {
-			return &l->ent[handle - l->start];
-		}
-		l=l->next;
-	}
-	return NULL;
+	if (!syscall_table) build_table();
+	if (handle<0 || handle>=syscall_table_len) return NULL;
+	return &syscall_table[handle].ent;
 }
 
 const char *vm_syscall_name(int handle) {
@@ -168,10 +244,36 @@ const char *vm_syscall_name(int handle) {
 	return ent->name;
 }
 
+int vm_syscall_exists(int handle) {
+	return ent_for_handle(handle)!=NULL;
+}
+
+int vm_syscall_nargs(int handle) {
+	if (!ent_for_handle(handle)) return -1;
+	return syscall_table[handle].nargs;
+}
+
+vm_syscall_fn_t *vm_syscall_fn(int handle) {
+	const vm_syscall_list_entry_t *ent=ent_for_handle(handle);
+	return ent?ent->fn:NULL;
+}
+
+vm_syscall_fn_t *vm_syscall_lane_fn(int handle) {
+	const vm_syscall_list_entry_t *ent=ent_for_handle(handle);
+	if (!ent || !(ent->flags&VM_SYSCALL_LANE_SAFE)) return NULL;
+	return ent->fn;
+}
+
+vm_syscall_fn_t *vm_syscall_pure_fn(int handle) {
+	const vm_syscall_list_entry_t *ent=ent_for_handle(handle);
+	if (!ent || !(ent->flags&VM_SYSCALL_PURE)) return NULL;
+	return ent->fn;
+}
+
 int32_t vm_syscall(lssl_vm_t *vm, int syscall, int32_t *arg) {
-	const vm_syscall_list_entry_t *ent=ent_for_handle(syscall);
-	assert(ent && "Invalid syscall entry!");
-	return ent->fn(vm, arg);
+	vm_syscall_fn_t *fn=vm_syscall_fn(syscall);
+	assert(fn && "Invalid syscall entry!");
+	return fn(vm, arg);
 }
 
 void vm_syscall_free() {
@@ -184,5 +286,9 @@ void vm_syscall_free() {
 		}
 		l=next;
 	}
+	syscall_list_last=&syscall_list_builtin;
 	syscall_list_last->next=NULL;
+	free(syscall_table);
+	syscall_table=NULL;
+	syscall_table_len=0;
 }
@@ -1,13 +1,25 @@
+#pragma once
 #include <stdint.h>
 #include "vm.h"
 
 typedef int32_t (vm_syscall_fn_t)(lssl_vm_t *vm, int32_t *args);
 
+//The arguments are passed in place on the VM stack: the syscall may change them, but
+//should not hang on to the pointer.
 #define LSSL_SYSCALL_FUNCTION(name) static int32_t name(lssl_vm_t *vm, int32_t *arg)
 
+//The syscall has no side effects other than ones that depend on lssl_vm_lane(), and does
+//not take addresses or function handles, so it can be called for every lane when running
+//lanes in lock-step.
+#define VM_SYSCALL_LANE_SAFE (1<<0)
+//The result only depends on the (number) arguments and there are no side effects at
+//all, so the compiler can do the call at compile time if all arguments are constant.
+#define VM_SYSCALL_PURE (1<<1)
+
 typedef struct {
 	const char *name;
 	vm_syscall_fn_t *fn;
+	int flags;
 } vm_syscall_list_entry_t;
 
 //Add a list of local syscalls. Note that the data 'header' and 'syscalls' point to should
@@ -17,6 +29,19 @@ void vm_syscall_add_local_syscalls(const char *name, const vm_syscall_list_entry
 int32_t vm_syscall(lssl_vm_t *vm, int syscall, int32_t *arg);
 int vm_syscall_handle_for_name(const char *name);
 const char *vm_syscall_name(int handle);
+//returns 1 if there is a syscall with this handle
+int vm_syscall_exists(int handle);
+//returns the amount of arguments the syscalldef of the syscall has, or -1 if there's no
+//syscall with this handle (or no syscalldef for it)
+int vm_syscall_nargs(int handle);
+//returns the function for the syscall, or NULL if there is none. Handles don't change
+//until vm_syscall_free(), so the VM looks these up once when loading a program.
+vm_syscall_fn_t *vm_syscall_fn(int handle);
+//returns the function for the syscall if it has the VM_SYSCALL_LANE_SAFE flag, NULL otherwise
+vm_syscall_fn_t *vm_syscall_lane_fn(int handle);
+//returns the function for the syscall if it has the VM_SYSCALL_PURE flag, NULL otherwise.
+//The vm argument of a pure syscall can be NULL.
+vm_syscall_fn_t *vm_syscall_pure_fn(int handle);
 void vm_syscall_free();
 //returns 0 if the idx is past the end of the list
 int vm_syscall_get_info(int idx, const char **name, const char **header);
@@ -0,0 +1,1495 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "vm_defs.h"
+#include "vm_syscall.h"
+#include "vm.h"
+#include "vm_int.h"
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+
+/*
+WebAssembly backend: translates a program into a small standalone wasm module, so the
+browser can run it at native speed instead of interpreting it with the VM that is itself
+compiled to wasm. The module imports the memory of the host (the emscripten build of
+the VM) and works on the stack and return stack of the lssl_vm_t in there, exactly like
+the interpreter would; syscalls are imported by name from the host.
+
+Every function in the program becomes a wasm function, and CALLs become wasm calls. As
+wasm only has structured control flow, the basic blocks of a function are dispatched
+from a loop around a br_table; jumps set the block to go to and branch back to the top
+of the loop. Within a basic block, values pushed stay in wasm locals until they're used
+or the block ends, like in vm_aot.c, which makes the same assumptions about the slots of
+the register insns not referring to those values.
+
+Unlike the JIT and the AOT code, the module can't hand over to the interpreter halfway
+a function, so it handles errors itself: the function stops and returns the error, and
+the VM cleans up after it like it does for the interpreter.
+*/
+
+//Registers and VM info the module works with, shared with it through memory. All fields
+//are 32-bit so the layout is the same everywhere; tests/wasm_parity.js uses it as well.
+typedef struct {
+	int32_t stack;		//address of the stack in memory
+	int32_t stack_size;
+	int32_t rstack;		//address of the return stack in memory
+	int32_t rstack_size;
+	int32_t sp, bp, ap, rsp, rbp;
+	int32_t ro_top;
+	int32_t max_depth;
+	int32_t glob_size;
+	int32_t glob_top;
+	int32_t ret;		//value the function returned
+	int32_t pc;			//bytecode address of the insn that ran into an error
+	int32_t vm;			//lssl_vm_t, for the syscalls
+	int32_t argv[16];	//syscall arguments; the result goes in argv[0]
+} lssl_vm_wasm_regs_t;
+
+#define R_OFF(f) offsetof(lssl_vm_wasm_regs_t, f)
+
+//Wasm opcodes and types we use
+#define W_BLOCK 0x02
+#define W_LOOP 0x03
+#define W_IF 0x04
+#define W_ELSE 0x05
+#define W_END 0x0b
+#define W_BR 0x0c
+#define W_BR_IF 0x0d
+#define W_BR_TABLE 0x0e
+#define W_RETURN 0x0f
+#define W_CALL 0x10
+#define W_SELECT 0x1b
+#define W_LOCAL_GET 0x20
+#define W_LOCAL_SET 0x21
+#define W_LOCAL_TEE 0x22
+#define W_GLOBAL_GET 0x23
+#define W_GLOBAL_SET 0x24
+#define W_I32_LOAD 0x28
+#define W_I32_STORE 0x36
+#define W_I32_CONST 0x41
+#define W_I64_CONST 0x42
+#define W_I32_EQZ 0x45
+#define W_I32_EQ 0x46
+#define W_I32_NE 0x47
+#define W_I32_LT_S 0x48
+#define W_I32_LT_U 0x49
+#define W_I32_GT_S 0x4a
+#define W_I32_LE_S 0x4c
+#define W_I32_GE_S 0x4e
+#define W_I32_GE_U 0x4f
+#define W_I64_LT_S 0x53
+#define W_I64_GT_S 0x55
+#define W_I32_ADD 0x6a
+#define W_I32_SUB 0x6b
+#define W_I32_MUL 0x6c
+#define W_I32_AND 0x71
+#define W_I32_OR 0x72
+#define W_I32_XOR 0x73
+#define W_I32_SHL 0x74
+#define W_I32_SHR_S 0x75
+#define W_I32_SHR_U 0x76
+#define W_I64_ADD 0x7c
+#define W_I64_SUB 0x7d
+#define W_I64_MUL 0x7e
+#define W_I64_DIV_S 0x7f
+#define W_I64_REM_S 0x81
+#define W_I64_SHL 0x86
+#define W_I64_SHR_S 0x87
+#define W_I32_WRAP_I64 0xa7
+#define W_I64_EXTEND_I32_S 0xac
+
+#define T_I32 0x7f
+#define T_I64 0x7e
+#define T_FUNC 0x60
+#define T_EMPTY 0x40
+
+//Function types
+enum {TY_RUN=0, TY_FN, TY_SAT, TY_ALLOC, TY_FRAME, TY_VOID2, TY_COUNT};
+
+//Globals: the registers that are shared between the functions, and the regs fields
+//that don't change while running. G_GLOB_SIZE is exported for hosts without a VM.
+enum {G_REGS=0, G_S, G_SS, G_R, G_RS, G_RSP, G_RBP, G_RO, G_MAXD, G_GSIZE, G_GTOP,
+		G_NSP, G_MUTABLE, G_GLOB_SIZE=G_MUTABLE};
+
+//Locals of the functions for the program. The first one is the parameter.
+enum {L_SP=0, L_BP, L_AP, L_A, L_X, L_Y, L_LBL, L_T0};
+
+typedef struct {
+	uint8_t *data;
+	int len;
+	int size;
+	int oom;
+} wbuf_t;
+
+static void emit(wbuf_t *b, int byte) {
+	if (b->len==b->size) {
+		int size=b->size?b->size*2:256;
+		uint8_t *n=realloc(b->data, size);
+		if (!n) {
+			b->oom=1;
+			return;
+		}
+		b->data=n;
+		b->size=size;
+	}
+	b->data[b->len++]=byte;
+}
+
+static void emit_uleb(wbuf_t *b, uint32_t v) {
+	do {
+		int c=v&0x7f;
+		v>>=7;
+		emit(b, c|(v?0x80:0));
+	} while (v);
+}
+
+static void emit_sleb(wbuf_t *b, int64_t v) {
+	while (1) {
+		int c=v&0x7f;
+		v>>=7;
+		if ((v==0 && !(c&0x40)) || (v==-1 && (c&0x40))) {
+			emit(b, c);
+			return;
+		}
+		emit(b, c|0x80);
+	}
+}
+
+static void emit_buf(wbuf_t *b, const wbuf_t *src) {
+	for (int i=0; i<src->len; i++) emit(b, src->data[i]);
+	if (src->oom) b->oom=1;
+}
+
+static void emit_str(wbuf_t *b, const char *s) {
+	emit_uleb(b, strlen(s));
+	while (*s) emit(b, *s++);
+}
+
+//Opcode with an index (local, global, function, branch depth) as immediate
+static void emit_idx(wbuf_t *b, int op, uint32_t idx) {
+	emit(b, op);
+	emit_uleb(b, idx);
+}
+
+static void i32c(wbuf_t *b, int32_t v) {
+	emit(b, W_I32_CONST);
+	emit_sleb(b, v);
+}
+
+static void i64c(wbuf_t *b, int64_t v) {
+	emit(b, W_I64_CONST);
+	emit_sleb(b, v);
+}
+
+//Load or store of a word
+static void emit_mem(wbuf_t *b, int op, uint32_t offset) {
+	emit(b, op);
+	emit_uleb(b, 2);
+	emit_uleb(b, offset);
+}
+
+static void emit_block(wbuf_t *b, int op) {
+	emit(b, op);
+	emit(b, T_EMPTY);
+}
+
+static void emit_section(wbuf_t *b, int id, wbuf_t *sec) {
+	emit(b, id);
+	emit_uleb(b, sec->len);
+	emit_buf(b, sec);
+	free(sec->data);
+	*sec=(wbuf_t){};
+}
+
+typedef struct {
+	lssl_vm_t *vm;
+	wbuf_t *b;			//code of the function being written
+	const int *fidx;	//per insn: wasm function index of the function starting there, or -1
+	const int *sysidx;	//per syscall: wasm function index of the import, or -1
+	int f_sat, f_zero, f_alloc, f_frame, f_ret;
+	int *blk;			//per insn: basic block starting there
+	int blocks;
+	int cur;			//basic block being written
+	int n;				//values pushed but not written to the stack yet, in t0..t(n-1)
+	int m;				//values the current insn popped from the stack; sp isn't updated yet
+	int max_n;
+} wasm_t;
+
+//Operands are either temps (>=0), or words on the stack (-1 is s[sp-1] etc).
+static int pop_opnd(wasm_t *w) {
+	if (w->n) return --w->n;
+	return -(++w->m);
+}
+
+static int push_opnd(wasm_t *w) {
+	if (w->n+1>w->max_n) w->max_n=w->n+1;
+	return w->n++;
+}
+
+//Address of s[local+k]. Returns the offset to use for the load or store.
+static uint32_t slot(wasm_t *w, int local, int k) {
+	emit_idx(w->b, W_LOCAL_GET, local);
+	if (k<0) {
+		i32c(w->b, k);
+		emit(w->b, W_I32_ADD);
+		k=0;
+	}
+	i32c(w->b, 2);
+	emit(w->b, W_I32_SHL);
+	emit_idx(w->b, W_GLOBAL_GET, G_S);
+	emit(w->b, W_I32_ADD);
+	return k*4;
+}
+
+//Address of the word the VM address in L_A points to
+static void addr_pos(wasm_t *w) {
+	emit_idx(w->b, W_LOCAL_GET, L_A);
+	i32c(w->b, 16);
+	emit(w->b, W_I32_SHR_U);
+	i32c(w->b, 2);
+	emit(w->b, W_I32_SHL);
+	emit_idx(w->b, W_GLOBAL_GET, G_S);
+	emit(w->b, W_I32_ADD);
+}
+
+static void get(wasm_t *w, int o) {
+	if (o>=0) {
+		emit_idx(w->b, W_LOCAL_GET, L_T0+o);
+	} else {
+		emit_mem(w->b, W_I32_LOAD, slot(w, L_SP, o));
+	}
+}
+
+static void set(wasm_t *w, int t) {
+	emit_idx(w->b, W_LOCAL_SET, L_T0+t);
+}
+
+static void add_sp(wasm_t *w, int v) {
+	emit_idx(w->b, W_LOCAL_GET, L_SP);
+	i32c(w->b, v);
+	emit(w->b, W_I32_ADD);
+	emit_idx(w->b, W_LOCAL_SET, L_SP);
+}
+
+static void apply_pops(wasm_t *w) {
+	if (w->m) add_sp(w, -w->m);
+	w->m=0;
+}
+
+//Writes all pending values to the stack.
+static void flush(wasm_t *w) {
+	apply_pops(w);
+	for (int k=0; k<w->n; k++) {
+		uint32_t o=slot(w, L_SP, k);
+		emit_idx(w->b, W_LOCAL_GET, L_T0+k);
+		emit_mem(w->b, W_I32_STORE, o);
+	}
+	if (w->n) add_sp(w, w->n);
+	w->n=0;
+}
+
+//Stops with error code (or the error in local l, if code<0) at insn i
+static void error_at(wasm_t *w, int i, int code, int l) {
+	emit_idx(w->b, W_GLOBAL_GET, G_REGS);
+	i32c(w->b, w->vm->insn_pc[i]);
+	emit_mem(w->b, W_I32_STORE, R_OFF(pc));
+	if (code>=0) {
+		i32c(w->b, code);
+	} else {
+		emit_idx(w->b, W_LOCAL_GET, l);
+	}
+	emit(w->b, W_RETURN);
+}
+
+//Same, if the value on the wasm stack is not 0
+static void error_if(wasm_t *w, int i, int code, int l) {
+	emit_block(w->b, W_IF);
+	error_at(w, i, code, l);
+	emit(w->b, W_END);
+}
+
+//Checks the VM address in L_A like CHECK_ADDR/CHECK_WR_ADDR in the interpreter
+static void check_addr(wasm_t *w, int i, int wr) {
+	wbuf_t *b=w->b;
+	emit_idx(b, W_LOCAL_GET, L_A);
+	i32c(b, 0xffff);
+	emit(b, W_I32_AND);
+	i32c(b, 1);
+	emit(b, W_I32_NE);
+	emit_idx(b, W_LOCAL_GET, L_A);
+	i32c(b, 16);
+	emit(b, W_I32_SHR_U);
+	emit_idx(b, W_GLOBAL_GET, G_SS);
+	emit(b, W_I32_GE_U);
+	emit(b, W_I32_OR);
+	error_if(w, i, LSSL_VM_ERR_ARRAY_OOB, 0);
+	if (!wr) return;
+	emit_idx(b, W_LOCAL_GET, L_A);
+	i32c(b, 16);
+	emit(b, W_I32_SHR_U);
+	emit_idx(b, W_GLOBAL_GET, G_RO);
+	emit(b, W_I32_LT_U);
+	error_if(w, i, LSSL_VM_ERR_RO_WRITE, 0);
+}
+
+//Continues at insn target. depth is the amount of blocks we're in within the basic block.
+static void jump(wasm_t *w, int target, int depth) {
+	i32c(w->b, w->blk[target]);
+	emit_idx(w->b, W_LOCAL_SET, L_LBL);
+	emit_idx(w->b, W_BR, w->blocks-1-w->cur+depth);
+}
+
+//Wasm op for the insns that map to a single one. Sets *test if the result is a boolean
+//that needs to be turned into a real.
+static int simple_op(int op, int *test) {
+	*test=1;
+	switch (op) {
+	case INSN_TEQ: return W_I32_EQ;
+	case INSN_TNEQ: return W_I32_NE;
+	case INSN_TL: return W_I32_LT_S;
+	case INSN_TG: return W_I32_GT_S;
+	case INSN_TLEQ: return W_I32_LE_S;
+	case INSN_TGEQ: return W_I32_GE_S;
+	}
+	*test=0;
+	switch (op) {
+	case INSN_BAND: return W_I32_AND;
+	case INSN_BOR: return W_I32_OR;
+	case INSN_BXOR: return W_I32_XOR;
+	}
+	return -1;
+}
+
+//For the arithmetic insns, which work on i64 and saturate: the op for the two values on
+//the wasm stack. The dividend needs to be shifted up already.
+static void wide_op(wasm_t *w, int op) {
+	wbuf_t *b=w->b;
+	switch (op) {
+	case INSN_ADD:
+		emit(b, W_I64_ADD);
+		break;
+	case INSN_SUB:
+		emit(b, W_I64_SUB);
+		break;
+	case INSN_MUL:
+		emit(b, W_I64_MUL);
+		i64c(b, 16);
+		emit(b, W_I64_SHR_S);
+		break;
+	default:
+		emit(b, (op==INSN_DIV)?W_I64_DIV_S:W_I64_REM_S);
+	}
+	emit_idx(b, W_CALL, w->f_sat);
+}
+
+//Calculates what stack insn op does with the values in L_X and L_Y, for the register insns.
+//Leaves the result on the wasm stack.
+static void reg_value(wasm_t *w, int op) {
+	wbuf_t *b=w->b;
+	int test;
+	int wop=simple_op(op, &test);
+	if (wop>=0) {
+		emit_idx(b, W_LOCAL_GET, L_X);
+		emit_idx(b, W_LOCAL_GET, L_Y);
+		emit(b, wop);
+		if (test) {
+			i32c(b, 16);
+			emit(b, W_I32_SHL);
+		}
+		return;
+	}
+	emit_idx(b, W_LOCAL_GET, L_X);
+	emit(b, W_I64_EXTEND_I32_S);
+	if (op==INSN_DIV || op==INSN_MOD) {
+		i64c(b, 16);
+		emit(b, W_I64_SHL);
+	}
+	emit_idx(b, W_LOCAL_GET, L_Y);
+	emit(b, W_I64_EXTEND_I32_S);
+	wide_op(w, op);
+}
+
+//Writes the code for insn i. Returns 0 if the code after it is never reached from here.
+static int emit_insn(wasm_t *w, int i) {
+	lssl_vm_t *vm=w->vm;
+	wbuf_t *b=w->b;
+	int op=vm->insn_op[i];
+	int32_t arg=vm->insns[i].arg;
+	int rd=vm->insns[i].d, rs=vm->insns[i].s;
+	int test;
+	int wop=simple_op(op, &test);
+	w->m=0;
+	if (wop>=0) {
+		int y=pop_opnd(w);
+		int x=pop_opnd(w);
+		get(w, x);
+		get(w, y);
+		emit(b, wop);
+		if (test) {
+			i32c(b, 16);
+			emit(b, W_I32_SHL);
+		}
+		set(w, push_opnd(w));
+		apply_pops(w);
+		return 1;
+	}
+	switch (op) {
+	case INSN_PUSH_I:
+		i32c(b, (int32_t)((uint32_t)arg<<16));
+		set(w, push_opnd(w));
+		break;
+	case INSN_PUSH_R:
+		i32c(b, arg);
+		set(w, push_opnd(w));
+		break;
+	case INSN_ADD:
+	case INSN_SUB:
+	case INSN_MUL:
+	case INSN_DIV:
+	case INSN_MOD: {
+		int y=pop_opnd(w);
+		int x=pop_opnd(w);
+		int div=(op==INSN_DIV || op==INSN_MOD);
+		if (div) {
+			get(w, y);
+			emit(b, W_I32_EQZ);
+			error_if(w, i, LSSL_VM_ERR_DIVZERO, 0);
+		}
+		get(w, x);
+		emit(b, W_I64_EXTEND_I32_S);
+		if (div) {
+			i64c(b, 16);
+			emit(b, W_I64_SHL);
+		}
+		get(w, y);
+		emit(b, W_I64_EXTEND_I32_S);
+		wide_op(w, op);
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_LAND:
+	case INSN_LOR: {
+		int y=pop_opnd(w);
+		int x=pop_opnd(w);
+		get(w, x);
+		i32c(b, 0);
+		emit(b, W_I32_NE);
+		get(w, y);
+		i32c(b, 0);
+		emit(b, W_I32_NE);
+		emit(b, (op==INSN_LAND)?W_I32_AND:W_I32_OR);
+		i32c(b, 16);
+		emit(b, W_I32_SHL);
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_BNOT:
+		get(w, pop_opnd(w));
+		i32c(b, -1);
+		emit(b, W_I32_XOR);
+		set(w, push_opnd(w));
+		break;
+	case INSN_LNOT:
+		get(w, pop_opnd(w));
+		emit(b, W_I32_EQZ);
+		i32c(b, 16);
+		emit(b, W_I32_SHL);
+		set(w, push_opnd(w));
+		break;
+	case INSN_JMP:
+		flush(w);
+		jump(w, arg, 0);
+		return 0;
+	case INSN_JZ:
+	case INSN_JNZ: {
+		int c=pop_opnd(w);
+		if (c<0) {
+			get(w, c);
+			emit_idx(b, W_LOCAL_SET, L_X);
+		}
+		flush(w);
+		emit_idx(b, W_LOCAL_GET, (c<0)?L_X:L_T0+c);
+		if (op==INSN_JZ) emit(b, W_I32_EQZ);
+		emit_block(b, W_IF);
+		jump(w, arg, 1);
+		emit(b, W_END);
+		break;
+	}
+	case INSN_ENTER:
+		flush(w);
+		if (arg>0) {
+			emit_idx(b, W_LOCAL_GET, L_SP);
+			i32c(b, arg);
+			emit_idx(b, W_CALL, w->f_zero);
+			add_sp(w, arg);
+		}
+		break;
+	case INSN_RETURN:
+		get(w, pop_opnd(w));
+		emit_idx(b, W_LOCAL_GET, L_BP);
+		i32c(b, 3+arg);
+		emit(b, W_I32_SUB);
+		emit_idx(b, W_CALL, w->f_ret);
+		i32c(b, LSSL_VM_ERR_NONE);
+		emit(b, W_RETURN);
+		w->n=0;
+		w->m=0;
+		return 0;
+	case INSN_CALL: {
+		lssl_vm_func_t *f=&vm->funcs[arg];
+		flush(w);
+		//room_for_call()
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		i32c(b, 3+f->max_depth);
+		emit(b, W_I32_ADD);
+		emit_idx(b, W_GLOBAL_GET, G_SS);
+		emit(b, W_I32_GT_S);
+		emit_idx(b, W_GLOBAL_GET, G_RSP);
+		i32c(b, 4+f->max_scopes);
+		emit(b, W_I32_ADD);
+		emit_idx(b, W_GLOBAL_GET, G_RS);
+		emit(b, W_I32_GT_S);
+		emit(b, W_I32_OR);
+		error_if(w, i, LSSL_VM_ERR_STACK_OVF, 0);
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		emit_idx(b, W_LOCAL_GET, L_AP);
+		emit_idx(b, W_LOCAL_GET, L_BP);
+		i32c(b, i+1);
+		emit_idx(b, W_CALL, w->f_frame);
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		i32c(b, 3);
+		emit(b, W_I32_ADD);
+		emit_idx(b, W_CALL, w->fidx[f->entry]);
+		emit_idx(b, W_LOCAL_TEE, L_X);
+		emit_block(b, W_IF);
+		emit_idx(b, W_LOCAL_GET, L_X);
+		emit(b, W_RETURN);
+		emit(b, W_END);
+		//The return value is on the stack now, in place of the arguments
+		add_sp(w, 1-((f->nargs>0)?f->nargs:0));
+		break;
+	}
+	case INSN_POP:
+		pop_opnd(w);
+		break;
+	case INSN_SYSCALL: {
+		int args=(arg>>12)&0xf;
+		int no=arg&0xfff;
+		if (w->sysidx[no]<0) goto bad_insn;
+		for (int k=0; k<args; k++) {
+			int o=pop_opnd(w);
+			emit_idx(b, W_GLOBAL_GET, G_REGS);
+			get(w, o);
+			emit_mem(b, W_I32_STORE, R_OFF(argv)+(args-k-1)*4);
+		}
+		apply_pops(w);
+		emit_idx(b, W_GLOBAL_GET, G_REGS);
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		emit_mem(b, W_I32_STORE, R_OFF(sp));
+		emit_idx(b, W_GLOBAL_GET, G_REGS);
+		emit_idx(b, W_LOCAL_GET, L_AP);
+		emit_mem(b, W_I32_STORE, R_OFF(ap));
+		emit_idx(b, W_GLOBAL_GET, G_REGS);
+		emit_idx(b, W_CALL, w->sysidx[no]);
+		emit_idx(b, W_LOCAL_SET, L_X);
+		emit_idx(b, W_GLOBAL_GET, G_REGS);
+		emit_mem(b, W_I32_LOAD, R_OFF(sp));
+		emit_idx(b, W_LOCAL_SET, L_SP);
+		emit_idx(b, W_LOCAL_GET, L_X);
+		error_if(w, i, -1, L_X);
+		emit_idx(b, W_GLOBAL_GET, G_REGS);
+		emit_mem(b, W_I32_LOAD, R_OFF(argv));
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_DUP: {
+		get(w, pop_opnd(w));
+		int t=push_opnd(w);
+		emit_idx(b, W_LOCAL_TEE, L_T0+t);
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_LEA:
+		emit_idx(b, W_LOCAL_GET, L_BP);
+		i32c(b, arg);
+		emit(b, W_I32_ADD);
+		i32c(b, 16);
+		emit(b, W_I32_SHL);
+		i32c(b, 1);
+		emit(b, W_I32_OR);
+		set(w, push_opnd(w));
+		break;
+	case INSN_LEA_G:
+		i32c(b, make_addr(arg, 1));
+		set(w, push_opnd(w));
+		break;
+	case INSN_LDA:
+		emit_mem(b, W_I32_LOAD, slot(w, L_BP, arg));
+		set(w, push_opnd(w));
+		break;
+	case INSN_LDA_G:
+		emit_idx(b, W_GLOBAL_GET, G_S);
+		emit_mem(b, W_I32_LOAD, arg*4);
+		set(w, push_opnd(w));
+		break;
+	case INSN_DEREF:
+	case INSN_PRE_ADD:
+	case INSN_POST_ADD:
+	case INSN_WR_VAR: {
+		int v=(op==INSN_WR_VAR)?pop_opnd(w):0;
+		get(w, pop_opnd(w));
+		emit_idx(b, W_LOCAL_SET, L_A);
+		check_addr(w, i, op!=INSN_DEREF);
+		if (op==INSN_WR_VAR) {
+			addr_pos(w);
+			get(w, v);
+			emit_mem(b, W_I32_STORE, 0);
+		} else if (op==INSN_DEREF) {
+			addr_pos(w);
+			emit_mem(b, W_I32_LOAD, 0);
+			set(w, push_opnd(w));
+		} else {
+			int t=push_opnd(w);
+			if (op==INSN_POST_ADD) {
+				addr_pos(w);
+				emit_mem(b, W_I32_LOAD, 0);
+				set(w, t);
+			}
+			addr_pos(w);
+			addr_pos(w);
+			emit_mem(b, W_I32_LOAD, 0);
+			emit(b, W_I64_EXTEND_I32_S);
+			i64c(b, arg);
+			wide_op(w, INSN_ADD);
+			emit_mem(b, W_I32_STORE, 0);
+			if (op==INSN_PRE_ADD) {
+				addr_pos(w);
+				emit_mem(b, W_I32_LOAD, 0);
+				set(w, t);
+			}
+		}
+		break;
+	}
+	case INSN_ARRAY_IDX: {
+		get(w, pop_opnd(w));
+		i32c(b, 16);
+		emit(b, W_I32_SHR_S);
+		emit_idx(b, W_LOCAL_SET, L_X);
+		get(w, pop_opnd(w));
+		emit_idx(b, W_LOCAL_SET, L_A);
+		//idx*arg>=size_from_addr(a) || idx<0
+		emit_idx(b, W_LOCAL_GET, L_X);
+		i32c(b, arg);
+		emit(b, W_I32_MUL);
+		emit_idx(b, W_LOCAL_GET, L_A);
+		i32c(b, 0xffff);
+		emit(b, W_I32_AND);
+		emit(b, W_I32_GE_S);
+		emit_idx(b, W_LOCAL_GET, L_X);
+		i32c(b, 0);
+		emit(b, W_I32_LT_S);
+		emit(b, W_I32_OR);
+		error_if(w, i, LSSL_VM_ERR_ARRAY_OOB, 0);
+		emit_idx(b, W_LOCAL_GET, L_A);
+		i32c(b, 16);
+		emit(b, W_I32_SHR_U);
+		emit_idx(b, W_LOCAL_GET, L_X);
+		i32c(b, arg);
+		emit(b, W_I32_MUL);
+		emit(b, W_I32_ADD);
+		i32c(b, 16);
+		emit(b, W_I32_SHL);
+		i32c(b, arg);
+		emit(b, W_I32_OR);
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_STRUCT_IDX: {
+		int a=pop_opnd(w);
+		int offset=pop_opnd(w);
+		get(w, a);
+		i32c(b, 16);
+		emit(b, W_I32_SHR_U);
+		get(w, offset);
+		i32c(b, 16);
+		emit(b, W_I32_SHR_S);
+		emit(b, W_I32_ADD);
+		i32c(b, 16);
+		emit(b, W_I32_SHL);
+		i32c(b, arg);
+		emit(b, W_I32_OR);
+		set(w, push_opnd(w));
+		break;
+	}
+	case INSN_SCOPE_ENTER: {
+		flush(w);
+		uint32_t o=slot(w, L_SP, 0);
+		emit_idx(b, W_LOCAL_GET, L_AP);
+		emit_mem(b, W_I32_STORE, o);
+		//rpush(ap)
+		emit_idx(b, W_GLOBAL_GET, G_RSP);
+		i32c(b, 2);
+		emit(b, W_I32_SHL);
+		emit_idx(b, W_GLOBAL_GET, G_R);
+		emit(b, W_I32_ADD);
+		emit_idx(b, W_LOCAL_GET, L_AP);
+		emit_mem(b, W_I32_STORE, 0);
+		emit_idx(b, W_GLOBAL_GET, G_RSP);
+		i32c(b, 1);
+		emit(b, W_I32_ADD);
+		emit_idx(b, W_GLOBAL_SET, G_RSP);
+		add_sp(w, 1);
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		emit_idx(b, W_LOCAL_SET, L_AP);
+		break;
+	}
+	case INSN_SCOPE_LEAVE:
+		w->n=0;
+		w->m=0;
+		emit_idx(b, W_LOCAL_GET, L_AP);
+		i32c(b, 1);
+		emit(b, W_I32_SUB);
+		emit_idx(b, W_LOCAL_SET, L_SP);
+		//ap=rpop()
+		emit_idx(b, W_GLOBAL_GET, G_RSP);
+		i32c(b, 1);
+		emit(b, W_I32_SUB);
+		emit_idx(b, W_GLOBAL_SET, G_RSP);
+		emit_idx(b, W_GLOBAL_GET, G_RSP);
+		i32c(b, 2);
+		emit(b, W_I32_SHL);
+		emit_idx(b, W_GLOBAL_GET, G_R);
+		emit(b, W_I32_ADD);
+		emit_mem(b, W_I32_LOAD, 0);
+		emit_idx(b, W_LOCAL_SET, L_AP);
+		break;
+	case INSN_ARRAYINIT:
+	case INSN_STRUCTINIT:
+		if (op==INSN_ARRAYINIT) {
+			get(w, pop_opnd(w));
+			i32c(b, 16);
+			emit(b, W_I32_SHR_S);
+			emit_idx(b, W_LOCAL_SET, L_X);
+		}
+		get(w, pop_opnd(w));
+		emit_idx(b, W_LOCAL_SET, L_A);
+		flush(w);
+		emit_idx(b, W_LOCAL_GET, L_SP);
+		emit_idx(b, W_LOCAL_GET, L_A);
+		if (op==INSN_ARRAYINIT) {
+			//Size of the array, or -1 for a negative count
+			i64c(b, -1);
+			emit_idx(b, W_LOCAL_GET, L_X);
+			emit(b, W_I64_EXTEND_I32_S);
+			i64c(b, arg);
+			emit(b, W_I64_MUL);
+			emit_idx(b, W_LOCAL_GET, L_X);
+			i32c(b, 0);
+			emit(b, W_I32_LT_S);
+			emit(b, W_SELECT);
+		} else {
+			i64c(b, arg);
+		}
+		emit_idx(b, W_CALL, w->f_alloc);
+		emit_idx(b, W_LOCAL_TEE, L_Y);
+		error_if(w, i, -1, L_Y);
+		emit_idx(b, W_GLOBAL_GET, G_NSP);
+		emit_idx(b, W_LOCAL_SET, L_SP);
+		break;
+	case INSN_STA: {
+		int v=pop_opnd(w);
+		uint32_t o=slot(w, L_BP, arg);
+		get(w, v);
+		emit_mem(b, W_I32_STORE, o);
+		break;
+	}
+	case INSN_RADD:
+	case INSN_RSUB:
+	case INSN_RMUL:
+	case INSN_RDIV:
+	case INSN_RMOD:
+	case INSN_RTEQ:
+	case INSN_RTNEQ:
+	case INSN_RTL:
+	case INSN_RTG:
+	case INSN_RTLEQ:
+	case INSN_RTGEQ:
+	case INSN_RADDI:
+	case INSN_RSUBI:
+	case INSN_RMULI:
+	case INSN_RDIVI:
+	case INSN_RMODI:
+	case INSN_RTEQI:
+	case INSN_RTNEQI:
+	case INSN_RTLI:
+	case INSN_RTGI:
+	case INSN_RTLEQI:
+	case INSN_RTGEQI: {
+		int stack_op=lssl_vm_ops[op].stack_op;
+		emit_mem(b, W_I32_LOAD, slot(w, L_BP, rs));
+		emit_idx(b, W_LOCAL_SET, L_X);
+		if (lssl_vm_ops[op].argtype==ARG_RRN) {
+			i32c(b, arg);
+		} else {
+			emit_mem(b, W_I32_LOAD, slot(w, L_BP, arg));
+		}
+		emit_idx(b, W_LOCAL_SET, L_Y);
+		if (stack_op==INSN_DIV || stack_op==INSN_MOD) {
+			emit_idx(b, W_LOCAL_GET, L_Y);
+			emit(b, W_I32_EQZ);
+			error_if(w, i, LSSL_VM_ERR_DIVZERO, 0);
+		}
+		uint32_t o=slot(w, L_BP, rd);
+		reg_value(w, stack_op);
+		emit_mem(b, W_I32_STORE, o);
+		break;
+	}
+	case INSN_RSET: {
+		uint32_t o=slot(w, L_BP, rd);
+		i32c(b, arg);
+		emit_mem(b, W_I32_STORE, o);
+		break;
+	}
+	case INSN_RJZ:
+	case INSN_RJNZ:
+		flush(w);
+		emit_mem(b, W_I32_LOAD, slot(w, L_BP, rs));
+		if (op==INSN_RJZ) emit(b, W_I32_EQZ);
+		emit_block(b, W_IF);
+		jump(w, arg, 1);
+		emit(b, W_END);
+		break;
+	default:
+	bad_insn:
+		//Not allowed by the verifier, so a function with this never runs
+		error_at(w, i, LSSL_VM_ERR_UNK_OP, 0);
+		w->n=0;
+		w->m=0;
+		return 0;
+	}
+	apply_pops(w);
+	return 1;
+}
+
+//Insns that can be reached when starting at entry, and which of those are jumped to.
+static void find_reach(lssl_vm_t *vm, int entry, uint8_t *reach, uint8_t *label, int *work) {
+	int n=vm->insn_count;
+	memset(reach, 0, n+1);
+	memset(label, 0, n+1);
+	int wp=0;
+	work[wp++]=entry;
+	reach[entry]=1;
+	while (wp) {
+		int i=work[--wp];
+		int op=vm->insn_op[i];
+		int arg=vm->insns[i].arg;
+		int next[2]={i+1, -1};
+		if (op>=LSSL_INSN_COUNT || op==INSN_NOP || op==INSN_RETURN) {
+			continue;
+		} else if (op==INSN_JMP) {
+			next[0]=arg;
+		} else if (op==INSN_JZ || op==INSN_JNZ || op==INSN_RJZ || op==INSN_RJNZ) {
+			next[1]=arg;
+		}
+		if (op==INSN_JMP || next[1]>=0) label[arg]=1;
+		for (int k=0; k<2; k++) {
+			if (next[k]<0 || next[k]>=n || reach[next[k]]) continue;
+			reach[next[k]]=1;
+			work[wp++]=next[k];
+		}
+	}
+}
+
+//Writes the body of the function starting at insn entry.
+static void emit_func(wasm_t *w, wbuf_t *out, int entry, uint8_t *reach, uint8_t *label) {
+	lssl_vm_t *vm=w->vm;
+	wbuf_t code={};
+	wbuf_t *b=&code;
+	w->b=b;
+	w->n=0;
+	w->m=0;
+	w->max_n=0;
+	//Every jump target starts a basic block, and so does the entry
+	label[entry]=1;
+	w->blocks=0;
+	for (int i=0; i<vm->insn_count; i++) {
+		if (reach[i] && label[i]) w->blk[i]=w->blocks++;
+	}
+	emit_idx(b, W_LOCAL_GET, L_SP);
+	emit_idx(b, W_LOCAL_TEE, L_BP);
+	emit_idx(b, W_LOCAL_SET, L_AP);
+	i32c(b, w->blk[entry]);
+	emit_idx(b, W_LOCAL_SET, L_LBL);
+	emit_block(b, W_LOOP);
+	for (int k=0; k<w->blocks; k++) emit_block(b, W_BLOCK);
+	emit_idx(b, W_LOCAL_GET, L_LBL);
+	emit(b, W_BR_TABLE);
+	emit_uleb(b, w->blocks);
+	for (int k=0; k<w->blocks; k++) emit_uleb(b, k);
+	emit_uleb(b, w->blocks-1);
+	int falls=0;
+	for (int i=0; i<vm->insn_count; i++) {
+		if (!reach[i]) continue;
+		if (label[i]) {
+			if (falls) flush(w);
+			emit(b, W_END);
+			w->cur=w->blk[i];
+		}
+		falls=emit_insn(w, i);
+	}
+	emit(b, W_END);
+	//Runs off the end of the program; the verifier does not allow this.
+	emit_idx(b, W_GLOBAL_GET, G_REGS);
+	i32c(b, vm->insn_pc[vm->insn_count]);
+	emit_mem(b, W_I32_STORE, R_OFF(pc));
+	i32c(b, LSSL_VM_ERR_UNK_OP);
+	emit(b, W_END);
+
+	wbuf_t body={};
+	emit_uleb(&body, 1);
+	emit_uleb(&body, L_T0-1+w->max_n);
+	emit(&body, T_I32);
+	emit_buf(&body, &code);
+	emit_uleb(out, body.len);
+	emit_buf(out, &body);
+	free(code.data);
+	free(body.data);
+}
+
+//Writes a function body from hand-written code: locals of type t, then the code.
+static void emit_helper(wbuf_t *out, int locals, int t, const wbuf_t *code) {
+	wbuf_t body={};
+	emit_uleb(&body, locals?1:0);
+	if (locals) {
+		emit_uleb(&body, locals);
+		emit(&body, t);
+	}
+	emit_buf(&body, code);
+	emit_uleb(out, body.len);
+	emit_buf(out, &body);
+	free(body.data);
+}
+
+//saturate(i64 v)
+static void helper_sat(wbuf_t *out) {
+	wbuf_t c={};
+	i32c(&c, INT32_MIN);
+	i32c(&c, INT32_MAX);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit(&c, W_I32_WRAP_I64);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i64c(&c, INT32_MAX);
+	emit(&c, W_I64_GT_S);
+	emit(&c, W_SELECT);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i64c(&c, INT32_MIN);
+	emit(&c, W_I64_LT_S);
+	emit(&c, W_SELECT);
+	emit(&c, W_END);
+	emit_helper(out, 0, 0, &c);
+	free(c.data);
+}
+
+//zero(start, count): clears count words of stack
+static void helper_zero(wbuf_t *out) {
+	wbuf_t c={};
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_LOCAL_GET, 1);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_SET, 2);
+	emit_block(&c, W_BLOCK);
+	emit_block(&c, W_LOOP);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I32_GE_S);
+	emit_idx(&c, W_BR_IF, 1);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_S);
+	emit(&c, W_I32_ADD);
+	i32c(&c, 0);
+	emit_mem(&c, W_I32_STORE, 0);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i32c(&c, 1);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_SET, 0);
+	emit_idx(&c, W_BR, 0);
+	emit(&c, W_END);
+	emit(&c, W_END);
+	emit(&c, W_END);
+	emit_helper(out, 1, T_I32, &c);
+	free(c.data);
+}
+
+//alloc(sp, addr, i64 size): ARRAYINIT/STRUCTINIT with the operands popped. Returns the
+//error, or 0 with the new sp in G_NSP.
+static void helper_alloc(wbuf_t *out, int f_zero) {
+	wbuf_t c={};
+	//CHECK_WR_ADDR(addr)
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 0xffff);
+	emit(&c, W_I32_AND);
+	i32c(&c, 1);
+	emit(&c, W_I32_NE);
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 16);
+	emit(&c, W_I32_SHR_U);
+	emit_idx(&c, W_GLOBAL_GET, G_SS);
+	emit(&c, W_I32_GE_U);
+	emit(&c, W_I32_OR);
+	emit_block(&c, W_IF);
+	i32c(&c, LSSL_VM_ERR_ARRAY_OOB);
+	emit(&c, W_RETURN);
+	emit(&c, W_END);
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 16);
+	emit(&c, W_I32_SHR_U);
+	emit_idx(&c, W_GLOBAL_GET, G_RO);
+	emit(&c, W_I32_LT_U);
+	emit_block(&c, W_IF);
+	i32c(&c, LSSL_VM_ERR_RO_WRITE);
+	emit(&c, W_RETURN);
+	emit(&c, W_END);
+	//Negative array size
+	emit_idx(&c, W_LOCAL_GET, 2);
+	i64c(&c, 0);
+	emit(&c, W_I64_LT_S);
+	emit_block(&c, W_IF);
+	i32c(&c, LSSL_VM_ERR_ARRAY_OOB);
+	emit(&c, W_RETURN);
+	emit(&c, W_END);
+	//sp+size+max_depth>stack_size
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit(&c, W_I64_EXTEND_I32_S);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I64_ADD);
+	emit_idx(&c, W_GLOBAL_GET, G_MAXD);
+	emit(&c, W_I64_EXTEND_I32_S);
+	emit(&c, W_I64_ADD);
+	emit_idx(&c, W_GLOBAL_GET, G_SS);
+	emit(&c, W_I64_EXTEND_I32_S);
+	emit(&c, W_I64_GT_S);
+	emit_block(&c, W_IF);
+	i32c(&c, LSSL_VM_ERR_STACK_OVF);
+	emit(&c, W_RETURN);
+	emit(&c, W_END);
+	//s[pos]=make_addr(sp, size)
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 16);
+	emit(&c, W_I32_SHR_U);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_S);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i32c(&c, 16);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I32_WRAP_I64);
+	emit(&c, W_I32_OR);
+	emit_mem(&c, W_I32_STORE, 0);
+	//Global objects move glob_top
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 16);
+	emit(&c, W_I32_SHR_U);
+	emit_idx(&c, W_GLOBAL_GET, G_GSIZE);
+	emit(&c, W_I32_LT_U);
+	emit_block(&c, W_IF);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I32_WRAP_I64);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_GLOBAL_SET, G_GTOP);
+	emit(&c, W_END);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I32_WRAP_I64);
+	emit_idx(&c, W_CALL, f_zero);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit(&c, W_I32_WRAP_I64);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_GLOBAL_SET, G_NSP);
+	i32c(&c, LSSL_VM_ERR_NONE);
+	emit(&c, W_END);
+	emit_helper(out, 0, 0, &c);
+	free(c.data);
+}
+
+//frame(sp, ap, bp, ret_insn): push_frame() for a CALL, with sp the caller's.
+static void helper_frame(wbuf_t *out) {
+	wbuf_t c={};
+	emit_idx(&c, W_LOCAL_GET, 0);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_S);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_SET, 4);
+	for (int k=0; k<3; k++) {
+		emit_idx(&c, W_LOCAL_GET, 4);
+		emit_idx(&c, W_LOCAL_GET, 1+k);
+		emit_mem(&c, W_I32_STORE, k*4);
+	}
+	emit_idx(&c, W_GLOBAL_GET, G_RSP);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_R);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_SET, 4);
+	for (int k=0; k<4; k++) {
+		emit_idx(&c, W_LOCAL_GET, 4);
+		if (k==2) {
+			emit_idx(&c, W_GLOBAL_GET, G_RBP);
+		} else {
+			emit_idx(&c, W_LOCAL_GET, (k==3)?3:1+k);
+		}
+		emit_mem(&c, W_I32_STORE, k*4);
+	}
+	emit_idx(&c, W_GLOBAL_GET, G_RSP);
+	i32c(&c, 4);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_GLOBAL_SET, G_RSP);
+	emit_idx(&c, W_GLOBAL_GET, G_RSP);
+	emit_idx(&c, W_GLOBAL_SET, G_RBP);
+	emit(&c, W_END);
+	emit_helper(out, 1, T_I32, &c);
+	free(c.data);
+}
+
+//ret(v, sp): pop_frame() for a RETURN of v, with sp the one after dropping the frame.
+//Returning to the caller of lssl_vm_call() writes the registers back to regs.
+static void helper_ret(wbuf_t *out) {
+	wbuf_t c={};
+	emit_idx(&c, W_GLOBAL_GET, G_RBP);
+	i32c(&c, 4);
+	emit(&c, W_I32_SUB);
+	emit_idx(&c, W_GLOBAL_SET, G_RSP);
+	emit_idx(&c, W_GLOBAL_GET, G_RSP);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_R);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_SET, 2);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit_mem(&c, W_I32_LOAD, 8);
+	emit_idx(&c, W_GLOBAL_SET, G_RBP);
+	emit_idx(&c, W_LOCAL_GET, 2);
+	emit_mem(&c, W_I32_LOAD, 12);
+	i32c(&c, -1);
+	emit(&c, W_I32_EQ);
+	emit_block(&c, W_IF);
+	const int fields[4][2]={{R_OFF(ret), 0}, {R_OFF(sp), 1}, {R_OFF(bp), 4}, {R_OFF(ap), 0}};
+	for (int k=0; k<4; k++) {
+		emit_idx(&c, W_GLOBAL_GET, G_REGS);
+		if (k<2) {
+			emit_idx(&c, W_LOCAL_GET, fields[k][1]);
+		} else {
+			emit_idx(&c, W_LOCAL_GET, 2);
+			emit_mem(&c, W_I32_LOAD, fields[k][1]);
+		}
+		emit_mem(&c, W_I32_STORE, fields[k][0]);
+	}
+	emit(&c, W_ELSE);
+	emit_idx(&c, W_LOCAL_GET, 1);
+	i32c(&c, 2);
+	emit(&c, W_I32_SHL);
+	emit_idx(&c, W_GLOBAL_GET, G_S);
+	emit(&c, W_I32_ADD);
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_mem(&c, W_I32_STORE, 0);
+	emit(&c, W_END);
+	emit(&c, W_END);
+	emit_helper(out, 1, T_I32, &c);
+	free(c.data);
+}
+
+//Fields of regs that get loaded into globals by run()
+static const int run_globals[][2]={
+	{R_OFF(stack), G_S}, {R_OFF(stack_size), G_SS}, {R_OFF(rstack), G_R},
+	{R_OFF(rstack_size), G_RS}, {R_OFF(rsp), G_RSP}, {R_OFF(rbp), G_RBP},
+	{R_OFF(ro_top), G_RO}, {R_OFF(max_depth), G_MAXD}, {R_OFF(glob_size), G_GSIZE},
+	{R_OFF(glob_top), G_GTOP},
+};
+
+//run(regs, pc, argc): runs the function at bytecode address pc, for which the host has set
+//up the stack frame with argc arguments. Returns the error, or -1 if there is no such
+//function or it takes a different number of arguments. Pass argc=-1 to skip that check.
+static void helper_run(wbuf_t *out, lssl_vm_t *vm, const int *fidx, const int *nargs) {
+	wbuf_t c={};
+	emit_idx(&c, W_LOCAL_GET, 0);
+	emit_idx(&c, W_GLOBAL_SET, G_REGS);
+	for (int k=0; k<sizeof(run_globals)/sizeof(run_globals[0]); k++) {
+		emit_idx(&c, W_LOCAL_GET, 0);
+		emit_mem(&c, W_I32_LOAD, run_globals[k][0]);
+		emit_idx(&c, W_GLOBAL_SET, run_globals[k][1]);
+	}
+	emit_block(&c, W_BLOCK);
+	for (int e=0; e<vm->insn_count; e++) {
+		if (fidx[e]<0) continue;
+		emit_idx(&c, W_LOCAL_GET, 1);
+		i32c(&c, vm->insn_pc[e]);
+		emit(&c, W_I32_EQ);
+		if (nargs[e]>=0) {
+			emit_idx(&c, W_LOCAL_GET, 2);
+			i32c(&c, nargs[e]);
+			emit(&c, W_I32_NE);
+			emit_idx(&c, W_LOCAL_GET, 2);
+			i32c(&c, 0);
+			emit(&c, W_I32_GE_S);
+			emit(&c, W_I32_AND);
+			emit(&c, W_I32_EQZ);
+			emit(&c, W_I32_AND);
+		}
+		emit_block(&c, W_IF);
+		emit_idx(&c, W_LOCAL_GET, 0);
+		emit_mem(&c, W_I32_LOAD, R_OFF(sp));
+		emit_idx(&c, W_CALL, fidx[e]);
+		emit_idx(&c, W_LOCAL_SET, 3);
+		emit_idx(&c, W_BR, 1);
+		emit(&c, W_END);
+	}
+	i32c(&c, -1);
+	emit(&c, W_RETURN);
+	emit(&c, W_END);
+	const int back[][2]={{R_OFF(rsp), G_RSP}, {R_OFF(rbp), G_RBP}, {R_OFF(glob_top), G_GTOP}};
+	for (int k=0; k<3; k++) {
+		emit_idx(&c, W_LOCAL_GET, 0);
+		emit_idx(&c, W_GLOBAL_GET, back[k][1]);
+		emit_mem(&c, W_I32_STORE, back[k][0]);
+	}
+	emit_idx(&c, W_LOCAL_GET, 3);
+	emit(&c, W_END);
+	emit_helper(out, 1, T_I32, &c);
+	free(c.data);
+}
+
+static void emit_type(wbuf_t *b, const char *params, int result) {
+	emit(b, T_FUNC);
+	emit_uleb(b, strlen(params));
+	for (const char *p=params; *p; p++) emit(b, (*p=='l')?T_I64:T_I32);
+	emit_uleb(b, result?1:0);
+	if (result) emit(b, T_I32);
+}
+
+uint8_t *lssl_vm_wasm_write(uint8_t *program, int prog_len, const int *func_pcs, int func_ct, int *len) {
+	lssl_vm_t *vm=lssl_vm_init(program, prog_len, 65536);
+	if (!vm) return NULL;
+	int n=vm->insn_count;
+	uint8_t *ret=NULL;
+	int *fidx=malloc((n+1)*sizeof(int));
+	int *nargs=malloc((n+1)*sizeof(int));
+	int *blk=malloc((n+1)*sizeof(int));
+	int *sysidx=malloc(4096*sizeof(int));
+	int *work=malloc((n+1)*sizeof(int));
+	uint8_t *reach=malloc(n+1);
+	uint8_t *label=malloc(n+1);
+	wbuf_t mod={}, sec={};
+	if (!fidx || !nargs || !blk || !sysidx || !work || !reach || !label) goto out;
+
+	//Everything that is CALLed, plus the functions the caller knows of
+	for (int i=0; i<=n; i++) fidx[i]=-1;
+	for (int k=0; k<vm->func_count; k++) fidx[vm->funcs[k].entry]=0;
+	for (int k=0; k<func_ct; k++) {
+		int e=0;
+		while (e<n && vm->insn_pc[e]!=func_pcs[k]) e++;
+		if (e==n) {
+			printf("lssl_vm_wasm_write: no function at pc 0x%X\n", func_pcs[k]);
+			goto out;
+		}
+		fidx[e]=0;
+	}
+	fidx[0]=0;
+
+	//Syscalls are imported by name
+	int imports=0;
+	for (int k=0; k<4096; k++) sysidx[k]=-1;
+	for (int i=0; i<n; i++) {
+		int no=vm->insns[i].arg&0xfff;
+		if (vm->insn_op[i]==INSN_SYSCALL && vm_syscall_exists(no)) sysidx[no]=0;
+	}
+	//...in the order of their numbers, as that's how the import section lists them
+	for (int k=0; k<4096; k++) {
+		if (sysidx[k]>=0) sysidx[k]=imports++;
+	}
+	wasm_t w={.vm=vm, .fidx=fidx, .sysidx=sysidx, .blk=blk};
+	w.f_sat=imports;
+	w.f_zero=imports+1;
+	w.f_alloc=imports+2;
+	w.f_frame=imports+3;
+	w.f_ret=imports+4;
+	int funcs=0;
+	for (int e=0; e<n; e++) {
+		if (fidx[e]>=0) fidx[e]=imports+5+funcs++;
+	}
+	int f_run=imports+5+funcs;
+
+	emit(&mod, 0);
+	emit(&mod, 'a');
+	emit(&mod, 's');
+	emit(&mod, 'm');
+	emit(&mod, 1);
+	emit(&mod, 0);
+	emit(&mod, 0);
+	emit(&mod, 0);
+
+	emit_uleb(&sec, TY_COUNT);
+	emit_type(&sec, "iii", 1);	//TY_RUN
+	emit_type(&sec, "i", 1);	//TY_FN
+	emit_type(&sec, "l", 1);	//TY_SAT
+	emit_type(&sec, "iil", 1);	//TY_ALLOC
+	emit_type(&sec, "iiii", 0);	//TY_FRAME
+	emit_type(&sec, "ii", 0);	//TY_VOID2
+	emit_section(&mod, 1, &sec);
+
+	emit_uleb(&sec, imports+1);
+	emit_str(&sec, "env");
+	emit_str(&sec, "memory");
+	emit(&sec, 2);
+	emit(&sec, 0);
+	emit_uleb(&sec, 0);
+	for (int k=0; k<4096; k++) {
+		if (sysidx[k]<0) continue;
+		emit_str(&sec, "lssl");
+		emit_str(&sec, vm_syscall_name(k));
+		emit(&sec, 0);
+		emit_uleb(&sec, TY_FN);
+	}
+	emit_section(&mod, 2, &sec);
+
+	emit_uleb(&sec, 5+funcs+1);
+	emit_uleb(&sec, TY_SAT);
+	emit_uleb(&sec, TY_VOID2);
+	emit_uleb(&sec, TY_ALLOC);
+	emit_uleb(&sec, TY_FRAME);
+	emit_uleb(&sec, TY_VOID2);
+	for (int k=0; k<funcs; k++) emit_uleb(&sec, TY_FN);
+	emit_uleb(&sec, TY_RUN);
+	emit_section(&mod, 3, &sec);
+
+	emit_uleb(&sec, G_MUTABLE+1);
+	for (int k=0; k<G_MUTABLE; k++) {
+		emit(&sec, T_I32);
+		emit(&sec, 1);
+		i32c(&sec, 0);
+		emit(&sec, W_END);
+	}
+	emit(&sec, T_I32);
+	emit(&sec, 0);
+	i32c(&sec, vm->glob_size);
+	emit(&sec, W_END);
+	emit_section(&mod, 6, &sec);
+
+	emit_uleb(&sec, 2);
+	emit_str(&sec, "run");
+	emit(&sec, 0);
+	emit_uleb(&sec, f_run);
+	emit_str(&sec, "glob_size");
+	emit(&sec, 3);
+	emit_uleb(&sec, G_GLOB_SIZE);
+	emit_section(&mod, 7, &sec);
+
+	emit_uleb(&sec, 5+funcs+1);
+	helper_sat(&sec);
+	helper_zero(&sec);
+	helper_alloc(&sec, w.f_zero);
+	helper_frame(&sec);
+	helper_ret(&sec);
+	for (int e=0; e<n; e++) {
+		if (fidx[e]<0) continue;
+		find_reach(vm, e, reach, label, work);
+		emit_func(&w, &sec, e, reach, label);
+		//Arguments taken, as the VM checks that for callbacks
+		nargs[e]=-1;
+		for (int i=0; i<n; i++) {
+			if (reach[i] && vm->insn_op[i]==INSN_RETURN) nargs[e]=vm->insns[i].arg;
+		}
+	}
+	helper_run(&sec, vm, fidx, nargs);
+	emit_section(&mod, 10, &sec);
+
+	if (!mod.oom) {
+		ret=mod.data;
+		*len=mod.len;
+		mod.data=NULL;
+	}
+out:
+	free(mod.data);
+	free(sec.data);
+	free(fidx);
+	free(nargs);
+	free(blk);
+	free(sysidx);
+	free(work);
+	free(reach);
+	free(label);
+	lssl_vm_free(vm);
+	return ret;
+}
+
+#ifdef __EMSCRIPTEN__
+
+//The page instantiates the module and puts it in Module.lssl_wasm; see web/lssl_edit.js.
+EM_JS(int, wasm_run, (lssl_vm_wasm_regs_t *regs, int pc), {
+	if (!Module.lssl_wasm) return -1;
+	return Module.lssl_wasm.exports.run(regs, pc, -1);
+});
+
+//Called by the syscall imports of the module
+EMSCRIPTEN_KEEPALIVE int lssl_vm_wasm_syscall(lssl_vm_wasm_regs_t *r, int no) {
+	lssl_vm_t *vm=(lssl_vm_t*)r->vm;
+	vm->sp=r->sp;
+	vm->ap=r->ap;
+	r->argv[0]=vm_syscall(vm, no, r->argv);
+	r->sp=vm->sp;
+	return vm->error;
+}
+
+int lssl_vm_wasm(lssl_vm_t *vm) {
+	vm->wasm=1;
+	return 1;
+}
+
+int lssl_vm_wasm_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+	lssl_vm_wasm_regs_t r={
+		.stack=(int32_t)vm->stack,
+		.stack_size=vm->stack_size,
+		.rstack=(int32_t)vm->rstack,
+		.rstack_size=vm->rstack_size,
+		.sp=vm->sp, .bp=vm->bp, .ap=vm->ap, .rsp=vm->rsp, .rbp=vm->rbp,
+		.ro_top=vm->ro_top,
+		.max_depth=vm->max_depth,
+		.glob_size=vm->glob_size,
+		.glob_top=vm->glob_top,
+		.vm=(int32_t)vm,
+	};
+	vm->error=LSSL_VM_ERR_NONE;
+	int e=wasm_run(&r, vm->insn_pc[vm->pc]);
+	if (e<0) return 0;
+	vm->glob_top=r.glob_top;
+	error->type=e;
+	error->pc=r.pc;
+	if (e==LSSL_VM_ERR_NONE) {
+		vm->sp=r.sp;
+		vm->bp=r.bp;
+		vm->ap=r.ap;
+		vm->rsp=r.rsp;
+		vm->rbp=r.rbp;
+		*ret=r.ret;
+	}
+	return 1;
+}
+
+#else
+
+int lssl_vm_wasm(lssl_vm_t *vm) {
+	return 0;
+}
+
+int lssl_vm_wasm_exec(lssl_vm_t *vm, int32_t *ret, vm_error_t *error) {
+	return 0;
+}
+
+#endif
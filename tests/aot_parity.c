@@ -0,0 +1,83 @@
+//Checks that programs translated to C (lssl -c) give the same results as the bytecode
+//VM. The program is linked in as lssl_prog (so the C file needs to be called prog.c)
+//and run twice: once interpreted from the bytecode the C file carries, once as native
+//code. What main() returns, the LED colours of a few frames and any runtime errors
+//need to match. Run it using 'make test_aot' in src/, which does this for every test.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "led_syscalls.h"
+#include "led_map.h"
+#include "vm.h"
+#include "vm_aot.h"
+
+#define LEDS 40
+#define FRAMES 12
+
+extern const lssl_vm_native_t lssl_prog;
+
+typedef struct {
+	int loaded;
+	int32_t ret;
+	vm_error_t err;
+	int frames;
+	uint8_t leds[FRAMES][LEDS*4];
+} result_t;
+
+static void run(int native, result_t *res) {
+	memset(res, 0, sizeof(*res));
+	led_syscalls_clear();
+	srand(1);
+	lssl_vm_t *vm;
+	if (native) {
+		vm=lssl_vm_init_native(&lssl_prog, 4096);
+	} else {
+		vm=lssl_vm_init((uint8_t*)lssl_prog.program, lssl_prog.prog_len, 4096);
+	}
+	if (!vm) return;
+	res->loaded=1;
+	res->ret=lssl_vm_run_main(vm, &res->err);
+	if (!res->err.type && led_syscalls_have_cb()) {
+		for (int fr=0; fr<FRAMES && !res->err.type; fr++) {
+			led_syscalls_frame_start(vm, fr*0.37, 0, &res->err);
+			led_syscalls_render_frame(vm, 0, LEDS, fr*0.37, res->leds[fr], LED_FORMAT_RGBW, &res->err);
+			res->frames++;
+		}
+	}
+	lssl_vm_free(vm);
+}
+
+int main(int argc, char **argv) {
+	const char *name=(argc>1)?argv[1]:"program";
+	led_syscalls_init();
+	led_map_create(64, 3);
+	for (int i=0; i<64; i++) led_map_set_led_pos(i, (i%8)/4.0-1, (i/8)/4.0-1, i/64.0);
+
+	static result_t vm, aot;
+	run(0, &vm);
+	run(1, &aot);
+	if (!vm.loaded) {
+		//Compile errors still give a C file, but nothing that loads
+		printf("%s: skipped, does not load\n", name);
+		return 0;
+	}
+	if (!aot.loaded) {
+		printf("%s: FAIL, native code does not load\n", name);
+		return 1;
+	}
+	if (vm.ret!=aot.ret) {
+		printf("%s: FAIL, main() returned %d, native code %d\n", name, vm.ret, aot.ret);
+		return 1;
+	}
+	if (vm.err.type!=aot.err.type || (vm.err.type && vm.err.pc!=aot.err.pc)) {
+		printf("%s: FAIL, error %d at pc 0x%X, native code error %d at pc 0x%X\n", name,
+				vm.err.type, vm.err.pc, aot.err.type, aot.err.pc);
+		return 1;
+	}
+	if (vm.frames!=aot.frames || memcmp(vm.leds, aot.leds, sizeof(vm.leds))!=0) {
+		printf("%s: FAIL, LED colours differ\n", name);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
@@ -0,0 +1,428 @@
+"use strict"
+//Checks that programs translated to WebAssembly (lssl -w) give the same results as the
+//bytecode VM. Every program is run once by lssl, simulating a few frames, and once as
+//a wasm module on a minimal host written in JS; what main() returns, the LED colours of
+//every frame and any runtime errors need to match. Needs nothing but node; run it using
+//'make test_wasm' in src/, or:
+//    node wasm_parity.js path/to/lssl file.lssl ...
+const fs=require("fs");
+const os=require("os");
+const path=require("path");
+const child_process=require("child_process");
+
+const LEDS=40;
+const FRAMES=12;
+
+//Memory of the host: lssl_vm_wasm_regs_t (see vm_wasm.c), followed by the stacks.
+const R={stack:0, stack_size:1, rstack:2, rstack_size:3, sp:4, bp:5, ap:6, rsp:7, rbp:8,
+		ro_top:9, max_depth:10, glob_size:11, glob_top:12, ret:13, pc:14, vm:15, argv:16};
+const REGS=0;
+const STACK=256;	//in words, like everything below
+const STACK_SIZE=65536;
+const RSTACK=STACK+STACK_SIZE;
+const RSTACK_SIZE=STACK_SIZE/2;
+const LSSL_VM_ERR_INTERNAL=6;
+
+//The trig syscalls use fixed_trig.c; this does the same, using its tables.
+const trig_src=fs.readFileSync(path.join(__dirname, "../src/fixed_trig.c"), "utf8");
+function trig_table(name) {
+	const m=trig_src.match(new RegExp(name+"\\[\\d+\\]=\\{([^}]*)\\}"));
+	return m[1].split(",").filter(v => v.trim()!="").map(v => parseInt(v));
+}
+const sin_table=trig_table("sin_table");
+const atan_table=trig_table("atan_table");
+
+function interpolate(table, i, frac) {
+	let v=table[i];
+	if (frac) v+=((table[i+1]-v)*frac+0x8000)>>16;
+	return v;
+}
+
+function sin_turn(phase) {
+	let q=phase&0x3fffffff;
+	if (phase&0x40000000) q=0x40000000-q;
+	const v=interpolate(sin_table, q>>>22, (q>>>6)&0xffff);
+	return (phase&0x80000000)?-v:v;
+}
+
+function rad_to_turn(a) {
+	return Number(BigInt.asUintN(32, (BigInt(a)*683565276n+0x8000n)>>16n));
+}
+
+function fixed_tan(a) {
+	const phase=rad_to_turn(a);
+	const s=sin_turn(phase);
+	const c=sin_turn((phase+0x40000000)>>>0);
+	if (c==0) return (s<0)?-2147483648:2147483647;
+	return Math.min(Math.max(Math.trunc(s*65536/c), -2147483648), 2147483647);
+}
+
+function fixed_atan2(y, x) {
+	const ax=BigInt(Math.abs(x)), ay=BigInt(Math.abs(y));
+	if (ax==0n && ay==0n) return 0;
+	let r;
+	if (ay<=ax) {
+		const t=Number((ay<<24n)/ax);
+		r=interpolate(atan_table, Math.floor(t/65536), t&0xffff);
+	} else {
+		const t=Number((ax<<24n)/ay);
+		r=102944-interpolate(atan_table, Math.floor(t/65536), t&0xffff);
+	}
+	if (x<0) r=205887-r;
+	return (y<0)?-r:r;
+}
+
+function set_rgb(h, a) {
+	h.led[0]=a[0]>>16;
+	h.led[1]=a[1]>>16;
+	h.led[2]=a[2]>>16;
+	return 0;
+}
+
+//Noise, as in fixed_noise.c
+function noise_hash(ix, iy, iz, seed) {
+	let h=Math.imul(ix, 0x8da6b343);
+	h^=Math.imul(iy, 0xd8163841);
+	h^=Math.imul(iz, 0xcb1ab31f);
+	h^=Math.imul(seed, 0x27d4eb2d);
+	h^=h>>>13;
+	h=Math.imul(h, 0x85ebca6b);
+	h^=h>>>16;
+	return h>>>0;
+}
+
+function noise_grad(h, x, y, z) {
+	h&=15;
+	const u=(h<8)?x:y;
+	const v=(h<4)?y:((h==12 || h==14)?x:z);
+	return ((h&1)?-u:u)+((h&2)?-v:v);
+}
+
+function noise_fade(t) {
+	const b=BigInt(t);
+	const a=(((6n*b-15n*65536n)*b)>>16n)+10n*65536n;
+	const t3=(((b*b)>>16n)*b)>>16n;
+	return Number((a*t3)>>16n);
+}
+
+function noise_lerp(a, b, t) {
+	return a+Math.floor((b-a)*t/65536);
+}
+
+function noise1(x, seed) {
+	const ix=x>>16, fx=x&0xffff;
+	const u=noise_fade(fx);
+	const a=(noise_hash(ix, 0, 0, seed)&1)?-fx:fx;
+	const b=(noise_hash(ix+1, 0, 0, seed)&1)?65536-fx:fx-65536;
+	return noise_lerp(a, b, u)*2;
+}
+
+function noise2(x, y, seed) {
+	return noise3(x, y, 0, seed, true);
+}
+
+function noise3(x, y, z, seed, flat) {
+	const ix=x>>16, iy=y>>16, iz=z>>16;
+	const fx=x&0xffff, fy=y&0xffff, fz=z&0xffff;
+	const u=noise_fade(fx), v=noise_fade(fy), w=noise_fade(fz);
+	const n=[];
+	for (let k=0; k<(flat?1:2); k++) {
+		const gz=flat?0:fz-k*65536;
+		const hz=flat?0:iz+k;
+		const n00=noise_grad(noise_hash(ix, iy, hz, seed), fx, fy, gz);
+		const n10=noise_grad(noise_hash(ix+1, iy, hz, seed), fx-65536, fy, gz);
+		const n01=noise_grad(noise_hash(ix, iy+1, hz, seed), fx, fy-65536, gz);
+		const n11=noise_grad(noise_hash(ix+1, iy+1, hz, seed), fx-65536, fy-65536, gz);
+		n.push(noise_lerp(noise_lerp(n00, n10, u), noise_lerp(n01, n11, u), v));
+	}
+	return flat?n[0]:noise_lerp(n[0], n[1], w);
+}
+
+function fractal(octaves, fn) {
+	octaves=clamp_fixed(octaves>>16, 1, 8);
+	let sum=0n;
+	for (let o=0; o<octaves; o++) sum+=BigInt(fn(c => c<<o, o)>>o);
+	return Number(sum*BigInt(1<<(octaves-1))/BigInt((1<<octaves)-1));
+}
+
+//Colours, as in led_syscalls.c
+function clamp_fixed(v, min, max) {
+	return Math.min(Math.max(v, min), max);
+}
+
+function mul_fixed(a, b) {
+	return Number((BigInt(a)*BigInt(b))>>16n);
+}
+
+function hsv_to_rgb(h, s, v) {
+	s=clamp_fixed(s, 0, 65536);
+	v=clamp_fixed(v, 0, 65536)*255;
+	const h6=(h&0xffff)*6;
+	const f=h6&0xffff;
+	const p=mul_fixed(v, 65536-s);
+	const q=mul_fixed(v, 65536-mul_fixed(f, s));
+	const t=mul_fixed(v, 65536-mul_fixed(65536-f, s));
+	return [[v, t, p], [q, v, p], [p, v, t], [p, q, v], [t, p, v], [v, p, q]][h6>>16];
+}
+
+//Struct arguments are VM addresses; the tests only pass valid ones.
+function struct_mem(h, addr) {
+	return h.w.subarray(STACK+(addr>>>16), STACK+(addr>>>16)+3);
+}
+
+function blend_rgb(h, a) {
+	const c0=struct_mem(h, a[0]), c1=struct_mem(h, a[1]), out=struct_mem(h, a[3]);
+	const t=clamp_fixed(a[2], 0, 65536);
+	for (let i=0; i<3; i++) out[i]=c0[i]+mul_fixed(c1[i]-c0[i], t);
+	return 0;
+}
+
+function scale_rgb(h, a) {
+	const c=struct_mem(h, a[0]);
+	for (let i=0; i<3; i++) c[i]=clamp_fixed(mul_fixed(c[i], a[1]), 0, 255<<16);
+	return 0;
+}
+
+//Syscalls, as in vm_syscall.c and led_syscalls.c. rand() can't be done the same way.
+const syscalls={
+	abs: (h, a) => (a[0]<0)?(-a[0])|0:a[0],
+	floor: (h, a) => a[0]&0xffff0000,
+	ceil: (h, a) => ((a[0]+0xffff)|0)&0xffff0000,
+	clamp: (h, a) => Math.min(Math.max(a[0], a[1]), a[2]),
+	sin: (h, a) => sin_turn(rad_to_turn(a[0])),
+	cos: (h, a) => sin_turn((rad_to_turn(a[0])+0x40000000)>>>0),
+	tan: (h, a) => fixed_tan(a[0]),
+	atan2: (h, a) => fixed_atan2(a[0], a[1]),
+	noise1: (h, a) => noise1(a[0], 0),
+	noise2: (h, a) => noise2(a[0], a[1], 0),
+	noise3: (h, a) => noise3(a[0], a[1], a[2], 0),
+	fractal_noise1: (h, a) => fractal(a[1], (c, o) => noise1(c(a[0]), o)),
+	fractal_noise2: (h, a) => fractal(a[2], (c, o) => noise2(c(a[0]), c(a[1]), o)),
+	fractal_noise3: (h, a) => fractal(a[3], (c, o) => noise3(c(a[0]), c(a[1]), c(a[2]), o)),
+	dump_stack: (h, a) => 0,
+	register_led_cb: (h, a) => { h.led_cb=a[0]; h.led_prologue=-1; return 0; },
+	register_led_mapped_cb: (h, a) => { h.led_mapped_cb=a[0]; h.led_mapped_prologue=-1; return 0; },
+	register_frame_start_cb: (h, a) => { h.frame_start_cb=a[0]; return 0; },
+	register_led_prologue_cb: (h, a) => { if (a[1]) h.led_mapped_prologue=a[0]; else h.led_prologue=a[0]; return 0; },
+	led_set_rgb: set_rgb,
+	led_set_rgbw: set_rgb,
+	led_get_closest: (h, a) => 0,
+	led_set_hsv: (h, a) => set_rgb(h, hsv_to_rgb(a[0], a[1], a[2])),
+	hsv_to_rgb: (h, a) => { struct_mem(h, a[1]).set(hsv_to_rgb(...struct_mem(h, a[0]))); return 0; },
+	blend_rgb: blend_rgb,
+	scale_rgb: scale_rgb,
+	noise3_pos: (h, a) => noise3(...struct_mem(h, a[0]), 0),
+	fractal_noise3_pos: (h, a) => fractal(a[1], (c, o) => noise3(...struct_mem(h, a[0]).map(c), o)),
+};
+
+//The time as the LED callbacks get it
+const fixed_time=(time) => (Math.trunc(time*65536)>>>0)&0x7fffffff;
+
+class Host {
+	constructor(mod) {
+		this.mem=new WebAssembly.Memory({initial: Math.ceil((RSTACK+RSTACK_SIZE)*4/65536)});
+		this.w=new Int32Array(this.mem.buffer);
+		this.led_cb=-1;
+		this.led_mapped_cb=-1;
+		this.frame_start_cb=-1;
+		this.led_prologue=-1;
+		this.led_mapped_prologue=-1;
+		this.led=new Uint8Array(3);
+		this.missing=[];
+		const imports={};
+		for (const imp of WebAssembly.Module.imports(mod)) {
+			if (imp.module!="lssl") continue;
+			const fn=syscalls[imp.name];
+			if (!fn) this.missing.push(imp.name);
+			imports[imp.name]=(regs => {
+				const argv=this.w.subarray(regs/4+R.argv, regs/4+R.argv+16);
+				argv[0]=fn(this, argv);
+				return 0;
+			});
+		}
+		this.inst=new WebAssembly.Instance(mod, {env: {memory: this.mem}, lssl: imports});
+		const w=this.w;
+		const glob_size=this.inst.exports.glob_size.value;
+		w[REGS+R.stack]=STACK*4;
+		w[REGS+R.stack_size]=STACK_SIZE;
+		w[REGS+R.rstack]=RSTACK*4;
+		w[REGS+R.rstack_size]=RSTACK_SIZE;
+		w[REGS+R.sp]=glob_size;
+		w[REGS+R.glob_size]=glob_size;
+	}
+
+	push(v) {
+		this.w[STACK+this.w[REGS+R.sp]++]=v;
+	}
+
+	rpush(v) {
+		this.w[RSTACK+this.w[REGS+R.rsp]++]=v;
+	}
+
+	//lssl_vm_call()
+	call(pc, argv) {
+		const w=this.w;
+		const saved=[R.sp, R.bp, R.ap, R.rsp, R.rbp].map(r => [r, w[REGS+r]]);
+		for (const v of argv) this.push(v);
+		//push_frame(vm, -1)
+		this.push(w[REGS+R.ap]);
+		this.push(w[REGS+R.bp]);
+		this.push(-1);
+		this.rpush(w[REGS+R.ap]);
+		this.rpush(w[REGS+R.bp]);
+		this.rpush(w[REGS+R.rbp]);
+		this.rpush(-1);
+		w[REGS+R.bp]=w[REGS+R.sp];
+		w[REGS+R.ap]=w[REGS+R.sp];
+		w[REGS+R.rbp]=w[REGS+R.rsp];
+		let e=this.inst.exports.run(REGS*4, pc, argv.length);
+		//lssl_vm_call_prepare() fails like this for a bad function
+		if (e<0) {
+			w[REGS+R.pc]=pc;
+			e=LSSL_VM_ERR_INTERNAL;
+		}
+		if (e) {
+			for (const [r, v] of saved) w[REGS+r]=v;
+			return {error: e, pc: w[REGS+R.pc]};
+		}
+		return {error: 0, ret: w[REGS+R.ret]};
+	}
+
+	//lssl_vm_run_main()
+	run_main() {
+		const w=this.w;
+		w[REGS+R.glob_top]=w[REGS+R.sp];
+		const r=this.call(0, []);
+		if (!r.error && w[REGS+R.glob_top]>w[REGS+R.sp]) w[REGS+R.sp]=w[REGS+R.glob_top];
+		return r;
+	}
+
+	//led_syscalls_frame_start(), without a budget
+	frame_start(time) {
+		if (this.frame_start_cb>=0) {
+			const r=this.call(this.frame_start_cb, []);
+			if (r.error) return r;
+		}
+		const prologue=(this.led_cb>=0)?this.led_prologue:this.led_mapped_prologue;
+		if (prologue<0) return {error: 0};
+		return this.call(prologue, [fixed_time(time)]);
+	}
+
+	//led_syscalls_render_frame(), without a LED map
+	render_frame(time, out) {
+		const w=this.w;
+		out.fill(0);
+		if (this.led_cb<0 && this.led_mapped_cb<0) return {error: 0};
+		const t=fixed_time(time);
+		const mapped=(this.led_cb<0);
+		const pos=w[REGS+R.sp];
+		if (mapped) w[REGS+R.sp]+=3;
+		let r={error: 0};
+		for (let led=0; led<LEDS && !r.error; led++) {
+			this.led=out.subarray(led*3, led*3+3);
+			if (mapped) {
+				w.set([led*65536, 0, 0], STACK+pos);
+				r=this.call(this.led_mapped_cb, [(pos<<16)|3, t]);
+			} else {
+				r=this.call(this.led_cb, [led<<16, t]);
+			}
+		}
+		if (mapped) w[REGS+R.sp]=pos;
+		return r;
+	}
+}
+
+//printf("%f", v/65536.0)
+function fixed_str(v) {
+	let n=BigInt(Math.abs(v))*1000000n;
+	let q=n/65536n;
+	const rem=n%65536n;
+	if (rem>32768n || (rem==32768n && (q&1n))) q++;
+	const s=q.toString().padStart(7, "0");
+	return ((v<0)?"-":"")+s.slice(0, -6)+"."+s.slice(-6);
+}
+
+function hex(v) {
+	return "0x"+v.toString(16).toUpperCase();
+}
+
+//The lines lssl -r -s LEDS -f FRAMES prints about the results
+function run_wasm(mod) {
+	const h=new Host(mod);
+	if (h.missing.length) return {skip: "uses "+h.missing.join(", ")};
+	const lines=[];
+	let r=h.run_main();
+	if (r.error) {
+		lines.push("Running main() returned error "+r.error+" at pc "+hex(r.pc));
+		return {lines};
+	}
+	lines.push("Ran main() succesfully, returned "+fixed_str(r.ret));
+	const out=new Uint8Array(LEDS*3);
+	let time=0;
+	for (let frame=0; frame<FRAMES; frame++) {
+		r=h.frame_start(time);
+		if (!r.error) r=h.render_frame(time, out);
+		if (r.error) {
+			lines.push("Frame "+frame+": error "+r.error+" at pc "+hex(r.pc));
+			break;
+		}
+		let l="Frame "+frame+":";
+		for (let i=0; i<LEDS*3; i+=3) l+=" "+Buffer.from(out.subarray(i, i+3)).toString("hex");
+		lines.push(l);
+		time=Math.fround(time+0.05);
+	}
+	return {lines};
+}
+
+function check(lssl, file, tmp) {
+	fs.rmSync(tmp, {force: true});
+	const p=child_process.spawnSync(lssl, ["-w", tmp, "-s", LEDS, "-f", FRAMES, "-t", "1", file],
+			{encoding: "utf8"});
+	const vm_lines=p.stdout.split("\n").filter(l => /^(Ran main|Running main|Frame )/.test(l));
+	if (!fs.existsSync(tmp)) {
+		if (p.stdout.includes("Parser found error")) return {skip: "does not compile"};
+		return {fail: "no wasm module written"};
+	}
+	const mod=new WebAssembly.Module(fs.readFileSync(tmp));
+	let res;
+	try {
+		res=run_wasm(mod);
+	} catch (e) {
+		return {fail: e.toString()};
+	}
+	if (res.skip) return res;
+	for (let i=0; i<Math.max(vm_lines.length, res.lines.length); i++) {
+		if (vm_lines[i]!==res.lines[i]) {
+			return {fail: "VM: "+vm_lines[i]+"\n  wasm: "+res.lines[i]};
+		}
+	}
+	return {};
+}
+
+function main(argv) {
+	if (argv.length<2) {
+		console.log("Usage: node wasm_parity.js path/to/lssl file.lssl ...");
+		return 1;
+	}
+	const tmp=path.join(os.tmpdir(), "wasm_parity_"+process.pid+".wasm");
+	let ok=0, skipped=0, failed=0;
+	for (const file of argv.slice(1)) {
+		const r=check(argv[0], file, tmp);
+		const name=path.basename(file);
+		if (r.fail) {
+			console.log(name+": FAIL\n  "+r.fail);
+			failed++;
+		} else if (r.skip) {
+			console.log(name+": skipped, "+r.skip);
+			skipped++;
+		} else {
+			console.log(name+": ok");
+			ok++;
+		}
+	}
+	fs.rmSync(tmp, {force: true});
+	console.log(" *** Success: "+ok+" Skipped: "+skipped+" Fail: "+failed+" ***");
+	return failed?1:0;
+}
+
+process.exitCode=main(process.argv.slice(2));
@@ -155,6 +155,35 @@ function code_keyrelease(e) {
 }
 
 var compile_errors=new Array();
+var wasm_generation=0;
+
+//Instantiates the wasm module the compiler made of the program, and has the VM run the
+//program with that. Until it's ready (or if it fails), the VM interprets the program.
+function load_wasm(pgm) {
+	var len=getValue(pgm+8, "i32");
+	var ptr=getValue(pgm+12, "*");
+	if (len==0) return;
+	var gen=wasm_generation;
+	var bytes=new Uint8Array(HEAPU8.buffer, ptr, len).slice();
+	WebAssembly.compile(bytes)
+		.then(mod => {
+			//The module uses the memory of the VM, and calls the syscalls through it
+			var syscalls={};
+			for (const imp of WebAssembly.Module.imports(mod)) {
+				if (imp.module!="lssl") continue;
+				const no=Module.ccall('vm_syscall_handle_for_name', 'number', ['string'], [imp.name]);
+				syscalls[imp.name]=(regs => Module._lssl_vm_wasm_syscall(regs, no));
+			}
+			return WebAssembly.instantiate(mod, {env: {memory: Module.wasmMemory}, lssl: syscalls});
+		})
+		.then(inst => {
+			if (gen!=wasm_generation) return; //recompiled in the mean time
+			Module.lssl_wasm=inst;
+			Module.ccall('use_wasm', null, [], []);
+			console.log("Running program as wasm");
+		})
+		.catch(err => console.log("Can't run program as wasm, interpreting it: "+err));
+}
 
 function recompile_typed() {
 	compile_errors=new Array(); //clear errors
@@ -171,6 +200,9 @@ function recompile_typed() {
 			return response.text();
 			});
 
+	//The module of the previous program is no use anymore
+	Module.lssl_wasm=null;
+	wasm_generation++;
 	var pgm=Module.ccall('recompile', 'number', ['string'], [code_text]);
 	if (pgm) {
 		var binlen=getValue(pgm+0, "i32");
@@ -179,6 +211,7 @@ function recompile_typed() {
 	}
 	
 	if (compile_errors.length==0 && pgm!=0) {
+		load_wasm(pgm);
 		//Save compiled bytecode
 		fetch("lssl_save_compiled/"+window.location.hash.substring(1), {
 				method: "POST", 
@@ -315,20 +348,20 @@ function led_tick() {
 	const canvas = document.querySelector("#leds");
 	const ctx = canvas.getContext("2d");
 
-	Module.ccall('frame_start', '', [], []);
+	Module.ccall('frame_start', '', ['float'], [led_time]);
 	if (check_show_errors()) return;
+	var leds_ptr=Module.ccall("render_leds", "number", ["int", "float"], [100, led_time]);
+	check_show_errors();
+	if (leds_ptr==0) {
+		//vm exec error, stop running
+		//note check_show_errors should already have unloaded the timer
+		console.log("VM ran into a runtime error. Stopping.");
+		return;
+	}
 	for (var i=0; i<100; i++) {
-		var leds_ptr=Module.ccall("get_led", "number", ["int", "float"], [i, led_time]);
-		check_show_errors();
-		if (leds_ptr==0) {
-			//vm exec error, stop running
-			//note check_show_errors should already have unloaded the timer
-			console.log("VM ran into a runtime error. Stopping.");
-			break;
-		}
-		var r=Module.HEAPU8[leds_ptr+0];
-		var g=Module.HEAPU8[leds_ptr+1];
-		var b=Module.HEAPU8[leds_ptr+2];
+		var r=Module.HEAPU8[leds_ptr+i*3+0];
+		var g=Module.HEAPU8[leds_ptr+i*3+1];
+		var b=Module.HEAPU8[leds_ptr+i*3+2];
 		ctx.fillStyle = "rgb("+r+" "+g+" "+b+")";
 		ctx.fillRect(i, 0, i+1, 1);
 	}